@@ -0,0 +1,126 @@
+#include "src/channel_cache.h"
+
+#include "deps/base/logging.h"
+
+namespace xcomet {
+
+ChannelCache::ChannelCache(size_t max_channels, size_t max_bytes)
+    : max_channels_(max_channels),
+      max_bytes_(max_bytes),
+      bytes_(0),
+      hit_number_(0),
+      miss_number_(0),
+      evict_number_(0) {
+  CHECK(max_channels_ > 0);
+}
+
+ChannelCache::~ChannelCache() {
+}
+
+ChannelInfo* ChannelCache::Get(const string& cid) {
+  auto it = index_.find(cid);
+  if (it == index_.end()) {
+    ++miss_number_;
+    return NULL;
+  }
+  ++hit_number_;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return &it->second->channel;
+}
+
+ChannelInfo* ChannelCache::Peek(const string& cid) {
+  auto it = index_.find(cid);
+  return it != index_.end() ? &it->second->channel : NULL;
+}
+
+ChannelInfo* ChannelCache::Put(const string& cid, const ChannelInfo& channel) {
+  auto it = index_.find(cid);
+  if (it != index_.end()) {
+    return &it->second->channel;
+  }
+  entries_.push_front(Entry(channel));
+  Entry& entry = entries_.front();
+  entry.bytes = entry.channel.MemoryBytes();
+  entry.pinned = pinned_.count(cid) > 0;
+  bytes_ += entry.bytes;
+  index_[cid] = entries_.begin();
+  Evict();
+  return &entry.channel;
+}
+
+void ChannelCache::Resize(const string& cid) {
+  auto it = index_.find(cid);
+  if (it == index_.end()) {
+    return;
+  }
+  Entry& entry = *it->second;
+  bytes_ -= entry.bytes;
+  entry.bytes = entry.channel.MemoryBytes();
+  bytes_ += entry.bytes;
+  Evict();
+}
+
+void ChannelCache::Erase(const string& cid) {
+  auto it = index_.find(cid);
+  if (it == index_.end()) {
+    return;
+  }
+  bytes_ -= it->second->bytes;
+  entries_.erase(it->second);
+  index_.erase(it);
+}
+
+void ChannelCache::Pin(const string& cid) {
+  pinned_.insert(cid);
+  auto it = index_.find(cid);
+  if (it != index_.end()) {
+    it->second->pinned = true;
+  }
+}
+
+void ChannelCache::Unpin(const string& cid) {
+  pinned_.erase(cid);
+  auto it = index_.find(cid);
+  if (it != index_.end()) {
+    it->second->pinned = false;
+    Evict();
+  }
+}
+
+// the most recently used channel is kept even if it's over the limits
+void ChannelCache::Evict() {
+  EntryList::iterator it = entries_.end();
+  while (index_.size() > 1 &&
+         (index_.size() > max_channels_ ||
+          (max_bytes_ > 0 && bytes_ > max_bytes_))) {
+    if (it == entries_.begin()) {
+      // all the others are pinned
+      break;
+    }
+    --it;
+    if (it == entries_.begin()) {
+      break;
+    }
+    if (it->pinned) {
+      continue;
+    }
+    VLOG(5) << "evict channel: " << it->channel.GetId();
+    bytes_ -= it->bytes;
+    index_.erase(it->channel.GetId());
+    it = entries_.erase(it);
+    ++evict_number_;
+  }
+}
+
+void ChannelCache::GetReport(Json::Value& report) const {
+  report["size"] = (Json::UInt64)index_.size();
+  report["max_size"] = (Json::UInt64)max_channels_;
+  report["memory_bytes"] = (Json::UInt64)bytes_;
+  report["max_memory_bytes"] = (Json::UInt64)max_bytes_;
+  report["pinned_number"] = (Json::UInt64)pinned_.size();
+  report["hit_number"] = (Json::Int64)hit_number_;
+  report["miss_number"] = (Json::Int64)miss_number_;
+  report["evict_number"] = (Json::Int64)evict_number_;
+}
+
+}  // namespace xcomet
@@ -0,0 +1,74 @@
+#ifndef SRC_CHANNEL_CACHE_H_
+#define SRC_CHANNEL_CACHE_H_
+
+#include <list>
+#include "deps/base/basictypes.h"
+#include "deps/jsoncpp/include/json/json.h"
+#include "src/channel_info.h"
+#include "src/include_std.h"
+
+namespace xcomet {
+
+// The members of the channels seen recently, the storage holds all of them.
+// Least recently used channels are evicted when there are more than
+// |max_channels| or they take more than |max_bytes| (0 for no limit).
+// Pinned channels are never evicted, a channel can be pinned before it's
+// loaded. Not thread safe, only use it from the main loop.
+class ChannelCache {
+ public:
+  ChannelCache(size_t max_channels, size_t max_bytes);
+  ~ChannelCache();
+
+  // NULL on miss, a hit makes the channel the most recently used one
+  ChannelInfo* Get(const string& cid);
+  // like Get but doesn't touch the counters nor the order, for updates
+  ChannelInfo* Peek(const string& cid);
+  // keeps the cached one if |cid| is already there
+  ChannelInfo* Put(const string& cid, const ChannelInfo& channel);
+  // call it after the members of a cached channel were changed, the
+  // pointers returned before may be invalid after it
+  void Resize(const string& cid);
+  void Erase(const string& cid);
+
+  void Pin(const string& cid);
+  void Unpin(const string& cid);
+
+  size_t Size() const {
+    return index_.size();
+  }
+  size_t MemoryBytes() const {
+    return bytes_;
+  }
+  void GetReport(Json::Value& report) const;
+
+ private:
+  struct Entry {
+    ChannelInfo channel;
+    size_t bytes;
+    bool pinned;
+
+    explicit Entry(const ChannelInfo& c)
+        : channel(c), bytes(0), pinned(false) {
+    }
+  };
+  typedef std::list<Entry> EntryList;
+
+  void Evict();
+
+  const size_t max_channels_;
+  const size_t max_bytes_;
+  // most recently used first
+  EntryList entries_;
+  unordered_map<string, EntryList::iterator> index_;
+  unordered_set<string> pinned_;
+  size_t bytes_;
+
+  int64 hit_number_;
+  int64 miss_number_;
+  int64 evict_number_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChannelCache);
+};
+
+}  // namespace xcomet
+#endif  // SRC_CHANNEL_CACHE_H_
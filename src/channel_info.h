@@ -2,27 +2,67 @@
 #define SRC_CHANNEL_INFO_H_
 
 #include "src/include_std.h"
+#include "src/id_set.h"
+#include "src/uid_table.h"
 
 namespace xcomet {
 
-class ChannelInfo;
-typedef unordered_map<string, ChannelInfo> ChannelInfoMap;
-
+// The members are indexed by the shard which owns them, so a node only
+// walks its own share of a channel. They are kept as ids of the UidTable,
+// so only use it from the main loop.
 class ChannelInfo {
  public:
-  ChannelInfo(const string& id) :id_(id) {
+  ChannelInfo(const string& id) :id_(id), user_count_(0) {
   }
   ~ChannelInfo() {}
   string GetId() const {return id_;}
-  int GetUserCount() const {return users_.size();}
-  void AddUser(const string& uid) {users_.insert(uid);}
-  void RemoveUser(const string& uid) {users_.erase(uid);}
-  const unordered_set<string>& GetUsers() const {return users_;}
+  int GetUserCount() const {return user_count_;}
+  // |shard| is the id of the peer which owns |uid|
+  void AddUser(const string& uid, int shard) {
+    if (shards_[shard].Insert(UidTable::Instance().Intern(uid))) {
+      ++user_count_;
+    }
+  }
+  void RemoveUser(const string& uid, int shard) {
+    uint32 id = 0;
+    auto it = shards_.find(shard);
+    if (it != shards_.end() &&
+        UidTable::Instance().Find(uid, &id) &&
+        it->second.Erase(id)) {
+      --user_count_;
+    }
+  }
+  // NULL if no member belongs to |shard|
+  const IdSet* GetShardUserIds(int shard) const {
+    auto it = shards_.find(shard);
+    return it != shards_.end() ? &it->second : NULL;
+  }
+  // approximate heap footprint, for the bound of the channel cache
+  size_t MemoryBytes() const {
+    size_t bytes = sizeof(*this) + id_.capacity();
+    for (auto it = shards_.begin(); it != shards_.end(); ++it) {
+      // the node of the map
+      bytes += 4 * sizeof(void*) + sizeof(*it) + it->second.MemoryBytes();
+    }
+    return bytes;
+  }
+  // calls f(const string& uid) for every member owned by |shard|
+  template <typename F>
+  void ForEachUser(int shard, F f) const {
+    const IdSet* ids = GetShardUserIds(shard);
+    if (ids == NULL) {
+      return;
+    }
+    const UidTable& table = UidTable::Instance();
+    ids->ForEach([&table, &f](uint32 id) {
+      f(table.Uid(id));
+    });
+  }
 
  private:
   string id_;
-  // TODO(qingfeng) use pointers
-  unordered_set<string> users_;
+  int user_count_;
+  map<int, IdSet> shards_;
 };
 
 }  // namespace xcomet
@@ -0,0 +1,94 @@
+#include "src/deferred_queue.h"
+
+#include "deps/base/logging.h"
+#include "deps/base/time.h"
+
+namespace xcomet {
+
+DeferredQueue::DeferredQueue(struct event_base* evbase, int budget_usec)
+    : event_(NULL),
+      active_(false),
+      budget_usec_(budget_usec),
+      run_number_(0),
+      total_latency_(0),
+      max_latency_(0),
+      over_budget_number_(0) {
+  CHECK(evbase);
+  CHECK(budget_usec_ > 0);
+  event_ = event_new(evbase, -1, 0, OnActive, this);
+  CHECK(event_) << "create deferred event failed";
+}
+
+DeferredQueue::~DeferredQueue() {
+  if (event_) event_free(event_);
+}
+
+void DeferredQueue::Push(function<void ()> fn) {
+  Item item;
+  item.fn.swap(fn);
+  item.push_time = base::GetTimeInUsec();
+  items_.push_back(item);
+  if (!active_) {
+    Schedule();
+  }
+}
+
+void DeferredQueue::Schedule() {
+  // event_active would put it back in the active queue which libevent runs
+  // until empty, before polling the fds again
+  static const struct timeval NOW = {0, 0};
+  active_ = true;
+  event_add(event_, &NOW);
+}
+
+void DeferredQueue::OnActive(evutil_socket_t fd, short events, void* ctx) {
+  static_cast<DeferredQueue*>(ctx)->Drain();
+}
+
+void DeferredQueue::Drain() {
+  active_ = false;
+  // closures pushed while draining wait for the next pass
+  size_t n = items_.size();
+  int64 start = base::GetTimeInUsec();
+  int64 now = start;
+  size_t i = 0;
+  while (i < n) {
+    Item item;
+    item.fn.swap(items_.front().fn);
+    item.push_time = items_.front().push_time;
+    items_.pop_front();
+
+    int64 latency = now - item.push_time;
+    total_latency_ += latency;
+    if (latency > max_latency_) {
+      max_latency_ = latency;
+    }
+    ++run_number_;
+    item.fn();
+
+    ++i;
+    // a closure may run for long, e.g. a fan-out slice
+    now = base::GetTimeInUsec();
+    if (now - start >= budget_usec_) {
+      break;
+    }
+  }
+  if (i < n) {
+    ++over_budget_number_;
+    VLOG(5) << "deferred queue over budget, " << items_.size() << " left";
+  }
+  if (!items_.empty() && !active_) {
+    Schedule();
+  }
+}
+
+void DeferredQueue::GetReport(Json::Value& report) const {
+  report["pending_number"] = (Json::Int64)items_.size();
+  report["run_number"] = (Json::Int64)run_number_;
+  report["avg_latency_us"] =
+      (Json::Int64)(run_number_ > 0 ? total_latency_ / run_number_ : 0);
+  report["max_latency_us"] = (Json::Int64)max_latency_;
+  report["over_budget_number"] = (Json::Int64)over_budget_number_;
+}
+
+}  // namespace xcomet
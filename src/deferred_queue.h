@@ -0,0 +1,55 @@
+#ifndef SRC_DEFERRED_QUEUE_H_
+#define SRC_DEFERRED_QUEUE_H_
+
+#include <event.h>
+#include <deque>
+#include "deps/base/basictypes.h"
+#include "deps/jsoncpp/include/json/json.h"
+#include "src/include_std.h"
+
+namespace xcomet {
+
+// Runs closures on the next pass of an event loop. The first Push adds a
+// timer which expires at once, and the closures queued before the pass
+// starts are run until the time budget is used up; the rest are left for
+// the following pass. The timer goes through the dispatcher, so the fds
+// which became ready meanwhile are served between two passes, which an
+// event_active from the callback wouldn't do.
+// Not thread safe, only use it in the thread running `evbase`.
+class DeferredQueue {
+ public:
+  DeferredQueue(struct event_base* evbase, int budget_usec);
+  ~DeferredQueue();
+
+  void Push(function<void ()> fn);
+  size_t Size() const {
+    return items_.size();
+  }
+  void GetReport(Json::Value& report) const;
+
+ private:
+  struct Item {
+    function<void ()> fn;
+    int64 push_time;
+  };
+
+  static void OnActive(evutil_socket_t fd, short events, void* ctx);
+  void Schedule();
+  void Drain();
+
+  struct event* event_;
+  // the timer is added and not run yet
+  bool active_;
+  const int budget_usec_;
+  std::deque<Item> items_;
+
+  int64 run_number_;
+  int64 total_latency_;
+  int64 max_latency_;
+  int64 over_budget_number_;
+
+  DISALLOW_COPY_AND_ASSIGN(DeferredQueue);
+};
+
+}  // namespace xcomet
+#endif  // SRC_DEFERRED_QUEUE_H_
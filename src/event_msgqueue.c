@@ -7,38 +7,46 @@
  *
  * Copyright (c) Andrew Danforth, 2006
  *
+ * The queue is a bounded lock-free multi-producer/single-consumer ring.
+ * Producers never take a lock, the consumer is woken up through an eventfd
+ * at most once per batch and drains the ring inside the event loop.
  */
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/socket.h>
+#include <sys/eventfd.h>
 
 #include "event_msgqueue.h"
 
-struct circqueue {
-   unsigned int head;
-   unsigned int tail;
-   unsigned int count;
-   unsigned int max_entries;
-   unsigned int array_elements;
-   void **entries;
-};
+#define DEFAULT_UNBOUNDED_QUEUE_SIZE 65536
+#define MAX_CALLBACKS_PER_WAKEUP 1024
+#define CACHE_LINE_SIZE 64
 
-#define DEFAULT_UNBOUNDED_QUEUE_SIZE 1024
+struct ring_cell {
+   unsigned long seq;
+   void *data;
+};
 
 struct event_msgqueue {
-   int push_fd;
-   int pop_fd;
-   int unlock_between_callbacks;
+   int efd;
+   int signaled;
 
    struct event queue_ev;
 
-   pthread_mutex_t lock;
    void (*callback)(void *, void *);
    void *cbarg;
-   struct circqueue *queue;
+   unsigned long mask;
+   struct ring_cell *cells;
+
+   /* keep the producer and consumer cursors on different cache lines */
+   char pad0[CACHE_LINE_SIZE];
+   unsigned long tail;
+   char pad1[CACHE_LINE_SIZE - sizeof(unsigned long)];
+   unsigned long head;
+   char pad2[CACHE_LINE_SIZE - sizeof(unsigned long)];
 };
 
 static unsigned int nextpow2(unsigned int num) {
@@ -51,180 +59,133 @@ static unsigned int nextpow2(unsigned int num) {
     return ++num;
 }
 
-#define circqueue_get_length(q) ((q)->count)
-#define circqueue_is_empty(q) (!circqueue_get_length(q))
-#define circqueue_is_full(q) ((q)->count == (q)->array_elements)
-
-static struct circqueue *circqueue_new(unsigned int size) {
-   struct circqueue *cq;
-
-   if (!(cq = calloc(1, sizeof(struct circqueue))))
-      return(NULL);
-
-   cq->max_entries = size;
-   if (!size || !(cq->array_elements = nextpow2(size)))
-      cq->array_elements = DEFAULT_UNBOUNDED_QUEUE_SIZE;
-   cq->entries = malloc(sizeof(void *) * cq->array_elements);
-   if (!cq->entries) {
-      free(cq);
-      return(NULL);
-   }
-
-   return(cq);
-}
-
-static void circqueue_destroy(struct circqueue *cq) {
-   free(cq->entries);
-   free(cq);
-}
-
-static int circqueue_grow(struct circqueue *cq) {
-   void **newents;
-   unsigned int newsize = cq->array_elements << 1;
-   unsigned int headchunklen = 0, tailchunklen = 0;
+static int ring_pop(struct event_msgqueue *msgq, void **data) {
+   struct ring_cell *cell = &msgq->cells[msgq->head & msgq->mask];
+   unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
 
-   if (!(newents = malloc(sizeof(void *) * newsize)))
+   if (seq != msgq->head + 1)
       return(-1);
 
-   if (cq->head < cq->tail)
-      headchunklen = cq->tail - cq->head;
-   else {
-      headchunklen = cq->array_elements - cq->head;
-      tailchunklen = cq->tail;
-   }
-
-   memcpy(newents, &cq->entries[cq->head], sizeof(void *) * headchunklen);
-   if (tailchunklen)
-      memcpy(&newents[headchunklen], cq->entries, sizeof(void *) * tailchunklen);
-
-   cq->head = 0;
-   cq->tail = headchunklen + tailchunklen;
-   cq->array_elements = newsize;
-
-   free(cq->entries);
-   cq->entries = newents;
+   *data = cell->data;
+   __atomic_store_n(&cell->seq, msgq->head + msgq->mask + 1, __ATOMIC_RELEASE);
+   __atomic_store_n(&msgq->head, msgq->head + 1, __ATOMIC_RELAXED);
 
    return(0);
 }
 
-static int circqueue_push_tail(struct circqueue *cq, void *elem) {
-   if (cq->max_entries) {
-      if (cq->count == cq->max_entries)
-         return(-1);
-   } else if (circqueue_is_full(cq) && circqueue_grow(cq) != 0)
-      return(-1);
-
-   cq->count++;
-   cq->entries[cq->tail++] = elem;
-   cq->tail &= cq->array_elements - 1;
-
-   return(0);
+static int ring_is_empty(struct event_msgqueue *msgq) {
+   struct ring_cell *cell = &msgq->cells[msgq->head & msgq->mask];
+   return(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != msgq->head + 1);
 }
 
-static void *circqueue_pop_head(struct circqueue *cq) {
-   void *data;
-
-   if (!cq->count)
-      return(NULL);
-
-   cq->count--;
-   data = cq->entries[cq->head++];
-   cq->head &= cq->array_elements - 1;
+/* only the first producer after a drain pays for the eventfd write */
+static void msgqueue_wakeup(struct event_msgqueue *msgq) {
+   uint64_t one = 1;
 
-   return(data);
+   if (!__atomic_exchange_n(&msgq->signaled, 1, __ATOMIC_SEQ_CST)) {
+      if (write(msgq->efd, &one, sizeof(one)) < 0) {
+         /* the counter can't overflow, EAGAIN means it's already readable */
+      }
+   }
 }
 
 static void msgqueue_pop(int fd, short flags, void *arg) {
    struct event_msgqueue *msgq = arg;
-   char buf[64];
+   uint64_t count;
+   unsigned int n = 0;
+   void *qdata;
 
-   recv(fd, buf, sizeof(buf),0);
-
-   pthread_mutex_lock(&msgq->lock);
-   while(!circqueue_is_empty(msgq->queue)) {
-      void *qdata;
-
-      qdata = circqueue_pop_head(msgq->queue);
-
-      if (msgq->unlock_between_callbacks)
-         pthread_mutex_unlock(&msgq->lock);
+   if (read(fd, &count, sizeof(count)) < 0) {
+      /* spurious wakeup, the ring is checked anyway */
+   }
+   /* pairs with the exchange in msgqueue_wakeup, so every element pushed
+    * before a skipped wakeup is visible to the drain below */
+   __atomic_exchange_n(&msgq->signaled, 0, __ATOMIC_SEQ_CST);
 
+   while (n < MAX_CALLBACKS_PER_WAKEUP && ring_pop(msgq, &qdata) == 0) {
       msgq->callback(qdata, msgq->cbarg);
-
-      if (msgq->unlock_between_callbacks)
-         pthread_mutex_lock(&msgq->lock);
+      n++;
    }
-   pthread_mutex_unlock(&msgq->lock);
+
+   /* give the other events a chance, come back in the next loop pass */
+   if (!ring_is_empty(msgq))
+      msgqueue_wakeup(msgq);
 }
 
 struct event_msgqueue *msgqueue_new(struct event_base *base, unsigned int max_size, void (*callback)(void *, void *), void *cbarg) {
    struct event_msgqueue *msgq;
-   struct circqueue *cq;
-   int fds[2];
+   unsigned long size;
+   unsigned long i;
+
+   size = max_size ? nextpow2(max_size) : DEFAULT_UNBOUNDED_QUEUE_SIZE;
+   if (!size)
+      return(NULL);
 
-   if (!(cq = circqueue_new(max_size)))
+   if (!(msgq = calloc(1, sizeof(struct event_msgqueue))))
       return(NULL);
 
-   if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
-      circqueue_destroy(cq);
+   if (!(msgq->cells = malloc(sizeof(struct ring_cell) * size))) {
+      free(msgq);
       return(NULL);
    }
+   for (i = 0; i < size; i++)
+      msgq->cells[i].seq = i;
 
-   if (!(msgq = malloc(sizeof(struct event_msgqueue)))) {
-      circqueue_destroy(cq);
-      close(fds[0]);
-      close(fds[1]);
+   if ((msgq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+      free(msgq->cells);
+      free(msgq);
       return(NULL);
    }
 
-   msgq->push_fd = fds[0];
-   msgq->pop_fd = fds[1];
-   msgq->queue = cq;
+   msgq->mask = size - 1;
    msgq->callback = callback;
    msgq->cbarg = cbarg;
-   pthread_mutex_init(&msgq->lock, NULL);
-   event_set(&msgq->queue_ev, msgq->pop_fd, EV_READ | EV_PERSIST, msgqueue_pop, msgq);
+   event_set(&msgq->queue_ev, msgq->efd, EV_READ | EV_PERSIST, msgqueue_pop, msgq);
    event_base_set(base, &msgq->queue_ev);
    event_add(&msgq->queue_ev, NULL);
 
-   msgq->unlock_between_callbacks = 1;
-
    return(msgq);
 }
 
 void msgqueue_destroy(struct event_msgqueue *msgq)
 {
-   //for( ; msgqueue_length(msgq) > 0; ) {
-   //   sleep( 1 );
-   //}
-
    event_del(&msgq->queue_ev);
-   circqueue_destroy(msgq->queue);
-   close(msgq->push_fd);
-   close(msgq->pop_fd);
+   close(msgq->efd);
+   free(msgq->cells);
    free(msgq);
 }
 
 int msgqueue_push(struct event_msgqueue *msgq, void *msg) {
-   const char buf[1] = { 0 };
-   int r = 0;
-
-   pthread_mutex_lock(&msgq->lock);
-   if ((r = circqueue_push_tail(msgq->queue, msg)) == 0) {
-      if (circqueue_get_length(msgq->queue) == 1)
-         send(msgq->push_fd, buf, 1,0);
+   struct ring_cell *cell;
+   unsigned long pos = __atomic_load_n(&msgq->tail, __ATOMIC_RELAXED);
+
+   for (;;) {
+      long diff;
+
+      cell = &msgq->cells[pos & msgq->mask];
+      diff = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)pos;
+      if (diff == 0) {
+         if (__atomic_compare_exchange_n(&msgq->tail, &pos, pos + 1, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+      } else if (diff < 0) {
+         /* full */
+         return(-1);
+      } else {
+         pos = __atomic_load_n(&msgq->tail, __ATOMIC_RELAXED);
+      }
    }
-   pthread_mutex_unlock(&msgq->lock);
 
-   return(r);
+   cell->data = msg;
+   __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+   msgqueue_wakeup(msgq);
+
+   return(0);
 }
 
 unsigned int msgqueue_length(struct event_msgqueue *msgq) {
-   unsigned int len;
-
-   pthread_mutex_lock(&msgq->lock);
-   len = circqueue_get_length(msgq->queue);
-   pthread_mutex_unlock(&msgq->lock);
+   unsigned long tail = __atomic_load_n(&msgq->tail, __ATOMIC_RELAXED);
+   unsigned long head = __atomic_load_n(&msgq->head, __ATOMIC_RELAXED);
 
-   return(len);
+   return(tail > head ? (unsigned int)(tail - head) : 0);
 }
@@ -2,10 +2,12 @@
 #define SRC_EVHELPER_H_
 
 #include <evhttp.h>
+#include <event2/buffer.h>
 #include <event2/event.h>
 #include <event2/listener.h>
 #include <string>
 #include "deps/base/logging.h"
+#include "src/typedef.h"
 
 namespace xcomet {
 
@@ -73,6 +75,24 @@ inline void ReplyRedirect(struct evhttp_request* req,
   evhttp_send_reply_end(req);
 }
 
+inline void ReleaseSharedString(const void* data, size_t len, void* extra) {
+  delete static_cast<StringPtr*>(extra);
+}
+
+// appends |data| to |buf| without copying, the buffer holds a reference
+// until the bytes are written to the socket
+inline void AddSharedString(struct evbuffer* buf, const StringPtr& data) {
+  if (data->empty()) {
+    return;
+  }
+  StringPtr* ref = new StringPtr(data);
+  if (evbuffer_add_reference(buf, data->data(), data->size(),
+                             ReleaseSharedString, ref) != 0) {
+    LOG(ERROR) << "evbuffer_add_reference failed";
+    delete ref;
+  }
+}
+
 inline bool IsWebSocketRequest(struct evhttp_request* req) {
   struct evkeyvalq* headers = evhttp_request_get_input_headers(req);
   const char* ws_field = evhttp_find_header(headers, "Upgrade");
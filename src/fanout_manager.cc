@@ -0,0 +1,136 @@
+#include "src/fanout_manager.h"
+
+#include "deps/base/logging.h"
+#include "deps/base/time.h"
+#include "src/uid_table.h"
+
+namespace xcomet {
+
+// reading the clock for every member is wasted on cheap deliveries
+const int SLICE_CHECK_INTERVAL = 64;
+
+FanoutManager::FanoutManager(DeferredQueue* deferred_queue,
+                             int slice_budget_usec)
+    : deferred_queue_(deferred_queue),
+      slice_budget_usec_(slice_budget_usec),
+      next_id_(0),
+      active_number_(0),
+      finished_number_(0),
+      delivered_number_(0),
+      slice_number_(0),
+      max_slice_usec_(0),
+      total_latency_(0),
+      max_latency_(0) {
+  CHECK(deferred_queue_);
+  CHECK(slice_budget_usec_ > 0);
+}
+
+FanoutManager::~FanoutManager() {
+  if (active_number_ > 0) {
+    LOG(WARNING) << active_number_ << " fanout jobs dropped";
+  }
+}
+
+void FanoutManager::Start(const string& name,
+                          vector<uint32>* uids,
+                          DeliverCallback deliver) {
+  JobPtr job(new Job());
+  job->id = ++next_id_;
+  job->name = name;
+  job->uids.swap(*uids);
+  job->next = 0;
+  job->slices = 0;
+  job->start_time = base::GetTimeInUsec();
+  job->deliver = deliver;
+  ++active_number_;
+  std::deque<JobPtr>& queue = jobs_[name];
+  queue.push_back(job);
+  if (queue.size() == 1) {
+    RunSlice(job);
+  } else {
+    VLOG(5) << "fanout job " << job->id << " of " << name << " waits for "
+            << queue.size() - 1 << " jobs";
+  }
+}
+
+void FanoutManager::RunSlice(JobPtr job) {
+  const UidTable& table = UidTable::Instance();
+  const int64 start = base::GetTimeInUsec();
+  int64 now = start;
+  size_t n = 0;
+  while (job->next < job->uids.size()) {
+    job->deliver(table.Uid(job->uids[job->next++]));
+    if (++n % SLICE_CHECK_INTERVAL == 0) {
+      now = base::GetTimeInUsec();
+      if (now - start >= slice_budget_usec_) {
+        break;
+      }
+    }
+  }
+  now = base::GetTimeInUsec();
+  ++job->slices;
+  ++slice_number_;
+  delivered_number_ += n;
+  if (now - start > max_slice_usec_) {
+    max_slice_usec_ = now - start;
+  }
+  if (job->next < job->uids.size()) {
+    VLOG(5) << "fanout job " << job->id << " of " << job->name << ": "
+            << job->next << "/" << job->uids.size();
+    deferred_queue_->Push(bind(&FanoutManager::RunSlice, this, job));
+  } else {
+    Finish(job);
+  }
+}
+
+void FanoutManager::Finish(JobPtr job) {
+  int64 latency = base::GetTimeInUsec() - job->start_time;
+  VLOG(4) << "fanout job " << job->id << " of " << job->name << " done, "
+          << job->uids.size() << " members, " << job->slices << " slices, "
+          << latency << " us";
+  --active_number_;
+  ++finished_number_;
+  total_latency_ += latency;
+  if (latency > max_latency_) {
+    max_latency_ = latency;
+  }
+  auto it = jobs_.find(job->name);
+  CHECK(it != jobs_.end() && it->second.front() == job);
+  it->second.pop_front();
+  if (it->second.empty()) {
+    jobs_.erase(it);
+  } else {
+    // the next job of the name starts on the next pass
+    deferred_queue_->Push(
+        bind(&FanoutManager::RunSlice, this, it->second.front()));
+  }
+}
+
+void FanoutManager::GetReport(Json::Value& report) const {
+  report["active_number"] = (Json::Int64)active_number_;
+  report["finished_number"] = (Json::Int64)finished_number_;
+  report["delivered_number"] = (Json::Int64)delivered_number_;
+  report["slice_number"] = (Json::Int64)slice_number_;
+  report["max_slice_us"] = (Json::Int64)max_slice_usec_;
+  report["avg_latency_us"] = (Json::Int64)(
+      finished_number_ > 0 ? total_latency_ / finished_number_ : 0);
+  report["max_latency_us"] = (Json::Int64)max_latency_;
+  Json::Value& jobs = report["jobs"];
+  jobs = Json::Value(Json::arrayValue);
+  const int64 now = base::GetTimeInUsec();
+  for (auto it = jobs_.begin(); it != jobs_.end(); ++it) {
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      const Job& job = *it->second[i];
+      Json::Value progress;
+      progress["id"] = (Json::Int64)job.id;
+      progress["name"] = job.name;
+      progress["total"] = (Json::Int64)job.uids.size();
+      progress["delivered"] = (Json::Int64)job.next;
+      progress["slices"] = job.slices;
+      progress["elapsed_us"] = (Json::Int64)(now - job.start_time);
+      jobs.append(progress);
+    }
+  }
+}
+
+}  // namespace xcomet
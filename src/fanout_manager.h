@@ -0,0 +1,71 @@
+#ifndef SRC_FANOUT_MANAGER_H_
+#define SRC_FANOUT_MANAGER_H_
+
+#include <deque>
+#include "deps/base/basictypes.h"
+#include "deps/jsoncpp/include/json/json.h"
+#include "src/deferred_queue.h"
+#include "src/include_std.h"
+
+namespace xcomet {
+
+// Delivers a message to a list of members as a resumable job. A slice runs
+// until the slice budget is used up, and the next one is queued on the
+// deferred queue, which runs it on the next loop pass after the ready fds
+// are served, so a big channel doesn't stall the other connections of the
+// loop. The first slice runs right away, a small channel is done within
+// Start.
+// Jobs with the same name run one after another, so the members of a
+// channel get its messages in order.
+// Not thread safe, only use it in the thread of the deferred queue.
+class FanoutManager {
+ public:
+  typedef function<void (const string& uid)> DeliverCallback;
+
+  FanoutManager(DeferredQueue* deferred_queue, int slice_budget_usec);
+  ~FanoutManager();
+
+  // |uids| are ids of the UidTable, they are taken by the job
+  void Start(const string& name,
+             vector<uint32>* uids,
+             DeliverCallback deliver);
+  size_t ActiveJobs() const {
+    return active_number_;
+  }
+  // totals, and the progress of the jobs in flight
+  void GetReport(Json::Value& report) const;
+
+ private:
+  struct Job {
+    int64 id;
+    string name;
+    vector<uint32> uids;
+    size_t next;
+    int slices;
+    int64 start_time;
+    DeliverCallback deliver;
+  };
+  typedef shared_ptr<Job> JobPtr;
+
+  void RunSlice(JobPtr job);
+  void Finish(JobPtr job);
+
+  DeferredQueue* deferred_queue_;
+  const int slice_budget_usec_;
+  int64 next_id_;
+  size_t active_number_;
+  // by name, the front one is running, the others wait for it
+  unordered_map<string, std::deque<JobPtr> > jobs_;
+
+  int64 finished_number_;
+  int64 delivered_number_;
+  int64 slice_number_;
+  int64 max_slice_usec_;
+  int64 total_latency_;
+  int64 max_latency_;
+
+  DISALLOW_COPY_AND_ASSIGN(FanoutManager);
+};
+
+}  // namespace xcomet
+#endif  // SRC_FANOUT_MANAGER_H_
@@ -2,6 +2,7 @@
 
 #include "deps/jsoncpp/include/json/json.h"
 #include "base/string_util.h"
+#include "src/evhelper.h"
 #include "src/session_server.h"
 
 namespace xcomet {
@@ -32,6 +33,19 @@ void HttpSession::Send(const std::string& packet_str) {
   SendChunk(packet_str.c_str(), false);
 }
 
+void HttpSession::Send(const StringPtr& packet) {
+  struct evbuffer* buf = evhttp_request_get_output_buffer(req_);
+  AddSharedString(buf, packet);
+  evhttp_send_reply_chunk_bi(req_, buf);
+}
+
+void HttpSession::Send(const string& prefix, const StringPtr& rest) {
+  struct evbuffer* buf = evhttp_request_get_output_buffer(req_);
+  evbuffer_add(buf, prefix.data(), prefix.size());
+  AddSharedString(buf, rest);
+  evhttp_send_reply_chunk_bi(req_, buf);
+}
+
 void HttpSession::SendHeartbeat() {
   SendChunk("{\"type\":\"noop\"}");
 }
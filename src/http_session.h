@@ -11,6 +11,8 @@ class HttpSession : public Session {
   virtual ~HttpSession();
   virtual void Send(const Message& msg);
   virtual void Send(const string& packet_str);
+  virtual void Send(const StringPtr& packet);
+  virtual void Send(const string& prefix, const StringPtr& rest);
   virtual void SendHeartbeat();
   virtual void Close();
   void Reset(struct evhttp_request* req);
@@ -0,0 +1,133 @@
+#include "src/id_set.h"
+
+#include <algorithm>
+
+namespace xcomet {
+
+size_t IdSet::LowerBound(uint16 high) const {
+  size_t begin = 0;
+  size_t end = chunks_.size();
+  while (begin < end) {
+    size_t middle = begin + (end - begin) / 2;
+    if (chunks_[middle].high < high) {
+      begin = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  return begin;
+}
+
+void IdSet::ToBitmap(Chunk* chunk) {
+  chunk->bitmap.assign(BITMAP_WORDS, 0);
+  for (size_t i = 0; i < chunk->array.size(); ++i) {
+    uint16 low = chunk->array[i];
+    chunk->bitmap[low / 64] |= 1ULL << (low % 64);
+  }
+  vector<uint16>().swap(chunk->array);
+}
+
+void IdSet::ToArray(Chunk* chunk) {
+  vector<uint16> array;
+  array.reserve(chunk->count);
+  for (size_t j = 0; j < chunk->bitmap.size(); ++j) {
+    uint64 word = chunk->bitmap[j];
+    while (word != 0) {
+      array.push_back(static_cast<uint16>(j * 64 + __builtin_ctzll(word)));
+      word &= word - 1;
+    }
+  }
+  chunk->array.swap(array);
+  vector<uint64>().swap(chunk->bitmap);
+}
+
+bool IdSet::Insert(uint32 id) {
+  const uint16 high = id >> 16;
+  const uint16 low = id & 0xFFFF;
+  size_t index = LowerBound(high);
+  if (index == chunks_.size() || chunks_[index].high != high) {
+    Chunk chunk;
+    chunk.high = high;
+    chunk.count = 0;
+    chunks_.insert(chunks_.begin() + index, chunk);
+  }
+  Chunk& chunk = chunks_[index];
+  if (!chunk.bitmap.empty()) {
+    uint64& word = chunk.bitmap[low / 64];
+    const uint64 bit = 1ULL << (low % 64);
+    if (word & bit) {
+      return false;
+    }
+    word |= bit;
+  } else {
+    auto it = std::lower_bound(chunk.array.begin(), chunk.array.end(), low);
+    if (it != chunk.array.end() && *it == low) {
+      return false;
+    }
+    chunk.array.insert(it, low);
+    if (chunk.array.size() > ARRAY_MAX) {
+      ToBitmap(&chunk);
+    }
+  }
+  ++chunk.count;
+  ++size_;
+  return true;
+}
+
+bool IdSet::Erase(uint32 id) {
+  const uint16 high = id >> 16;
+  const uint16 low = id & 0xFFFF;
+  size_t index = LowerBound(high);
+  if (index == chunks_.size() || chunks_[index].high != high) {
+    return false;
+  }
+  Chunk& chunk = chunks_[index];
+  if (!chunk.bitmap.empty()) {
+    uint64& word = chunk.bitmap[low / 64];
+    const uint64 bit = 1ULL << (low % 64);
+    if (!(word & bit)) {
+      return false;
+    }
+    word &= ~bit;
+  } else {
+    auto it = std::lower_bound(chunk.array.begin(), chunk.array.end(), low);
+    if (it == chunk.array.end() || *it != low) {
+      return false;
+    }
+    chunk.array.erase(it);
+  }
+  --size_;
+  if (--chunk.count == 0) {
+    chunks_.erase(chunks_.begin() + index);
+  } else if (!chunk.bitmap.empty() && chunk.count < ARRAY_MAX / 2) {
+    // half of the limit, so a chunk at the limit doesn't flip on every
+    // insert and erase
+    ToArray(&chunk);
+  }
+  return true;
+}
+
+bool IdSet::Contains(uint32 id) const {
+  const uint16 high = id >> 16;
+  const uint16 low = id & 0xFFFF;
+  size_t index = LowerBound(high);
+  if (index == chunks_.size() || chunks_[index].high != high) {
+    return false;
+  }
+  const Chunk& chunk = chunks_[index];
+  if (!chunk.bitmap.empty()) {
+    return chunk.bitmap[low / 64] & (1ULL << (low % 64));
+  }
+  return std::binary_search(chunk.array.begin(), chunk.array.end(), low);
+}
+
+size_t IdSet::MemoryBytes() const {
+  size_t bytes = chunks_.capacity() * sizeof(Chunk);
+  for (size_t i = 0; i < chunks_.size(); ++i) {
+    bytes += chunks_[i].array.capacity() * sizeof(uint16) +
+             chunks_[i].bitmap.capacity() * sizeof(uint64);
+  }
+  return bytes;
+}
+
+}  // namespace xcomet
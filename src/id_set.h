@@ -0,0 +1,82 @@
+#ifndef SRC_ID_SET_H_
+#define SRC_ID_SET_H_
+
+#include "deps/base/basictypes.h"
+#include "src/include_std.h"
+
+namespace xcomet {
+
+// A set of uint32 ids, split in chunks of the ids sharing the high 16
+// bits. A chunk is a sorted array of the low 16 bits while it's small and
+// a bitmap of 8K bytes once it has more than ARRAY_MAX ids, so a dense set
+// costs about one bit per id and a sparse one two bytes per id. Iteration
+// is in ascending order over contiguous memory.
+class IdSet {
+ public:
+  IdSet() : size_(0) {}
+
+  // false if |id| is already in the set
+  bool Insert(uint32 id);
+  // false if |id| is not in the set
+  bool Erase(uint32 id);
+  bool Contains(uint32 id) const;
+  void Clear() {
+    chunks_.clear();
+    size_ = 0;
+  }
+  size_t Size() const {
+    return size_;
+  }
+  bool Empty() const {
+    return size_ == 0;
+  }
+  // approximate heap usage
+  size_t MemoryBytes() const;
+
+  // calls f(uint32 id) for every id in ascending order, the set must not
+  // be changed meanwhile
+  template <typename F>
+  void ForEach(F f) const {
+    for (size_t i = 0; i < chunks_.size(); ++i) {
+      const Chunk& chunk = chunks_[i];
+      const uint32 high = static_cast<uint32>(chunk.high) << 16;
+      if (chunk.bitmap.empty()) {
+        for (size_t j = 0; j < chunk.array.size(); ++j) {
+          f(high | chunk.array[j]);
+        }
+      } else {
+        for (size_t j = 0; j < chunk.bitmap.size(); ++j) {
+          uint64 word = chunk.bitmap[j];
+          while (word != 0) {
+            f(high | static_cast<uint32>(j * 64 + __builtin_ctzll(word)));
+            word &= word - 1;
+          }
+        }
+      }
+    }
+  }
+
+ private:
+  static const size_t ARRAY_MAX = 4096;
+  static const size_t BITMAP_WORDS = 65536 / 64;
+
+  struct Chunk {
+    uint16 high;
+    uint32 count;
+    // one of them is used, the bitmap when it's not empty
+    vector<uint16> array;
+    vector<uint64> bitmap;
+  };
+
+  // index of the chunk of |high| or of the first one after it
+  size_t LowerBound(uint16 high) const;
+  static void ToBitmap(Chunk* chunk);
+  static void ToArray(Chunk* chunk);
+
+  // sorted by high
+  vector<Chunk> chunks_;
+  size_t size_;
+};
+
+}  // namespace xcomet
+#endif  // SRC_ID_SET_H_
@@ -1,57 +1,196 @@
 #include "src/loop_executor.h"
 
 #include <event.h>
+#include <algorithm>
+#include "deps/base/flags.h"
 #include "deps/base/logging.h"
 #include "src/event_msgqueue.h"
 
-namespace xcomet {
+DEFINE_int32(loop_queue_ring_size, 65536,
+             "max cells of the ring of a loop queue, allocated up front, the "
+             "tasks beyond it wait in the overflow list");
 
-const int DEFAULT_CALLBACK_QUEUE_SIZE = 1000000;
+namespace xcomet {
 
-struct LoopExecutorImpl {
-  struct event_msgqueue* callback_queue;
-};
+const int TASK_CHUNK_SIZE = 1024;
+const int TAG_SHIFT = 48;
+const uint64 ADDRESS_MASK = (1ULL << TAG_SHIFT) - 1;
 
-LoopExecutor::LoopExecutor() {
+static LoopTask* HeadTask(uint64 head) {
+  return reinterpret_cast<LoopTask*>(head & ADDRESS_MASK);
 }
 
-LoopExecutor::~LoopExecutor() {
+// |task| as the new head, with the count of the updates of |head| plus one
+static uint64 NextHead(uint64 head, LoopTask* task) {
+  return (((head >> TAG_SHIFT) + 1) << TAG_SHIFT) |
+         reinterpret_cast<uintptr_t>(task);
 }
 
-void LoopExecutor::DoDestroy() {
-  if (p_->callback_queue) {
-    msgqueue_destroy(p_->callback_queue);
+LoopQueue::LoopQueue(void* loop_base, int max_size)
+    : queue_(NULL),
+      capacity_(max_size * 2),
+      free_list_(0),
+      allocated_(0),
+      overflow_list_(NULL),
+      overflow_number_(0),
+      reject_number_(0) {
+  CHECK(max_size >= 0);
+  CHECK(FLAGS_loop_queue_ring_size > 0);
+  struct event_base* evbase = static_cast<event_base*>(loop_base);
+  // 16 bytes a cell, a queue of the max size would cost megabytes per lane
+  // while it's rarely more than a few thousand deep
+  int ring_size = FLAGS_loop_queue_ring_size;
+  if (max_size != NO_LIMIT) {
+    ring_size = std::min(max_size, ring_size);
   }
-  delete p_;
+  queue_ = msgqueue_new(evbase, ring_size, &Callback, this);
+  CHECK(queue_) << "failed to create callback queue";
 }
 
-void LoopExecutor::Callback(void* data, void* ctx) {
-  function<void ()>* cb = static_cast<function<void ()>*>(data); 
-  (*cb)();
-  delete cb;
+LoopQueue::~LoopQueue() {
+  if (queue_) {
+    msgqueue_destroy(queue_);
+  }
+  LoopTask* task = overflow_list_.exchange(NULL);
+  while (task != NULL) {
+    LoopTask* next = task->next;
+    task->invoke(task, false);
+    task = next;
+  }
+  for (size_t i = 0; i < chunks_.size(); ++i) {
+    delete [] chunks_[i];
+  }
 }
 
+void LoopQueue::Callback(void* data, void* ctx) {
+  LoopQueue* self = static_cast<LoopQueue*>(ctx);
+  if (data != NULL) {
+    self->RunTask(static_cast<LoopTask*>(data));
+  }
+  if (self->overflow_list_ != NULL && msgqueue_length(self->queue_) == 0) {
+    self->DrainOverflow();
+  }
+}
 
-void LoopExecutor::DoInit(void* loop_base) {
-  p_ = new LoopExecutorImpl();
-  struct event_base* evbase = static_cast<event_base*>(loop_base);
-  p_->callback_queue = msgqueue_new(evbase,
-                                    DEFAULT_CALLBACK_QUEUE_SIZE,
-                                    &Callback,
-                                    NULL);
-  CHECK(p_->callback_queue) << "failed to create callback queue";
+LoopTask* LoopQueue::AllocTask() {
+  LoopTask* task = PopFreeTask();
+  if (task != NULL) {
+    return task;
+  }
+  std::lock_guard<std::mutex> lock(alloc_mutex_);
+  // another producer may have added a chunk meanwhile
+  task = PopFreeTask();
+  if (task != NULL) {
+    return task;
+  }
+  int n = TASK_CHUNK_SIZE;
+  if (capacity_ != NO_LIMIT) {
+    if (allocated_ >= capacity_) {
+      return NULL;
+    }
+    n = std::min(n, capacity_ - allocated_);
+  }
+  LoopTask* chunk = new LoopTask[n];
+  CHECK((reinterpret_cast<uintptr_t>(chunk + n) & ~ADDRESS_MASK) == 0)
+      << "task address doesn't fit in " << TAG_SHIFT << " bits";
+  chunks_.push_back(chunk);
+  allocated_ += n;
+  if (n > 1) {
+    for (int i = 1; i < n - 1; ++i) {
+      chunk[i].next = &chunk[i + 1];
+    }
+    PushFreeTasks(&chunk[1], &chunk[n - 1]);
+  }
+  return &chunk[0];
 }
 
-void LoopExecutor::DoRunInMainLoop(function<void ()> f) {
-  function<void ()>* cb = new function<void ()>(f);
+LoopTask* LoopQueue::PopFreeTask() {
+  uint64 head = free_list_.load(std::memory_order_acquire);
   while (true) {
-    if (msgqueue_push(p_->callback_queue, cb) == -1) {
-      LOG(WARNING) << "msgqueue_push failed, will try 100ms later";
-      base::MilliSleep(100);
-    } else {
-      break;
+    LoopTask* task = HeadTask(head);
+    if (task == NULL) {
+      return NULL;
+    }
+    // stale if another producer took the node meanwhile, then the compare
+    // fails on the count
+    LoopTask* next = __atomic_load_n(&task->next, __ATOMIC_RELAXED);
+    if (free_list_.compare_exchange_weak(head, NextHead(head, next),
+                                         std::memory_order_acquire,
+                                         std::memory_order_acquire)) {
+      return task;
     }
   }
 }
 
+void LoopQueue::PushFreeTasks(LoopTask* first, LoopTask* last) {
+  uint64 head = free_list_.load(std::memory_order_relaxed);
+  do {
+    __atomic_store_n(&last->next, HeadTask(head), __ATOMIC_RELAXED);
+  } while (!free_list_.compare_exchange_weak(head, NextHead(head, first),
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+}
+
+void LoopQueue::FreeTask(LoopTask* task) {
+  PushFreeTasks(task, task);
+}
+
+void LoopQueue::Enqueue(LoopTask* task) {
+  if (overflow_list_ == NULL && msgqueue_push(queue_, task) == 0) {
+    return;
+  }
+  LoopTask* head = overflow_list_;
+  do {
+    task->next = head;
+  } while (!overflow_list_.compare_exchange_weak(head, task));
+  ++overflow_number_;
+  // if the ring is still full the loop has pending callbacks and will see
+  // the overflow list after the last one, otherwise wake it up
+  msgqueue_push(queue_, NULL);
+}
+
+void LoopQueue::RunTask(LoopTask* task) {
+  task->invoke(task, true);
+  FreeTask(task);
+}
+
+void LoopQueue::DrainOverflow() {
+  LoopTask* task = overflow_list_.exchange(NULL);
+  LoopTask* reversed = NULL;
+  while (task != NULL) {
+    LoopTask* next = task->next;
+    task->next = reversed;
+    reversed = task;
+    task = next;
+  }
+  while (reversed != NULL) {
+    LoopTask* next = reversed->next;
+    RunTask(reversed);
+    reversed = next;
+  }
+}
+
+void LoopQueue::OnReject() {
+  int64 n = ++reject_number_;
+  if (n % 10000 == 1) {
+    LOG(ERROR) << "loop queue is full, " << n << " tasks rejected so far";
+  }
+}
+
+LoopExecutor::LoopExecutor() {
+}
+
+LoopExecutor::~LoopExecutor() {
+}
+
+void LoopExecutor::DoDestroy() {
+  callback_queue_.reset();
+}
+
+void LoopExecutor::DoInit(void* loop_base) {
+  // the storage and auth completions, a dropped one would leave its
+  // request waiting forever
+  callback_queue_.reset(new LoopQueue(loop_base, LoopQueue::NO_LIMIT));
 }
+
+}  // namespace xcomet
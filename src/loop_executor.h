@@ -1,19 +1,149 @@
 #ifndef SRC_LOOP_EXECUTOR_H_
 #define SRC_LOOP_EXECUTOR_H_
 
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include "deps/base/scoped_ptr.h"
 #include "deps/base/singleton.h"
 #include "src/include_std.h"
 
+struct event_msgqueue;
+
 namespace xcomet {
 
-class LoopExecutorImpl;
+// A closure waiting in a LoopQueue. Nodes are recycled through a free list
+// and closures that fit in |storage| are constructed in place, so posting
+// doesn't touch the heap in the steady state.
+struct LoopTask {
+  static const size_t INLINE_SIZE = 64;
+
+  LoopTask* next;
+  // runs the closure if |run| is true, then destroys it
+  void (*invoke)(LoopTask* task, bool run);
+  union {
+    void* heap;
+    std::aligned_storage<INLINE_SIZE>::type storage;
+  };
+};
+
+template <typename F>
+class LoopClosure {
+ public:
+  typedef typename std::decay<F>::type Fn;
+
+  static void Init(LoopTask* task, F&& f) {
+    Init(task, std::forward<F>(f),
+         std::integral_constant<bool,
+             sizeof(Fn) <= LoopTask::INLINE_SIZE &&
+             alignof(Fn) <= alignof(std::aligned_storage<
+                 LoopTask::INLINE_SIZE>::type)>());
+  }
+
+ private:
+  static void Init(LoopTask* task, F&& f, std::true_type) {
+    new (&task->storage) Fn(std::forward<F>(f));
+    task->invoke = &InvokeInline;
+  }
+
+  static void Init(LoopTask* task, F&& f, std::false_type) {
+    task->heap = new Fn(std::forward<F>(f));
+    task->invoke = &InvokeHeap;
+  }
+
+  static void InvokeInline(LoopTask* task, bool run) {
+    Fn* fn = reinterpret_cast<Fn*>(&task->storage);
+    if (run) {
+      (*fn)();
+    }
+    fn->~Fn();
+  }
+
+  static void InvokeHeap(LoopTask* task, bool run) {
+    Fn* fn = static_cast<Fn*>(task->heap);
+    if (run) {
+      (*fn)();
+    }
+    delete fn;
+  }
+};
+
+// Runs closures posted from any thread inside the loop of `loop_base`.
+// The ring has at most --loop_queue_ring_size cells. When it is full, tasks
+// go to an overflow list which is drained once the ring is empty, so the
+// order of posts from one thread is kept. Ring and overflow together hold
+// at most 2 * max_size tasks, beyond that Post fails fast instead of
+// blocking the caller. With NO_LIMIT the overflow list grows as needed and
+// Post never fails, for the completions and handoffs which can't be lost.
+class LoopQueue {
+ public:
+  static const int NO_LIMIT = 0;
+
+  LoopQueue(void* loop_base, int max_size);
+  ~LoopQueue();
+
+  // returns false and drops the closure when the queue is full, never with
+  // NO_LIMIT
+  template <typename F>
+  bool Post(F&& f) {
+    LoopTask* task = AllocTask();
+    if (task == NULL) {
+      OnReject();
+      return false;
+    }
+    LoopClosure<F>::Init(task, std::forward<F>(f));
+    Enqueue(task);
+    return true;
+  }
+
+  int64 OverflowNumber() const {
+    return overflow_number_;
+  }
+
+  int64 RejectNumber() const {
+    return reject_number_;
+  }
+
+ private:
+  static void Callback(void* data, void* ctx);
+  LoopTask* AllocTask();
+  LoopTask* PopFreeTask();
+  // links the nodes from |first| to |last| in front of the free list
+  void PushFreeTasks(LoopTask* first, LoopTask* last);
+  void FreeTask(LoopTask* task);
+  void Enqueue(LoopTask* task);
+  void RunTask(LoopTask* task);
+  void DrainOverflow();
+  void OnReject();
+
+  struct event_msgqueue* queue_;
+  const int capacity_;
+
+  // the head node in the low 48 bits of the address and a count of the
+  // updates in the high 16 bits, so a pop which raced with another pop and
+  // a push of the same node fails its compare instead of linking a node in
+  // use (ABA). Popped by any producer without a lock
+  atomic<uint64> free_list_;
+  // only taken to add a chunk of nodes when the free list is empty
+  std::mutex alloc_mutex_;
+  int allocated_;
+  vector<LoopTask*> chunks_;
+
+  atomic<LoopTask*> overflow_list_;
+  atomic<int64> overflow_number_;
+  atomic<int64> reject_number_;
+
+  DISALLOW_COPY_AND_ASSIGN(LoopQueue);
+};
+
 class LoopExecutor {
  public:
   static LoopExecutor& Instance() {
     return *Singleton<LoopExecutor>::get();
   }
-  static void RunInMainLoop(function<void ()> f) {
-    return Instance().DoRunInMainLoop(f);
+  template <typename F>
+  static bool RunInMainLoop(F&& f) {
+    return Instance().callback_queue_->Post(std::forward<F>(f));
   }
   static void Destroy() {
     Instance().DoDestroy();
@@ -27,11 +157,8 @@ class LoopExecutor {
   ~LoopExecutor();
   void DoInit(void* loop_base);
   void DoDestroy();
-  void DoRunInMainLoop(function<void ()> f);
-
-  static void Callback(void* data, void* ctx);
 
-  LoopExecutorImpl* p_;
+  scoped_ptr<LoopQueue> callback_queue_;
   DISALLOW_COPY_AND_ASSIGN(LoopExecutor);
 
   friend struct DefaultSingletonTraits<LoopExecutor>;
@@ -0,0 +1,467 @@
+#include "src/message.h"
+
+#include <string.h>
+#include <event.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace xcomet {
+
+// the first '"' or '\\' in [p, end), end if there is none
+static inline const char* FindQuoteOrEscape(const char* p, const char* end) {
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i escape = _mm_set1_epi8('\\');
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                              _mm_cmpeq_epi8(chunk, escape)));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#else
+  // word at a time, a zero byte in (w ^ pattern) is a match
+  const uint64 ones = 0x0101010101010101ULL;
+  const uint64 highs = 0x8080808080808080ULL;
+  while (end - p >= 8) {
+    uint64 w;
+    ::memcpy(&w, p, sizeof(w));
+    uint64 q = w ^ (ones * '"');
+    uint64 e = w ^ (ones * '\\');
+    if ((((q - ones) & ~q) | ((e - ones) & ~e)) & highs) {
+      break;
+    }
+    p += 8;
+  }
+#endif
+  while (p < end && *p != '"' && *p != '\\') {
+    ++p;
+  }
+  return p;
+}
+
+static inline const char* SkipSpaces(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+    ++p;
+  }
+  return p;
+}
+
+static bool ParseInt64(const char* p, size_t len, int64* value) {
+  const char* end = p + len;
+  bool negative = false;
+  if (p < end && *p == '-') {
+    negative = true;
+    ++p;
+  }
+  if (p == end) {
+    return false;
+  }
+  int64 v = 0;
+  for (; p < end; ++p) {
+    if (*p < '0' || *p > '9') {
+      return false;
+    }
+    v = v * 10 + (*p - '0');
+  }
+  *value = negative ? -v : v;
+  return true;
+}
+
+// the first char which needs an escape in [p, end), end if there is none
+static inline const char* FindSpecial(const char* p, const char* end) {
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i escape = _mm_set1_epi8('\\');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i hit = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, escape)),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+    int mask = _mm_movemask_epi8(hit);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#else
+  const uint64 ones = 0x0101010101010101ULL;
+  const uint64 highs = 0x8080808080808080ULL;
+  while (end - p >= 8) {
+    uint64 w;
+    ::memcpy(&w, p, sizeof(w));
+    uint64 q = w ^ (ones * '"');
+    uint64 e = w ^ (ones * '\\');
+    uint64 r = w ^ (ones * '\r');
+    uint64 n = w ^ (ones * '\n');
+    if ((((q - ones) & ~q) | ((e - ones) & ~e) |
+         ((r - ones) & ~r) | ((n - ones) & ~n)) & highs) {
+      break;
+    }
+    p += 8;
+  }
+#endif
+  while (p < end && *p != '"' && *p != '\\' && *p != '\r' && *p != '\n') {
+    ++p;
+  }
+  return p;
+}
+
+static size_t EscapedSize(const string& s) {
+  const char* p = s.data();
+  const char* end = p + s.size();
+  size_t size = s.size();
+  while ((p = FindSpecial(p, end)) != end) {
+    ++size;
+    ++p;
+  }
+  return size;
+}
+
+static char* WriteEscaped(char* out, const string& s) {
+  const char* p = s.data();
+  const char* end = p + s.size();
+  while (true) {
+    const char* special = FindSpecial(p, end);
+    ::memcpy(out, p, special - p);
+    out += special - p;
+    if (special == end) {
+      return out;
+    }
+    *out++ = '\\';
+    char c = *special;
+    *out++ = c == '\r' ? 'r' : (c == '\n' ? 'n' : c);
+    p = special + 1;
+  }
+}
+
+static char* WriteInt64(char* out, int64 v) {
+  char buf[24];
+  char* p = buf + sizeof(buf);
+  uint64 u = v < 0 ? 0 - (uint64)v : (uint64)v;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (v < 0) {
+    *--p = '-';
+  }
+  size_t len = buf + sizeof(buf) - p;
+  ::memcpy(out, p, len);
+  return out + len;
+}
+
+// ,"f":
+static inline char* WriteKey(char* out, char f, bool first) {
+  if (!first) {
+    *out++ = ',';
+  }
+  *out++ = '"';
+  *out++ = f;
+  *out++ = '"';
+  *out++ = ':';
+  return out;
+}
+
+static inline char* WriteString(char* out,
+                                char f,
+                                bool first,
+                                const string& value,
+                                size_t escaped) {
+  out = WriteKey(out, f, first);
+  *out++ = '"';
+  if (escaped == value.size()) {
+    ::memcpy(out, value.data(), escaped);
+    out += escaped;
+  } else {
+    out = WriteEscaped(out, value);
+  }
+  *out++ = '"';
+  return out;
+}
+
+// key with separator is at most 5 bytes, an int64 at most 20
+static const size_t kIntField = 5 + 20;
+static const size_t kStringField = 5 + 2;
+
+// The serialized form is a prefix of the fields which differ between the
+// recipients of a fan-out, "{" t s, and a shared part of all the others,
+// y l f u c b "}\n", so the shared part can be reused by the clones.
+static const int kSharedStringNumber = 4;
+
+static bool HasSharedFields(const MessagePrivate& m) {
+  const MessageContent& content = m.Content();
+  return m.type != -1 || m.ttl != -1 || !m.user.empty() ||
+         !content.from.empty() || !content.channel.empty() ||
+         !content.body.empty();
+}
+
+static size_t PrefixMaxSize(const MessagePrivate& m, size_t* escaped) {
+  *escaped = m.to.empty() ? 0 : EscapedSize(m.to);
+  return 2 + kIntField + kStringField + *escaped;
+}
+
+static char* WritePrefix(const MessagePrivate& m,
+                         size_t escaped,
+                         bool more,
+                         char* out) {
+  bool first = true;
+  *out++ = '{';
+  if (!m.to.empty()) {
+    out = WriteString(out, K_TO, first, m.to, escaped);
+    first = false;
+  }
+  if (m.seq != -1) {
+    out = WriteInt64(WriteKey(out, K_SEQ, first), m.seq);
+    first = false;
+  }
+  if (!first && more) {
+    *out++ = ',';
+  }
+  return out;
+}
+
+static size_t SharedMaxSize(const MessagePrivate& m,
+                            const string* strings[],
+                            size_t escaped[]) {
+  const MessageContent& content = m.Content();
+  strings[0] = &content.from;
+  strings[1] = &m.user;
+  strings[2] = &content.channel;
+  strings[3] = &content.body;
+  size_t size = 2 + 2 * kIntField;
+  for (int i = 0; i < kSharedStringNumber; ++i) {
+    escaped[i] = strings[i]->empty() ? 0 : EscapedSize(*strings[i]);
+    size += kStringField + escaped[i];
+  }
+  return size;
+}
+
+static char* WriteShared(const MessagePrivate& m,
+                         const string* strings[],
+                         const size_t escaped[],
+                         char* out) {
+  static const char keys[kSharedStringNumber] = {
+    K_FROM, K_USER, K_CHANNEL, K_BODY
+  };
+  bool first = true;
+  if (m.type != -1) {
+    out = WriteInt64(WriteKey(out, K_TYPE, first), m.type);
+    first = false;
+  }
+  if (m.ttl != -1) {
+    out = WriteInt64(WriteKey(out, K_TTL, first), m.ttl);
+    first = false;
+  }
+  for (int i = 0; i < kSharedStringNumber; ++i) {
+    if (!strings[i]->empty()) {
+      out = WriteString(out, keys[i], first, *strings[i], escaped[i]);
+      first = false;
+    }
+  }
+  *out++ = '}';
+  *out++ = '\n';
+  return out;
+}
+
+StringPtr Message::Serialize(const Message& msg) {
+  MessagePrivate& m = *msg.p_;
+  if (m.serialized.get() != NULL) {
+    return m.serialized;
+  }
+  size_t to_escaped = 0;
+  size_t size = PrefixMaxSize(m, &to_escaped);
+  StringPtr data;
+  if (m.shared_serialized.get() != NULL) {
+    // a clone of a fan-out, only the prefix is encoded
+    const string& shared = *m.shared_serialized;
+    data.reset(new string(size + shared.size(), '\0'));
+    char* const begin = &(*data)[0];
+    char* out = WritePrefix(m, to_escaped, shared.size() > 2, begin);
+    ::memcpy(out, shared.data(), shared.size());
+    data->resize(out - begin + shared.size());
+  } else {
+    const string* strings[kSharedStringNumber];
+    size_t escaped[kSharedStringNumber];
+    size += SharedMaxSize(m, strings, escaped);
+    data.reset(new string(size, '\0'));
+    char* const begin = &(*data)[0];
+    char* out = WritePrefix(m, to_escaped, HasSharedFields(m), begin);
+    out = WriteShared(m, strings, escaped, out);
+    data->resize(out - begin);
+  }
+  m.serialized = data;
+  return data;
+}
+
+StringPtr Message::SerializeParts(const Message& msg, string* prefix) {
+  MessagePrivate& m = *msg.p_;
+  if (m.shared_serialized.get() == NULL) {
+    const string* strings[kSharedStringNumber];
+    size_t escaped[kSharedStringNumber];
+    StringPtr shared(new string(SharedMaxSize(m, strings, escaped), '\0'));
+    char* const begin = &(*shared)[0];
+    shared->resize(WriteShared(m, strings, escaped, begin) - begin);
+    m.shared_serialized = shared;
+  }
+  size_t to_escaped = 0;
+  prefix->resize(PrefixMaxSize(m, &to_escaped));
+  char* const begin = &(*prefix)[0];
+  char* out = WritePrefix(m,
+                          to_escaped,
+                          m.shared_serialized->size() > 2,
+                          begin);
+  prefix->resize(out - begin);
+  return m.shared_serialized;
+}
+
+bool Message::SetField(char f, Message& m, const char* v, size_t len) {
+  VLOG(8) << f << ", " << string(v, len);
+  m.p_->serialized.reset();
+  m.p_->shared_serialized.reset();
+  int64 n = 0;
+  switch (f) {
+    case K_FROM:
+      m.MutableContent()->from.assign(v, len);
+      break;
+    case K_TO:
+      m.p_->to.assign(v, len);
+      break;
+    case K_USER:
+      m.p_->user.assign(v, len);
+      break;
+    case K_CHANNEL:
+      m.MutableContent()->channel.assign(v, len);
+      break;
+    case K_BODY:
+      m.MutableContent()->body.assign(v, len);
+      break;
+    case K_TYPE:
+    case K_SEQ:
+    case K_TTL:
+      if (!ParseInt64(v, len, &n)) {
+        LOG(ERROR) << "invalid integer of field " << f << ": "
+                   << string(v, len);
+        return false;
+      }
+      if (f == K_TYPE) {
+        m.SetType(MType(n));
+      } else if (f == K_SEQ) {
+        m.SetSeq(int(n));
+      } else {
+        m.SetTTL(n);
+      }
+      break;
+    default:
+      LOG(ERROR) << "invalid message field: " << f;
+      return false;
+  }
+  return true;
+}
+
+bool Message::Parse(const char* data, size_t len, Message* msg) {
+  const char* p = data;
+  const char* end = data + len;
+  p = SkipSpaces(p, end);
+  if (p == end || *p++ != '{') {
+    return false;
+  }
+  string unescaped;
+  while (true) {
+    // "f":
+    p = SkipSpaces(p, end);
+    if (end - p < 4 || p[0] != '"' || !::isalpha(p[1]) || p[2] != '"') {
+      return false;
+    }
+    char f = p[1];
+    p = SkipSpaces(p + 3, end);
+    if (p == end || *p++ != ':') {
+      return false;
+    }
+    p = SkipSpaces(p, end);
+    if (p == end) {
+      return false;
+    }
+
+    if (*p == '"') {
+      const char* start = ++p;
+      p = FindQuoteOrEscape(p, end);
+      if (p == end) {
+        return false;
+      }
+      if (*p == '"') {
+        SetField(f, *msg, start, p - start);
+      } else {
+        unescaped.assign(start, p - start);
+        while (*p == '\\') {
+          if (end - p < 2) {
+            return false;
+          }
+          char c = p[1];
+          if (c == 'n') {
+            unescaped.push_back('\n');
+          } else if (c == 'r') {
+            unescaped.push_back('\r');
+          } else if (::isprint(c)) {
+            unescaped.push_back(c);
+          } else {
+            return false;
+          }
+          start = p + 2;
+          p = FindQuoteOrEscape(start, end);
+          if (p == end) {
+            return false;
+          }
+          unescaped.append(start, p - start);
+        }
+        SetField(f, *msg, unescaped.data(), unescaped.size());
+      }
+      ++p;
+    } else {
+      const char* start = p;
+      if (*p == '-') {
+        ++p;
+      }
+      while (p < end && *p >= '0' && *p <= '9') {
+        ++p;
+      }
+      if (p == start) {
+        return false;
+      }
+      SetField(f, *msg, start, p - start);
+    }
+
+    p = SkipSpaces(p, end);
+    if (p == end) {
+      return false;
+    }
+    char c = *p++;
+    if (c == '}') {
+      return true;
+    } else if (c != ',') {
+      return false;
+    }
+  }
+}
+
+bool Message::Parse(struct evbuffer* buf, size_t len, Message* msg) {
+  if (evbuffer_get_length(buf) < len) {
+    return false;
+  }
+  struct evbuffer_iovec vec;
+  int n = evbuffer_peek(buf, len, NULL, &vec, 1);
+  if (n == 1 && vec.iov_len >= len) {
+    return Parse(static_cast<const char*>(vec.iov_base), len, msg);
+  }
+  // spread over several chunks, make them contiguous
+  unsigned char* data = evbuffer_pullup(buf, len);
+  return data != NULL && Parse(reinterpret_cast<const char*>(data), len, msg);
+}
+
+}  // namespace xcomet
@@ -5,12 +5,17 @@
 #include <string>
 #include <ostream>
 #include "deps/base/logging.h"
+#include "src/pool_allocator.h"
 #include "src/typedef.h"
 #include "src/utils.h"
 
+struct evbuffer;
+
 namespace xcomet {
 
-typedef shared_ptr<vector<string> > MessageDataSet;
+// the bodies are shared with the storage and the output buffers of the
+// sessions, they must not be modified
+typedef shared_ptr<vector<StringPtr> > MessageDataSet;
 
 const int64 NO_EXPIRE = 0;
 
@@ -25,27 +30,47 @@ const int64 NO_EXPIRE = 0;
 // only used for peer conmunication, remove before save or send to user
 #define K_TTL             'l'
 
+// The fields which are the same for every recipient of a message, shared
+// by the clones of a message and copied only when one of them is changed.
+struct MessageContent {
+  string from;
+  string channel;
+  string body;
+
+  bool operator==(const MessageContent& other) const {
+    return from == other.from &&
+           channel == other.channel &&
+           body == other.body;
+  }
+};
+
 struct MessagePrivate {
   int type;
   int seq;
   string to;
-  string from;
   int64 ttl;
   string user;
-  string channel;
-  string body;
+  // NULL until one of its fields is set
+  shared_ptr<MessageContent> content;
+  // the result of Message::Serialize, reset by every setter
+  StringPtr serialized;
+  // the part of it which is the same for every recipient, set by
+  // Message::SerializeParts, reset by the setters of the fields in it
+  StringPtr shared_serialized;
 
   MessagePrivate() : type(-1), seq(-1), ttl(-1) {
   }
+  const MessageContent& Content() const {
+    static const MessageContent empty;
+    return content.get() != NULL ? *content : empty;
+  }
   bool operator==(const MessagePrivate& other) {
     return type == other.type &&
            seq == other.seq &&
            to == other.to &&
-           from == other.from &&
            ttl == other.ttl &&
            user == other.user &&
-           channel == other.channel &&
-           body == other.body;
+           Content() == other.Content();
   }
 };
 
@@ -75,55 +100,70 @@ class Message {
     return MTYPE_STRINGS[type];
   }
 
-  Message() : p_(new MessagePrivate()) {}
+  Message()
+      : p_(std::allocate_shared<MessagePrivate>(
+            PoolAllocator<MessagePrivate>())) {
+  }
   ~Message() {}
   bool operator==(const Message& other) {
     return *p_ == *(other.p_);
   }
+  // the clone shares from, channel and body with this message until one of
+  // them is changed on either side, so a clone per recipient is cheap
   Message Clone() const {
     Message msg;
     *(msg.p_) = *(p_);
     return msg;
   }
   void SetFrom(const string& uid) {
-    p_->from = uid;
+    MutableContent()->from = uid;
   }
   void SetTo(const string& uid) {
+    p_->serialized.reset();
     p_->to = uid;
   }
   void SetSeq(int seq) {
+    p_->serialized.reset();
     p_->seq = seq;
   }
   void SetTTL(int64 ttl) {
+    p_->serialized.reset();
+    p_->shared_serialized.reset();
     p_->ttl = ttl;
   }
   void SetType(MType type) {
+    p_->serialized.reset();
+    p_->shared_serialized.reset();
     p_->type = (int)type;
   }
   void SetUser(const string& user) {
+    p_->serialized.reset();
+    p_->shared_serialized.reset();
     p_->user = user;
   }
   void SetUser(const char* ptr) {
+    p_->serialized.reset();
+    p_->shared_serialized.reset();
     p_->user.append(ptr);
   }
   void SetChannel(const string& channel) {
-    p_->channel = channel;
+    MutableContent()->channel = channel;
   }
   void SetChannel(const char* ptr) {
-    p_->channel.append(ptr);
+    MutableContent()->channel.append(ptr);
   }
   void SetBody(const string& body) {
-    p_->body = body;
+    MutableContent()->body = body;
   }
   void SetBody(const char* ptr, size_t len) {
-    p_->body.append(ptr, len);
+    MutableContent()->body.append(ptr, len);
   }
   void SetBody(const char* ptr) {
-    p_->body.append(ptr);
+    MutableContent()->body.append(ptr);
   }
 
   const string& From() const {
-    return p_->from;
+    return p_->Content().from;
   }
   const string& To() const {
     return p_->to;
@@ -133,11 +173,19 @@ class Message {
   }
   int64 TTL() const {
     int64 ttl = p_->ttl;
-    p_->ttl = -1;
+    if (ttl != -1) {
+      p_->serialized.reset();
+      p_->shared_serialized.reset();
+      p_->ttl = -1;
+    }
     return ttl;
   }
   void RemoveTTL() {
-    p_->ttl = -1;
+    if (p_->ttl != -1) {
+      p_->serialized.reset();
+      p_->shared_serialized.reset();
+      p_->ttl = -1;
+    }
   }
   MType Type() const {
     return (MType)p_->type;
@@ -146,10 +194,10 @@ class Message {
     return p_->user;
   }
   const string& Channel() const {
-    return p_->channel;
+    return p_->Content().channel;
   }
-  const string& Body() {
-    return p_->body;
+  const string& Body() const {
+    return p_->Content().body;
   }
 
   bool HasSeq() const {
@@ -167,214 +215,54 @@ class Message {
   }
 
   static bool SetField(char f, Message& m, const string& v) {
-    VLOG(8) << f << ", " << v;
-    switch (f) {
-      case K_FROM:
-        m.SetFrom(v);
-        break;
-      case K_TO:
-        m.SetTo(v);
-        break;
-      case K_USER:
-        m.SetUser(v);
-        break;
-      case K_CHANNEL:
-        m.SetChannel(v);
-        break;
-      case K_BODY:
-        m.SetBody(v);
-        break;
-      case K_TYPE:
-        m.SetType(MType(std::stoi(v)));
-        break;
-      case K_SEQ:
-        m.SetSeq(std::stoi(v));
-        break;
-      case K_TTL:
-        m.SetTTL(std::stoll(v));
-        break;
-      default:
-        LOG(ERROR) << "invalid message field: " << f;
-        return false;
-    }
-    return true;
+    return SetField(f, m, v.data(), v.size());
   }
+  static bool SetField(char f, Message& m, const char* v, size_t len);
+
   // need to bind, cannot overload
   static Message UnserializeString(const string& data) {
-    enum ParseStatus {
-      PS_NOT_START,
-      PS_OBJ_START,
-      PS_FIELD_START,
-      PS_FIELD_FOUND,
-      PS_FIELD_END,
-      PS_VALUE_START,
-      PS_VALUE_INT,
-      PS_VALUE_STRING,
-      PS_VALUE_STRING_ESCAPE,
-      PS_VALUE_STRING_END,
-      PS_OBJ_END,
-    };
     Message msg;
-    ParseStatus status = PS_NOT_START;
-    ostringstream stream;
-    char f = '\0';
-    for (int i = 0; i < data.size(); ++i) {
-      VLOG(8) << status << ", " << data[i];
-      char c = data[i];
-      if (c == ' ') {
-        if (status == PS_VALUE_STRING) {
-          stream << c;
-        }
-        continue;
-      }
-      switch (status) {
-        case PS_NOT_START:
-          if (c == '{') {
-            status = PS_OBJ_START;
-          } else {
-            goto __loop_end;
-          }
-          break;
-        case PS_OBJ_START:
-          if (c == '"') {
-            status = PS_FIELD_START;
-          } else {
-            goto __loop_end;
-          }
-          break;
-        case PS_FIELD_START:
-          if (::isalpha(c)) {
-            f = c;
-            status = PS_FIELD_FOUND;
-          } else {
-            goto __loop_end;
-          }
-          break;
-        case PS_FIELD_FOUND:
-          if (c == '"') {
-            status = PS_FIELD_END;
-          } else {
-            goto __loop_end;
-          }
-          break;
-        case PS_FIELD_END:
-          if (c == ':') {
-            status = PS_VALUE_START;
-            stream.str("");
-          } else {
-            goto __loop_end;
-          }
-          break;
-        case PS_VALUE_START:
-          if (c == '"') {
-            status = PS_VALUE_STRING;
-          } else if (::isdigit(c)) {
-            status = PS_VALUE_INT;
-            stream << c;
-          }
-          break;
-        case PS_VALUE_STRING:
-          if (c == '\\') {
-            status = PS_VALUE_STRING_ESCAPE;
-          } else if (c == '"') {
-            status = PS_VALUE_STRING_END;
-          } else {
-            stream << c;
-          }
-          break;
-        case PS_VALUE_STRING_ESCAPE:
-          if (c == 'n') {
-            stream << '\n';
-          } else if (c == 'r') {
-            stream << '\r';
-          } else if (::isprint(c)) {
-            stream << c;
-          } else {
-            goto __loop_end;
-          }
-          status = PS_VALUE_STRING;
-          break;
-        case PS_VALUE_STRING_END:
-          if (c == ',') {
-            SetField(f, msg, stream.str());
-            status = PS_OBJ_START;
-          } else if (c == '}') {
-            SetField(f, msg, stream.str());
-            status = PS_OBJ_END;
-          } else {
-            goto __loop_end;
-          }
-          break;
-        case PS_VALUE_INT:
-          if (c == ',') {
-            SetField(f, msg, stream.str());
-            status = PS_OBJ_START;
-          } else if (c == '}') {
-            SetField(f, msg, stream.str());
-            status = PS_OBJ_END;
-          } else {
-            stream << c;
-          }
-          break;
-        default:
-          goto __loop_end;
-      }
-    }
-    __loop_end:
-    if (status != PS_OBJ_END) {
+    if (!Parse(data.data(), data.size(), &msg)) {
       LOG(ERROR) << "invalid message: " << data;
     }
     return msg;
   }
 
-  static StringPtr Serialize(const Message& msg) {
-    ostringstream stream;
-    stream << "{";
-    if (msg.p_->type != -1) {
-      stream << '"' << K_TYPE << "\":" << msg.p_->type;
-    }
-    if (msg.p_->seq != -1) {
-      stream << ",\"" << K_SEQ << "\":" << msg.p_->seq;
-    }
-    if (msg.p_->ttl != -1) {
-      stream << ",\"" << K_TTL << "\":" << msg.p_->ttl;
-    }
-    if (!msg.p_->to.empty()) {
-      stream << ",\"" << K_TO << "\":\"" << msg.p_->to << '"';
-    }
-    if (!msg.p_->from.empty()) {
-      stream << ",\"" << K_FROM << "\":\"" << msg.p_->from << '"';
-    }
-    if (!msg.p_->user.empty()) {
-      stream << ",\"" << K_USER << "\":\"" << msg.p_->user << '"';
-    }
-    if (!msg.p_->channel.empty()) {
-      stream << ",\"" << K_CHANNEL << "\":\"" << msg.p_->channel << '"';
-    }
-    if (!msg.p_->body.empty()) {
-      stream << ",\"" << K_BODY << "\":\"";
-      for (int i = 0; i < msg.p_->body.size(); ++i) {
-        char c = msg.p_->body[i];
-        if(c == '"') {
-          stream << "\\\"";
-        } else if (c == '\\') {
-          stream << "\\\\";
-        } else if(c == '\r') {
-          stream << "\\r";
-        } else if(c == '\n') {
-          stream << "\\n";
-        } else {
-          stream << c;
-        }
-      }
-      stream << '"';
+  // Parses in one pass over the input, the values are copied straight into
+  // the message fields, only the escaped ones go through a second buffer.
+  // Return false if the input is not a complete message, the fields parsed
+  // before the error are kept.
+  static bool Parse(const char* data, size_t len, Message* msg);
+  // parses the first |len| bytes of |buf| without draining them, in place
+  // if they are in one chunk
+  static bool Parse(struct evbuffer* buf, size_t len, Message* msg);
+
+  // The result is cached in the message until a field changes, copies of
+  // a message share the cache, so don't modify the returned string.
+  static StringPtr Serialize(const Message& msg);
+  // For fan-out, splits the serialized form in |prefix|, which only holds
+  // the fields which differ between recipients (to and seq), and the
+  // returned rest. The rest is cached and shared by the clones made after
+  // this call, and Serialize of such a clone only encodes its prefix.
+  // |prefix| followed by the rest equals Serialize(msg).
+  static StringPtr SerializeParts(const Message& msg, string* prefix);
+
+ private:
+  // resets the serialized cache, and copies the content if it's shared
+  // with a clone
+  MessageContent* MutableContent() {
+    p_->serialized.reset();
+    p_->shared_serialized.reset();
+    if (p_->content.get() == NULL) {
+      p_->content = std::allocate_shared<MessageContent>(
+          PoolAllocator<MessageContent>());
+    } else if (!p_->content.unique()) {
+      p_->content = std::allocate_shared<MessageContent>(
+          PoolAllocator<MessageContent>(), *p_->content);
     }
-    stream << "}\n";
-    StringPtr data(new string(stream.str()));
-    return data;
+    return p_->content.get();
   }
 
- private:
   shared_ptr<MessagePrivate> p_;
 
   friend ostream& operator<<(ostream&, const Message&);
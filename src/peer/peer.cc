@@ -5,7 +5,6 @@
 #include "src/peer/zhelpers.h"
 
 const int IO_THREAD_NUM = 1;
-const int ALL_PEERS = -1;
 DEFINE_int32(peer_start_port, 11000, "");
 
 Peer::Peer(const int id, const vector<PeerInfo>& peers)
@@ -87,6 +86,10 @@ void Peer::Send(const int target,
   outbox_.Push(msg);
 }
 
+void Peer::Send(PeerMessagePtr msg) {
+  outbox_.Push(msg);
+}
+
 void Peer::Send(const int target,
                 const int type,
                 const string& user,
@@ -153,14 +156,11 @@ void Peer::RestartSend() {
 
 static void DoSend(zmq::socket_t& publisher,
                    int target,
-                   const PeerMessage& msg) {
-  // send message address
-  s_sendmore(publisher, std::to_string(target));
-
-  // send message data
-  s_sendmore(publisher, std::to_string(msg.type));
-  s_sendmore(publisher, msg.user);
-  s_send(publisher, msg.content);
+                   const string& frame) {
+  string address;
+  EncodePeerAddress(target, &address);
+  s_sendmore(publisher, address);
+  s_send(publisher, frame);
 }
 
 void Peer::Sending() {
@@ -172,18 +172,21 @@ void Peer::Sending() {
   LOG(INFO) << "ready to publish: " << id_;
   s_started_ = true;
 
+  string frame;
   while (!s_stoped_) {
     try {
       //  Write two messages, each with an envelope and content
       PeerMessagePtr msg;
       outbox_.Pop(msg);
       if (msg.get()) {
+        // encoded once, whatever the number of targets
+        EncodePeerFrame(*msg, &frame);
         if (msg->target == ALL_PEERS) {
           for (int i = 0; i < peers_.size(); ++i) {
-            DoSend(publisher, peers_[i].id, *msg);
+            DoSend(publisher, peers_[i].id, frame);
           }
         } else {
-          DoSend(publisher, msg->target, *msg);
+          DoSend(publisher, msg->target, frame);
         }
       }
     } catch (std::exception& e) {
@@ -199,13 +202,16 @@ void Peer::Receiving() {
   zmq::pollitem_t* poll_items = new zmq::pollitem_t[peers_.size()];
   zmq::context_t context(IO_THREAD_NUM);
   vector<shared_ptr<zmq::socket_t> > sockets(peers_.size());
+  string address_filter;
+  EncodePeerAddress(id_, &address_filter);
   for (int i = 0; i < peers_.size(); ++i) {
     sockets[i].reset(new zmq::socket_t(context, ZMQ_SUB));
     string address = "tcp://" + peers_[i].ip + ":" +
                      std::to_string(FLAGS_peer_start_port + peers_[i].id);
     LOG(INFO) << "connecting to peer: " << address;
     sockets[i]->connect(address.c_str());
-    sockets[i]->setsockopt(ZMQ_SUBSCRIBE, std::to_string(id_).c_str(), 1);
+    sockets[i]->setsockopt(ZMQ_SUBSCRIBE, address_filter.data(),
+                           address_filter.size());
     poll_items[i] = {*sockets[i], 0, ZMQ_POLLIN, 0};
   }
 
@@ -220,11 +226,27 @@ void Peer::Receiving() {
 
       for (int i = 0; i < peers_.size(); ++i) {
         if (poll_items[i].revents & ZMQ_POLLIN) {
+          zmq::message_t address;
+          zmq::message_t frame;
+          sockets[i]->recv(&address);
+          sockets[i]->recv(&frame);
+          // a peer of an older version sends more parts, drop them
+          while (frame.more()) {
+            zmq::message_t rest;
+            sockets[i]->recv(&rest);
+            if (!rest.more()) {
+              break;
+            }
+          }
           PeerMessagePtr pmsg(new PeerMessage());
-          pmsg->target = std::stoi(s_recv(*sockets[i]));
-          pmsg->type = std::stoi(s_recv(*sockets[i]));
-          pmsg->user = s_recv(*sockets[i]);
-          pmsg->content = s_recv(*sockets[i]);
+          if (!DecodePeerFrame(static_cast<const char*>(frame.data()),
+                               frame.size(),
+                               pmsg.get())) {
+            LOG(ERROR) << "invalid peer frame from " << peers_[i].id
+                       << ", size " << frame.size();
+            continue;
+          }
+          pmsg->target = id_;
           pmsg->source = peers_[i].id;
           VLOG(4) << "receive peer msg: " << *pmsg;
           if (msg_cb_) {
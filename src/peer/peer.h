@@ -3,6 +3,7 @@
 
 #include "deps/base/concurrent_queue.h"
 #include "src/include_std.h"
+#include "src/peer/peer_message.h"
 
 using std::string;
 using std::vector;
@@ -15,32 +16,6 @@ struct PeerInfo {
   string admin_addr;
 };
 
-const int PMT_REDIRECT_TO_SERVER = 1;
-const int PMT_NOTIFY_TO_USER = 2;
-
-struct PeerMessage {
-  int source;
-  int target;
-
-  // following is message frame data
-  int type;
-  // if type is PMT_REDIRECT_TO_SERVER, user refers to where the msg come from
-  // maybe the endpoint user or the backend service
-  // if type is PMT_NOTIFY_TO_USER, user refers to the endpoint where we send
-  // the message to
-  string user;
-  string content;
-};
-
-inline ostream& operator<<(ostream& os, const PeerMessage& msg) {
-  os << "PeerMessage(" << msg.source
-     << ", " << msg.target
-     << ", " << msg.type
-     << ", " << msg.user
-     << ", " << msg.content << ")";
-}
-
-typedef shared_ptr<PeerMessage> PeerMessagePtr;
 typedef function<void (PeerMessagePtr)> PeerMessageCallback;
 
 class Peer {
@@ -60,6 +35,9 @@ class Peer {
             const int type,
             const string& user,
             const char* content);
+  // |msg->target| is a peer id or ALL_PEERS, fill the routing header of
+  // |msg| so the receiver can route it without parsing the content
+  void Send(PeerMessagePtr msg);
   void SetMessageCallback(const PeerMessageCallback& cb) {msg_cb_ = cb;}
 
  private:
@@ -0,0 +1,103 @@
+#include "src/peer/peer_message.h"
+
+#include <string.h>
+#include "deps/base/logging.h"
+#include "deps/base/varint.h"
+
+static inline uint64 ZigZag(int64 v) {
+  return (static_cast<uint64>(v) << 1) ^ static_cast<uint64>(v >> 63);
+}
+
+static inline int64 UnZigZag(uint64 v) {
+  return static_cast<int64>(v >> 1) ^ -static_cast<int64>(v & 1);
+}
+
+// the varint readers don't check the end of the buffer, pad the tail
+static const uint8* ReadVarint(const uint8* p, const uint8* end, uint64* v) {
+  if (end - p >= base::kMaxVarintBytes) {
+    return base::ReadVarint64(p, v);
+  }
+  uint8 buf[base::kMaxVarintBytes] = {0};
+  ::memcpy(buf, p, end - p);
+  const uint8* q = base::ReadVarint64(buf, v);
+  if (q == NULL || q - buf > end - p) {
+    return NULL;
+  }
+  return p + (q - buf);
+}
+
+static const uint8* ReadString(const uint8* p, const uint8* end, string* s) {
+  uint64 len = 0;
+  p = ReadVarint(p, end, &len);
+  if (p == NULL || len > static_cast<uint64>(end - p)) {
+    return NULL;
+  }
+  s->assign(reinterpret_cast<const char*>(p), len);
+  return p + len;
+}
+
+void EncodePeerAddress(int target, string* frame) {
+  uint8 buf[base::kMaxVarint32Bytes];
+  uint8* end = base::WriteVarint32(static_cast<uint32>(target), buf);
+  frame->assign(reinterpret_cast<char*>(buf), end - buf);
+}
+
+void EncodePeerFrame(const PeerMessage& msg, string* frame) {
+  const size_t max_header = 1 + 4 * base::kMaxVarint32Bytes +
+                            3 * base::kMaxVarintBytes;
+  frame->resize(max_header + msg.user.size() + msg.to.size() +
+                msg.content.size());
+  uint8* begin = reinterpret_cast<uint8*>(&(*frame)[0]);
+  uint8* p = begin;
+  *p++ = PEER_FRAME_VERSION;
+  p = base::WriteVarint32(static_cast<uint32>(msg.type), p);
+  p = base::WriteVarint32(msg.user.size(), p);
+  ::memcpy(p, msg.user.data(), msg.user.size());
+  p += msg.user.size();
+  p = base::WriteVarint32(static_cast<uint32>(msg.msg_type + 1), p);
+  p = base::WriteVarint32(msg.to.size(), p);
+  ::memcpy(p, msg.to.data(), msg.to.size());
+  p += msg.to.size();
+  p = base::WriteVarint64(ZigZag(msg.ttl), p);
+  p = base::WriteVarint64(ZigZag(msg.seq), p);
+  p = base::WriteVarint64(static_cast<uint64>(msg.channel_ts), p);
+  ::memcpy(p, msg.content.data(), msg.content.size());
+  p += msg.content.size();
+  frame->resize(p - begin);
+}
+
+bool DecodePeerFrame(const char* data, size_t len, PeerMessage* msg) {
+  const uint8* p = reinterpret_cast<const uint8*>(data);
+  const uint8* end = p + len;
+  if (p == end || *p != PEER_FRAME_VERSION) {
+    LOG(ERROR) << "unknown peer frame version: "
+               << (p == end ? -1 : static_cast<int>(*p));
+    return false;
+  }
+  ++p;
+  uint64 v = 0;
+  if ((p = ReadVarint(p, end, &v)) == NULL) {
+    return false;
+  }
+  msg->type = static_cast<int>(v);
+  if ((p = ReadString(p, end, &msg->user)) == NULL ||
+      (p = ReadVarint(p, end, &v)) == NULL) {
+    return false;
+  }
+  msg->msg_type = static_cast<int>(v) - 1;
+  if ((p = ReadString(p, end, &msg->to)) == NULL ||
+      (p = ReadVarint(p, end, &v)) == NULL) {
+    return false;
+  }
+  msg->ttl = UnZigZag(v);
+  if ((p = ReadVarint(p, end, &v)) == NULL) {
+    return false;
+  }
+  msg->seq = static_cast<int>(UnZigZag(v));
+  if ((p = ReadVarint(p, end, &v)) == NULL) {
+    return false;
+  }
+  msg->channel_ts = static_cast<int64>(v);
+  msg->content.assign(reinterpret_cast<const char*>(p), end - p);
+  return true;
+}
@@ -0,0 +1,79 @@
+#ifndef SRC_PEER_PEER_MESSAGE_H_
+#define SRC_PEER_PEER_MESSAGE_H_
+
+#include "deps/base/basictypes.h"
+#include "src/include_std.h"
+
+using std::string;
+using std::shared_ptr;
+
+const int PMT_REDIRECT_TO_SERVER = 1;
+const int PMT_NOTIFY_TO_USER = 2;
+// content is a serialized message for all the online users of the peer
+const int PMT_BROADCAST = 3;
+
+const int ALL_PEERS = -1;
+
+// bumped whenever the layout of the frame changes
+const uint8 PEER_FRAME_VERSION = 2;
+
+struct PeerMessage {
+  int source;
+  int target;
+
+  // following is message frame data
+  int type;
+  // if type is PMT_REDIRECT_TO_SERVER, user refers to where the msg come from
+  // maybe the endpoint user or the backend service
+  // if type is PMT_NOTIFY_TO_USER, user refers to the endpoint where we send
+  // the message to
+  string user;
+
+  // routing header, copied from the message in content so the receiver
+  // doesn't need to parse it to decide where the message goes,
+  // -1 or empty when not set
+  int msg_type;
+  string to;
+  int64 ttl;
+  int seq;
+  // publish time of the channel timeline entry of a channel message,
+  // 0 if it has none
+  int64 channel_ts;
+
+  string content;
+
+  PeerMessage()
+      : source(-1), target(-1), type(0), msg_type(-1), ttl(-1), seq(-1),
+        channel_ts(0) {
+  }
+};
+
+inline ostream& operator<<(ostream& os, const PeerMessage& msg) {
+  os << "PeerMessage(" << msg.source
+     << ", " << msg.target
+     << ", " << msg.type
+     << ", " << msg.user
+     << ", " << msg.msg_type
+     << ", " << msg.to
+     << ", " << msg.ttl
+     << ", " << msg.seq
+     << ", " << msg.channel_ts
+     << ", " << msg.content << ")";
+  return os;
+}
+
+typedef shared_ptr<PeerMessage> PeerMessagePtr;
+
+// The address frame is the varint of the target peer id, varints are prefix
+// free so a subscription never matches another peer's id.
+// The data frame is:
+//   version(1 byte) type user_len user msg_type to_len to ttl seq channel_ts
+//   content
+// lengths, types and channel_ts are varints, ttl and seq zigzag varints,
+// and the content takes the rest of the frame.
+void EncodePeerAddress(int target, string* frame);
+void EncodePeerFrame(const PeerMessage& msg, string* frame);
+// fills all the fields but source and target
+bool DecodePeerFrame(const char* data, size_t len, PeerMessage* msg);
+
+#endif  // SRC_PEER_PEER_MESSAGE_H_
@@ -0,0 +1,91 @@
+#ifndef SRC_POOL_ALLOCATOR_H_
+#define SRC_POOL_ALLOCATOR_H_
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include "src/include_std.h"
+
+namespace xcomet {
+
+// Allocator of single objects for std::allocate_shared, the object and the
+// reference count share one block which is recycled through a free list.
+// The free lists are per thread and per block type, a block freed on
+// another thread joins the list of that thread, the lists are capped so
+// they can't grow without bound. The blocks on the list of an exiting
+// thread are not returned to the system, only use it from long lived
+// threads. Arrays go straight to operator new.
+template <typename T>
+class PoolAllocator {
+ public:
+  typedef T value_type;
+
+  static const size_t MAX_FREE_BLOCKS = 4096;
+
+  PoolAllocator() {}
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    if (n != 1) {
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    Block* block = free_list_.head;
+    if (block != NULL) {
+      free_list_.head = block->next;
+      --free_list_.size;
+      return reinterpret_cast<T*>(block);
+    }
+    return reinterpret_cast<T*>(::operator new(sizeof(Block)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    if (n != 1 || free_list_.size >= MAX_FREE_BLOCKS) {
+      ::operator delete(p);
+      return;
+    }
+    Block* block = reinterpret_cast<Block*>(p);
+    block->next = free_list_.head;
+    free_list_.head = block;
+    ++free_list_.size;
+  }
+
+  // number of blocks of this type cached by the calling thread
+  static size_t FreeBlocks() {
+    return free_list_.size;
+  }
+
+  template <typename U>
+  struct rebind {
+    typedef PoolAllocator<U> other;
+  };
+
+ private:
+  union Block {
+    Block* next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+  struct FreeList {
+    Block* head;
+    size_t size;
+  };
+
+  static __thread FreeList free_list_;
+};
+
+template <typename T>
+__thread typename PoolAllocator<T>::FreeList PoolAllocator<T>::free_list_ =
+    {NULL, 0};
+
+template <typename T, typename U>
+inline bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+  return false;
+}
+
+}  // namespace xcomet
+#endif  // SRC_POOL_ALLOCATOR_H_
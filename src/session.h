@@ -13,6 +13,14 @@ class Session {
   virtual ~Session() {}
   virtual void Send(const Message& msg) {}
   virtual void Send(const string& packet_str) {}
+  // the packet is shared with the caller and sent without being copied
+  virtual void Send(const StringPtr& packet) {
+    Send(*packet);
+  }
+  // sends |prefix| followed by |rest| as one packet
+  virtual void Send(const string& prefix, const StringPtr& rest) {
+    Send(prefix + *rest);
+  }
   virtual void SendHeartbeat() {}
   virtual void Close() {}
 
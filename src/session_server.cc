@@ -1,10 +1,17 @@
 #include "src/session_server.h"
 
+#include <list>
 #include "deps/jsoncpp/include/json/json.h"
 #include "deps/base/logging.h"
 #include "deps/base/flags.h"
 #include "deps/base/string_util.h"
+#include "deps/base/hash.h"
+#include "deps/base/time.h"
+#include "src/deferred_queue.h"
+#include "src/fanout_manager.h"
+#include "src/single_flight.h"
 #include "src/loop_executor.h"
+#include "src/timing_wheel.h"
 #include "src/storage/inmemory_storage.h"
 #include "src/storage/cassandra_storage.h"
 #include "src/http_session.h"
@@ -17,7 +24,10 @@
 DEFINE_int32(client_listen_port, 9000, "");
 DEFINE_int32(admin_listen_port, 9001, "");
 DEFINE_int32(websocket_port, 9002, "");
-DEFINE_int32(poll_timeout_sec, 1800, "");
+DEFINE_int32(poll_timeout_sec, 1800, "idle timeout of the polling connections");
+DEFINE_int32(stream_timeout_sec, 1800, "idle timeout of the stream connections");
+DEFINE_int32(heartbeat_interval_sec, 60, "");
+DEFINE_int32(timing_wheel_tick_ms, 100, "");
 DEFINE_int32(timer_interval_sec, 1, "");
 DEFINE_bool(is_server_heartbeat, false, "");
 DEFINE_int32(peer_id, 0, "");
@@ -27,6 +37,20 @@ DEFINE_string(peers_admin_address, "127.0.0.1:9001", "admin peers address");
 DEFINE_bool(check_offline_msg_on_login, true, "");
 DEFINE_string(persistence, "InMemory", "InMemory|Cassandra");
 DEFINE_string(auth, "Proxy", "Proxy|DB");
+DEFINE_int32(reactor_threads, 1, "event loops serving the client connections");
+DEFINE_int32(deferred_task_budget_usec, 5000,
+             "max time spent on deferred tasks per loop pass");
+DEFINE_int32(channel_cache_size, 100000,
+             "max channels whose members are cached");
+DEFINE_int32(channel_cache_memory_mb, 0,
+             "max memory taken by the cached channel members, 0 for no limit");
+DEFINE_string(pinned_channels, "",
+              "channels never evicted from the cache, seperated by `,`");
+DEFINE_int32(broadcast_users_per_sec, 100000,
+             "max users the broadcasts are sent to per second, shared by "
+             "the running ones, 0 for no limit");
+DEFINE_int32(fanout_slice_budget_usec, 2000,
+             "max time spent on one channel message per loop pass");
 
 const bool CHECK_SHARD = true;
 const bool NO_CHECK_SHARD = false;
@@ -51,17 +75,6 @@ const char* SYSTEM_USER = "SYSTEM";
     }\
   } while(0)
 
-#define CHECK_REDIRECT_CLIENT(uid)\
-  do {\
-    int shard_id = GetShardId(uid);\
-    if (shard_id != peer_id_) {\
-      VLOG(3) << "redirect to shard " << shard_id;\
-      stats_.OnRedirect();\
-      ReplyRedirect(req, peers_[shard_id].public_addr);\
-      return;\
-    }\
-  } while(0)
-
 #define CHECK_REDIRECT_ADMIN(uid)\
   do {\
     int shard_id = GetShardId(uid);\
@@ -75,11 +88,7 @@ const char* SYSTEM_USER = "SYSTEM";
 
 namespace xcomet {
 
-static void ConnectHandler(struct evhttp_request* req, void* ctx) {
-  LOG(INFO) << "request: " << evhttp_request_get_uri(req);
-  SessionServer* server = static_cast<SessionServer*>(ctx);
-  server->Connect(req);
-}
+typedef SingleFlight<const ChannelInfo*>::Callback ChannelLoadCallback;
 
 static void DisconnectHandler(struct evhttp_request* req, void* ctx) {
   LOG(INFO) << "request: " << evhttp_request_get_uri(req);
@@ -146,35 +155,149 @@ static void TimerHandler(evutil_socket_t sig, short events, void *ctx) {
 
 struct SessionServerPrivate {
   struct event_base* evbase;
-  struct evhttp* client_http;
   struct evhttp* admin_http;
   struct event* sigterm_event;
   struct event* sigint_event;
   struct event* timer_event;
+  scoped_ptr<DeferredQueue> deferred_queue;
+  // channel deliveries, in slices run by deferred_queue
+  scoped_ptr<FanoutManager> fanout;
+  // timers of the main loop, shared by lane 0 and the storage
+  scoped_ptr<TimingWheel> timer_wheel;
+  // publish time of the last channel timeline entry written by this node
+  int64 last_channel_ts;
+  // storage loads shared by the messages arriving while they are in flight
+  SingleFlight<const ChannelInfo*> channel_loader;
+  SingleFlight<int> max_seq_loader;
+  // the storage writes waiting for the next pass, see FlushStorageWrites
+  vector<SaveMessageEntry> pending_saves;
+  vector<pair<string, int> > pending_acks;
 
   SessionServerPrivate()
       : evbase(NULL),
-        client_http(NULL),
         admin_http(NULL),
         sigterm_event(NULL),
         sigint_event(NULL),
-        timer_event(NULL) {
+        timer_event(NULL),
+        last_channel_ts(0) {
     evbase = event_base_new();
     CHECK(evbase) << "create evbase failed";
+    deferred_queue.reset(
+        new DeferredQueue(evbase, FLAGS_deferred_task_budget_usec));
+    fanout.reset(
+        new FanoutManager(deferred_queue.get(),
+                          FLAGS_fanout_slice_budget_usec));
+    timer_wheel.reset(
+        new TimingWheel(base::GetTimeInMs(), FLAGS_timing_wheel_tick_ms));
   }
   ~SessionServerPrivate() {
+    deferred_queue.reset();
+    fanout.reset();
+    timer_wheel.reset();
     if (timer_event) event_free(timer_event);
     if (sigterm_event) event_free(sigterm_event);
     if (sigint_event) event_free(sigint_event);
-    if (client_http) evhttp_free(client_http);
     if (admin_http) evhttp_free(admin_http);
     if (evbase) event_base_free(evbase);
   }
 };
 
-Storage* CreateStorage() {
+// a broadcast being sent by a lane to the users it had when the broadcast
+// came
+struct LaneBroadcast {
+  StringPtr data;
+  vector<string> uids;
+  size_t next;
+};
+typedef shared_ptr<LaneBroadcast> LaneBroadcastPtr;
+
+// the lane index of the running thread, -1 if it's not a lane thread
+static __thread int current_lane_id = -1;
+
+// a reactor lane is an event loop serving a part of the client connections,
+// the connections and their timers are only touched in its own thread
+struct SessionLane {
+  int id;
+  SessionServer* server;
+  struct event_base* evbase;
+  bool own_evbase;
+  struct evhttp* client_http;
+  struct event* timer_event;
+  scoped_ptr<LoopQueue> inbox;
+  TimingWheel* timer_wheel;
+  scoped_ptr<TimingWheel> own_timer_wheel;
+  UserMap users;
+  // sent in order, a part of the users every tick, all of them share the
+  // rate cap of the lane
+  std::list<LaneBroadcastPtr> broadcasts;
+  // users the broadcasts can still be sent to in the tick started at
+  // |broadcast_tick|
+  int64 broadcast_tokens;
+  int64 broadcast_tick;
+  TimerNode broadcast_timer;
+  std::thread thread;
+
+  // use the given evbase and timer wheel if not NULL, otherwise create
+  // new ones
+  SessionLane(int lane_id,
+              SessionServer* serv,
+              struct event_base* base,
+              TimingWheel* wheel)
+      : id(lane_id),
+        server(serv),
+        evbase(base),
+        own_evbase(base == NULL),
+        client_http(NULL),
+        timer_event(NULL),
+        timer_wheel(wheel),
+        broadcast_tokens(0),
+        broadcast_tick(0) {
+    if (own_evbase) {
+      evbase = event_base_new();
+      CHECK(evbase) << "create lane evbase failed";
+    }
+    // the handoffs between the lanes can't be dropped
+    inbox.reset(new LoopQueue(evbase, LoopQueue::NO_LIMIT));
+    if (timer_wheel == NULL) {
+      own_timer_wheel.reset(
+          new TimingWheel(base::GetTimeInMs(), FLAGS_timing_wheel_tick_ms));
+      timer_wheel = own_timer_wheel.get();
+    }
+  }
+  ~SessionLane() {
+    // the users and the broadcasts unlink their timers from the wheel
+    users.clear();
+    broadcast_timer.Cancel();
+    broadcasts.clear();
+    own_timer_wheel.reset();
+    inbox.reset();
+    if (timer_event) event_free(timer_event);
+    if (client_http) evhttp_free(client_http);
+    if (own_evbase && evbase) event_base_free(evbase);
+  }
+};
+
+static void ConnectHandler(struct evhttp_request* req, void* ctx) {
+  LOG(INFO) << "request: " << evhttp_request_get_uri(req);
+  SessionLane* lane = static_cast<SessionLane*>(ctx);
+  lane->server->Connect(lane->id, req);
+}
+
+static void LaneTimerHandler(evutil_socket_t sig, short events, void *ctx) {
+  SessionLane* lane = static_cast<SessionLane*>(ctx);
+  lane->server->OnLaneTimer(lane->id);
+}
+
+static void LaneLoop(SessionLane* lane) {
+  current_lane_id = lane->id;
+  LOG(INFO) << "lane " << lane->id << " loop start";
+  event_base_dispatch(lane->evbase);
+  LOG(INFO) << "lane " << lane->id << " loop exited";
+}
+
+Storage* CreateStorage(TimingWheel* timer_wheel) {
   if (FLAGS_persistence == "InMemory") {
-    return new InMemoryStorage();
+    return new InMemoryStorage(timer_wheel);
   } else if (FLAGS_persistence == "Cassandra") {
     return new CassandraStorage();
   } else {
@@ -195,13 +318,21 @@ Auth* CreateAuth(struct event_base* evbase) {
 SessionServer::SessionServer()
     : client_listen_port_(FLAGS_client_listen_port),
       admin_listen_port_(FLAGS_admin_listen_port),
-      timeout_counter_(FLAGS_poll_timeout_sec / FLAGS_timer_interval_sec),
-      timeout_queue_(timeout_counter_),
+      next_generation_(0),
+      channels_(FLAGS_channel_cache_size,
+                (size_t)FLAGS_channel_cache_memory_mb * 1024 * 1024),
       stats_(FLAGS_timer_interval_sec),
       p_(new SessionServerPrivate()),
-      storage_(CreateStorage()),
+      storage_(CreateStorage(p_->timer_wheel.get())),
       peer_id_(FLAGS_peer_id),
       auth_(CreateAuth(p_->evbase)) {
+  vector<string> pinned_channels;
+  SplitString(FLAGS_pinned_channels, ',', &pinned_channels);
+  for (size_t i = 0; i < pinned_channels.size(); ++i) {
+    if (!pinned_channels[i].empty()) {
+      channels_.Pin(pinned_channels[i]);
+    }
+  }
   vector<string> peers_ip;
   SplitString(FLAGS_peers_ip, ',', &peers_ip);
   vector<string> peers_address;
@@ -229,6 +360,7 @@ SessionServer::~SessionServer() {
 }
 
 void SessionServer::Start() {
+  SetupLanes();
   SetupClientHandler();
   SetupAdminHandler();
   SetupEventHandler();
@@ -238,7 +370,15 @@ void SessionServer::Start() {
 }
 
 void SessionServer::Stop() {
-  users_.clear();
+  for (int i = 1; i < lanes_.size(); ++i) {
+    SessionLane* lane = lanes_[i].get();
+    lane->inbox->Post([lane]() {
+      lane->users.clear();
+      event_base_loopbreak(lane->evbase);
+    });
+  }
+  lanes_[0]->users.clear();
+  user_lanes_.clear();
   event_base_loopbreak(p_->evbase);
 }
 
@@ -247,86 +387,293 @@ void SessionServer::OnStart() {
   stats_.OnServerStart();
   cluster_->Start();
   cluster_->SetMessageCallback(bind(&SessionServer::OnPeerMessage, this, _1));
+  for (int i = 1; i < lanes_.size(); ++i) {
+    lanes_[i]->thread = std::thread(&LaneLoop, lanes_[i].get());
+  }
 }
 
 void SessionServer::OnStop() {
   VLOG(3) << "SessionServer::OnStop";
+  FlushStorageWrites();
+  for (int i = 1; i < lanes_.size(); ++i) {
+    if (lanes_[i]->thread.joinable()) {
+      lanes_[i]->thread.join();
+    }
+  }
   xcomet::LoopExecutor::Destroy();
   cluster_->Stop();
 }
 
+bool SessionServer::InLane(int lane) const {
+  return current_lane_id == lane;
+}
+
+// the closure is built in the node of the inbox, not in a std::function
+template <typename F>
+void SessionServer::RunInLane(int lane, F&& fn) {
+  if (InLane(lane)) {
+    fn();
+  } else {
+    lanes_[lane]->inbox->Post(std::forward<F>(fn));
+  }
+}
+
+template <typename F>
+void SessionServer::RunInMainLane(F&& fn) {
+  RunInLane(0, std::forward<F>(fn));
+}
+
 // /connect?uid=123&token=ABCDE&type=1|2
-void SessionServer::Connect(struct evhttp_request* req) {
-  stats_.OnRequest("Connect");
-  CHECK_HTTP_GET();
+void SessionServer::Connect(int lane, struct evhttp_request* req) {
+  CHECK(InLane(lane));
+  RunInMainLane([this]() {stats_.OnRequest("Connect");});
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    RunInMainLane([this]() {stats_.OnBadRequest();});
+    ReplyError(req, HTTP_BADMETHOD);
+    return;
+  }
   HttpQuery query(req);
   string uid = query.GetStr("uid", "");
   string password = query.GetStr("password", "");
   int type = query.GetInt("type", 1);
   if (uid.empty() || password.empty()) {
-    stats_.OnBadRequest();
+    RunInMainLane([this]() {stats_.OnBadRequest();});
     ReplyError(req, HTTP_BADREQUEST, "uid or password should not empty");
     return;
   }
 
-  CHECK_REDIRECT_CLIENT(uid);
+  int shard_id = GetShardId(uid);
+  if (shard_id != peer_id_) {
+    VLOG(3) << "redirect to shard " << shard_id;
+    RunInMainLane([this]() {stats_.OnRedirect();});
+    ReplyRedirect(req, peers_[shard_id].public_addr);
+    return;
+  }
+
+  // the auth backends are bound to the main loop
+  RunInMainLane([lane, req, uid, password, type, this]() {
+    auth_->Authenticate(uid, password, [lane, req, uid, type, this](Error err,
+                                                                    bool ok) {
+      bool success = (err == NO_ERROR && ok);
+      if (!success) {
+        stats_.OnAuthFailed();
+      }
+      // the lanes report the connections to the main lane in any order,
+      // the generation tells which one is the newest
+      const int64 generation = ++next_generation_;
+      RunInLane(lane, bind(&SessionServer::OnAuthenticated,
+                           this, lane, req, uid, type, generation, success));
+    });
+  });
+}
+
+void SessionServer::OnAuthenticated(int lane,
+                                    struct evhttp_request* req,
+                                    const string& uid,
+                                    int type,
+                                    int64 generation,
+                                    bool ok) {
+  if (!ok) {
+    ReplyError(req, HTTP_BADREQUEST, "authentication failed");
+    return;
+  }
+  Session* session;
+  if (IsWebSocketRequest(req)) {
+    session = new WebSocketSession(req);
+  } else {
+    session = new HttpSession(req);
+  }
+  UserPtr user(new User(uid, type, session, *this));
+  user->SetLane(lane);
+  user->SetGeneration(generation);
+  SessionLane* l = lanes_[lane].get();
+  // a previous connection of the user is dropped with its timer
+  l->users[uid] = user;
+  ResetUserTimer(user.get(), true);
+  RunInMainLane(bind(&SessionServer::OnUserOnline,
+                     this, uid, lane, generation));
+}
 
-  auth_->Authenticate(uid, password, [req, uid, type, this](Error err,
-                                                            bool ok) {
-    if (err != NO_ERROR || !ok) {
-      stats_.OnAuthFailed();
-      ReplyError(req, HTTP_BADREQUEST, "authentication failed");
+void SessionServer::OnUserOnline(const string& uid,
+                                 int lane,
+                                 int64 generation) {
+  auto lane_it = user_lanes_.find(uid);
+  if (lane_it == user_lanes_.end()) {
+    stats_.OnUserConnect();
+    LOG(INFO) << "login user: " << uid;
+    UserLane entry = {lane, generation};
+    user_lanes_.insert(make_pair(uid, entry));
+  } else {
+    stats_.OnUserReconnect();
+    LOG(INFO) << "relogin user: " << uid;
+    if (lane_it->second.generation > generation) {
+      // reported after a newer connection of another lane
+      KickUser(lane, uid, generation);
       return;
     }
-    Session* session;
-    if (IsWebSocketRequest(req)) {
-      session = new WebSocketSession(req);
-    } else {
-      session = new HttpSession(req);
+    if (lane_it->second.lane != lane) {
+      // the previous connection is held by another lane
+      KickUser(lane_it->second.lane, uid, lane_it->second.generation);
+    }
+    lane_it->second.lane = lane;
+    lane_it->second.generation = generation;
+  }
+
+  UserInfoMap::iterator info_iter = user_infos_.find(uid);
+  if (info_iter == user_infos_.end()) {
+    user_infos_.insert(make_pair(uid, UserInfo(uid)));
+  }
+
+  if (!FLAGS_check_offline_msg_on_login) {
+    return;
+  }
+
+  FlushStorageWrites();
+  storage_->GetOfflineMessage(uid, [uid, this](Error error,
+                                               MessageDataSet m,
+                                               const ChannelCursors& cursors) {
+    if (error != NO_ERROR) {
+      stats_.OnError();
+      LOG(ERROR) << "GetMessage failed: " << error;
+      return;
     }
-    UserPtr user(new User(uid, type, session, *this));
-    UserMap::iterator iter = users_.find(uid);
-    if (iter == users_.end()) {
-      stats_.OnUserConnect();
-      LOG(INFO) << "login user: " << uid;
+    if (m.get() != NULL && m->size() > 0) {
+      if (!IsUserOnline(uid)) {
+        LOG(WARNING) << "user offline after get offline messages: " << uid;
+        return;
+      }
+      // the bodies are shared with the storage down to the sockets, the
+      // timeline entries are read by the cursors once they are all sent
+      for (int i = 0; i < m->size(); ++i) {
+        stats_.OnSend(*m->at(i));
+        SendToUser(uid, m->at(i));
+      }
+      if (!cursors.empty()) {
+        SetUserChannelTs(uid, cursors);
+      }
     } else {
-      stats_.OnUserReconnect();
-      timeout_queue_.RemoveUser(iter->second.get());
-      LOG(INFO) << "relogin user: " << uid;
+      VLOG(3) << "no offline message for this user: " << uid;
+    }
+  });
+}
+
+void SessionServer::OnUserOffline(const string& uid,
+                                  int lane,
+                                  int64 generation,
+                                  const ChannelCursors& channel_ts) {
+  stats_.OnUserDisconnect();
+  auto lane_it = user_lanes_.find(uid);
+  if (lane_it != user_lanes_.end() &&
+      lane_it->second.lane == lane &&
+      lane_it->second.generation == generation) {
+    user_lanes_.erase(lane_it);
+  }
+  // the entries after them were not sent to this connection, a newer one
+  // of the user only moves the cursors further. Each channel has its own,
+  // the channels are delivered apart and a later entry of one doesn't mean
+  // the earlier ones of the others were sent
+  if (FLAGS_channel_timeline) {
+    for (auto& channel : channel_ts) {
+      UpdateChannelCursor(uid, channel.first, channel.second);
     }
-    users_[uid] = user;
-    timeout_queue_.PushUserBack(user.get());
+  }
+}
 
-    UserInfoMap::iterator info_iter = user_infos_.find(uid);
-    if (info_iter == user_infos_.end()) {
-      user_infos_.insert(make_pair(uid, UserInfo(uid)));
+void SessionServer::KickUser(int lane, const string& uid, int64 generation) {
+  RunInLane(lane, [lane, uid, generation, this]() {
+    User* user = GetUser(lane, uid);
+    if (user != NULL &&
+        (generation == 0 || user->GetGeneration() == generation)) {
+      user->Close();
     }
+  });
+}
 
-    if (!FLAGS_check_offline_msg_on_login) {
-      return;
+bool SessionServer::SendToUser(const string& uid, const StringPtr& data) {
+  auto lane_it = user_lanes_.find(uid);
+  if (lane_it == user_lanes_.end()) {
+    return false;
+  }
+  const int lane = lane_it->second.lane;
+  if (InLane(lane)) {
+    User* user = GetUser(lane, uid);
+    if (user != NULL) {
+      user->Send(data);
     }
+  } else {
+    RunInLane(lane, [lane, uid, data, this]() {
+      User* user = GetUser(lane, uid);
+      if (user != NULL) {
+        user->Send(data);
+      }
+    });
+  }
+  return true;
+}
 
-    storage_->GetMessage(uid, [uid, this](Error error, MessageDataSet m) {
-      if (error != NO_ERROR) {
-        stats_.OnError();
-        LOG(ERROR) << "GetMessage failed: " << error;
-        return;
+// the inbox of a lane runs in order, so it follows the sends before it
+void SessionServer::SetUserChannelTs(const string& uid,
+                                     const ChannelCursors& channel_ts) {
+  auto lane_it = user_lanes_.find(uid);
+  if (lane_it == user_lanes_.end()) {
+    return;
+  }
+  const int lane = lane_it->second.lane;
+  RunInLane(lane, [lane, uid, channel_ts, this]() {
+    User* user = GetUser(lane, uid);
+    if (user != NULL) {
+      for (auto& channel : channel_ts) {
+        user->SetChannelTs(channel.first, channel.second);
       }
-      if (m.get() != NULL && m->size() > 0) {
-        UserMap::iterator uit = users_.find(uid);
-        if (uit == users_.end()) {
-          LOG(WARNING) << "user offline after get offline messages: " << uid;
-          return;
-        }
-        for (int i = 0; i < m->size(); ++i) {
-          stats_.OnSend(m->at(i));
-          uit->second->Send(m->at(i));
+    }
+  });
+}
+
+bool SessionServer::SendToUser(const string& uid, const string& data) {
+  auto lane_it = user_lanes_.find(uid);
+  if (lane_it == user_lanes_.end()) {
+    return false;
+  }
+  if (InLane(lane_it->second.lane)) {
+    User* user = GetUser(lane_it->second.lane, uid);
+    if (user != NULL) {
+      user->Send(data);
+    }
+    return true;
+  }
+  return SendToUser(uid, StringPtr(new string(data)));
+}
+
+bool SessionServer::SendToUser(const string& uid,
+                               const string& prefix,
+                               const StringPtr& rest,
+                               const string& cid,
+                               int64 channel_ts) {
+  auto lane_it = user_lanes_.find(uid);
+  if (lane_it == user_lanes_.end()) {
+    return false;
+  }
+  const int lane = lane_it->second.lane;
+  if (InLane(lane)) {
+    User* user = GetUser(lane, uid);
+    if (user != NULL) {
+      user->Send(prefix, rest);
+      if (channel_ts > 0) {
+        user->SetChannelTs(cid, channel_ts);
+      }
+    }
+  } else {
+    RunInLane(lane, [lane, uid, prefix, rest, cid, channel_ts, this]() {
+      User* user = GetUser(lane, uid);
+      if (user != NULL) {
+        user->Send(prefix, rest);
+        if (channel_ts > 0) {
+          user->SetChannelTs(cid, channel_ts);
         }
-      } else {
-        VLOG(3) << "no offline message for this user: " << uid;
       }
     });
-  });
+  }
+  return true;
 }
 
 void SessionServer::SendUserMsg(Message& msg, int64 ttl, bool check_shard) {
@@ -341,23 +688,24 @@ void SessionServer::SendUserMsg(Message& msg, int64 ttl, bool check_shard) {
     int shard_id = GetShardId(uid);
     if (shard_id != peer_id_) {
       VLOG(4) << "send to peer " << shard_id << ": " << msg;
-      msg.SetTTL(ttl);
-      StringPtr data = Message::Serialize(msg);
-      cluster_->Send(shard_id, PMT_NOTIFY_TO_USER, SYSTEM_USER, *data);
+      SendToPeer(shard_id, SYSTEM_USER, msg, ttl);
       return;
     }
   }
   SendSave(uid, msg, ttl);
 }
 
-void SessionServer::SendSave(const string& uid, Message& msg, int64 ttl) {
+void SessionServer::SendSave(const string& uid,
+                             Message& msg,
+                             int64 ttl,
+                             int64 channel_ts) {
   if (ttl == NO_EXPIRE) {
-    StringPtr data = Message::Serialize(msg);
+    // the rest is shared by all the recipients of a channel message
+    string prefix;
+    StringPtr rest = Message::SerializeParts(msg, &prefix);
     msg.SetSeq(-1);
-    auto user_it = users_.find(msg.To());
-    if (user_it != users_.end()) {
-      stats_.OnSend(*data);
-      user_it->second->Send(*data);
+    if (SendToUser(msg.To(), prefix, rest, msg.Channel(), channel_ts)) {
+      stats_.OnSend(prefix.size() + rest->size());
     } else {
       VLOG(5) << "user not online and the message dropped: " << msg;
     }
@@ -369,8 +717,11 @@ void SessionServer::SendSave(const string& uid, Message& msg, int64 ttl) {
   }
   CHECK(info_it != user_infos_.end());
   if (info_it->second.GetMaxSeq() == -1) {
-    storage_->GetMaxSeq(uid, [this, info_it, msg, ttl](Error error,
-                                                       int seq) {
+    // the messages arriving meanwhile wait on the same query, then take
+    // their seqs in order
+    p_->max_seq_loader.Load(uid, [uid, this](GetMaxSeqCallback done) {
+      storage_->GetMaxSeq(uid, done);
+    }, [this, uid, msg, ttl](Error error, int seq) {
       if (error != NO_ERROR) {
         stats_.OnError();
         LOG(ERROR) << "GetMaxSeq failed: " << error;
@@ -378,11 +729,14 @@ void SessionServer::SendSave(const string& uid, Message& msg, int64 ttl) {
       }
       VLOG(7) << "GetMaxSeq " << seq;
       CHECK(seq >= 0);
-      if (info_it->second.GetMaxSeq() < seq) {
-        info_it->second.SetMaxSeq(seq);
+      // looked up again, the map may have been rehashed meanwhile
+      UserInfo& info =
+          user_infos_.insert(make_pair(uid, UserInfo(uid))).first->second;
+      if (info.GetMaxSeq() < seq) {
+        info.SetMaxSeq(seq);
       }
-      VLOG(7) << "current max seq: " << info_it->second.GetMaxSeq();
-      ((Message&)msg).SetSeq(info_it->second.IncMaxSeq());
+      VLOG(7) << "current max seq: " << info.GetMaxSeq();
+      ((Message&)msg).SetSeq(info.IncMaxSeq());
       DoSendSave(msg, ttl);
     });
   } else {
@@ -399,61 +753,165 @@ void SessionServer::DoSendSave(const Message& msg, int64 ttl) {
     LOG(ERROR) << "serialize failed: " << msg;
     return;
   }
-  auto user_it = users_.find(msg.To());
-  if (user_it != users_.end()) {
+  if (SendToUser(uid, data)) {
     stats_.OnSend(*data);
-    user_it->second->Send(*data);
   }
-  storage_->SaveMessage(data, uid, msg.Seq(), ttl, [this](Error error_save) {
-    if (error_save != NO_ERROR) {
-      stats_.OnError();
-      LOG(ERROR) << "SaveMessage failed: " << error_save;
-      return;
-    }
-    VLOG(5) << "SaveMessage done";
-  });
+  // a channel fanout slice saves all its offline members in one batch
+  if (p_->pending_saves.empty() && p_->pending_acks.empty()) {
+    RunInNextTick(bind(&SessionServer::FlushStorageWrites, this));
+  }
+  p_->pending_saves.push_back(SaveMessageEntry());
+  SaveMessageEntry& entry = p_->pending_saves.back();
+  entry.msg = data;
+  entry.uid = uid;
+  entry.seq = msg.Seq();
+  entry.ttl = ttl;
 }
 
-void SessionServer::SendChannelMsg(Message& msg, int64 ttl) {
-  const string cid = msg.Channel();
-  const string uid = msg.From();
-  VLOG(5) << "SendChannelMsg from " << uid << " to " << cid;
-  ChannelInfoMap::const_iterator iter = channels_.find(cid);
-  if (iter == channels_.end()) {
-    storage_->GetChannelUsers(cid, [cid, msg, ttl, this](Error error,
-                                                         UserResultSet u) {
+void SessionServer::FlushStorageWrites() {
+  // the saves go first, an ack may cover a message queued before it
+  if (!p_->pending_saves.empty()) {
+    vector<SaveMessageEntry> saves;
+    saves.swap(p_->pending_saves);
+    storage_->SaveMessages(saves, [this](Error error) {
       if (error != NO_ERROR) {
         stats_.OnError();
-        LOG(ERROR) << "GetChannelUsers failed: " << error;
+        LOG(ERROR) << "SaveMessages failed: " << error;
         return;
       }
-      if (u.get() == NULL) {
-        LOG(WARNING) << "no user in this channel: " << cid;
+      VLOG(5) << "SaveMessages done";
+    });
+  }
+  if (!p_->pending_acks.empty()) {
+    vector<pair<string, int> > acks;
+    acks.swap(p_->pending_acks);
+    storage_->UpdateAcks(acks, [this](Error error) {
+      if (error != NO_ERROR) {
+        stats_.OnError();
+        LOG(ERROR) << "UpdateAcks failed: " << error;
         return;
       }
+      VLOG(5) << "UpdateAcks done";
+    });
+  }
+}
+
+void SessionServer::SendChannelMsg(Message& msg,
+                                   int64 ttl,
+                                   int64 channel_ts) {
+  const string cid = msg.Channel();
+  const string uid = msg.From();
+  VLOG(5) << "SendChannelMsg from " << uid << " to " << cid;
+  // encode the fields shared by all the members once, the clones below
+  // inherit it and only encode their own to and seq
+  string prefix;
+  Message::SerializeParts(msg, &prefix);
+  const ChannelInfo* cached = channels_.Get(cid);
+  if (cached != NULL) {
+    StartChannelFanout(*cached, msg, ttl, channel_ts);
+    return;
+  }
+  // the messages arriving before the members are loaded wait on the same
+  // query, and are delivered in order
+  p_->channel_loader.Load(cid, [cid, this](ChannelLoadCallback done) {
+    storage_->GetChannelUsers(cid, [cid, done, this](Error error,
+                                                     UserResultSet u) {
+      if (error != NO_ERROR || u.get() == NULL) {
+        done(error, NULL);
+        return;
+      }
+      // the shard of every member is looked up once here, then the
+      // channel is walked only over the members of this node
       ChannelInfo channel(cid);
       for (int i = 0; i < u->size(); ++i) {
         const string& cuser = u->at(i);
-        channel.AddUser(cuser);
-        Message copy = msg.Clone();
-        copy.SetTo(cuser);
-        if (CheckShard(cuser)) {
-          SendUserMsg(copy, ttl, NO_CHECK_SHARD);
-        }
+        channel.AddUser(cuser, GetShardId(cuser));
       }
-      channels_.insert(make_pair(cid, channel));
+      done(NO_ERROR, channels_.Put(cid, channel));
     });
-  } else {
-    const auto& user_ids = iter->second.GetUsers();
-    auto uit = user_ids.begin();
-    for (; uit != user_ids.end(); ++uit) {
-      Message copy = msg.Clone();
-      copy.SetTo(*uit);
-      if (CheckShard(*uit)) {
-        SendUserMsg(copy, ttl, NO_CHECK_SHARD);
-      }
+  }, [cid, msg, ttl, channel_ts, this](Error error,
+                                        const ChannelInfo* channel) {
+    if (error != NO_ERROR) {
+      stats_.OnError();
+      LOG(ERROR) << "GetChannelUsers failed: " << error;
+      return;
+    }
+    if (channel == NULL) {
+      LOG(WARNING) << "no user in this channel: " << cid;
+      return;
+    }
+    StartChannelFanout(*channel, msg, ttl, channel_ts);
+  });
+}
+
+void SessionServer::StartChannelFanout(const ChannelInfo& channel,
+                                       const Message& msg,
+                                       int64 ttl,
+                                       int64 channel_ts) {
+  const IdSet* ids = channel.GetShardUserIds(peer_id_);
+  if (ids == NULL) {
+    return;
+  }
+  // a snapshot, members joining or leaving during the job don't affect it
+  vector<uint32> uids;
+  uids.reserve(ids->Size());
+  ids->ForEach([&uids](uint32 id) {
+    uids.push_back(id);
+  });
+  // the job may outlive the caller's message, keep a clone of it
+  Message shared = msg.Clone();
+  // the offline members read the channel timeline, only deliver online
+  if (FLAGS_channel_timeline) {
+    ttl = NO_EXPIRE;
+  }
+  p_->fanout->Start(channel.GetId(),
+                    &uids,
+                    [this, shared, ttl, channel_ts](const string& cuser) {
+    Message copy = shared.Clone();
+    copy.SetTo(cuser);
+    SendSave(cuser, copy, ttl, channel_ts);
+  });
+}
+
+// written once by the node the message is published to, the peers only
+// deliver it to their online members
+int64 SessionServer::SaveChannelTimeline(const Message& msg, int64 ttl) {
+  // publish times of this node are strictly increasing
+  int64 ts = base::GetTimeInUsec();
+  if (ts <= p_->last_channel_ts) {
+    ts = p_->last_channel_ts + 1;
+  }
+  p_->last_channel_ts = ts;
+  StringPtr data = Message::Serialize(msg);
+  storage_->SaveChannelMessage(data, msg.Channel(), ts, ttl,
+                               [this](Error error) {
+    if (error != NO_ERROR) {
+      stats_.OnError();
+      LOG(ERROR) << "SaveChannelMessage failed: " << error;
+      return;
     }
+    VLOG(5) << "SaveChannelMessage done";
+  });
+  return ts;
+}
+
+void SessionServer::UpdateChannelCursor(const string& uid,
+                                        const string& cid,
+                                        int64 cursor) {
+  UserInfo& info =
+      user_infos_.insert(make_pair(uid, UserInfo(uid))).first->second;
+  if (cursor <= info.GetChannelCursor(cid)) {
+    return;
   }
+  info.SetChannelCursor(cid, cursor);
+  storage_->UpdateChannelCursor(uid, cid, cursor, [this](Error error) {
+    if (error != NO_ERROR) {
+      stats_.OnError();
+      LOG(ERROR) << "UpdateChannelCursor failed: " << error;
+      return;
+    }
+    VLOG(5) << "UpdateChannelCursor done";
+  });
 }
 
 void SessionServer::Pub(struct evhttp_request* req) {
@@ -506,12 +964,12 @@ void SessionServer::Pub(struct evhttp_request* req) {
     msg.SetFrom(from);
     msg.SetChannel(channel);
     msg.SetBody(bufferstr, len);
-    msg.SetTTL(ttl);
-    cluster_->Broadcast(PMT_NOTIFY_TO_USER,
-                        SYSTEM_USER,
-                        *(Message::Serialize(msg)));
-    msg.RemoveTTL();
-    SendChannelMsg(msg, ttl);
+    int64 channel_ts = 0;
+    if (FLAGS_channel_timeline) {
+      channel_ts = SaveChannelTimeline(msg, ttl);
+    }
+    SendToPeer(ALL_PEERS, SYSTEM_USER, msg, ttl, channel_ts);
+    SendChannelMsg(msg, ttl, channel_ts);
     ReplyOK(req);
   }
 }
@@ -551,7 +1009,7 @@ void SessionServer::Relay(int shard_id,
 }
 
 bool SessionServer::IsUserOnline(const string& user) {
-  return users_.find(user) != users_.end();
+  return user_lanes_.find(user) != user_lanes_.end();
 }
 
 void SessionServer::Disconnect(struct evhttp_request* req) {
@@ -568,11 +1026,11 @@ void SessionServer::Disconnect(struct evhttp_request* req) {
 
   CHECK_REDIRECT_ADMIN(uid);
 
-  UserMap::iterator uit = users_.find(uid);
-  if (uit == users_.end()) {
+  auto lane_it = user_lanes_.find(uid);
+  if (lane_it == user_lanes_.end()) {
     LOG(WARNING) << "user not found";
   } else {
-    uit->second->Close();
+    KickUser(lane_it->second.lane, uid);
   }
   ReplyOK(req);
 }
@@ -598,9 +1056,10 @@ void SessionServer::Sub(struct evhttp_request* req) {
 
 void SessionServer::Subscribe(const string& uid, const string& cid) {
   VLOG(5) << "Subscribe: " << uid << ", "  << cid;
-  ChannelInfoMap::iterator cit = channels_.find(cid);
-  if (cit != channels_.end()) {
-    cit->second.AddUser(uid);
+  ChannelInfo* channel = channels_.Peek(cid);
+  if (channel != NULL) {
+    channel->AddUser(uid, GetShardId(uid));
+    channels_.Resize(cid);
   }
   storage_->AddUserToChannel(uid, cid, [this](Error error) {
     if (error != NO_ERROR) {
@@ -614,9 +1073,10 @@ void SessionServer::Subscribe(const string& uid, const string& cid) {
 
 void SessionServer::Unsubscribe(const string& uid, const string& cid) {
   VLOG(5) << "Unsubscribe: " << uid << ", "  << cid;
-  ChannelInfoMap::iterator cit = channels_.find(cid);
-  if (cit != channels_.end()) {
-    cit->second.RemoveUser(uid);
+  ChannelInfo* channel = channels_.Peek(cid);
+  if (channel != NULL) {
+    channel->RemoveUser(uid, GetShardId(uid));
+    channels_.Resize(cid);
   }
   storage_->RemoveUserFromChannel(uid, cid, [this](Error error) {
     if (error != NO_ERROR) {
@@ -661,6 +1121,7 @@ void SessionServer::Msg(struct evhttp_request* req) {
 
   CHECK_REDIRECT_ADMIN(uid);
 
+  FlushStorageWrites();
   storage_->GetMessage(uid, [req, this](Error error, MessageDataSet m) {
     if (error != NO_ERROR) {
       stats_.OnError();
@@ -671,7 +1132,7 @@ void SessionServer::Msg(struct evhttp_request* req) {
     resp["result"] = Json::Value(Json::arrayValue);
     if (m.get() != NULL) {
       for (int i = 0; i < m->size(); ++i) {
-        resp["result"].append(m->at(i));
+        resp["result"].append(*m->at(i));
       }
     }
     ReplyOK(req, resp.toStyledString());
@@ -694,40 +1155,163 @@ void SessionServer::Shard(struct evhttp_request* req) {
   ReplyOK(req, resp.toStyledString());
 }
 
-// /broadcast?content=hello
+// /broadcast?from=admin, the body is the message to all the online users
 void SessionServer::Broadcast(struct evhttp_request* req) {
-  // TODO(qingfeng) is broadcast needed?
+  stats_.OnRequest("Broadcast");
+  CHECK_HTTP_POST();
+
+  HttpQuery query(req);
+  const char* from = query.GetStr("from", NULL);
+  if (from == NULL) {
+    stats_.OnBadRequest();
+    ReplyError(req, HTTP_BADREQUEST, "source id is invalid");
+    return;
+  }
+  struct evbuffer* input_buffer = evhttp_request_get_input_buffer(req);
+  int len = evbuffer_get_length(input_buffer);
+  const char* bufferstr = (const char*)evbuffer_pullup(input_buffer, len);
+  if (bufferstr == NULL) {
+    stats_.OnBadRequest();
+    ReplyError(req, HTTP_BADREQUEST, "body cannot be empty");
+    return;
+  }
+
+  Message msg;
+  msg.SetType(Message::T_MESSAGE);
+  msg.SetFrom(from);
+  msg.SetBody(bufferstr, len);
+  // serialized once for the whole cluster, the peers send the content as
+  // it is
+  StringPtr data = Message::Serialize(msg);
+  PeerMessagePtr pmsg(new PeerMessage());
+  pmsg->target = ALL_PEERS;
+  pmsg->type = PMT_BROADCAST;
+  pmsg->user = SYSTEM_USER;
+  pmsg->msg_type = Message::T_MESSAGE;
+  pmsg->content = *data;
+  cluster_->Send(pmsg);
+  BroadcastLocal(data);
+  ReplyOK(req);
 }
 
-void SessionServer::OnTimer() {
-  VLOG(7) << "OnTimer";
-  stats_.OnTimer(users_.size());
-  DLinkedList<User*> timeout_users = timeout_queue_.GetFront();
-  DLinkedList<User*>::Iterator it = timeout_users.GetIterator();
-  if (FLAGS_is_server_heartbeat) {
-    while (User* user = it.Next()) {
-      if (user->GetType() == User::COMET_TYPE_POLLING) {
-        user->Close();
-      } else {
-        user->SendHeartbeat();
+void SessionServer::BroadcastLocal(const StringPtr& data) {
+  VLOG(3) << "BroadcastLocal: " << *data;
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    const int lane = i;
+    RunInLane(lane, [lane, data, this]() {
+      SessionLane* l = lanes_[lane].get();
+      LaneBroadcastPtr job(new LaneBroadcast());
+      job->data = data;
+      job->next = 0;
+      job->uids.reserve(l->users.size());
+      for (auto it = l->users.begin(); it != l->users.end(); ++it) {
+        job->uids.push_back(it->first);
       }
+      l->broadcasts.push_back(job);
+      // otherwise it waits for the next tick with the running ones
+      if (!l->broadcast_timer.IsScheduled()) {
+        RunLaneBroadcasts(lane);
+      }
+    });
+  }
+}
+
+// called in |lane|, the broadcasts share the rate cap of the lane, the
+// tokens are refilled once per tick
+void SessionServer::RunLaneBroadcasts(int lane) {
+  SessionLane* l = lanes_[lane].get();
+  TimingWheel* wheel = l->timer_wheel;
+  const bool limited = FLAGS_broadcast_users_per_sec > 0;
+  if (limited && wheel->Now() >= l->broadcast_tick + wheel->TickMs()) {
+    l->broadcast_tick = wheel->Now();
+    l->broadcast_tokens = std::max<int64>(1,
+        (int64)FLAGS_broadcast_users_per_sec * wheel->TickMs() /
+        1000 / lanes_.size());
+  }
+  int64 sent = 0;
+  int64 bytes = 0;
+  while (!l->broadcasts.empty()) {
+    LaneBroadcast* job = l->broadcasts.front().get();
+    size_t end = job->uids.size();
+    if (limited) {
+      end = std::min<size_t>(end, job->next + l->broadcast_tokens);
+      l->broadcast_tokens -= end - job->next;
     }
-  } else { // for performance consider, don't merge the two loop
-    while (User* user = it.Next()) {
-      user->Close();
+    int64 job_sent = 0;
+    for (; job->next < end; ++job->next) {
+      User* user = GetUser(lane, job->uids[job->next]);
+      if (user != NULL) {
+        user->Send(job->data);
+        ++job_sent;
+      }
+    }
+    sent += job_sent;
+    bytes += job_sent * job->data->size();
+    if (job->next < job->uids.size()) {
+      break;
     }
+    l->broadcasts.pop_front();
+  }
+  if (sent > 0) {
+    RunInMainLane([sent, bytes, this]() {
+      stats_.OnSendBatch(sent, bytes);
+    });
+  }
+  if (!l->broadcasts.empty()) {
+    wheel->Schedule(&l->broadcast_timer, wheel->Now() + wheel->TickMs());
   }
+}
 
-  timeout_queue_.IncHead();
+void SessionServer::OnTimer() {
+  VLOG(7) << "OnTimer";
+  stats_.OnTimer(user_lanes_.size());
+}
+
+void SessionServer::OnLaneTimer(int lane) {
+  lanes_[lane]->timer_wheel->Advance(base::GetTimeInMs());
+}
 
-  function<void ()> task;
-  while (task_queue_.TryPop(task)) {
-    task();
+static bool IsHeartbeatUser(User* user) {
+  return FLAGS_is_server_heartbeat &&
+         user->GetType() != User::COMET_TYPE_POLLING;
+}
+
+// the stream users get heartbeats when server heartbeat is on, the others
+// are closed after being idle for the timeout of their type
+void SessionServer::ResetUserTimer(User* user, bool is_new) {
+  TimingWheel* wheel = lanes_[user->GetLane()]->timer_wheel;
+  int64 now = wheel->Now();
+  int64 delay;
+  if (IsHeartbeatUser(user)) {
+    delay = FLAGS_heartbeat_interval_sec * 1000LL;
+    if (is_new && delay > 0) {
+      // spread the first heartbeat over the interval, so the users logged
+      // in together don't get their heartbeats in the same tick forever
+      delay = base::Fingerprint(user->GetId()) % delay + 1;
+    }
+  } else if (user->GetType() == User::COMET_TYPE_POLLING) {
+    delay = FLAGS_poll_timeout_sec * 1000LL;
+  } else {
+    delay = FLAGS_stream_timeout_sec * 1000LL;
+  }
+  wheel->Schedule(user->Timer(), now + delay);
+}
+
+void SessionServer::OnUserTimeout(User* user) {
+  if (IsHeartbeatUser(user)) {
+    ResetUserTimer(user, false);
+    user->SendHeartbeat();
+  } else {
+    user->Close();
   }
 }
 
 void SessionServer::RunInNextTick(function<void ()> fn) {
-  task_queue_.Push(fn);
+  if (InLane(0)) {
+    p_->deferred_queue->Push(fn);
+  } else {
+    RunInMainLane(fn);
+  }
 }
 
 void SessionServer::UpdateUserAck(const string& uid, int ack) {
@@ -739,14 +1323,10 @@ void SessionServer::UpdateUserAck(const string& uid, int ack) {
     return;
   }
   uit->second.SetLastAck(ack);
-  storage_->UpdateAck(uid, uit->second.GetLastAck(), [this](Error error) {
-    if (error != NO_ERROR) {
-      stats_.OnError();
-      LOG(ERROR) << "UpdateAck failed: " << error;
-      return;
-    }
-    VLOG(5) << "UpdateAck done";
-  });
+  if (p_->pending_saves.empty() && p_->pending_acks.empty()) {
+    RunInNextTick(bind(&SessionServer::FlushStorageWrites, this));
+  }
+  p_->pending_acks.push_back(make_pair(uid, uit->second.GetLastAck()));
 }
 
 bool SessionServer::IsHeartbeatMessage(const string& msg) {
@@ -758,30 +1338,36 @@ void SessionServer::OnUserMessage(const string& from,
                                   StringPtr data) {
   VLOG(4) << "OnUserMessage: " << from << ", [" << data->c_str() << "]";
 
-  UserMap::iterator uit = users_.find(from);
-  if (uit == users_.end()) {
-    stats_.OnError();
+  SessionLane* lane = lanes_[user->GetLane()].get();
+  UserMap::iterator uit = lane->users.find(from);
+  if (uit == lane->users.end()) {
+    RunInMainLane([this]() {stats_.OnError();});
     LOG(ERROR) << "user not found: " << from;
   } else {
-    timeout_queue_.PushUserBack(uit->second.get());
+    ResetUserTimer(uit->second.get(), false);
   }
 
   if (!IsHeartbeatMessage(*data)) {
     try {
+      // parse in the connection lane, route in the main lane
       Message msg = Message::Unserialize(data);
       if (!msg.HasType()) {
-        stats_.OnError();
+        RunInMainLane([this]() {stats_.OnError();});
         LOG(ERROR) << "invalid message without type: " << data->c_str();
         return;
       }
-      stats_.OnReceive(*data, msg);
-      HandleMessage(from, msg);
+      string uid = from;
+      RunInMainLane([uid, data, msg, this]() {
+        Message m = msg;
+        stats_.OnReceive(*data, m);
+        HandleMessage(uid, m);
+      });
     } catch (std::exception& e) {
-      stats_.OnError();
+      RunInMainLane([this]() {stats_.OnError();});
       LOG(ERROR) << "json exception: " << e.what()
                  << ", msg[" << data->c_str() << "]";
     } catch (...) {
-      stats_.OnError();
+      RunInMainLane([this]() {stats_.OnError();});
       LOG(ERROR) << "unknow exception for user msg[" << data->c_str() << "]";
     }
   } else {
@@ -803,9 +1389,7 @@ void SessionServer::HandleMessage(const string& from, Message& msg) {
         msg.SetFrom(from);
       }
       SendChannelMsg(msg, NO_EXPIRE);
-      cluster_->Broadcast(PMT_NOTIFY_TO_USER,
-                          SYSTEM_USER,
-                          *(Message::Serialize(msg)));
+      SendToPeer(ALL_PEERS, SYSTEM_USER, msg, NO_EXPIRE);
       break;
     case Message::T_ACK:
       UpdateUserAck(from, msg.Seq());
@@ -833,53 +1417,75 @@ void SessionServer::OnPeerMessage(PeerMessagePtr pmsg) {
 
 void SessionServer::HandlePeerMessage(PeerMessagePtr pmsg) {
   VLOG(3) << "HandlePeerMessage: " << *pmsg;
-  try {
-    Message msg = Message::UnserializeString(pmsg->content);
-
-    int64 ttl = msg.TTL();
-    switch (msg.Type()) {
-      case Message::T_MESSAGE: {
-        const string& user = msg.To();
-        if (CheckShard(user)) {
-          SendUserMsg(msg, ttl, NO_CHECK_SHARD);
-        } else {
-          stats_.OnError();
-          LOG(ERROR) << "wrong shard, user: " << user
-                     << ", pmsg: " << *pmsg;
-        }
-        break;
-      }
-      case Message::T_CHANNEL_MESSAGE: {
-        SendChannelMsg(msg, ttl);
-        break;
-      }
-      case Message::T_SUBSCRIBE: {
-        string uid = msg.User();
-        string cid = msg.Channel();
-        Subscribe(uid, cid);
-        break;
-      }
-      case Message::T_UNSUBSCRIBE: {
-        string uid = msg.User();
-        string cid = msg.Channel();
-        Unsubscribe(uid, cid);
-        break;
-      }
-      default: {
-        stats_.OnError();
-        LOG(ERROR) << "unexpected peer message type: " << *pmsg;
-        break;
-      }
-    }
-  } catch (std::exception& e) {
+  if (pmsg->type == PMT_BROADCAST) {
+    BroadcastLocal(StringPtr(new string(pmsg->content)));
+    return;
+  }
+  // route by the header first, the content is parsed only when the message
+  // is going to be delivered
+  if (pmsg->msg_type == Message::T_MESSAGE && !CheckShard(pmsg->to)) {
     stats_.OnError();
-    LOG(ERROR) << "json exception: " << e.what() << ", msg = " << *pmsg;
-  } catch (...) {
+    LOG(ERROR) << "wrong shard, user: " << pmsg->to << ", pmsg: " << *pmsg;
+    return;
+  }
+  switch (pmsg->msg_type) {
+    case Message::T_MESSAGE:
+    case Message::T_CHANNEL_MESSAGE:
+    case Message::T_SUBSCRIBE:
+    case Message::T_UNSUBSCRIBE:
+      break;
+    default:
+      stats_.OnError();
+      LOG(ERROR) << "unexpected peer message type: " << *pmsg;
+      return;
+  }
+
+  Message msg;
+  if (!Message::Parse(pmsg->content.data(), pmsg->content.size(), &msg)) {
     stats_.OnError();
-    LOG(ERROR) << "unknow exception for peer msg: " << *pmsg;
+    LOG(ERROR) << "invalid peer message content: " << *pmsg;
+    return;
+  }
+  // the ttl travels in the header, a ttl in the content is only honored
+  // when the header has none
+  int64 ttl = msg.TTL();
+  if (pmsg->ttl != -1) {
+    ttl = pmsg->ttl;
+  }
+  switch (pmsg->msg_type) {
+    case Message::T_MESSAGE:
+      SendUserMsg(msg, ttl, NO_CHECK_SHARD);
+      break;
+    case Message::T_CHANNEL_MESSAGE:
+      SendChannelMsg(msg, ttl, pmsg->channel_ts);
+      break;
+    case Message::T_SUBSCRIBE:
+      Subscribe(msg.User(), msg.Channel());
+      break;
+    case Message::T_UNSUBSCRIBE:
+      Unsubscribe(msg.User(), msg.Channel());
+      break;
   }
 }
 
+void SessionServer::SendToPeer(int shard_id,
+                               const string& user,
+                               const Message& msg,
+                               int64 ttl,
+                               int64 channel_ts) {
+  PeerMessagePtr pmsg(new PeerMessage());
+  pmsg->target = shard_id;
+  pmsg->type = PMT_NOTIFY_TO_USER;
+  pmsg->user = user;
+  pmsg->msg_type = msg.HasType() ? msg.Type() : -1;
+  pmsg->to = msg.To();
+  pmsg->ttl = ttl;
+  pmsg->seq = msg.Seq();
+  pmsg->channel_ts = channel_ts;
+  pmsg->content = *Message::Serialize(msg);
+  cluster_->Send(pmsg);
+}
+
 void SessionServer::RedirectUserMessage(int shard_id,
                                         const string& uid,
                                         const Message& msg) {
@@ -887,7 +1493,7 @@ void SessionServer::RedirectUserMessage(int shard_id,
           << ", uid: " << uid
           << ", msg: " << msg;
   CHECK(shard_id != peer_id_) << "should not redirect to self";
-  cluster_->Send(shard_id, PMT_NOTIFY_TO_USER, uid, *Message::Serialize(msg));
+  SendToPeer(shard_id, uid, msg, -1);
 }
 
 bool SessionServer::CheckShard(const string& user) {
@@ -899,11 +1505,19 @@ int SessionServer::GetShardId(const string& user) {
 }
 
 void SessionServer::OnUserDisconnect(User* user) {
-  stats_.OnUserDisconnect();
-  const string& uid = user->GetId();
+  const int lane = user->GetLane();
+  const string uid = user->GetId();
+  const int64 generation = user->GetGeneration();
+  const ChannelCursors channel_ts = user->GetChannelTs();
   LOG(INFO) << "OnUserDisconnect: " << uid;
-  timeout_queue_.RemoveUser(user);
-  users_.erase(uid);
+  SessionLane* l = lanes_[lane].get();
+  user->Timer()->Cancel();
+  auto it = l->users.find(uid);
+  if (it != l->users.end() && it->second.get() == user) {
+    l->users.erase(it);
+  }
+  RunInMainLane(bind(&SessionServer::OnUserOffline,
+                     this, uid, lane, generation, channel_ts));
 }
 
 void SessionServer::Stats(struct evhttp_request* req) {
@@ -911,24 +1525,49 @@ void SessionServer::Stats(struct evhttp_request* req) {
   Json::Value response;
   Json::Value& result = response["result"];
   stats_.GetReport(result);
+  p_->deferred_queue->GetReport(result["deferred_queue"]);
+  p_->fanout->GetReport(result["fanout"]);
+  channels_.GetReport(result["channel_cache"]);
+  p_->channel_loader.GetReport(result["channel_loader"]);
+  p_->max_seq_loader.GetReport(result["max_seq_loader"]);
+  storage_->GetReport(result["storage"]);
   ReplyOK(req, response.toStyledString());
 }
 
-void SessionServer::SetupClientHandler() {
-  p_->client_http = evhttp_new(p_->evbase);
-  CHECK(p_->client_http) << "create client http handle failed";
-  evhttp_set_cb(p_->client_http, "/connect", ConnectHandler, this);
-
-  struct evhttp_bound_socket* sock = NULL;
-  sock = evhttp_bind_socket_with_handle(p_->client_http,
-                                        "0.0.0.0",
-                                        client_listen_port_);
-  CHECK(sock) << "bind address failed: " << strerror(errno);
-
-  LOG(INFO) << "clinet server listen on " << client_listen_port_;
+void SessionServer::SetupLanes() {
+  CHECK(FLAGS_reactor_threads > 0);
+  current_lane_id = 0;
+  for (int i = 0; i < FLAGS_reactor_threads; ++i) {
+    struct event_base* evbase = (i == 0 ? p_->evbase : NULL);
+    TimingWheel* timer_wheel = (i == 0 ? p_->timer_wheel.get() : NULL);
+    lanes_.push_back(shared_ptr<SessionLane>(
+        new SessionLane(i, this, evbase, timer_wheel)));
+    lanes_.back()->broadcast_timer.SetCallback([i, this]() {
+      RunLaneBroadcasts(i);
+    });
+  }
+}
 
-  struct evconnlistener *listener = evhttp_bound_socket_get_listener(sock);
-  evconnlistener_set_error_cb(listener, AcceptErrorHandler);
+void SessionServer::SetupClientHandler() {
+  // every lane listens on the same port, the kernel balances the connections
+  const bool reuse_port = lanes_.size() > 1;
+  for (int i = 0; i < lanes_.size(); ++i) {
+    SessionLane* lane = lanes_[i].get();
+    lane->client_http = evhttp_new(lane->evbase);
+    CHECK(lane->client_http) << "create client http handle failed";
+    evhttp_set_cb(lane->client_http, "/connect", ConnectHandler, lane);
+
+    int fd = CreateListenSocket(client_listen_port_, reuse_port);
+    CHECK(fd >= 0) << "bind address failed: " << strerror(errno);
+    struct evhttp_bound_socket* sock = NULL;
+    sock = evhttp_accept_socket_with_handle(lane->client_http, fd);
+    CHECK(sock) << "listen failed: " << strerror(errno);
+
+    struct evconnlistener *listener = evhttp_bound_socket_get_listener(sock);
+    evconnlistener_set_error_cb(listener, AcceptErrorHandler);
+  }
+  LOG(INFO) << "clinet server listen on " << client_listen_port_
+            << " with " << lanes_.size() << " lanes";
 }
 
 void SessionServer::SetupAdminHandler() {
@@ -970,11 +1609,26 @@ void SessionServer::SetupEventHandler() {
   tv.tv_usec = 0;
   CHECK(p_->timer_event&& event_add(p_->timer_event, &tv) == 0)
       << "set timer handler failed";
+
+  // every lane ticks its own timer wheel
+  tv.tv_sec = FLAGS_timing_wheel_tick_ms / 1000;
+  tv.tv_usec = FLAGS_timing_wheel_tick_ms % 1000 * 1000;
+  for (int i = 0; i < lanes_.size(); ++i) {
+    SessionLane* lane = lanes_[i].get();
+    lane->timer_event = event_new(lane->evbase,
+                                  -1,
+                                  EV_PERSIST,
+                                  LaneTimerHandler,
+                                  lane);
+    CHECK(lane->timer_event && event_add(lane->timer_event, &tv) == 0)
+        << "set lane timer handler failed";
+  }
 }
 
-User* SessionServer::GetUser(const string& uid) {
-  auto iter = users_.find(uid);
-  return iter == users_.end() ? NULL : iter->second.get();
+User* SessionServer::GetUser(int lane, const string& uid) {
+  UserMap& users = lanes_[lane]->users;
+  auto iter = users.find(uid);
+  return iter == users.end() ? NULL : iter->second.get();
 }
 
 }  // namespace xcomet
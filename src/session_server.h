@@ -2,11 +2,10 @@
 #define SRC_SESSION_SERVER_H_
 
 #include "deps/base/scoped_ptr.h"
-#include "deps/base/concurrent_queue.h"
 #include "src/include_std.h"
 #include "src/user.h"
 #include "src/user_info.h"
-#include "src/channel_info.h"
+#include "src/channel_cache.h"
 #include "src/http_query.h"
 #include "src/stats_manager.h"
 #include "src/typedef.h"
@@ -20,6 +19,7 @@ namespace xcomet {
 
 class Storage;
 class SessionServerPrivate;
+struct SessionLane;
 class SessionServer {
  public:
   SessionServer();
@@ -27,7 +27,8 @@ class SessionServer {
   void Start();
   void Stop();
 
-  void Connect(struct evhttp_request* req);
+  // called in the reactor lane which accepted the connection
+  void Connect(int lane, struct evhttp_request* req);
 
   void Pub(struct evhttp_request* req);
   void Disconnect(struct evhttp_request* req);
@@ -39,9 +40,11 @@ class SessionServer {
   void Shard(struct evhttp_request* req);
 
   void OnTimer();
+  void OnLaneTimer(int lane);
   void OnUserMessage(const string& uid, User* user, shared_ptr<string> message);
   void OnPeerMessage(PeerMessagePtr message);
   void OnUserDisconnect(User* user);
+  void OnUserTimeout(User* user);
 
   void RedirectUserMessage(int shard_id, const string& uid, const Message& msg);
 
@@ -50,10 +53,49 @@ class SessionServer {
  private:
   DISALLOW_COPY_AND_ASSIGN(SessionServer);
 
+  void SetupLanes();
   void SetupClientHandler();
   void SetupAdminHandler();
   void SetupEventHandler();
 
+  // lane 0 is the main loop which owns the storage, channels, stats, admin
+  // and peer handling, the other lanes only serve client connections
+  bool InLane(int lane) const;
+  // only used in session_server.cc, where they are defined
+  template <typename F>
+  void RunInLane(int lane, F&& fn);
+  template <typename F>
+  void RunInMainLane(F&& fn);
+  void OnAuthenticated(int lane,
+                       struct evhttp_request* req,
+                       const string& uid,
+                       int type,
+                       int64 generation,
+                       bool ok);
+  void OnUserOnline(const string& uid, int lane, int64 generation);
+  // |channel_ts| has the last timeline entry of each channel sent to the
+  // connection
+  void OnUserOffline(const string& uid,
+                     int lane,
+                     int64 generation,
+                     const ChannelCursors& channel_ts);
+  // closes the connection of |generation|, any if it's 0
+  void KickUser(int lane, const string& uid, int64 generation = 0);
+  // schedule the idle timeout or the next heartbeat of the user
+  void ResetUserTimer(User* user, bool is_new);
+  // return false if the user is not connected to this server
+  bool SendToUser(const string& uid, const StringPtr& data);
+  bool SendToUser(const string& uid, const string& data);
+  // sends |prefix| followed by |rest| without joining them, a |channel_ts|
+  // of |cid| is recorded on the connection once the data is sent to it
+  bool SendToUser(const string& uid,
+                  const string& prefix,
+                  const StringPtr& rest,
+                  const string& cid = string(),
+                  int64 channel_ts = 0);
+  // recorded on the connection after the data sent to it before
+  void SetUserChannelTs(const string& uid, const ChannelCursors& channel_ts);
+
   void OnStart();
   void OnStop();
 
@@ -66,32 +108,64 @@ class SessionServer {
   int  GetShardId(const string& user);
   void HandleMessage(const string& from, Message& msg);
   void HandlePeerMessage(PeerMessagePtr message);
+  // |shard_id| is a peer id or ALL_PEERS, |channel_ts| is the timeline
+  // entry of a channel message, 0 if it has none
+  void SendToPeer(int shard_id,
+                  const string& user,
+                  const Message& msg,
+                  int64 ttl,
+                  int64 channel_ts = 0);
   void SendUserMsg(Message& msg, int64 ttl, bool check_shard = true);
-  void SendChannelMsg(Message& msg, int64 ttl);
-
-  void SendSave(const string& uid, Message& msg, int64 ttl);
+  void SendChannelMsg(Message& msg, int64 ttl, int64 channel_ts = 0);
+  // delivers to the members of this node, in slices if there are many
+  void StartChannelFanout(const ChannelInfo& channel,
+                          const Message& msg,
+                          int64 ttl,
+                          int64 channel_ts);
+
+  // sends |data| to every user connected to this node
+  void BroadcastLocal(const StringPtr& data);
+  void RunLaneBroadcasts(int lane);
+  // returns the publish time of the entry
+  int64 SaveChannelTimeline(const Message& msg, int64 ttl);
+  // only moves the cursor forward
+  void UpdateChannelCursor(const string& uid, const string& cid, int64 cursor);
+
+  void SendSave(const string& uid,
+                Message& msg,
+                int64 ttl,
+                int64 channel_ts = 0);
   void DoSendSave(const Message& msg, int64 ttl);
   void Subscribe(const string& uid, const string& cid);
   void Unsubscribe(const string& uid, const string& cid);
   void UpdateUserAck(const string& uid, int ack);
+  // the offline messages and acks of a loop pass are queued and written in
+  // batches on the next pass, or before the offline messages are read
+  void FlushStorageWrites();
 
   bool IsUserOnline(const string& user);
   bool IsHeartbeatMessage(const string& msg);
 
-  // NULL if not found
-  User* GetUser(const string& uid);
+  // NULL if not found, must be called in the lane owning the user
+  User* GetUser(int lane, const string& uid);
 
   const int client_listen_port_;
   const int admin_listen_port_;
-  const int timeout_counter_;
-  UserMap users_;
+  struct UserLane {
+    // owning the connection
+    int lane;
+    int64 generation;
+  };
+  // online user -> newest connection, only touched in main lane
+  unordered_map<string, UserLane> user_lanes_;
+  // given in main lane when the auth of a connection completes
+  int64 next_generation_;
   UserInfoMap user_infos_;
-  ChannelInfoMap channels_;
-  UserCircleQueue timeout_queue_;
+  ChannelCache channels_;
   StatsManager stats_;
-  base::ConcurrentQueue<function<void ()> > task_queue_;
 
   scoped_ptr<SessionServerPrivate> p_;
+  vector<shared_ptr<SessionLane> > lanes_;
 
   scoped_ptr<Storage> storage_;
 
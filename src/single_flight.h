@@ -0,0 +1,73 @@
+#ifndef SRC_SINGLE_FLIGHT_H_
+#define SRC_SINGLE_FLIGHT_H_
+
+#include "deps/base/basictypes.h"
+#include "deps/base/logging.h"
+#include "deps/jsoncpp/include/json/json.h"
+#include "src/include_std.h"
+#include "src/typedef.h"
+
+namespace xcomet {
+
+// Coalesces the loads of the same key: while a load is in flight, the
+// other requests for the key wait on it and are called back in the order
+// they came with the same result. The key is done before the callbacks
+// run, a Load from a callback starts a new flight.
+// Not thread safe, the loader must call back in the calling thread.
+template <typename Result>
+class SingleFlight {
+ public:
+  typedef function<void (Error, Result)> Callback;
+  // called with the function completing the flight
+  typedef function<void (Callback)> Loader;
+
+  SingleFlight() : load_number_(0), coalesced_number_(0) {}
+  ~SingleFlight() {}
+
+  // returns false if it joined a load in flight
+  bool Load(const string& key, const Loader& loader, const Callback& cb) {
+    auto it = flights_.find(key);
+    if (it != flights_.end()) {
+      ++coalesced_number_;
+      it->second.push_back(cb);
+      return false;
+    }
+    ++load_number_;
+    flights_[key].push_back(cb);
+    // the loader may complete right away
+    loader([this, key](Error error, Result result) {
+      Complete(key, error, result);
+    });
+    return true;
+  }
+
+  size_t InFlight() const {
+    return flights_.size();
+  }
+  void GetReport(Json::Value& report) const {
+    report["in_flight"] = (Json::UInt64)flights_.size();
+    report["load_number"] = (Json::Int64)load_number_;
+    report["coalesced_number"] = (Json::Int64)coalesced_number_;
+  }
+
+ private:
+  void Complete(const string& key, Error error, Result result) {
+    auto it = flights_.find(key);
+    CHECK(it != flights_.end()) << "no load in flight: " << key;
+    vector<Callback> waiters;
+    waiters.swap(it->second);
+    flights_.erase(it);
+    for (size_t i = 0; i < waiters.size(); ++i) {
+      waiters[i](error, result);
+    }
+  }
+
+  unordered_map<string, vector<Callback> > flights_;
+  int64 load_number_;
+  int64 coalesced_number_;
+
+  DISALLOW_COPY_AND_ASSIGN(SingleFlight);
+};
+
+}  // namespace xcomet
+#endif  // SRC_SINGLE_FLIGHT_H_
@@ -22,8 +22,15 @@ class StatsManager {
     ++recv_msg_type_count_[msg.Type()];
   }
   void OnSend(const string& data) {
+    OnSend(data.size());
+  }
+  void OnSend(size_t bytes) {
     ++d_.total_send_number;
-    d_.total_send_bytes += data.size();
+    d_.total_send_bytes += bytes;
+  }
+  void OnSendBatch(int64 number, int64 bytes) {
+    d_.total_send_number += number;
+    d_.total_send_bytes += bytes;
   }
   void OnRequest(const char* request) {
     ++req_count_[request];
@@ -1,6 +1,7 @@
 #include "src/storage/cassandra_storage.h"
 
 #include <algorithm>
+#include <mutex>
 #include "src/loop_executor.h"
 
 DEFINE_int32(cassandra_io_worker_thread_num, 4, "");
@@ -9,11 +10,95 @@ DEFINE_int32(cassandra_low_water_mark, 5000, "");
 DEFINE_int32(cassandra_high_water_mark, 10000, "");
 DEFINE_int32(cassandra_queue_size, 10000, "");
 DEFINE_string(cassandra_hosts, "127.0.0.1", "");
+DEFINE_int32(cassandra_batch_size, 100,
+             "the max statements of a batch, bigger partitions are split");
+DEFINE_string(cassandra_ack_layout, "user",
+              "where the acks are kept: user, migrating or static, see "
+              "scripts/migrate_static_ack.cql");
 
 namespace xcomet {
 
+enum QueryId {
+  Q_GET_USER,
+  Q_GET_MESSAGES,
+  Q_GET_OFFLINE,
+  Q_GET_USER_CHANNELS,
+  Q_GET_TIMELINE,
+  Q_SAVE_MESSAGE,
+  Q_UPDATE_ACK,
+  Q_GET_MAX_SEQ,
+  Q_ADD_CHANNEL_USER,
+  Q_ADD_USER_CHANNEL,
+  Q_REMOVE_CHANNEL_USER,
+  Q_REMOVE_USER_CHANNEL,
+  Q_GET_CHANNEL_USERS,
+  Q_SAVE_CHANNEL_MESSAGE,
+  Q_UPDATE_CHANNEL_CURSOR,
+  Q_UPDATE_STATIC_ACK,
+  QUERY_NUMBER
+};
+
+// the columns a query needs, which may not exist in every keyspace, a query
+// is only prepared if they are all used
+enum QueryNeeds {
+  // the tables and columns added for --channel_timeline
+  NEED_TIMELINE = 1,
+  // the acks of the user table
+  NEED_USER_ACK = 2,
+  // the static acks of the message partition
+  NEED_STATIC_ACK = 4,
+};
+
+struct QueryInfo {
+  QueryId id;
+  int needs;
+  const char* cql;
+};
+
+// in the order of the ids
+static const QueryInfo QUERIES[QUERY_NUMBER] = {
+  {Q_GET_USER, NEED_USER_ACK, "SELECT last_ack FROM user where uid = ?;"},
+  {Q_GET_MESSAGES, NEED_USER_ACK,
+   "SELECT body FROM message WHERE uid = ?"
+   " AND seq > ? order by seq DESC limit ?;"},
+  // the static columns can't be filtered on, the acked messages among the
+  // latest ones are dropped when read
+  {Q_GET_OFFLINE, NEED_STATIC_ACK,
+   "SELECT seq, body, last_ack FROM message WHERE uid = ?"
+   " order by seq DESC limit ?;"},
+  // a row without joined is only the cursor written after the user left
+  {Q_GET_USER_CHANNELS, NEED_TIMELINE,
+   "SELECT cid, joined, cursor FROM user_channel WHERE uid = ?;"},
+  {Q_GET_TIMELINE, NEED_TIMELINE, "SELECT cid, ts, body FROM channel_timeline"
+                                  " WHERE cid = ? AND ts > ? limit ?;"},
+  {Q_SAVE_MESSAGE, 0, "INSERT INTO message (uid, seq, body)"
+                      " VALUES (?, ?, ?) using ttl ?;"},
+  {Q_UPDATE_ACK, NEED_USER_ACK, "UPDATE user SET last_ack = ? WHERE uid = ?;"},
+  {Q_GET_MAX_SEQ, 0, "SELECT seq FROM message WHERE uid = ?"
+                     " ORDER BY seq DESC limit 1;"},
+  {Q_ADD_CHANNEL_USER, 0, "INSERT INTO channel (cid, uid) VALUES (?, ?);"},
+  // the cursor of a member joining again is kept
+  {Q_ADD_USER_CHANNEL, NEED_TIMELINE,
+   "INSERT INTO user_channel (uid, cid, joined) VALUES (?, ?, true);"},
+  {Q_REMOVE_CHANNEL_USER, 0, "DELETE FROM channel WHERE cid=? AND uid=?;"},
+  {Q_REMOVE_USER_CHANNEL, NEED_TIMELINE,
+   "DELETE FROM user_channel WHERE uid=? AND cid=?;"},
+  {Q_GET_CHANNEL_USERS, 0, "SELECT uid FROM channel WHERE cid=?;"},
+  {Q_SAVE_CHANNEL_MESSAGE, NEED_TIMELINE,
+   "INSERT INTO channel_timeline (cid, ts, body)"
+   " VALUES (?, ?, ?) using ttl ?;"},
+  {Q_UPDATE_CHANNEL_CURSOR, NEED_TIMELINE,
+   "UPDATE user_channel SET cursor = ? WHERE uid = ? AND cid = ?;"},
+  {Q_UPDATE_STATIC_ACK, NEED_STATIC_ACK,
+   "UPDATE message SET last_ack = ? WHERE uid = ?;"},
+};
+
 struct CassContext {
   CassSession* session;
+  // by query id, owned by the storage
+  const CassPrepared* const* prepared;
+  CassandraStorage::AckLayout ack_layout;
+  std::atomic<int64>* ack_fallbacks;
 };
 
 template<typename CbType>
@@ -22,10 +107,27 @@ struct CbContext : public CassContext {
   string uid;
 };
 
-static void RunCallback(const function<void()>& cb) {
-  LoopExecutor::RunInMainLoop(cb);
+// forwarded as it is, so the bound callback is built in the task node
+template <typename F>
+static void RunCallback(F&& cb) {
+  LoopExecutor::RunInMainLoop(std::forward<F>(cb));
 }
 
+// the offline messages of a user and the unread entries of the timelines
+// of its channels, the timelines are read in parallel by the io threads
+struct GetMessageContext : public CbContext<GetOfflineMessageCallback> {
+  // the latest messages of the user by seq descending, read with the static
+  // ack before it's known
+  vector<pair<int, StringPtr> > latest;
+  MessageDataSet messages;
+  std::mutex mutex;
+  int pending;
+  Error error;
+  vector<pair<int64, string> > entries;
+  // the last entry read of each channel
+  ChannelCursors cursors;
+};
+
 template<typename CbType>
 static CbContext<CbType>* CreateContext(const CbType& cb) {
   CbContext<CbType>* ctx = new CbContext<CbType>();
@@ -43,6 +145,17 @@ static Error GetError(CassFuture* future) {
   return message;
 }
 
+static bool IsNull(const CassValue* value) {
+  return value == NULL || cass_value_is_null(value);
+}
+
+// only the id of the prepared query and the values are sent
+static CassStatement* NewStatement(CassContext* ctx, QueryId id) {
+  const CassPrepared* prepared = ctx->prepared[id];
+  CHECK(prepared != NULL) << "query not prepared: " << QUERIES[id].cql;
+  return cass_prepared_bind(prepared);
+}
+
 static void ExecuteQuery(CassStatement* statement,
                   CassFutureCallback callback,
                   CassContext* ctx) {
@@ -54,8 +167,124 @@ static void ExecuteQuery(CassStatement* statement,
   cass_statement_free(statement);
 }
 
-CassandraStorage::CassandraStorage() {
+static void ExecuteBatch(CassBatch* batch,
+                         CassFutureCallback callback,
+                         CassContext* ctx) {
+  CHECK(ctx != NULL);
+  CHECK(ctx->session != NULL);
+  CassFuture* future = cass_session_execute_batch(ctx->session, batch);
+  cass_future_set_callback(future, callback, ctx);
+  cass_future_free(future);
+  cass_batch_free(batch);
+}
+
+// the statements of a batch call, the ones of a partition are sent in
+// unlogged batches which the coordinator applies as one mutation without
+// the batch log, the callback runs once after the last of them is done
+struct BatchContext : public CbContext<function<void (Error)> > {
+  std::mutex mutex;
+  int pending;
+  Error error;
+};
+
+static BatchContext* CreateBatchContext(const function<void (Error)>& cb) {
+  BatchContext* ctx = new BatchContext();
+  ctx->cb = cb;
+  ctx->pending = 0;
+  ctx->error = NO_ERROR;
+  return ctx;
+}
+
+// the statements by partition key
+typedef map<string, vector<CassStatement*> > PartitionStatements;
+
+static void OnBatch(CassFuture* future, void* data) {
+  VLOG(5) << "OnBatch enter";
+  auto ctx = static_cast<BatchContext*>(data);
+  Error error = NO_ERROR;
+  if (cass_future_error_code(future) != CASS_OK) {
+    error = GetError(future);
+  }
+  bool done = false;
+  {
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+    if (error != NO_ERROR) {
+      ctx->error = error;
+    }
+    done = --ctx->pending == 0;
+  }
+  if (done) {
+    RunCallback(bind(ctx->cb, ctx->error));
+    delete ctx;
+  }
+}
+
+// the ack of a user is written where the layout keeps it, to both while
+// migrating. The partitions are keyed by the table, they are not the same
+static void AddAckStatements(CassContext* ctx,
+                             const string& uid,
+                             int ack_seq,
+                             PartitionStatements* partitions) {
+  if (ctx->ack_layout != CassandraStorage::ACK_STATIC) {
+    CassStatement* statement = NewStatement(ctx, Q_UPDATE_ACK);
+    cass_statement_bind_int32(statement, 0, ack_seq);
+    cass_statement_bind_string(statement, 1, uid.c_str());
+    (*partitions)["user:" + uid].push_back(statement);
+  }
+  if (ctx->ack_layout != CassandraStorage::ACK_IN_USER) {
+    CassStatement* statement = NewStatement(ctx, Q_UPDATE_STATIC_ACK);
+    cass_statement_bind_int32(statement, 0, ack_seq);
+    cass_statement_bind_string(statement, 1, uid.c_str());
+    (*partitions)["message:" + uid].push_back(statement);
+  }
+}
+
+// takes the context and the statements
+static void ExecutePartitions(BatchContext* ctx,
+                              PartitionStatements* partitions) {
+  const size_t batch_size = std::max(FLAGS_cassandra_batch_size, 1);
+  int requests = 0;
+  for (auto& partition : *partitions) {
+    requests += (partition.second.size() + batch_size - 1) / batch_size;
+  }
+  if (requests == 0) {
+    RunCallback(bind(ctx->cb, NO_ERROR));
+    delete ctx;
+    return;
+  }
+  // set before the first request, which may be done at once
+  ctx->pending = requests;
+  for (auto& partition : *partitions) {
+    vector<CassStatement*>& statements = partition.second;
+    for (size_t i = 0; i < statements.size(); i += batch_size) {
+      size_t end = std::min(statements.size(), i + batch_size);
+      if (end - i == 1) {
+        ExecuteQuery(statements[i], OnBatch, ctx);
+        continue;
+      }
+      CassBatch* batch = cass_batch_new(CASS_BATCH_TYPE_UNLOGGED);
+      for (size_t j = i; j < end; ++j) {
+        cass_batch_add_statement(batch, statements[j]);
+        cass_statement_free(statements[j]);
+      }
+      ExecuteBatch(batch, OnBatch, ctx);
+    }
+  }
+  partitions->clear();
+}
+
+CassandraStorage::CassandraStorage()
+    : ack_layout_(ACK_IN_USER),
+      ack_fallbacks_(0) {
   CHECK(FLAGS_max_offline_msg_num > 0);
+  if (FLAGS_cassandra_ack_layout == "migrating") {
+    ack_layout_ = ACK_MIGRATING;
+  } else if (FLAGS_cassandra_ack_layout == "static") {
+    ack_layout_ = ACK_STATIC;
+  } else {
+    CHECK(FLAGS_cassandra_ack_layout == "user")
+        << "unknown --cassandra_ack_layout: " << FLAGS_cassandra_ack_layout;
+  }
   CHECK(!FLAGS_cassandra_hosts.empty());
   CHECK(FLAGS_cassandra_io_worker_thread_num > 0);
   CHECK(FLAGS_cassandra_connection_per_thread > 0);
@@ -82,9 +311,15 @@ CassandraStorage::CassandraStorage() {
   CHECK(cass_future_error_code(future) == CASS_OK)
       << "cassandra connect failed";
   cass_future_free(future);
+  Prepare();
 }
 
 CassandraStorage::~CassandraStorage() {
+  for (size_t i = 0; i < prepared_.size(); ++i) {
+    if (prepared_[i] != NULL) {
+      cass_prepared_free(prepared_[i]);
+    }
+  }
   CassFuture* close_future = cass_session_close(cass_session_);
   cass_future_wait(close_future);
   cass_future_free(close_future);
@@ -92,16 +327,202 @@ CassandraStorage::~CassandraStorage() {
   cass_session_free(cass_session_);
 }
 
+void CassandraStorage::Prepare() {
+  int used = 0;
+  if (FLAGS_channel_timeline) {
+    used |= NEED_TIMELINE;
+  }
+  if (ack_layout_ != ACK_STATIC) {
+    used |= NEED_USER_ACK;
+  }
+  if (ack_layout_ != ACK_IN_USER) {
+    used |= NEED_STATIC_ACK;
+  }
+  prepared_.assign(QUERY_NUMBER, NULL);
+  // sent together, the startup waits for the slowest one only
+  vector<CassFuture*> futures(QUERY_NUMBER, NULL);
+  for (int i = 0; i < QUERY_NUMBER; ++i) {
+    CHECK(QUERIES[i].id == i);
+    if ((QUERIES[i].needs & used) != QUERIES[i].needs) {
+      continue;
+    }
+    futures[i] = cass_session_prepare(cass_session_, QUERIES[i].cql);
+  }
+  for (int i = 0; i < QUERY_NUMBER; ++i) {
+    if (futures[i] == NULL) {
+      continue;
+    }
+    cass_future_wait(futures[i]);
+    CHECK(cass_future_error_code(futures[i]) == CASS_OK)
+        << "cassandra prepare failed: " << QUERIES[i].cql << ", "
+        << GetError(futures[i]);
+    prepared_[i] = cass_future_get_prepared(futures[i]);
+    cass_future_free(futures[i]);
+  }
+}
+
+void CassandraStorage::InitContext(CassContext* ctx) const {
+  ctx->session = cass_session_;
+  ctx->prepared = prepared_.data();
+  ctx->ack_layout = ack_layout_;
+  ctx->ack_fallbacks = &ack_fallbacks_;
+}
+
+void CassandraStorage::GetReport(Json::Value& report) const {
+  report["ack_layout"] = FLAGS_cassandra_ack_layout;
+  report["ack_fallback_number"] = static_cast<Json::Int64>(ack_fallbacks_);
+}
+
+static void FinishGetMessage(GetMessageContext* ctx) {
+  if (ctx->error != NO_ERROR) {
+    RunCallback(bind(ctx->cb, ctx->error, MessageDataSet(NULL),
+                     ChannelCursors()));
+    delete ctx;
+    return;
+  }
+  // the channels are merged by the publish time
+  std::stable_sort(ctx->entries.begin(), ctx->entries.end(),
+      [](const pair<int64, string>& a, const pair<int64, string>& b) {
+    return a.first < b.first;
+  });
+  MessageDataSet messages = ctx->messages;
+  messages->reserve(messages->size() + ctx->entries.size());
+  for (auto& entry : ctx->entries) {
+    messages->push_back(StringPtr(new string()));
+    messages->back()->swap(entry.second);
+  }
+  VLOG(6) << "FinishGetMessage size = " << messages->size();
+  RunCallback(bind(ctx->cb, NO_ERROR, messages, ctx->cursors));
+  delete ctx;
+}
+
+static void OnGetTimeline(CassFuture* future, void* data) {
+  VLOG(5) << "OnGetTimeline enter";
+  auto ctx = static_cast<GetMessageContext*>(data);
+  vector<pair<int64, string> > entries;
+  string cid;
+  int64 last_ts = 0;
+  Error error = NO_ERROR;
+  if (cass_future_error_code(future) != CASS_OK) {
+    error = GetError(future);
+  } else {
+    const CassResult* result = cass_future_get_result(future);
+    CassIterator* iter = cass_iterator_from_result(result);
+    while (cass_iterator_next(iter)) {
+      const CassRow* row = cass_iterator_get_row(iter);
+      cass_int64_t ts = 0;
+      const char* buf_ptr;
+      size_t buf_len;
+      if (cid.empty()) {
+        cass_value_get_string(cass_row_get_column_by_name(row, "cid"),
+                              &buf_ptr,
+                              &buf_len);
+        cid.assign(buf_ptr, buf_len);
+      }
+      cass_value_get_int64(cass_row_get_column_by_name(row, "ts"), &ts);
+      last_ts = std::max<int64>(last_ts, ts);
+      cass_value_get_string(cass_row_get_column_by_name(row, "body"),
+                            &buf_ptr,
+                            &buf_len);
+      entries.push_back(make_pair(ts, string(buf_ptr, buf_len)));
+    }
+    cass_iterator_free(iter);
+    cass_result_free(result);
+  }
+  bool done = false;
+  {
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+    if (error != NO_ERROR) {
+      ctx->error = error;
+    }
+    if (!entries.empty()) {
+      ctx->cursors[cid] = last_ts;
+    }
+    for (auto& entry : entries) {
+      ctx->entries.push_back(pair<int64, string>());
+      ctx->entries.back().first = entry.first;
+      ctx->entries.back().second.swap(entry.second);
+    }
+    done = --ctx->pending == 0;
+  }
+  if (done) {
+    FinishGetMessage(ctx);
+  }
+}
+
+static void OnGetUserChannels(CassFuture* future, void* data) {
+  VLOG(5) << "OnGetUserChannels enter";
+  auto ctx = static_cast<GetMessageContext*>(data);
+  if (cass_future_error_code(future) != CASS_OK) {
+    RunCallback(bind(ctx->cb, GetError(future), MessageDataSet(NULL),
+                     ChannelCursors()));
+    delete ctx;
+    return;
+  }
+  // each channel is read from its own cursor
+  vector<pair<string, int64> > channels;
+  const CassResult* result = cass_future_get_result(future);
+  CassIterator* iter = cass_iterator_from_result(result);
+  while (cass_iterator_next(iter)) {
+    const CassRow* row = cass_iterator_get_row(iter);
+    if (IsNull(cass_row_get_column_by_name(row, "joined"))) {
+      continue;
+    }
+    const char* buf_ptr;
+    size_t buf_len;
+    cass_value_get_string(cass_row_get_column_by_name(row, "cid"),
+                          &buf_ptr,
+                          &buf_len);
+    const CassValue* value = cass_row_get_column_by_name(row, "cursor");
+    cass_int64_t cursor = 0;
+    if (!IsNull(value)) {
+      cass_value_get_int64(value, &cursor);
+    }
+    channels.push_back(make_pair(string(buf_ptr, buf_len), cursor));
+  }
+  cass_iterator_free(iter);
+  cass_result_free(result);
+  VLOG(6) << "OnGetUserChannels size = " << channels.size();
+  if (channels.empty()) {
+    FinishGetMessage(ctx);
+    return;
+  }
+  // set before the first query is sent, the callbacks may run at once
+  ctx->pending = channels.size();
+  for (size_t i = 0; i < channels.size(); ++i) {
+    CassStatement* statement = NewStatement(ctx, Q_GET_TIMELINE);
+    cass_statement_bind_string(statement, 0, channels[i].first.c_str());
+    cass_statement_bind_int64(statement, 1, channels[i].second);
+    cass_statement_bind_int32(statement, 2, FLAGS_max_channel_timeline_num);
+    ExecuteQuery(statement, OnGetTimeline, ctx);
+  }
+}
+
+// the channel timelines are read after the messages of the user
+static void GetChannelMessages(GetMessageContext* ctx,
+                               MessageDataSet messages) {
+  if (!FLAGS_channel_timeline) {
+    RunCallback(bind(ctx->cb, NO_ERROR, messages, ChannelCursors()));
+    delete ctx;
+    return;
+  }
+  ctx->messages = messages;
+  CassStatement* statement = NewStatement(ctx, Q_GET_USER_CHANNELS);
+  cass_statement_bind_string(statement, 0, ctx->uid.c_str());
+  ExecuteQuery(statement, OnGetUserChannels, ctx);
+}
+
 static void OnGetMessage(CassFuture* future, void* data) {
   VLOG(5) << "OnGetMessage enter";
-  auto ctx = static_cast<CbContext<GetMessageCallback>*>(data);
+  auto ctx = static_cast<GetMessageContext*>(data);
   if (cass_future_error_code(future) != CASS_OK) {
-    RunCallback(bind(ctx->cb, GetError(future), MessageDataSet(NULL)));
+    RunCallback(bind(ctx->cb, GetError(future), MessageDataSet(NULL),
+                     ChannelCursors()));
     delete ctx;
     return;
   }
 
-  MessageDataSet messages(new vector<string>());
+  MessageDataSet messages(new vector<StringPtr>());
   const CassResult* result = cass_future_get_result(future);
   CassIterator* iter = cass_iterator_from_result(result);
   while (cass_iterator_next(iter)) {
@@ -111,31 +532,22 @@ static void OnGetMessage(CassFuture* future, void* data) {
     cass_value_get_string(cass_row_get_column_by_name(row, "body"),
                           &buf_ptr,
                           &buf_len);
-    messages->push_back(string());
-    messages->back().reserve(buf_len);
-    messages->back().assign(buf_ptr, buf_len);
+    messages->push_back(StringPtr(new string(buf_ptr, buf_len)));
   }
   VLOG(6) << "OnGetMessage size = " << messages->size();
   if (FLAGS_v >= 6) {
     for (int i = 0; i < messages->size(); ++i) {
-      VLOG(6) << i << ": " << messages->at(i);
+      VLOG(6) << i << ": " << *messages->at(i);
     }
   }
   std::reverse(messages->begin(), messages->end());
   cass_iterator_free(iter);
   cass_result_free(result);
-  RunCallback(bind(ctx->cb, NO_ERROR, messages));
-  delete ctx;
+  GetChannelMessages(ctx, messages);
 }
 
-static void OnGetLastAck(CassFuture* future, void* data) {
-  VLOG(5) << "OnGetLastAck enter";
-  auto ctx = static_cast<CbContext<GetMessageCallback>*>(data);
-  if (cass_future_error_code(future) != CASS_OK) {
-    RunCallback(bind(ctx->cb, GetError(future), MessageDataSet(NULL)));
-    delete ctx;
-    return;
-  }
+// the row of the user table
+static int ReadUserAck(CassFuture* future) {
   int last_ack = 0;
   const CassResult* result = cass_future_get_result(future);
   CassIterator* iter = cass_iterator_from_result(result);
@@ -143,30 +555,148 @@ static void OnGetLastAck(CassFuture* future, void* data) {
     const CassRow* row = cass_iterator_get_row(iter);
     cass_value_get_int32(cass_row_get_column_by_name(row, "last_ack"),
                          &last_ack);
-    cass_iterator_free(iter);
-    cass_result_free(result);
   }
+  cass_iterator_free(iter);
+  cass_result_free(result);
+  return last_ack;
+}
+
+static void OnGetLastAck(CassFuture* future, void* data) {
+  VLOG(5) << "OnGetLastAck enter";
+  auto ctx = static_cast<GetMessageContext*>(data);
+  if (cass_future_error_code(future) != CASS_OK) {
+    RunCallback(bind(ctx->cb, GetError(future), MessageDataSet(NULL),
+                     ChannelCursors()));
+    delete ctx;
+    return;
+  }
+  int last_ack = ReadUserAck(future);
   VLOG(6) << "OnGetLastAck last_ack = " << last_ack;
-  const char* query = "SELECT body FROM message WHERE uid = ? AND seq > ?"
-                      " order by seq DESC limit ?;";
-  CassStatement* statement = cass_statement_new(query, 3);
+  CassStatement* statement = NewStatement(ctx, Q_GET_MESSAGES);
   cass_statement_bind_string(statement, 0, ctx->uid.c_str());
   cass_statement_bind_int32(statement, 1, last_ack);
   cass_statement_bind_int32(statement, 2, FLAGS_max_offline_msg_num);
   ExecuteQuery(statement, OnGetMessage, ctx);
 }
 
-void CassandraStorage::GetMessage(const string& uid,
-                                  GetMessageCallback callback) {
-  VLOG(5) << "GetMessage enter";
-  auto ctx = CreateContext(callback);
+// the latest messages which are not acked yet, by seq ascending
+static void FilterOffline(GetMessageContext* ctx, int last_ack) {
+  MessageDataSet messages(new vector<StringPtr>());
+  for (auto iter = ctx->latest.rbegin(); iter != ctx->latest.rend(); ++iter) {
+    if (iter->first > last_ack) {
+      messages->push_back(iter->second);
+    }
+  }
+  ctx->latest.clear();
+  VLOG(6) << "FilterOffline last_ack = " << last_ack
+          << ", size = " << messages->size();
+  GetChannelMessages(ctx, messages);
+}
+
+static void OnCopyAck(Error error) {
+  if (error != NO_ERROR) {
+    LOG(ERROR) << "copy the ack to the message partition failed: " << error;
+  }
+}
+
+static void OnGetUserAck(CassFuture* future, void* data) {
+  VLOG(5) << "OnGetUserAck enter";
+  auto ctx = static_cast<GetMessageContext*>(data);
+  if (cass_future_error_code(future) != CASS_OK) {
+    RunCallback(bind(ctx->cb, GetError(future), MessageDataSet(NULL),
+                     ChannelCursors()));
+    delete ctx;
+    return;
+  }
+  int last_ack = ReadUserAck(future);
+  // copied for the next reads, not waited for. An ack written meanwhile may
+  // be overwritten by this older one, which only delivers a few acked
+  // messages again
+  BatchContext* copy_ctx = CreateBatchContext(OnCopyAck);
+  *static_cast<CassContext*>(copy_ctx) = *ctx;
+  PartitionStatements partitions;
+  vector<CassStatement*>& statements = partitions[ctx->uid];
+  statements.push_back(NewStatement(ctx, Q_UPDATE_STATIC_ACK));
+  cass_statement_bind_int32(statements.back(), 0, last_ack);
+  cass_statement_bind_string(statements.back(), 1, ctx->uid.c_str());
+  ExecutePartitions(copy_ctx, &partitions);
+  FilterOffline(ctx, last_ack);
+}
+
+static void OnGetOffline(CassFuture* future, void* data) {
+  VLOG(5) << "OnGetOffline enter";
+  auto ctx = static_cast<GetMessageContext*>(data);
+  if (cass_future_error_code(future) != CASS_OK) {
+    RunCallback(bind(ctx->cb, GetError(future), MessageDataSet(NULL),
+                     ChannelCursors()));
+    delete ctx;
+    return;
+  }
+  // the static columns are returned with every row, and alone in a row
+  // without a seq if the partition has no messages
+  bool ack_found = false;
+  int last_ack = 0;
+  const CassResult* result = cass_future_get_result(future);
+  CassIterator* iter = cass_iterator_from_result(result);
+  while (cass_iterator_next(iter)) {
+    const CassRow* row = cass_iterator_get_row(iter);
+    if (!ack_found) {
+      const CassValue* value = cass_row_get_column_by_name(row, "last_ack");
+      if (!IsNull(value)) {
+        cass_value_get_int32(value, &last_ack);
+        ack_found = true;
+      }
+    }
+    const CassValue* seq_value = cass_row_get_column_by_name(row, "seq");
+    if (IsNull(seq_value)) {
+      continue;
+    }
+    int seq = 0;
+    cass_value_get_int32(seq_value, &seq);
+    const char* buf_ptr;
+    size_t buf_len;
+    cass_value_get_string(cass_row_get_column_by_name(row, "body"),
+                          &buf_ptr,
+                          &buf_len);
+    ctx->latest.push_back(make_pair(seq, StringPtr(new string(buf_ptr,
+                                                              buf_len))));
+  }
+  cass_iterator_free(iter);
+  cass_result_free(result);
+  VLOG(6) << "OnGetOffline last_ack = " << last_ack
+          << ", latest = " << ctx->latest.size();
+  if (ctx->ack_layout == CassandraStorage::ACK_MIGRATING && !ack_found) {
+    // not copied from the user table yet
+    ++*ctx->ack_fallbacks;
+    CassStatement* statement = NewStatement(ctx, Q_GET_USER);
+    cass_statement_bind_string(statement, 0, ctx->uid.c_str());
+    ExecuteQuery(statement, OnGetUserAck, ctx);
+    return;
+  }
+  FilterOffline(ctx, last_ack);
+}
+
+void CassandraStorage::GetOfflineMessage(const string& uid,
+                                         GetOfflineMessageCallback callback) {
+  VLOG(5) << "GetOfflineMessage enter";
+  auto ctx = new GetMessageContext();
   ctx->cb = callback;
   ctx->uid = uid;
-  ctx->session = cass_session_;
-  const char* query = "SELECT last_ack FROM user where uid = ?;";
-  CassStatement* statement = cass_statement_new(query, 1);
+  InitContext(ctx);
+  ctx->pending = 0;
+  ctx->error = NO_ERROR;
+  if (ack_layout_ == ACK_IN_USER) {
+    CassStatement* statement = NewStatement(ctx, Q_GET_USER);
+    cass_statement_bind_string(statement, 0, uid.c_str());
+    ExecuteQuery(statement, OnGetLastAck, ctx);
+    return;
+  }
+  // the ack is a static column of the message partition, read with the
+  // messages in one round trip
+  CassStatement* statement = NewStatement(ctx, Q_GET_OFFLINE);
   cass_statement_bind_string(statement, 0, uid.c_str());
-  ExecuteQuery(statement, OnGetLastAck, ctx);
+  cass_statement_bind_int32(statement, 1, FLAGS_max_offline_msg_num);
+  ExecuteQuery(statement, OnGetOffline, ctx);
 }
 
 static void OnSaveMessage(CassFuture* future, void* data) {
@@ -187,10 +717,8 @@ void CassandraStorage::SaveMessage(const StringPtr& msg,
                                    SaveMessageCallback callback) {
   VLOG(5) << "SaveMessage enter";
   auto ctx = CreateContext(callback);
-  ctx->session = cass_session_;
-  const char* query = "INSERT INTO message (uid, seq, body)"
-                      " VALUES (?, ?, ?) using ttl ?;";
-  CassStatement* statement = cass_statement_new(query, 4);
+  InitContext(ctx);
+  CassStatement* statement = NewStatement(ctx, Q_SAVE_MESSAGE);
   cass_statement_bind_string(statement, 0, uid.c_str());
   cass_statement_bind_int32(statement, 1, seq);
   cass_statement_bind_string(statement, 2, msg->c_str());
@@ -198,28 +726,50 @@ void CassandraStorage::SaveMessage(const StringPtr& msg,
   ExecuteQuery(statement, OnSaveMessage, ctx);
 }
 
-static void OnUpdateAck(CassFuture* future, void* data) {
-  VLOG(5) << "OnUpdateAck enter";
-  auto ctx = static_cast<CbContext<UpdateAckCallback>*>(data);
-  if (cass_future_error_code(future) != CASS_OK) {
-    RunCallback(bind(ctx->cb, GetError(future)));
-  } else {
-    RunCallback(bind(ctx->cb, NO_ERROR));
+void CassandraStorage::SaveMessages(const vector<SaveMessageEntry>& entries,
+                                    SaveMessagesCallback callback) {
+  VLOG(5) << "SaveMessages enter: " << entries.size();
+  auto ctx = CreateBatchContext(callback);
+  InitContext(ctx);
+  PartitionStatements partitions;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const SaveMessageEntry& entry = entries[i];
+    CassStatement* statement = NewStatement(ctx, Q_SAVE_MESSAGE);
+    cass_statement_bind_string(statement, 0, entry.uid.c_str());
+    cass_statement_bind_int32(statement, 1, entry.seq);
+    cass_statement_bind_string(statement, 2, entry.msg->c_str());
+    cass_statement_bind_int32(statement, 3, entry.ttl);
+    partitions[entry.uid].push_back(statement);
   }
-  delete ctx;
+  ExecutePartitions(ctx, &partitions);
 }
 
 void CassandraStorage::UpdateAck(const string& uid,
                                  int ack_seq,
                                  UpdateAckCallback callback) {
   VLOG(5) << "UpdateAck enter";
-  auto ctx = CreateContext(callback);
-  ctx->session = cass_session_;
-  const char* query = "UPDATE user SET last_ack = ? WHERE uid = ?;";
-  CassStatement* statement = cass_statement_new(query, 2);
-  cass_statement_bind_int32(statement, 0, ack_seq);
-  cass_statement_bind_string(statement, 1, uid.c_str());
-  ExecuteQuery(statement, OnUpdateAck, ctx);
+  auto ctx = CreateBatchContext(callback);
+  InitContext(ctx);
+  PartitionStatements partitions;
+  AddAckStatements(ctx, uid, ack_seq, &partitions);
+  ExecutePartitions(ctx, &partitions);
+}
+
+void CassandraStorage::UpdateAcks(const vector<pair<string, int> >& acks,
+                                  UpdateAcksCallback callback) {
+  VLOG(5) << "UpdateAcks enter: " << acks.size();
+  auto ctx = CreateBatchContext(callback);
+  InitContext(ctx);
+  // one row per user, only the last ack of a user is written
+  map<string, int> last_acks;
+  for (size_t i = 0; i < acks.size(); ++i) {
+    last_acks[acks[i].first] = acks[i].second;
+  }
+  PartitionStatements partitions;
+  for (auto& ack : last_acks) {
+    AddAckStatements(ctx, ack.first, ack.second, &partitions);
+  }
+  ExecutePartitions(ctx, &partitions);
 }
 
 static void OnGetMaxSeq(CassFuture* future, void* data) {
@@ -249,10 +799,8 @@ void CassandraStorage::GetMaxSeq(const string& uid,
                                  GetMaxSeqCallback callback) {
   VLOG(5) << "GetMaxSeq enter";
   auto ctx = CreateContext(callback);
-  ctx->session = cass_session_;
-  const char* query = "SELECT seq FROM message WHERE uid = ?"
-                      " ORDER BY seq DESC limit 1;";
-  CassStatement* statement = cass_statement_new(query, 1);
+  InitContext(ctx);
+  CassStatement* statement = NewStatement(ctx, Q_GET_MAX_SEQ);
   cass_statement_bind_string(statement, 0, uid.c_str());
   ExecuteQuery(statement, OnGetMaxSeq, ctx);
 }
@@ -273,12 +821,54 @@ void CassandraStorage::AddUserToChannel(const string& uid,
                                         AddUserToChannelCallback callback) {
   VLOG(5) << "AddUserToChannel enter";
   auto ctx = CreateContext(callback);
-  ctx->session = cass_session_;
-  const char* query = "INSERT INTO channel (cid, uid) VALUES (?, ?);";
-  CassStatement* statement = cass_statement_new(query, 2);
+  InitContext(ctx);
+  CassStatement* statement = NewStatement(ctx, Q_ADD_CHANNEL_USER);
   cass_statement_bind_string(statement, 0, cid.c_str());
   cass_statement_bind_string(statement, 1, uid.c_str());
-  ExecuteQuery(statement, OnAddUserToChannel, ctx);
+  if (!FLAGS_channel_timeline) {
+    ExecuteQuery(statement, OnAddUserToChannel, ctx);
+    return;
+  }
+  // the channels of a user are needed to read the timelines
+  CassStatement* index_statement = NewStatement(ctx, Q_ADD_USER_CHANNEL);
+  cass_statement_bind_string(index_statement, 0, uid.c_str());
+  cass_statement_bind_string(index_statement, 1, cid.c_str());
+  CassBatch* batch = cass_batch_new(CASS_BATCH_TYPE_LOGGED);
+  cass_batch_add_statement(batch, statement);
+  cass_batch_add_statement(batch, index_statement);
+  cass_statement_free(statement);
+  cass_statement_free(index_statement);
+  ExecuteBatch(batch, OnAddUserToChannel, ctx);
+}
+
+void CassandraStorage::AddUsersToChannel(const vector<string>& uids,
+                                         const string& cid,
+                                         AddUsersToChannelCallback callback) {
+  VLOG(5) << "AddUsersToChannel enter: " << cid << ", " << uids.size();
+  auto ctx = CreateBatchContext(callback);
+  InitContext(ctx);
+  // the members are rows of the channel partition, the index rows are in
+  // the partitions of the users. Unlike AddUserToChannel they are not
+  // written atomically, both inserts are idempotent so a failed batch can
+  // simply be retried. The partitions are keyed by the table too, a uid may
+  // look like a cid
+  PartitionStatements partitions;
+  vector<CassStatement*>& members = partitions["channel:" + cid];
+  for (size_t i = 0; i < uids.size(); ++i) {
+    CassStatement* statement = NewStatement(ctx, Q_ADD_CHANNEL_USER);
+    cass_statement_bind_string(statement, 0, cid.c_str());
+    cass_statement_bind_string(statement, 1, uids[i].c_str());
+    members.push_back(statement);
+  }
+  if (FLAGS_channel_timeline) {
+    for (size_t i = 0; i < uids.size(); ++i) {
+      CassStatement* statement = NewStatement(ctx, Q_ADD_USER_CHANNEL);
+      cass_statement_bind_string(statement, 0, uids[i].c_str());
+      cass_statement_bind_string(statement, 1, cid.c_str());
+      partitions["user_channel:" + uids[i]].push_back(statement);
+    }
+  }
+  ExecutePartitions(ctx, &partitions);
 }
 
 static void OnRemoveUserFromChannel(CassFuture* future, void* data) {
@@ -298,12 +888,23 @@ void CassandraStorage::RemoveUserFromChannel(
     RemoveUserFromChannelCallback callback) {
   VLOG(5) << "RemoveUserFromChannel enter";
   auto ctx = CreateContext(callback);
-  ctx->session = cass_session_;
-  const char* query = "DELETE FROM channel WHERE cid=? AND uid=?;";
-  CassStatement* statement = cass_statement_new(query, 2);
+  InitContext(ctx);
+  CassStatement* statement = NewStatement(ctx, Q_REMOVE_CHANNEL_USER);
   cass_statement_bind_string(statement, 0, cid.c_str());
   cass_statement_bind_string(statement, 1, uid.c_str());
-  ExecuteQuery(statement, OnRemoveUserFromChannel, ctx);
+  if (!FLAGS_channel_timeline) {
+    ExecuteQuery(statement, OnRemoveUserFromChannel, ctx);
+    return;
+  }
+  CassStatement* index_statement = NewStatement(ctx, Q_REMOVE_USER_CHANNEL);
+  cass_statement_bind_string(index_statement, 0, uid.c_str());
+  cass_statement_bind_string(index_statement, 1, cid.c_str());
+  CassBatch* batch = cass_batch_new(CASS_BATCH_TYPE_LOGGED);
+  cass_batch_add_statement(batch, statement);
+  cass_batch_add_statement(batch, index_statement);
+  cass_statement_free(statement);
+  cass_statement_free(index_statement);
+  ExecuteBatch(batch, OnRemoveUserFromChannel, ctx);
 }
 
 static void OnGetChannelUsers(CassFuture* future, void* data) {
@@ -344,11 +945,65 @@ void CassandraStorage::GetChannelUsers(const string& cid,
                                        GetChannelUsersCallback callback) {
   VLOG(5) << "GetChannelUsers enter";
   auto ctx = CreateContext(callback);
-  ctx->session = cass_session_;
-  const char* query = "SELECT uid FROM channel WHERE cid=?;";
-  CassStatement* statement = cass_statement_new(query, 1);
+  InitContext(ctx);
+  CassStatement* statement = NewStatement(ctx, Q_GET_CHANNEL_USERS);
   cass_statement_bind_string(statement, 0, cid.c_str());
   ExecuteQuery(statement, OnGetChannelUsers, ctx);
 }
 
+static void OnSaveChannelMessage(CassFuture* future, void* data) {
+  VLOG(5) << "OnSaveChannelMessage enter";
+  auto ctx = static_cast<CbContext<SaveChannelMessageCallback>*>(data);
+  if (cass_future_error_code(future) != CASS_OK) {
+    RunCallback(bind(ctx->cb, GetError(future)));
+  } else {
+    RunCallback(bind(ctx->cb, NO_ERROR));
+  }
+  delete ctx;
+}
+
+void CassandraStorage::SaveChannelMessage(
+    const StringPtr& msg,
+    const string& cid,
+    int64 ts,
+    int64 ttl,
+    SaveChannelMessageCallback callback) {
+  VLOG(5) << "SaveChannelMessage enter";
+  auto ctx = CreateContext(callback);
+  InitContext(ctx);
+  CassStatement* statement = NewStatement(ctx, Q_SAVE_CHANNEL_MESSAGE);
+  cass_statement_bind_string(statement, 0, cid.c_str());
+  cass_statement_bind_int64(statement, 1, ts);
+  cass_statement_bind_string(statement, 2, msg->c_str());
+  cass_statement_bind_int32(statement, 3, ttl);
+  ExecuteQuery(statement, OnSaveChannelMessage, ctx);
+}
+
+static void OnUpdateChannelCursor(CassFuture* future, void* data) {
+  VLOG(5) << "OnUpdateChannelCursor enter";
+  auto ctx = static_cast<CbContext<UpdateChannelCursorCallback>*>(data);
+  if (cass_future_error_code(future) != CASS_OK) {
+    RunCallback(bind(ctx->cb, GetError(future)));
+  } else {
+    RunCallback(bind(ctx->cb, NO_ERROR));
+  }
+  delete ctx;
+}
+
+// the row of the membership, the ack layout doesn't matter
+void CassandraStorage::UpdateChannelCursor(
+    const string& uid,
+    const string& cid,
+    int64 cursor,
+    UpdateChannelCursorCallback callback) {
+  VLOG(5) << "UpdateChannelCursor enter";
+  auto ctx = CreateContext(callback);
+  InitContext(ctx);
+  CassStatement* statement = NewStatement(ctx, Q_UPDATE_CHANNEL_CURSOR);
+  cass_statement_bind_int64(statement, 0, cursor);
+  cass_statement_bind_string(statement, 1, uid.c_str());
+  cass_statement_bind_string(statement, 2, cid.c_str());
+  ExecuteQuery(statement, OnUpdateChannelCursor, ctx);
+}
+
 }  // namespace xcomet
@@ -1,17 +1,40 @@
 #ifndef SRC_STORAGE_CASSANDRA_STORAGE_H_
 #define SRC_STORAGE_CASSANDRA_STORAGE_H_
 
+#include <atomic>
 #include "deps/cassandra/cpp-driver/include/cassandra.h"
 #include "src/storage/storage.h"
 
 namespace xcomet {
 
+struct CassContext;
+
+// Every query is prepared once when connected, the calls only bind the
+// values to the prepared handles so the coordinator never parses them again.
 class CassandraStorage : public Storage {
  public:
+  // where the acks and the channel cursors are kept, by --cassandra_ack_layout,
+  // see scripts/migrate_static_ack.cql
+  enum AckLayout {
+    // the user table, read before the messages, two round trips
+    ACK_IN_USER,
+    // written to both, read from the message partition and from the user
+    // table for the users whose static columns are not set yet, which are
+    // then copied
+    ACK_MIGRATING,
+    // the static columns of the message partition, read with the messages
+    // in one round trip
+    ACK_STATIC,
+  };
+
   CassandraStorage();
   ~CassandraStorage();
+
+  virtual void GetReport(Json::Value& report) const;
+
  private:
-  virtual void GetMessage(const string& uid, GetMessageCallback callback);
+  virtual void GetOfflineMessage(const string& uid,
+                                 GetOfflineMessageCallback callback);
   virtual void SaveMessage(const StringPtr& msg,
                            const string& uid,
                            int seq,
@@ -32,9 +55,34 @@ class CassandraStorage : public Storage {
                                      RemoveUserFromChannelCallback callback);
   virtual void GetChannelUsers(const string& cid,
                                GetChannelUsersCallback callback);
+  virtual void SaveChannelMessage(const StringPtr& msg,
+                                  const string& cid,
+                                  int64 ts,
+                                  int64 ttl,
+                                  SaveChannelMessageCallback callback);
+  virtual void UpdateChannelCursor(const string& uid,
+                                   const string& cid,
+                                   int64 cursor,
+                                   UpdateChannelCursorCallback callback);
+  virtual void SaveMessages(const vector<SaveMessageEntry>& entries,
+                            SaveMessagesCallback callback);
+  virtual void UpdateAcks(const vector<pair<string, int> >& acks,
+                          UpdateAcksCallback callback);
+  virtual void AddUsersToChannel(const vector<string>& uids,
+                                 const string& cid,
+                                 AddUsersToChannelCallback callback);
+
+  void Prepare();
+  // the session and the prepared queries the callbacks need
+  void InitContext(CassContext* ctx) const;
 
   CassSession* cass_session_;
   CassCluster* cass_cluster_;
+  // by query id, only read once prepared, NULL if the query isn't used
+  vector<const CassPrepared*> prepared_;
+  AckLayout ack_layout_;
+  // the offline reads which fell back to the user table while migrating
+  mutable std::atomic<int64> ack_fallbacks_;
 };
 
 }
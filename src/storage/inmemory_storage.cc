@@ -1,15 +1,37 @@
 #include "src/storage/inmemory_storage.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
 #include "deps/base/time.h"
 #include "deps/base/file.h"
 #include "deps/base/string_util.h"
 #include "deps/base/flags.h"
+#include "deps/base/varint.h"
 #include "src/loop_executor.h"
+#include "src/uid_table.h"
 
 using base::File;
 using base::Time;
 
 DEFINE_string(inmemory_data_dir, "inmemory_data", "");
+DEFINE_bool(inmemory_wal, true,
+            "log the updates so they survive a crash");
+DEFINE_bool(inmemory_wal_sync, true,
+            "sync the log to the disk after each write");
+DEFINE_int32(inmemory_snapshot_interval_sec, 600,
+             "snapshot the data periodically to shorten the log replay, "
+             "0 to only snapshot at exit");
+DEFINE_int32(inmemory_snapshot_keep, 2, "number of the snapshots kept");
+DEFINE_int32(inmemory_snapshot_shards, 8,
+             "the users of a snapshot are split in this many files, which "
+             "are written and loaded in parallel");
+DEFINE_int32(inmemory_snapshot_slice_usec, 2000,
+             "max time spent on taking a snapshot per tick of the main loop");
 
 namespace xcomet {
 
@@ -18,73 +40,286 @@ static int64 Now() {
   return base::GetTimeInSecond();
 }
 
+static int64 ExpiredTime(int64 ttl) {
+  return ttl > 0 ? Now() + ttl : 0;
+}
+
+enum WalRecordType {
+  WAL_SAVE_MESSAGE = 1,
+  WAL_UPDATE_ACK = 2,
+  WAL_ADD_USER_TO_CHANNEL = 3,
+  WAL_REMOVE_USER_FROM_CHANNEL = 4,
+  WAL_SAVE_CHANNEL_MESSAGE = 5,
+  WAL_UPDATE_CHANNEL_CURSOR = 6,
+};
+
+// The log records and the snapshot files are made of varint numbers and
+// length prefixed strings, a log record starts with its type
+class RecordWriter {
+ public:
+  explicit RecordWriter(string* out) : out_(out) {
+  }
+  RecordWriter& Put(uint64 value) {
+    uint8 buf[10];
+    uint8* end = base::WriteVarint64(value, buf);
+    out_->append(reinterpret_cast<char*>(buf), end - buf);
+    return *this;
+  }
+  RecordWriter& Put(const string& value) {
+    Put(value.size());
+    out_->append(value);
+    return *this;
+  }
+
+ private:
+  string* out_;
+};
+
+class RecordReader {
+ public:
+  explicit RecordReader(const string& record)
+      : p_(record.data()), end_(record.data() + record.size()) {
+  }
+  RecordReader(const char* data, size_t size)
+      : p_(data), end_(data + size) {
+  }
+  bool Done() const {
+    return p_ == end_;
+  }
+  bool Get(int64* value) {
+    uint64 v = 0;
+    for (int shift = 0; shift < 64 && p_ < end_; shift += 7) {
+      uint8 byte = static_cast<uint8>(*p_++);
+      v |= static_cast<uint64>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        *value = static_cast<int64>(v);
+        return true;
+      }
+    }
+    return false;
+  }
+  bool Get(string* value) {
+    const char* data = NULL;
+    size_t size = 0;
+    if (!Get(&data, &size)) {
+      return false;
+    }
+    value->assign(data, size);
+    return true;
+  }
+  // points into the record, without copying
+  bool Get(const char** data, size_t* size) {
+    int64 len = 0;
+    if (!Get(&len) || len < 0 || len > end_ - p_) {
+      return false;
+    }
+    *data = p_;
+    *size = len;
+    p_ += len;
+    return true;
+  }
+
+ private:
+  const char* p_;
+  const char* end_;
+};
+
+// the smallest ring allocated, in slots
+static const int MIN_RING_CAPACITY = 4;
+
 InMemoryUserData::InMemoryUserData()
     : head_(0),
       head_seq_(0),
       tail_(0),
       tail_seq_(0),
-      ack_(0) {
-  CHECK(FLAGS_max_offline_msg_num > 0);
-  msg_queue_.resize(FLAGS_max_offline_msg_num+1);
+      ack_(0),
+      wheel_(NULL),
+      bytes_(0),
+      messages_(0),
+      usage_(NULL) {
+  expire_timer_.SetCallback([this]() {ExpireMessages();});
 }
 
 InMemoryUserData::~InMemoryUserData() {
+  if (usage_ != NULL) {
+    usage_->bytes -= bytes_;
+    usage_->messages -= messages_;
+  }
 }
 
-bool InMemoryUserData::Dump(Json::Value& json) {
-  if (tail_seq_ == 0) {
-    return false;
+void InMemoryUserData::SetUsage(Usage* usage) {
+  CHECK(usage_ == NULL);
+  usage_ = usage;
+  usage_->bytes += bytes_;
+  usage_->messages += messages_;
+}
+
+void InMemoryUserData::Account(int64 bytes, int64 messages) {
+  bytes_ += bytes;
+  messages_ += messages;
+  if (usage_ != NULL) {
+    usage_->bytes += bytes;
+    usage_->messages += messages;
+  }
+}
+
+// the slots outside of head to tail are always empty
+void InMemoryUserData::SetSlot(int index,
+                               int64 expired,
+                               const StringPtr& msg) {
+  pair<int64, StringPtr>& slot = msg_queue_[index];
+  if (slot.second.get() != NULL) {
+    Account(-static_cast<int64>(slot.second->size()), -1);
+  }
+  slot.first = expired;
+  slot.second = msg;
+  if (msg.get() != NULL) {
+    Account(msg->size(), 1);
+  }
+}
+
+void InMemoryUserData::Resize(int capacity) {
+  const int size = msg_queue_.size();
+  const int len = size > 0 ? (tail_ - head_ + size) % size : 0;
+  // one slot is always left free to tell a full ring from an empty one
+  CHECK(capacity > len || (capacity == 0 && len == 0));
+  vector<pair<int64, StringPtr> > queue(capacity);
+  for (int i = 0; i < len; ++i) {
+    queue[i].swap(msg_queue_[(head_ + i) % size]);
   }
-  json["head"] = head_;
-  json["head_seq"] = head_seq_;
-  json["tail"] = tail_;
-  json["tail_seq"] = tail_seq_;
-  json["ack"] = ack_;
-  json["msgs"] = Json::Value(Json::arrayValue);
-  Json::Value& msgs = json["msgs"];
+  msg_queue_.swap(queue);
+  head_ = 0;
+  tail_ = len;
+  Account(static_cast<int64>(capacity - size) *
+          sizeof(pair<int64, StringPtr>), 0);
+}
 
+void InMemoryUserData::SetChannelCursor(const string& cid, int64 cursor) {
+  auto iter = channels_.find(cid);
+  if (iter != channels_.end()) {
+    iter->second = cursor;
+  }
+}
+
+bool InMemoryUserData::Snap(Image* image) const {
+  image->cursors.clear();
+  for (auto& channel : channels_) {
+    if (channel.second > 0) {
+      image->cursors.push_back(channel);
+    }
+  }
+  if (tail_seq_ == 0 && image->cursors.empty()) {
+    return false;
+  }
   int start_pos;
   int len;
   GetQueueInfo(start_pos, len);
-  if (len <= 0) {
-    return true;
+  const int size = msg_queue_.size();
+  image->tail_seq = tail_seq_;
+  image->ack = ack_;
+  image->msgs.clear();
+  // only the unacked messages, with their seqs
+  for (int i = 0; i < len; ++i) {
+    const pair<int64, StringPtr>& msg = msg_queue_[(start_pos + i) % size];
+    if (msg.second.get() != NULL) {
+      Image::Slot slot = {tail_seq_ - len + 1 + i, msg.first, msg.second};
+      image->msgs.push_back(slot);
+    }
   }
-  int size = msg_queue_.size();
-  int64 now = Now();
-  int end = tail_;
-  if (tail_ < start_pos) {
-    end = size;
+  return true;
+}
+
+void InMemoryUserData::Encode(const Image& image, string* out) {
+  // the messages expired since the image was taken are left out
+  const int64 now = Now();
+  auto alive = [now](const Image::Slot& slot) {
+    return slot.expired <= 0 || now < slot.expired;
+  };
+  int number = 0;
+  for (auto& slot : image.msgs) {
+    if (alive(slot)) {
+      ++number;
+    }
+  }
+  RecordWriter writer(out);
+  writer.Put(image.tail_seq).Put(image.ack).Put(image.cursors.size());
+  for (auto& cursor : image.cursors) {
+    writer.Put(cursor.first).Put(cursor.second);
   }
-  for (int i = start_pos; i < end; ++i) {
-    if (IsMsgOK(now, msg_queue_[i])) {
-      Json::Value msg;
-      msg["i"] = i;
-      msg["t"] = static_cast<Json::Int64>(msg_queue_[i].first);
-      msg["b"] = *(msg_queue_[i].second);
-      msgs.append(msg);
+  writer.Put(number);
+  for (auto& slot : image.msgs) {
+    if (alive(slot)) {
+      writer.Put(slot.seq).Put(slot.expired).Put(*slot.body);
     }
   }
-  if (start_pos > tail_) {
-    for (int i = 0; i < tail_; ++i) {
-      if (IsMsgOK(now, msg_queue_[i])) {
-        Json::Value msg;
-        msg["i"] = i;
-        msg["t"] = static_cast<Json::Int64>(msg_queue_[i].first);
-        msg["b"] = *(msg_queue_[i].second);
-        msgs.append(msg);
-      }
+}
+
+bool InMemoryUserData::Decode(const char* data,
+                              size_t size,
+                              int64* next_expired) {
+  RecordReader reader(data, size);
+  int64 tail_seq = 0;
+  int64 ack = 0;
+  int64 cursors = 0;
+  int64 number = 0;
+  if (!(reader.Get(&tail_seq) && reader.Get(&ack) && reader.Get(&cursors))) {
+    return false;
+  }
+  // the memberships of the cursors are loaded with the channels, none of
+  // them is kept without the timeline
+  for (int64 i = 0; i < cursors; ++i) {
+    string cid;
+    int64 cursor = 0;
+    if (!(reader.Get(&cid) && reader.Get(&cursor))) {
+      return false;
+    }
+    if (FLAGS_channel_timeline) {
+      channels_[cid] = cursor;
     }
   }
-  return true;
+  if (!reader.Get(&number)) {
+    return false;
+  }
+  // only the unacked seqs get a slot, the oldest ones are dropped if the
+  // limit was lowered since the snapshot
+  tail_seq_ = tail_seq;
+  head_seq_ = std::max<int64>(ack, tail_seq - FLAGS_max_offline_msg_num);
+  head_seq_ = std::max(std::min(head_seq_, tail_seq_), 0);
+  ack_ = std::max<int64>(ack, head_seq_);
+  const int len = tail_seq_ - head_seq_;
+  if (len > 0) {
+    Resize(std::max(len + 1, MIN_RING_CAPACITY));
+    tail_ = len;
+  }
+  *next_expired = 0;
+  for (int64 i = 0; i < number; ++i) {
+    int64 seq = 0;
+    int64 expired = 0;
+    StringPtr body(new string());
+    if (!(reader.Get(&seq) && reader.Get(&expired) &&
+          reader.Get(body.get()))) {
+      return false;
+    }
+    if (seq <= head_seq_ || seq > tail_seq_) {
+      continue;
+    }
+    SetSlot(seq - head_seq_ - 1, expired, body);
+    if (expired > 0 && (*next_expired == 0 || expired < *next_expired)) {
+      *next_expired = expired;
+    }
+  }
+  return reader.Done();
 }
 
-void InMemoryUserData::Load(const Json::Value& json) {
+void InMemoryUserData::Load(const Json::Value& json, TimingWheel* wheel) {
   CHECK(json.isMember("head"));
   CHECK(json.isMember("head_seq"));
   CHECK(json.isMember("tail"));
   CHECK(json.isMember("tail_seq"));
   CHECK(json.isMember("ack"));
   CHECK(json.isMember("msgs"));
+  // the slots of these dumps are the indexes of a full sized ring
+  Resize(FLAGS_max_offline_msg_num + 1);
   head_ = json["head"].asInt();
   head_seq_ = json["head_seq"].asInt();
   tail_ = json["tail"].asInt();
@@ -97,22 +332,34 @@ void InMemoryUserData::Load(const Json::Value& json) {
     CHECK(msg.isMember("b"));
     int64 expired_time = msg["t"].asInt64();
     int index = msg["i"].asInt();
+    CHECK(index >= 0 && index < static_cast<int>(msg_queue_.size()));
     StringPtr data(new string());
     *data = msg["b"].asString();
-    msg_queue_[index] = make_pair(expired_time, data);
+    SetSlot(index, expired_time, data);
+    if (expired_time > 0) {
+      ScheduleExpire(expired_time, wheel);
+    }
   }
 }
 
-void InMemoryUserData::AddMessage(const StringPtr& msg, int64 ttl) {
+void InMemoryUserData::AddMessage(const StringPtr& msg,
+                                  int64 expired,
+                                  TimingWheel* wheel) {
+  CHECK(FLAGS_max_offline_msg_num > 0);
+  const int max_capacity = FLAGS_max_offline_msg_num + 1;
+  int size = msg_queue_.size();
+  // grows before the ring is full, a full ring drops its oldest message
+  if (size < max_capacity && (size == 0 || (tail_ + 1) % size == head_)) {
+    Resize(std::min(std::max(size * 2, MIN_RING_CAPACITY), max_capacity));
+    size = msg_queue_.size();
+  }
   ++tail_seq_;
   VLOG(6) << "tail_seq=" << tail_seq_ << ", tail=" << tail_;
-  if (ttl <= 0) {
-    msg_queue_[tail_] = make_pair(0, msg);
-  } else {
-    int64 expired = Now() + ttl;
-    msg_queue_[tail_] = make_pair(expired, msg);
+  SetSlot(tail_, expired, msg);
+  if (expired > 0) {
+    ScheduleExpire(expired, wheel);
   }
-  if (++tail_ == msg_queue_.size()) {
+  if (++tail_ == size) {
     tail_ = 0;
   }
   if (tail_ == head_) {
@@ -120,15 +367,36 @@ void InMemoryUserData::AddMessage(const StringPtr& msg, int64 ttl) {
     if (ack_ < head_seq_) {
       ack_ = head_seq_;
     }
-    if (++head_ == msg_queue_.size()) {
+    SetSlot(head_, 0, StringPtr());
+    if (++head_ == size) {
+      head_ = 0;
+    }
+  }
+}
+
+// the acked messages are never read again, they are released at once
+void InMemoryUserData::SetAck(int ack) {
+  ack_ = ack;
+  const int size = msg_queue_.size();
+  while (head_ != tail_ && head_seq_ < ack_) {
+    SetSlot(head_, 0, StringPtr());
+    if (++head_ == size) {
       head_ = 0;
     }
+    ++head_seq_;
+  }
+  if (head_ == tail_ && size > 0) {
+    Resize(0);
   }
 }
 
-void InMemoryUserData::GetQueueInfo(int& start_pos, int& len) {
+void InMemoryUserData::GetQueueInfo(int& start_pos, int& len) const {
   int size = msg_queue_.size();
-  CHECK(size > 0);
+  if (size == 0) {
+    start_pos = 0;
+    len = 0;
+    return;
+  }
   start_pos = head_;
   VLOG(6) << "start_pos=" << start_pos;
   if (ack_ > head_seq_) {
@@ -139,6 +407,41 @@ void InMemoryUserData::GetQueueInfo(int& start_pos, int& len) {
   VLOG(6) << "tail=" << tail_ << ", msg queue len=" << len;
 }
 
+// one timer per user, set to the earliest expire time in the queue
+void InMemoryUserData::ScheduleExpire(int64 expired, TimingWheel* wheel) {
+  if (wheel == NULL) {
+    return;
+  }
+  wheel_ = wheel;
+  int64 deadline = expired * 1000;
+  if (!expire_timer_.IsScheduled() ||
+      deadline < expire_timer_.Deadline()) {
+    wheel_->Schedule(&expire_timer_, deadline);
+  }
+}
+
+void InMemoryUserData::ExpireMessages() {
+  int64 now = Now();
+  int64 next = 0;
+  int expired_number = 0;
+  for (size_t i = 0; i < msg_queue_.size(); ++i) {
+    pair<int64, StringPtr>& msg = msg_queue_[i];
+    if (msg.first <= 0 || msg.second.get() == NULL) {
+      continue;
+    }
+    if (now >= msg.first) {
+      SetSlot(i, 0, StringPtr());
+      ++expired_number;
+    } else if (next == 0 || msg.first < next) {
+      next = msg.first;
+    }
+  }
+  VLOG(6) << expired_number << " offline messages expired";
+  if (next > 0) {
+    ScheduleExpire(next, wheel_);
+  }
+}
+
 bool InMemoryUserData::IsMsgOK(int64 now, const pair<int64, StringPtr>& msg) {
   return (msg.first <= 0 || now < msg.first) && msg.second.get() != NULL;
 }
@@ -152,7 +455,7 @@ MessageDataSet InMemoryUserData::GetMessages() {
   int len;
   GetQueueInfo(start_pos, len);
   if (len > 0) {
-    result.reset(new vector<string>());
+    result.reset(new vector<StringPtr>());
     result->reserve(len);
     int size = msg_queue_.size();
     int64 now = Now();
@@ -162,13 +465,13 @@ MessageDataSet InMemoryUserData::GetMessages() {
     }
     for (int i = start_pos; i < end; ++i) {
       if (IsMsgOK(now, msg_queue_[i])) {
-        result->push_back(*(msg_queue_[i].second));
+        result->push_back(msg_queue_[i].second);
       }
     }
     if (start_pos > tail_) {
       for (int i = 0; i < tail_; ++i) {
         if (IsMsgOK(now, msg_queue_[i])) {
-          result->push_back(*(msg_queue_[i].second));
+          result->push_back(msg_queue_[i].second);
         }
       }
     }
@@ -176,14 +479,149 @@ MessageDataSet InMemoryUserData::GetMessages() {
   return result;
 }
 
-InMemoryStorage::InMemoryStorage() {
+void InMemoryChannelTimeline::AddMessage(const StringPtr& msg,
+                                         int64 ts,
+                                         int64 expired) {
+  Item item;
+  item.ts = ts;
+  item.expired = expired;
+  item.body = msg;
+  // the publish times come from several nodes, keep the timeline ordered
+  auto pos = items_.end();
+  while (pos != items_.begin() && (pos - 1)->ts > ts) {
+    --pos;
+  }
+  items_.insert(pos, item);
+  Trim(Now());
+}
+
+void InMemoryChannelTimeline::Trim(int64 now) {
+  CHECK(FLAGS_max_channel_timeline_num > 0);
+  while (items_.size() >
+         static_cast<size_t>(FLAGS_max_channel_timeline_num)) {
+    items_.pop_front();
+  }
+  while (!items_.empty() &&
+         items_.front().expired > 0 &&
+         now >= items_.front().expired) {
+    items_.pop_front();
+  }
+}
+
+void InMemoryChannelTimeline::GetMessagesAfter(int64 cursor,
+                                               vector<Entry>* entries) {
+  int64 now = Now();
+  Trim(now);
+  auto it = items_.end();
+  while (it != items_.begin() && (it - 1)->ts > cursor) {
+    --it;
+  }
+  for (; it != items_.end(); ++it) {
+    if (it->expired <= 0 || now < it->expired) {
+      entries->push_back(make_pair(it->ts, it->body));
+    }
+  }
+}
+
+bool InMemoryChannelTimeline::Encode(string* out) {
+  Trim(Now());
+  if (items_.empty()) {
+    return false;
+  }
+  RecordWriter writer(out);
+  writer.Put(items_.size());
+  for (auto& item : items_) {
+    writer.Put(item.ts).Put(item.expired).Put(*item.body);
+  }
+  return true;
+}
+
+bool InMemoryChannelTimeline::Decode(const char* data, size_t size) {
+  RecordReader reader(data, size);
+  int64 number = 0;
+  if (!reader.Get(&number)) {
+    return false;
+  }
+  for (int64 i = 0; i < number; ++i) {
+    Item item;
+    item.body.reset(new string());
+    if (!(reader.Get(&item.ts) && reader.Get(&item.expired) &&
+          reader.Get(item.body.get()))) {
+      return false;
+    }
+    items_.push_back(item);
+  }
+  Trim(Now());
+  return reader.Done();
+}
+
+void InMemoryChannelTimeline::Load(const Json::Value& json) {
+  CHECK(json.type() == Json::arrayValue);
+  for (Json::ArrayIndex i = 0; i < json.size(); ++i) {
+    const Json::Value& msg = json[i];
+    CHECK(msg.isMember("ts"));
+    CHECK(msg.isMember("t"));
+    CHECK(msg.isMember("b"));
+    Item item;
+    item.ts = msg["ts"].asInt64();
+    item.expired = msg["t"].asInt64();
+    item.body.reset(new string(msg["b"].asString()));
+    items_.push_back(item);
+  }
+  Trim(Now());
+}
+
+// The buckets of the maps are scanned in order, an entry is taken by the
+// scan or, if it's updated before its bucket is reached, by the update.
+// The maps aren't expected to rehash meanwhile, which would move the
+// buckets, but the load factor is only a hint so the bucket counts are
+// checked and a rehashed scan is restarted.
+struct InMemoryStorage::SnapshotScan {
+  shared_ptr<SnapshotData> data;
+  // the next bucket to scan
+  size_t user_bucket;
+  size_t channel_bucket;
+  size_t timeline_bucket;
+  // the bucket counts at the start
+  size_t user_buckets;
+  size_t channel_buckets;
+  size_t timeline_buckets;
+  // taken before being updated, or created after the rotation
+  unordered_set<string> users;
+  unordered_set<string> channels;
+  unordered_set<string> timelines;
+  float user_load_factor;
+  float channel_load_factor;
+  float timeline_load_factor;
+};
+
+// high enough to never be reached by the entries added during a snapshot
+static const float SCAN_LOAD_FACTOR = 1e6;
+
+InMemoryStorage::InMemoryStorage(TimingWheel* timer_wheel)
+    : timer_wheel_(timer_wheel),
+      snapshot_writing_(false) {
   Load();
+  snapshot_timer_.SetCallback([this]() {
+    Snapshot(true);
+    ScheduleSnapshot();
+  });
+  scan_timer_.SetCallback([this]() {
+    ScanSnapshot(true);
+  });
+  ScheduleSnapshot();
 }
 
 InMemoryStorage::~InMemoryStorage() {
   Dump();
 }
 
+void InMemoryStorage::FlushLog() {
+  if (wal_.get() != NULL) {
+    wal_->Flush();
+  }
+}
+
 static string CurrentTime() {
   Time::Exploded time;
   Time::Now().LocalExplode(&time);
@@ -197,56 +635,501 @@ static string CurrentTime() {
 
 }
 
+static const char TMP_SUFFIX[] = ".tmp";
+
+static bool IsTmpDir(const string& dir) {
+  const size_t len = sizeof(TMP_SUFFIX) - 1;
+  return dir.size() >= len &&
+         dir.compare(dir.size() - len, len, TMP_SUFFIX) == 0;
+}
+
+// the complete snapshots, oldest first
+static vector<string> SnapshotDirs() {
+  vector<string> dirs;
+  vector<string> all;
+  if (!File::IsDir(FLAGS_inmemory_data_dir) ||
+      !File::GetDirsInDir(FLAGS_inmemory_data_dir, &all)) {
+    return dirs;
+  }
+  for (size_t i = 0; i < all.size(); ++i) {
+    if (!IsTmpDir(all[i])) {
+      dirs.push_back(all[i]);
+    }
+  }
+  std::sort(dirs.begin(), dirs.end());
+  return dirs;
+}
+
+static void SyncPath(const string& path) {
+  if (!FLAGS_inmemory_wal_sync) {
+    return;
+  }
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0 || ::fsync(fd) != 0) {
+    LOG(ERROR) << "sync failed: " << path << ", " << strerror(errno);
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+static void WriteSnapshotFile(const string& dir,
+                              const string& name,
+                              const string& content) {
+  string path = File::JoinPath(dir, name);
+  CHECK(File::WriteStringToFile(content, path)) << "write failed: " << path;
+  SyncPath(path);
+}
+
+static string UserShardName(int shard) {
+  return "user." + std::to_string(shard);
+}
+
+// runs fn(0) .. fn(number - 1) on their own threads and waits for them
+static void RunParallel(int number, function<void (int)> fn) {
+  vector<std::thread> threads;
+  for (int i = 0; i < number; ++i) {
+    threads.push_back(std::thread(fn, i));
+  }
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+}
+
+// A read only view of a whole file, the pages are read on demand and
+// dropped once used instead of being copied into the heap
+class MappedFile {
+ public:
+  explicit MappedFile(const string& path) : data_(NULL), size_(0) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    CHECK(fd >= 0) << "open failed: " << path << ", " << strerror(errno);
+    struct stat st;
+    CHECK(::fstat(fd, &st) == 0) << "stat failed: " << path;
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void* p = ::mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      CHECK(p != MAP_FAILED)
+          << "mmap failed: " << path << ", " << strerror(errno);
+      ::madvise(p, size_, MADV_SEQUENTIAL);
+      data_ = static_cast<const char*>(p);
+    }
+    ::close(fd);
+  }
+  ~MappedFile() {
+    if (data_ != NULL) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+  }
+  const char* Data() const {
+    return data_;
+  }
+  size_t Size() const {
+    return size_;
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedFile);
+};
+
+void InMemoryStorage::ScheduleSnapshot() {
+  if (timer_wheel_ == NULL || FLAGS_inmemory_snapshot_interval_sec <= 0) {
+    return;
+  }
+  timer_wheel_->Schedule(&snapshot_timer_, timer_wheel_->Now() +
+      FLAGS_inmemory_snapshot_interval_sec * 1000LL);
+}
+
+// the last snapshot, taken at exit
 void InMemoryStorage::Dump() {
   LOG(INFO) << "InMemoryStorage::Dump ...";
-  string dir = File::JoinPath(FLAGS_inmemory_data_dir, CurrentTime());
-  if (!File::IsDir(dir)) {
-    File::RecursivelyCreateDir(dir, 0777);
+  snapshot_timer_.Cancel();
+  scan_timer_.Cancel();
+  if (scan_.get() != NULL) {
+    ScanSnapshot(false);
+  }
+  if (snapshot_writer_.joinable()) {
+    snapshot_writer_.join();
   }
+  Snapshot(false);
+  snapshot_writer_.join();
+  wal_.reset();
+}
 
-  Json::FastWriter writer;
-  string user_file = File::JoinPath(dir, "user");
-  for (auto& i : user_data_) {
-    Json::Value v;
-    v["name"] = i.first;
-    if (i.second.Dump(v["imud"])) {
-      File::AppendStringToFile(writer.write(v), user_file);
+void InMemoryStorage::Snapshot(bool in_slices) {
+  if (scan_.get() != NULL || snapshot_writing_) {
+    LOG(WARNING) << "the previous snapshot isn't written yet, skipped";
+    return;
+  }
+  if (snapshot_writer_.joinable()) {
+    snapshot_writer_.join();
+  }
+  // the updates after it go to a new segment, which isn't covered by the
+  // snapshot and is replayed after it
+  int64 segment = wal_.get() != NULL ? wal_->Rotate() : 0;
+  scan_.reset(new SnapshotScan());
+  SnapshotData* data = new SnapshotData();
+  scan_->data.reset(data);
+  data->dir = File::JoinPath(FLAGS_inmemory_data_dir,
+      StringPrintf("%s.%06lld", CurrentTime().c_str(),
+                   static_cast<long long>(segment)));
+  data->segment = segment;
+  data->users.resize(std::max(FLAGS_inmemory_snapshot_shards, 1));
+  scan_->user_bucket = 0;
+  scan_->channel_bucket = 0;
+  scan_->timeline_bucket = 0;
+  scan_->user_load_factor = user_data_.max_load_factor();
+  scan_->channel_load_factor = channel_map_.max_load_factor();
+  scan_->timeline_load_factor = timelines_.max_load_factor();
+  user_data_.max_load_factor(SCAN_LOAD_FACTOR);
+  channel_map_.max_load_factor(SCAN_LOAD_FACTOR);
+  timelines_.max_load_factor(SCAN_LOAD_FACTOR);
+  scan_->user_buckets = user_data_.bucket_count();
+  scan_->channel_buckets = channel_map_.bucket_count();
+  scan_->timeline_buckets = timelines_.bucket_count();
+  ScanSnapshot(in_slices && timer_wheel_ != NULL);
+}
+
+// takes the entries of the buckets from |*bucket| on which weren't taken
+// before, returns false if |deadline| passed first
+template <typename Map, typename Take>
+static bool ScanBuckets(const Map& map,
+                        const unordered_set<string>& taken,
+                        int64 deadline,
+                        size_t* bucket,
+                        Take take) {
+  while (*bucket < map.bucket_count()) {
+    for (auto it = map.begin(*bucket); it != map.end(*bucket); ++it) {
+      if (taken.count(it->first) == 0) {
+        take(it->first, it->second);
+      }
+    }
+    ++*bucket;
+    if (base::GetTimeInUsec() >= deadline) {
+      return *bucket == map.bucket_count();
     }
   }
+  return true;
+}
 
-  string channel_file = File::JoinPath(dir, "channel");
-  for (auto& i : channel_map_) {
-    Json::Value channel;
-    channel["name"] = i.first;
-    channel["users"] = Json::Value(Json::arrayValue);
-    Json::Value& users = channel["users"];
-    for (auto& j : i.second) {
-      users.append(j);
+void InMemoryStorage::ScanSnapshot(bool in_slices) {
+  const int64 deadline = in_slices ?
+      base::GetTimeInUsec() + FLAGS_inmemory_snapshot_slice_usec : kint64max;
+  SnapshotScan* scan = scan_.get();
+  if (user_data_.bucket_count() != scan->user_buckets ||
+      channel_map_.bucket_count() != scan->channel_buckets ||
+      timelines_.bucket_count() != scan->timeline_buckets) {
+    // no segment is removed before a snapshot is written, so the new one
+    // simply covers the segment of this one too
+    LOG(WARNING) << "rehashed during the snapshot scan, restarted";
+    RestoreLoadFactors();
+    scan_.reset();
+    Snapshot(in_slices);
+    return;
+  }
+  if (!(ScanBuckets(user_data_, scan->users, deadline, &scan->user_bucket,
+            [this](const string& uid, const InMemoryUserData& user) {
+          TakeUser(uid, user);
+        }) &&
+        ScanBuckets(channel_map_, scan->channels, deadline,
+            &scan->channel_bucket,
+            [this](const string& cid, const IdSet& members) {
+          TakeChannel(cid, members);
+        }) &&
+        ScanBuckets(timelines_, scan->timelines, deadline,
+            &scan->timeline_bucket,
+            [this](const string& cid, const InMemoryChannelTimeline& line) {
+          TakeTimeline(cid, line);
+        }))) {
+    timer_wheel_->Schedule(&scan_timer_,
+                           timer_wheel_->Now() + timer_wheel_->TickMs());
+    return;
+  }
+  FinishSnapshot();
+}
+
+void InMemoryStorage::RestoreLoadFactors() {
+  user_data_.max_load_factor(scan_->user_load_factor);
+  channel_map_.max_load_factor(scan_->channel_load_factor);
+  timelines_.max_load_factor(scan_->timeline_load_factor);
+}
+
+void InMemoryStorage::FinishSnapshot() {
+  RestoreLoadFactors();
+  shared_ptr<SnapshotData> data = scan_->data;
+  scan_.reset();
+  snapshot_writing_ = true;
+  snapshot_writer_ = std::thread([data, this]() {
+    WriteSnapshot(data.get());
+    snapshot_writing_ = false;
+  });
+}
+
+// the state of |key| at the rotation is taken before it's updated, unless
+// its bucket was scanned already or it was taken before, nothing is taken
+// once |map| rehashed since the scan will be restarted
+template <typename Map, typename Take>
+static void SnapEntry(const Map& map,
+                      size_t buckets,
+                      size_t scanned,
+                      unordered_set<string>* taken,
+                      const string& key,
+                      Take take) {
+  if (map.bucket_count() != buckets || map.bucket(key) < scanned ||
+      !taken->insert(key).second) {
+    return;
+  }
+  auto it = map.find(key);
+  if (it != map.end()) {
+    take(it->first, it->second);
+  }
+}
+
+void InMemoryStorage::SnapUser(const string& uid) {
+  if (scan_.get() != NULL) {
+    SnapEntry(user_data_, scan_->user_buckets, scan_->user_bucket,
+              &scan_->users, uid,
+              [this](const string& uid, const InMemoryUserData& user) {
+      TakeUser(uid, user);
+    });
+  }
+}
+
+void InMemoryStorage::SnapChannel(const string& cid) {
+  if (scan_.get() != NULL) {
+    SnapEntry(channel_map_, scan_->channel_buckets, scan_->channel_bucket,
+              &scan_->channels, cid,
+              [this](const string& cid, const IdSet& members) {
+      TakeChannel(cid, members);
+    });
+  }
+}
+
+void InMemoryStorage::SnapTimeline(const string& cid) {
+  if (scan_.get() != NULL) {
+    SnapEntry(timelines_, scan_->timeline_buckets, scan_->timeline_bucket,
+              &scan_->timelines, cid,
+              [this](const string& cid, const InMemoryChannelTimeline& line) {
+      TakeTimeline(cid, line);
+    });
+  }
+}
+
+void InMemoryStorage::TakeUser(const string& uid,
+                               const InMemoryUserData& user) {
+  SnapshotData* data = scan_->data.get();
+  auto& shard = data->users[user_data_.bucket(uid) % data->users.size()];
+  shard.push_back(make_pair(uid, InMemoryUserData::Image()));
+  if (!user.Snap(&shard.back().second)) {
+    shard.pop_back();
+  }
+}
+
+void InMemoryStorage::TakeChannel(const string& cid, const IdSet& members) {
+  const UidTable& table = UidTable::Instance();
+  RecordWriter writer(&scan_->data->channel);
+  writer.Put(cid).Put(members.Size());
+  members.ForEach([&writer, &table](uint32 id) {
+    writer.Put(table.Uid(id));
+  });
+}
+
+void InMemoryStorage::TakeTimeline(const string& cid,
+                                   const InMemoryChannelTimeline& line) {
+  scan_->data->timelines.push_back(make_pair(cid, line));
+}
+
+// runs in the snapshot writer, a snapshot only becomes visible once it's
+// complete, then the segments before its segment are no longer needed
+void InMemoryStorage::WriteSnapshot(SnapshotData* data) {
+  const string& dir = data->dir;
+  string tmp_dir = dir + TMP_SUFFIX;
+  File::DeleteRecursively(tmp_dir);
+  CHECK(File::RecursivelyCreateDir(tmp_dir, 0777)) << tmp_dir;
+  RunParallel(data->users.size(), [&tmp_dir, data](int shard) {
+    string out;
+    string body;
+    for (auto& user : data->users[shard]) {
+      body.clear();
+      InMemoryUserData::Encode(user.second, &body);
+      RecordWriter(&out).Put(user.first).Put(body);
     }
-    File::AppendStringToFile(writer.write(channel), channel_file);
+    WriteSnapshotFile(tmp_dir, UserShardName(shard), out);
+  });
+  string timeline;
+  string body;
+  for (auto& i : data->timelines) {
+    body.clear();
+    if (i.second.Encode(&body)) {
+      RecordWriter(&timeline).Put(i.first).Put(body);
+    }
+  }
+  WriteSnapshotFile(tmp_dir, "shards", std::to_string(data->users.size()));
+  WriteSnapshotFile(tmp_dir, "channel", data->channel);
+  WriteSnapshotFile(tmp_dir, "timeline", timeline);
+  // the first segment to replay after the snapshot, 0 without the log
+  WriteSnapshotFile(tmp_dir, "wal", std::to_string(data->segment));
+  File::DeleteRecursively(dir);
+  CHECK(::rename(tmp_dir.c_str(), dir.c_str()) == 0)
+      << "rename snapshot failed: " << dir << ", " << strerror(errno);
+  SyncPath(FLAGS_inmemory_data_dir);
+  LOG(INFO) << "inmemory snapshot written: " << dir;
+
+  if (data->segment > 0) {
+    WriteAheadLog::RemoveSegments(FLAGS_inmemory_data_dir, data->segment);
+  }
+  vector<string> dirs = SnapshotDirs();
+  const size_t keep = std::max(FLAGS_inmemory_snapshot_keep, 1);
+  for (size_t i = 0; i + keep < dirs.size(); ++i) {
+    File::DeleteRecursively(dirs[i]);
   }
 }
 
 void InMemoryStorage::Load() {
   LOG(INFO) << "InMemoryStorage::Load ...";
-  if (!File::IsDir(FLAGS_inmemory_data_dir)) {
-    LOG(INFO) << "no inmemory dump data";
+  vector<string> data_dirs = SnapshotDirs();
+  LOG(INFO) << data_dirs.size() << " inmemory data dirs";
+  // replays all the segments if there is no snapshot
+  int64 first = 1;
+  if (!data_dirs.empty()) {
+    const string latest_dir = data_dirs[data_dirs.size() - 1];
+    LOG(INFO) << "select the latest inmemory dump data: " << latest_dir;
+    LoadSnapshot(latest_dir);
+    // the dumps written without the log are not followed by any segment
+    string wal_file = File::JoinPath(latest_dir, "wal");
+    string wal;
+    first = 0;
+    if (File::Exists(wal_file) && File::ReadFileToString(wal_file, &wal)) {
+      first = ::strtoll(wal.c_str(), NULL, 10);
+    }
+  }
+  if (!FLAGS_inmemory_wal) {
     return;
   }
-  vector<string> data_dirs;
-  CHECK(base::File::GetDirsInDir(FLAGS_inmemory_data_dir, &data_dirs));
-  LOG(INFO) << data_dirs.size() << " inmemory data dirs";
-  if (data_dirs.empty()) {
+  int64 last = 0;
+  if (first > 0) {
+    last = WriteAheadLog::Replay(FLAGS_inmemory_data_dir, first,
+        bind(&InMemoryStorage::Replay, this, _1));
+  } else {
+    WriteAheadLog::RemoveSegments(FLAGS_inmemory_data_dir, kint64max);
+  }
+  wal_.reset(new WriteAheadLog(FLAGS_inmemory_data_dir,
+                               FLAGS_inmemory_wal_sync));
+  // never appends to a replayed segment, its tail may be torn
+  wal_->Open(last + 1);
+}
+
+void InMemoryStorage::LoadSnapshot(const string& dir) {
+  string shards_file = File::JoinPath(dir, "shards");
+  string shards;
+  if (!File::Exists(shards_file)) {
+    LoadJsonSnapshot(dir);
     return;
   }
-  std::sort(data_dirs.begin(), data_dirs.end());
-  const string latest_dir = data_dirs[data_dirs.size() - 1];
-  LOG(INFO) << "select the latest inmemory dump data: " << latest_dir;
+  CHECK(File::ReadFileToString(shards_file, &shards)) << shards_file;
+  int64 start = base::GetTimeInMs();
+  LoadUsers(dir, ::atoi(shards.c_str()));
+  LoadChannels(File::JoinPath(dir, "channel"));
+  LoadTimelines(File::JoinPath(dir, "timeline"));
+  LOG(INFO) << user_data_.size() << " users, " << channel_map_.size()
+            << " channels loaded in " << base::GetTimeInMs() - start << "ms";
+}
+
+// The shards are parsed in parallel, only the map insertions are made on
+// this thread, then the users are decoded in parallel in place
+void InMemoryStorage::LoadUsers(const string& dir, int shards) {
+  struct UserSlice {
+    string uid;
+    const char* data;
+    size_t size;
+    InMemoryUserData* user;
+    int64 next_expired;
+  };
+  vector<shared_ptr<MappedFile> > files(shards);
+  vector<vector<UserSlice> > slices(shards);
+  RunParallel(shards, [&dir, &files, &slices](int shard) {
+    string path = File::JoinPath(dir, UserShardName(shard));
+    files[shard].reset(new MappedFile(path));
+    RecordReader reader(files[shard]->Data(), files[shard]->Size());
+    while (!reader.Done()) {
+      UserSlice slice;
+      CHECK(reader.Get(&slice.uid) && reader.Get(&slice.data, &slice.size))
+          << "corrupted snapshot: " << path;
+      slices[shard].push_back(slice);
+    }
+  });
+
+  size_t total = user_data_.size();
+  for (int i = 0; i < shards; ++i) {
+    total += slices[i].size();
+  }
+  user_data_.reserve(total);
+  for (int i = 0; i < shards; ++i) {
+    for (auto& slice : slices[i]) {
+      slice.user = &user_data_[slice.uid];
+    }
+  }
+
+  RunParallel(shards, [&slices](int shard) {
+    for (auto& slice : slices[shard]) {
+      CHECK(slice.user->Decode(slice.data, slice.size, &slice.next_expired))
+          << "corrupted snapshot of " << slice.uid;
+    }
+  });
+  // the timer wheel and the usage are not thread safe
+  for (int i = 0; i < shards; ++i) {
+    for (auto& slice : slices[i]) {
+      slice.user->SetUsage(&usage_);
+      if (slice.next_expired > 0) {
+        slice.user->ScheduleExpire(slice.next_expired, timer_wheel_);
+      }
+    }
+  }
+}
+
+void InMemoryStorage::LoadChannels(const string& path) {
+  MappedFile file(path);
+  RecordReader reader(file.Data(), file.Size());
+  UidTable& table = UidTable::Instance();
+  string cid;
+  string uid;
+  while (!reader.Done()) {
+    int64 number = 0;
+    CHECK(reader.Get(&cid) && reader.Get(&number))
+        << "corrupted snapshot: " << path;
+    IdSet& members = channel_map_[cid];
+    for (int64 i = 0; i < number; ++i) {
+      CHECK(reader.Get(&uid)) << "corrupted snapshot: " << path;
+      members.Insert(table.Intern(uid));
+      if (FLAGS_channel_timeline) {
+        MutableUser(uid).AddChannel(cid);
+      }
+    }
+  }
+}
+
+void InMemoryStorage::LoadTimelines(const string& path) {
+  MappedFile file(path);
+  RecordReader reader(file.Data(), file.Size());
+  string cid;
+  while (!reader.Done()) {
+    const char* data = NULL;
+    size_t size = 0;
+    CHECK(reader.Get(&cid) && reader.Get(&data, &size) &&
+          timelines_[cid].Decode(data, size))
+        << "corrupted snapshot: " << path;
+  }
+}
+
+// the dumps written before the binary snapshots
+void InMemoryStorage::LoadJsonSnapshot(const string& dir) {
   Json::Reader parser;
   ifstream reader;
   string line;
 
-  string user_file = File::JoinPath(latest_dir, "user");
+  string user_file = File::JoinPath(dir, "user");
   if (File::Exists(user_file)) {
     reader.open(user_file.c_str(), ifstream::in);
     CHECK(reader.is_open());
@@ -256,13 +1139,12 @@ void InMemoryStorage::Load() {
       CHECK(json.isMember("name"));
       CHECK(json.isMember("imud"));
       const string& name = json["name"].asString();
-      auto it = user_data_.insert(make_pair(name, InMemoryUserData()));
-      it.first->second.Load(json["imud"]);
+      MutableUser(name).Load(json["imud"], timer_wheel_);
     }
     reader.close();
   }
 
-  string channel_file = File::JoinPath(latest_dir, "channel");
+  string channel_file = File::JoinPath(dir, "channel");
   if (File::Exists(channel_file)) {
     reader.open(channel_file.c_str(), ifstream::in);
     CHECK(reader.is_open());
@@ -272,13 +1154,165 @@ void InMemoryStorage::Load() {
       CHECK(json.isMember("name"));
       CHECK(json.isMember("users"));
       const string& name = json["name"].asString();
-      auto it = channel_map_.insert(make_pair(name, unordered_set<string>()));
+      IdSet& members = channel_map_[name];
       const Json::Value& users = json["users"];
       CHECK(users.type() == Json::arrayValue);
+      UidTable& table = UidTable::Instance();
       for (Json::ArrayIndex i = 0; i < users.size(); ++i) {
-        it.first->second.insert(users[i].asString());
+        const string& uid = users[i].asString();
+        members.Insert(table.Intern(uid));
+        if (FLAGS_channel_timeline) {
+          MutableUser(uid).AddChannel(name);
+        }
       }
     }
+    reader.close();
+  }
+
+  string timeline_file = File::JoinPath(dir, "timeline");
+  if (File::Exists(timeline_file)) {
+    reader.open(timeline_file.c_str(), ifstream::in);
+    CHECK(reader.is_open());
+    while (getline(reader, line)) {
+      Json::Value json;
+      CHECK(parser.parse(line, json));
+      CHECK(json.isMember("name"));
+      CHECK(json.isMember("msgs"));
+      timelines_[json["name"].asString()].Load(json["msgs"]);
+    }
+    reader.close();
+  }
+}
+
+void InMemoryStorage::Log(const string& record) {
+  if (wal_.get() != NULL) {
+    wal_->Append(record);
+  }
+}
+
+void InMemoryStorage::Log(const vector<string>& records) {
+  if (wal_.get() != NULL) {
+    wal_->Append(records);
+  }
+}
+
+void InMemoryStorage::Replay(const string& record) {
+  RecordReader reader(record);
+  int64 type = 0;
+  int64 value = 0;
+  int64 expired = 0;
+  string uid;
+  string cid;
+  StringPtr body(new string());
+  bool ok = false;
+  if (reader.Get(&type)) {
+    switch (type) {
+      case WAL_SAVE_MESSAGE:
+        ok = reader.Get(&uid) && reader.Get(&expired) &&
+             reader.Get(body.get());
+        if (ok) {
+          MutableUser(uid).AddMessage(body, expired, timer_wheel_);
+        }
+        break;
+      case WAL_UPDATE_ACK:
+        ok = reader.Get(&uid) && reader.Get(&value);
+        if (ok) {
+          SetAck(uid, value);
+        }
+        break;
+      case WAL_ADD_USER_TO_CHANNEL:
+        ok = reader.Get(&uid) && reader.Get(&cid);
+        if (ok) {
+          AddMember(uid, cid);
+        }
+        break;
+      case WAL_REMOVE_USER_FROM_CHANNEL:
+        ok = reader.Get(&uid) && reader.Get(&cid);
+        if (ok) {
+          RemoveMember(uid, cid);
+        }
+        break;
+      case WAL_SAVE_CHANNEL_MESSAGE:
+        ok = reader.Get(&cid) && reader.Get(&value) &&
+             reader.Get(&expired) && reader.Get(body.get());
+        if (ok) {
+          timelines_[cid].AddMessage(body, value, expired);
+        }
+        break;
+      case WAL_UPDATE_CHANNEL_CURSOR:
+        ok = reader.Get(&uid) && reader.Get(&cid) && reader.Get(&value);
+        if (ok) {
+          SetChannelCursor(uid, cid, value);
+        }
+        break;
+    }
+  }
+  LOG_IF(WARNING, !ok) << "bad wal record dropped, type " << type;
+}
+
+InMemoryUserData& InMemoryStorage::MutableUser(const string& uid) {
+  SnapUser(uid);
+  auto iter = user_data_.find(uid);
+  if (iter != user_data_.end()) {
+    return iter->second;
+  }
+  InMemoryUserData& user = user_data_[uid];
+  user.SetUsage(&usage_);
+  return user;
+}
+
+// the users without messages have nothing to ack
+void InMemoryStorage::SetAck(const string& uid, int ack) {
+  auto iter = user_data_.find(uid);
+  if (iter != user_data_.end()) {
+    SnapUser(uid);
+    iter->second.SetAck(ack);
+  }
+}
+
+// the cursor of a channel the user left is dropped
+void InMemoryStorage::SetChannelCursor(const string& uid,
+                                       const string& cid,
+                                       int64 cursor) {
+  auto iter = user_data_.find(uid);
+  if (iter != user_data_.end()) {
+    SnapUser(uid);
+    iter->second.SetChannelCursor(cid, cursor);
+  }
+}
+
+void InMemoryStorage::GetReport(Json::Value& report) const {
+  report["user_number"] = static_cast<Json::UInt64>(user_data_.size());
+  report["message_number"] = static_cast<Json::Int64>(usage_.messages);
+  report["message_bytes"] = static_cast<Json::Int64>(usage_.bytes);
+  // the rings and the bodies, plus the users and the buckets of the map
+  const int64 user_bytes = user_data_.size() *
+      (sizeof(pair<const string, InMemoryUserData>) + 2 * sizeof(void*));
+  report["memory_bytes"] = static_cast<Json::Int64>(usage_.bytes +
+      user_bytes + user_data_.bucket_count() * sizeof(void*));
+  report["channel_number"] = static_cast<Json::UInt64>(channel_map_.size());
+  report["snapshot_running"] = scan_.get() != NULL || snapshot_writing_;
+}
+
+void InMemoryStorage::AddMember(const string& uid, const string& cid) {
+  SnapChannel(cid);
+  channel_map_[cid].Insert(UidTable::Instance().Intern(uid));
+  if (FLAGS_channel_timeline) {
+    MutableUser(uid).AddChannel(cid);
+  }
+}
+
+void InMemoryStorage::RemoveMember(const string& uid, const string& cid) {
+  auto iter = channel_map_.find(cid);
+  uint32 id = 0;
+  if (iter != channel_map_.end() && UidTable::Instance().Find(uid, &id)) {
+    SnapChannel(cid);
+    iter->second.Erase(id);
+  }
+  auto user_iter = user_data_.find(uid);
+  if (user_iter != user_data_.end()) {
+    SnapUser(uid);
+    user_iter->second.RemoveChannel(cid);
   }
 }
 
@@ -294,38 +1328,137 @@ void InMemoryStorage::SaveMessage(const StringPtr& msg,
                                   SaveMessageCallback cb) {
   // inmemory `seq` is not used
   VLOG(6) << "SaveMessage " << uid << ": " << *msg << ", seq=" << seq;
-  user_data_[uid].AddMessage(msg, ttl);
+  // logged with the absolute time so a replay doesn't extend it
+  int64 expired = ExpiredTime(ttl);
+  string record;
+  RecordWriter(&record).Put(WAL_SAVE_MESSAGE).Put(uid).Put(expired).Put(*msg);
+  Log(record);
+  MutableUser(uid).AddMessage(msg, expired, timer_wheel_);
+  Callback(bind(cb, NO_ERROR));
+}
+
+void InMemoryStorage::SaveMessages(const vector<SaveMessageEntry>& entries,
+                                   SaveMessagesCallback cb) {
+  VLOG(6) << "SaveMessages " << entries.size();
+  vector<string> records(entries.size());
+  vector<int64> expired(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const SaveMessageEntry& entry = entries[i];
+    expired[i] = ExpiredTime(entry.ttl);
+    RecordWriter(&records[i]).Put(WAL_SAVE_MESSAGE)
+        .Put(entry.uid).Put(expired[i]).Put(*entry.msg);
+  }
+  // logged before any of them is applied, like the single updates
+  Log(records);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    MutableUser(entries[i].uid).AddMessage(entries[i].msg, expired[i],
+                                           timer_wheel_);
+  }
   Callback(bind(cb, NO_ERROR));
 }
 
-void InMemoryStorage::GetMessage(const string& uid, GetMessageCallback cb) {
-  MessageDataSet msgs = user_data_[uid].GetMessages();
-  Callback(bind(cb, NO_ERROR, msgs));
+void InMemoryStorage::GetOfflineMessage(const string& uid,
+                                        GetOfflineMessageCallback cb) {
+  auto user_iter = user_data_.find(uid);
+  if (user_iter == user_data_.end()) {
+    Callback(bind(cb, NO_ERROR, MessageDataSet(), ChannelCursors()));
+    return;
+  }
+  InMemoryUserData& user = user_iter->second;
+  MessageDataSet msgs = user.GetMessages();
+  vector<InMemoryChannelTimeline::Entry> entries;
+  ChannelCursors cursors;
+  for (auto& channel : user.GetChannels()) {
+    auto iter = timelines_.find(channel.first);
+    if (iter == timelines_.end()) {
+      continue;
+    }
+    const size_t start = entries.size();
+    iter->second.GetMessagesAfter(channel.second, &entries);
+    if (entries.size() > start) {
+      cursors[channel.first] = entries.back().first;
+    }
+  }
+  if (!entries.empty()) {
+    // the channels are merged by the publish time
+    std::stable_sort(entries.begin(), entries.end(),
+        [](const InMemoryChannelTimeline::Entry& a,
+           const InMemoryChannelTimeline::Entry& b) {
+      return a.first < b.first;
+    });
+    if (msgs.get() == NULL) {
+      msgs.reset(new vector<StringPtr>());
+    }
+    msgs->reserve(msgs->size() + entries.size());
+    for (auto& entry : entries) {
+      msgs->push_back(entry.second);
+    }
+  }
+  Callback(bind(cb, NO_ERROR, msgs, cursors));
 }
 
 void InMemoryStorage::GetMaxSeq(const string& uid, GetMaxSeqCallback cb) {
-  int max_seq = user_data_[uid].GetMaxSeq();
+  auto iter = user_data_.find(uid);
+  int max_seq = iter != user_data_.end() ? iter->second.GetMaxSeq() : 0;
   Callback(bind(cb, NO_ERROR, max_seq));
 }
 
 void InMemoryStorage::UpdateAck(const string& uid,
                               int ack_seq,
                               UpdateAckCallback cb) {
-  user_data_[uid].SetAck(ack_seq);
+  string record;
+  RecordWriter(&record).Put(WAL_UPDATE_ACK).Put(uid).Put(ack_seq);
+  Log(record);
+  SetAck(uid, ack_seq);
+  Callback(bind(cb, NO_ERROR));
+}
+
+void InMemoryStorage::UpdateAcks(const vector<pair<string, int> >& acks,
+                               UpdateAcksCallback cb) {
+  vector<string> records(acks.size());
+  for (size_t i = 0; i < acks.size(); ++i) {
+    RecordWriter(&records[i])
+        .Put(WAL_UPDATE_ACK).Put(acks[i].first).Put(acks[i].second);
+  }
+  Log(records);
+  for (size_t i = 0; i < acks.size(); ++i) {
+    SetAck(acks[i].first, acks[i].second);
+  }
   Callback(bind(cb, NO_ERROR));
 }
 
 void InMemoryStorage::AddUserToChannel(const string& uid,
                                        const string& cid,
                                        AddUserToChannelCallback cb) {
-  channel_map_[cid].insert(uid);
+  string record;
+  RecordWriter(&record).Put(WAL_ADD_USER_TO_CHANNEL).Put(uid).Put(cid);
+  Log(record);
+  AddMember(uid, cid);
+  Callback(bind(cb, NO_ERROR));
+}
+
+void InMemoryStorage::AddUsersToChannel(const vector<string>& uids,
+                                        const string& cid,
+                                        AddUsersToChannelCallback cb) {
+  vector<string> records(uids.size());
+  for (size_t i = 0; i < uids.size(); ++i) {
+    RecordWriter(&records[i])
+        .Put(WAL_ADD_USER_TO_CHANNEL).Put(uids[i]).Put(cid);
+  }
+  Log(records);
+  for (size_t i = 0; i < uids.size(); ++i) {
+    AddMember(uids[i], cid);
+  }
   Callback(bind(cb, NO_ERROR));
 }
 
 void InMemoryStorage::RemoveUserFromChannel(const string& uid,
                                             const string& cid,
                                             RemoveUserFromChannelCallback cb) {
-  channel_map_[cid].erase(uid);
+  string record;
+  RecordWriter(&record).Put(WAL_REMOVE_USER_FROM_CHANNEL).Put(uid).Put(cid);
+  Log(record);
+  RemoveMember(uid, cid);
   Callback(bind(cb, NO_ERROR));
 }
 
@@ -335,10 +1468,41 @@ void InMemoryStorage::GetChannelUsers(const string& cid,
   auto iter = channel_map_.find(cid);
   if (iter != channel_map_.end()) {
     users.reset(new vector<string>());
-    users->reserve(iter->second.size());
-    users->assign(iter->second.begin(), iter->second.end());
+    users->reserve(iter->second.Size());
+    const UidTable& table = UidTable::Instance();
+    iter->second.ForEach([&users, &table](uint32 id) {
+      users->push_back(table.Uid(id));
+    });
   }
   Callback(bind(cb, NO_ERROR, users));
 }
 
+void InMemoryStorage::SaveChannelMessage(const StringPtr& msg,
+                                         const string& cid,
+                                         int64 ts,
+                                         int64 ttl,
+                                         SaveChannelMessageCallback cb) {
+  VLOG(6) << "SaveChannelMessage " << cid << ": " << *msg << ", ts=" << ts;
+  int64 expired = ExpiredTime(ttl);
+  string record;
+  RecordWriter(&record)
+      .Put(WAL_SAVE_CHANNEL_MESSAGE).Put(cid).Put(ts).Put(expired).Put(*msg);
+  Log(record);
+  SnapTimeline(cid);
+  timelines_[cid].AddMessage(msg, ts, expired);
+  Callback(bind(cb, NO_ERROR));
+}
+
+void InMemoryStorage::UpdateChannelCursor(const string& uid,
+                                          const string& cid,
+                                          int64 cursor,
+                                          UpdateChannelCursorCallback cb) {
+  string record;
+  RecordWriter(&record)
+      .Put(WAL_UPDATE_CHANNEL_CURSOR).Put(uid).Put(cid).Put(cursor);
+  Log(record);
+  SetChannelCursor(uid, cid, cursor);
+  Callback(bind(cb, NO_ERROR));
+}
+
 }  // namespace xcomet
@@ -1,25 +1,83 @@
 #ifndef SRC_STORAGE_INMEMORY_STORAGE_H_
 #define SRC_STORAGE_INMEMORY_STORAGE_H_
 
+#include <atomic>
+#include <deque>
+#include <thread>
+#include "deps/base/scoped_ptr.h"
 #include "deps/jsoncpp/include/json/value.h"
+#include "src/id_set.h"
 #include "src/storage/storage.h"
+#include "src/storage/write_ahead_log.h"
+#include "src/timing_wheel.h"
 
 namespace xcomet {
 
+// The offline messages of a user in a ring buffer. The ring starts empty,
+// grows by doubling up to max_offline_msg_num messages and is released once
+// every message is acked, so the users without pending messages cost no
+// more than the object itself.
 class InMemoryUserData {
  public:
+  // the memory held by the users of a storage, the bodies shared by
+  // several users are counted for each of them
+  struct Usage {
+    Usage() : bytes(0), messages(0) {}
+    int64 bytes;
+    int64 messages;
+  };
+
   InMemoryUserData();
   ~InMemoryUserData();
-  void AddMessage(const StringPtr& msg, int64 ttl);
+  // |usage| is kept up to date from now on, it must outlive the user
+  void SetUsage(Usage* usage);
+  // |expired| is in seconds, 0 if never expires. The expired messages are
+  // released by |wheel| if it's not NULL, otherwise they are only filtered
+  // out when read
+  void AddMessage(const StringPtr& msg, int64 expired, TimingWheel* wheel);
   MessageDataSet GetMessages();
-  void SetAck(int ack) {ack_ = ack;}
-  int GetMaxSeq() {return tail_seq_;}
-  bool Dump(Json::Value& json);
-  void Load(const Json::Value& json);
+  void SetAck(int ack);
+  int GetMaxSeq() const {return tail_seq_;}
+
+  // what a snapshot keeps of a user, the bodies are shared with the ring
+  struct Image {
+    struct Slot {
+      int64 seq;
+      int64 expired;
+      StringPtr body;
+    };
+    int64 tail_seq;
+    int64 ack;
+    // the channels which have a cursor
+    vector<pair<string, int64> > cursors;
+    vector<Slot> msgs;
+  };
+  // false if there is nothing to keep
+  bool Snap(Image* image) const;
+  // appends the binary form of |image| to |out|, can run on any thread
+  static void Encode(const Image& image, string* out);
+  // doesn't touch the timer wheel so it can run on any thread, the
+  // earliest expire time of the messages is returned in |next_expired|
+  bool Decode(const char* data, size_t size, int64* next_expired);
+  // the json dumps written before the binary snapshots
+  void Load(const Json::Value& json, TimingWheel* wheel);
+  void ScheduleExpire(int64 expired, TimingWheel* wheel);
+
+  // the channels are rebuilt from the channel members, only their cursors
+  // are dumped. A cursor goes with the membership
+  void AddChannel(const string& cid) {channels_.insert(make_pair(cid, 0));}
+  void RemoveChannel(const string& cid) {channels_.erase(cid);}
+  const ChannelCursors& GetChannels() const {return channels_;}
+  void SetChannelCursor(const string& cid, int64 cursor);
 
  private:
-  void GetQueueInfo(int& start, int& len);
-  bool IsMsgOK(int64 now, const pair<int64, StringPtr>& msg);
+  void GetQueueInfo(int& start, int& len) const;
+  static bool IsMsgOK(int64 now, const pair<int64, StringPtr>& msg);
+  void ExpireMessages();
+  void SetSlot(int index, int64 expired, const StringPtr& msg);
+  // keeps the messages from head to tail, in a ring of |capacity| slots
+  void Resize(int capacity);
+  void Account(int64 bytes, int64 messages);
 
   int head_;
   int head_seq_;
@@ -28,19 +86,71 @@ class InMemoryUserData {
   int ack_;
   // pair is expired_second + message
   vector<pair<int64, StringPtr> > msg_queue_;
+  TimingWheel* wheel_;
+  TimerNode expire_timer_;
+  ChannelCursors channels_;
+  // the ring and the bodies it holds
+  int64 bytes_;
+  int64 messages_;
+  Usage* usage_;
+
+  DISALLOW_COPY_AND_ASSIGN(InMemoryUserData);
 };
 
+// The messages of a channel ordered by the publish time, shared by all the
+// members. The oldest entries are dropped beyond max_channel_timeline_num,
+// the expired ones are skipped when read and dropped from the front. A copy
+// shares the bodies.
+class InMemoryChannelTimeline {
+ public:
+  typedef pair<int64, StringPtr> Entry;
+
+  // |expired| is in seconds, 0 if never expires
+  void AddMessage(const StringPtr& msg, int64 ts, int64 expired);
+  // appends the entries published after |cursor| to |entries|
+  void GetMessagesAfter(int64 cursor, vector<Entry>* entries);
+  // appends the binary form to |out|, false if there is nothing to keep
+  bool Encode(string* out);
+  bool Decode(const char* data, size_t size);
+  void Load(const Json::Value& json);
+
+ private:
+  struct Item {
+    int64 ts;
+    // in seconds, 0 if never expires
+    int64 expired;
+    StringPtr body;
+  };
+  void Trim(int64 now);
+
+  std::deque<Item> items_;
+};
+
+// The updates are appended to a write ahead log before being applied, and
+// the whole state is written to a snapshot periodically, the log segments
+// covered by the snapshot are then removed. A restart loads the latest
+// snapshot and replays the segments after it, so a crash only loses what
+// wasn't synced yet.
+// A snapshot is the state at a rotation of the log. It's taken in slices
+// on the main thread, the entries updated before their slice is reached
+// are taken first, then it's encoded and written by a thread of its own.
 class InMemoryStorage : public Storage {
  public:
-  InMemoryStorage();
+  explicit InMemoryStorage(TimingWheel* timer_wheel = NULL);
   ~InMemoryStorage();
+
+  // blocks until the updates before are written to the log
+  void FlushLog();
+  virtual void GetReport(Json::Value& report) const;
+
  private:
   virtual void SaveMessage(const StringPtr& msg,
                            const string& uid,
                            int seq,
                            int64 ttl,
                            SaveMessageCallback cb);
-  virtual void GetMessage(const string& uid, GetMessageCallback cb);
+  virtual void GetOfflineMessage(const string& uid,
+                                 GetOfflineMessageCallback cb);
   virtual void GetMaxSeq(const string& uid, GetMaxSeqCallback cb);
   virtual void UpdateAck(const string& uid,
                          int ack_seq,
@@ -54,11 +164,84 @@ class InMemoryStorage : public Storage {
                                      RemoveUserFromChannelCallback cb);
   virtual void GetChannelUsers(const string& cid,
                                GetChannelUsersCallback cb);
+  virtual void SaveChannelMessage(const StringPtr& msg,
+                                  const string& cid,
+                                  int64 ts,
+                                  int64 ttl,
+                                  SaveChannelMessageCallback cb);
+  virtual void UpdateChannelCursor(const string& uid,
+                                   const string& cid,
+                                   int64 cursor,
+                                   UpdateChannelCursorCallback cb);
+  // one pass over the entries, their records go to the log together
+  virtual void SaveMessages(const vector<SaveMessageEntry>& entries,
+                            SaveMessagesCallback cb);
+  virtual void UpdateAcks(const vector<pair<string, int> >& acks,
+                          UpdateAcksCallback cb);
+  virtual void AddUsersToChannel(const vector<string>& uids,
+                                 const string& cid,
+                                 AddUsersToChannelCallback cb);
+
+  // the parts of a snapshot, the users are split in shards which are
+  // encoded and loaded in parallel
+  struct SnapshotData {
+    string dir;
+    // the first segment of the log to replay after it, 0 without the log
+    int64 segment;
+    vector<vector<pair<string, InMemoryUserData::Image> > > users;
+    // the uids of the members are looked up on the main thread
+    string channel;
+    vector<pair<string, InMemoryChannelTimeline> > timelines;
+  };
+  struct SnapshotScan;
+
+  // the lookups which only read never create a user
+  InMemoryUserData& MutableUser(const string& uid);
+  void SetAck(const string& uid, int ack);
+  void SetChannelCursor(const string& uid, const string& cid, int64 cursor);
+  void AddMember(const string& uid, const string& cid);
+  void RemoveMember(const string& uid, const string& cid);
+  void Log(const string& record);
+  void Log(const vector<string>& records);
+  void Replay(const string& record);
+  void ScheduleSnapshot();
+  // starts a snapshot, taken at once if |in_slices| is false
+  void Snapshot(bool in_slices);
+  // takes the next slice, the rest of the snapshot if |in_slices| is false
+  void ScanSnapshot(bool in_slices);
+  void RestoreLoadFactors();
+  void FinishSnapshot();
+  // called before the entries are updated
+  void SnapUser(const string& uid);
+  void SnapChannel(const string& cid);
+  void SnapTimeline(const string& cid);
+  void TakeUser(const string& uid, const InMemoryUserData& user);
+  void TakeChannel(const string& cid, const IdSet& members);
+  void TakeTimeline(const string& cid, const InMemoryChannelTimeline& line);
+  static void WriteSnapshot(SnapshotData* data);
   void Dump();
   void Load();
+  void LoadSnapshot(const string& dir);
+  void LoadUsers(const string& dir, int shards);
+  void LoadChannels(const string& path);
+  void LoadTimelines(const string& path);
+  void LoadJsonSnapshot(const string& dir);
 
+  TimingWheel* timer_wheel_;
+  scoped_ptr<WriteAheadLog> wal_;
+  TimerNode snapshot_timer_;
+  // the snapshot being taken, NULL if none
+  scoped_ptr<SnapshotScan> scan_;
+  TimerNode scan_timer_;
+  // the last snapshot taken, set while it's being written
+  std::thread snapshot_writer_;
+  std::atomic<bool> snapshot_writing_;
+  // declared before the users which update it when destroyed
+  InMemoryUserData::Usage usage_;
   unordered_map<string, InMemoryUserData> user_data_;
-  unordered_map<string, unordered_set<string> > channel_map_;
+  // members are ids of the UidTable
+  unordered_map<string, IdSet> channel_map_;
+  unordered_map<string, InMemoryChannelTimeline> timelines_;
 };
 
 }  // namespace xcomet
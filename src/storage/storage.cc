@@ -2,6 +2,11 @@
 #include "deps/base/flags.h"
 
 DEFINE_int32(max_offline_msg_num, 10, "");
+DEFINE_int32(max_channel_timeline_num, 100,
+             "max entries kept in the timeline of a channel");
+DEFINE_bool(channel_timeline, false,
+            "save a channel message once in the channel timeline instead of "
+            "once per member");
 
 namespace xconmet {
 
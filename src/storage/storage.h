@@ -2,23 +2,43 @@
 #define SRC_STORAGE_STORAGE_H_
 
 #include <inttypes.h>
+#include "deps/jsoncpp/include/json/value.h"
 #include "src/include_std.h"
 #include "src/message.h"
 #include "src/typedef.h"
 
 DECLARE_int32(max_offline_msg_num);
+DECLARE_int32(max_channel_timeline_num);
+DECLARE_bool(channel_timeline);
 
 namespace xcomet {
 
 typedef shared_ptr<vector<string> > UserResultSet;
 
+// an offline message of SaveMessages
+struct SaveMessageEntry {
+  StringPtr msg;
+  string uid;
+  int seq;
+  int64 ttl;
+};
+
 typedef function<void (Error, MessageDataSet)> GetMessageCallback;
+// the last argument has the publish time of the last timeline entry in the
+// result for each channel which has some
+typedef function<void (Error, MessageDataSet, const ChannelCursors&)>
+    GetOfflineMessageCallback;
 typedef function<void (Error)> SaveMessageCallback;
 typedef function<void (Error)> UpdateAckCallback;
 typedef function<void (Error, int)> GetMaxSeqCallback;
 typedef function<void (Error)> AddUserToChannelCallback;
 typedef function<void (Error)> RemoveUserFromChannelCallback;
 typedef function<void (Error, UserResultSet)> GetChannelUsersCallback;
+typedef function<void (Error)> SaveChannelMessageCallback;
+typedef function<void (Error)> UpdateChannelCursorCallback;
+typedef function<void (Error)> SaveMessagesCallback;
+typedef function<void (Error)> UpdateAcksCallback;
+typedef function<void (Error)> AddUsersToChannelCallback;
 
 class Storage {
  public:
@@ -30,7 +50,17 @@ class Storage {
                            int seq,
                            int64 ttl,
                            SaveMessageCallback cb) = 0;
-  virtual void GetMessage(const string& uid, GetMessageCallback cb) = 0;
+  // the user's own messages, followed by the entries of the timelines of
+  // its channels published after their cursors when --channel_timeline
+  virtual void GetOfflineMessage(const string& uid,
+                                 GetOfflineMessageCallback cb) = 0;
+  void GetMessage(const string& uid, GetMessageCallback cb) {
+    GetOfflineMessage(uid, [cb](Error error,
+                                MessageDataSet m,
+                                const ChannelCursors&) {
+      cb(error, m);
+    });
+  }
   virtual void GetMaxSeq(const string& uid, GetMaxSeqCallback cb) = 0;
   virtual void UpdateAck(const string& uid,
                          int ack_seq,
@@ -44,6 +74,36 @@ class Storage {
                                      RemoveUserFromChannelCallback cb) = 0;
   virtual void GetChannelUsers(const string& cid,
                                GetChannelUsersCallback cb) = 0;
+
+  // the channel timeline, a channel message is written once for all the
+  // members, |ts| is the publish time in microseconds and orders the
+  // timeline
+  virtual void SaveChannelMessage(const StringPtr& msg,
+                                  const string& cid,
+                                  int64 ts,
+                                  int64 ttl,
+                                  SaveChannelMessageCallback cb) = 0;
+  // the entries of |cid| published after |cursor| are unread by the user,
+  // each channel has its own cursor as the channels are delivered apart.
+  // Only kept while the user is a member of the channel
+  virtual void UpdateChannelCursor(const string& uid,
+                                   const string& cid,
+                                   int64 cursor,
+                                   UpdateChannelCursorCallback cb) = 0;
+
+  // the batch variants, the callback runs once after all the entries are
+  // written, with one of the errors if some of them failed
+  virtual void SaveMessages(const vector<SaveMessageEntry>& entries,
+                            SaveMessagesCallback cb) = 0;
+  // the last one wins if a uid appears several times
+  virtual void UpdateAcks(const vector<pair<string, int> >& acks,
+                          UpdateAcksCallback cb) = 0;
+  virtual void AddUsersToChannel(const vector<string>& uids,
+                                 const string& cid,
+                                 AddUsersToChannelCallback cb) = 0;
+
+  // the figures reported on /stats, none by default
+  virtual void GetReport(Json::Value& report) const {}
 };
 }  // namespace xcomet
 #endif  // SRC_STORAGE_STORAGE_H_
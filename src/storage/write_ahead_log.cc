@@ -0,0 +1,278 @@
+#include "src/storage/write_ahead_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "deps/base/file.h"
+#include "deps/base/hash.h"
+#include "deps/base/logging.h"
+#include "deps/base/varint.h"
+
+using base::File;
+
+namespace xcomet {
+
+static const char SEGMENT_PREFIX[] = "wal.";
+// varint32 length and fixed32 checksum
+static const size_t MAX_FRAME_HEADER = 5 + 4;
+
+static void EncodeFixed32(uint32 value, char* buf) {
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+  buf[2] = (value >> 16) & 0xff;
+  buf[3] = (value >> 24) & 0xff;
+}
+
+static uint32 DecodeFixed32(const char* buf) {
+  const uint8* p = reinterpret_cast<const uint8*>(buf);
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32>(p[3]) << 24);
+}
+
+// NULL if the varint is cut by |end|
+static const char* ReadLength(const char* p, const char* end, uint32* len) {
+  uint32 value = 0;
+  for (int shift = 0; shift < 35 && p < end; shift += 7) {
+    uint8 byte = static_cast<uint8>(*p++);
+    value |= static_cast<uint32>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *len = value;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+WriteAheadLog::WriteAheadLog(const string& dir, bool sync)
+    : dir_(dir),
+      sync_(sync),
+      fd_(-1),
+      segment_(0),
+      stopped_(false),
+      appended_(0),
+      done_(0) {
+}
+
+WriteAheadLog::~WriteAheadLog() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  cond_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+void WriteAheadLog::Open(int64 segment) {
+  CHECK(segment > 0);
+  CHECK(fd_ < 0) << "wal opened twice";
+  if (!File::IsDir(dir_)) {
+    File::RecursivelyCreateDir(dir_, 0777);
+  }
+  OpenSegment(segment);
+  thread_ = std::thread(&WriteAheadLog::Loop, this);
+}
+
+void WriteAheadLog::Append(const string& record) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    AppendLocked(record);
+  }
+  cond_.notify_all();
+}
+
+void WriteAheadLog::Append(const vector<string>& records) {
+  if (records.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < records.size(); ++i) {
+      AppendLocked(records[i]);
+    }
+  }
+  cond_.notify_all();
+}
+
+void WriteAheadLog::AppendLocked(const string& record) {
+  char header[MAX_FRAME_HEADER];
+  char* p = reinterpret_cast<char*>(base::WriteVarint32(
+      record.size(), reinterpret_cast<uint8*>(header)));
+  EncodeFixed32(base::Fingerprint32(record), p);
+  p += 4;
+  if (ops_.empty() || ops_.back().segment > 0) {
+    ops_.push_back(Op());
+    ops_.back().segment = 0;
+    ++appended_;
+  }
+  string& data = ops_.back().data;
+  data.append(header, p - header);
+  data.append(record);
+}
+
+int64 WriteAheadLog::Rotate() {
+  int64 segment;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // the numbers are only taken here, the writer follows them in order
+    segment = ++segment_;
+    ops_.push_back(Op());
+    ops_.back().segment = segment;
+    ++appended_;
+  }
+  cond_.notify_all();
+  return segment;
+}
+
+void WriteAheadLog::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  const int64 target = appended_;
+  cond_.wait(lock, [this, target]() {return done_ >= target;});
+}
+
+void WriteAheadLog::Loop() {
+  while (true) {
+    vector<Op> ops;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this]() {return stopped_ || !ops_.empty();});
+      if (ops_.empty()) {
+        break;
+      }
+      ops.swap(ops_);
+    }
+    for (size_t i = 0; i < ops.size(); ++i) {
+      Op& op = ops[i];
+      Write(op.data);
+      if (op.segment > 0) {
+        Sync();
+        ::close(fd_);
+        OpenSegment(op.segment);
+      }
+    }
+    // one sync for all the records of the batch
+    Sync();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ += ops.size();
+    }
+    cond_.notify_all();
+  }
+  VLOG(3) << "wal writer exited";
+}
+
+void WriteAheadLog::Write(const string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = ::write(fd_, data.data() + written, data.size() - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(FATAL) << "write wal failed: " << strerror(errno);
+    }
+    written += n;
+  }
+}
+
+void WriteAheadLog::Sync() {
+  if (sync_ && ::fdatasync(fd_) != 0) {
+    LOG(ERROR) << "sync wal failed: " << strerror(errno);
+  }
+}
+
+// the writer owns the file, the number is also read by Rotate under lock
+void WriteAheadLog::OpenSegment(int64 segment) {
+  string path = SegmentPath(dir_, segment);
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  CHECK(fd_ >= 0) << "open wal failed: " << path << ", " << strerror(errno);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (segment_ < segment) {
+    segment_ = segment;
+  }
+  VLOG(3) << "wal segment opened: " << path;
+}
+
+string WriteAheadLog::SegmentPath(const string& dir, int64 segment) {
+  return File::JoinPath(dir, SEGMENT_PREFIX + std::to_string(segment));
+}
+
+vector<int64> WriteAheadLog::ListSegments(const string& dir) {
+  vector<int64> segments;
+  vector<string> files;
+  if (!File::IsDir(dir) || !File::GetFilesInDir(dir, &files)) {
+    return segments;
+  }
+  const size_t prefix_len = sizeof(SEGMENT_PREFIX) - 1;
+  for (size_t i = 0; i < files.size(); ++i) {
+    string name = File::BaseName(files[i]);
+    if (name.compare(0, prefix_len, SEGMENT_PREFIX) != 0) {
+      continue;
+    }
+    char* end = NULL;
+    int64 segment = ::strtoll(name.c_str() + prefix_len, &end, 10);
+    if (end != NULL && *end == '\0' && segment > 0) {
+      segments.push_back(segment);
+    }
+  }
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
+
+int64 WriteAheadLog::Replay(const string& dir,
+                            int64 first,
+                            function<void (const string& record)> fn) {
+  int64 last = first - 1;
+  vector<int64> segments = ListSegments(dir);
+  string record;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    if (segments[i] < first) {
+      continue;
+    }
+    last = segments[i];
+    string path = SegmentPath(dir, segments[i]);
+    string data;
+    CHECK(File::ReadFileToString(path, &data)) << "read wal failed: " << path;
+    const char* p = data.data();
+    const char* end = p + data.size();
+    int64 number = 0;
+    while (p < end) {
+      uint32 len = 0;
+      const char* q = ReadLength(p, end, &len);
+      if (q == NULL || end - q < 4 || end - q - 4 < len) {
+        LOG(WARNING) << "torn wal record dropped: " << path
+                     << ", offset " << (p - data.data());
+        break;
+      }
+      uint32 checksum = DecodeFixed32(q);
+      record.assign(q + 4, len);
+      if (base::Fingerprint32(record) != checksum) {
+        LOG(WARNING) << "corrupted wal record dropped: " << path
+                     << ", offset " << (p - data.data());
+        break;
+      }
+      fn(record);
+      ++number;
+      p = q + 4 + len;
+    }
+    LOG(INFO) << number << " records replayed from " << path;
+  }
+  return last;
+}
+
+void WriteAheadLog::RemoveSegments(const string& dir, int64 segment) {
+  vector<int64> segments = ListSegments(dir);
+  for (size_t i = 0; i < segments.size(); ++i) {
+    if (segments[i] < segment) {
+      ::unlink(SegmentPath(dir, segments[i]).c_str());
+    }
+  }
+}
+
+}  // namespace xcomet
@@ -0,0 +1,76 @@
+#ifndef SRC_STORAGE_WRITE_AHEAD_LOG_H_
+#define SRC_STORAGE_WRITE_AHEAD_LOG_H_
+
+#include <condition_variable>
+#include <mutex>
+#include "deps/base/basictypes.h"
+#include "src/include_std.h"
+
+namespace xcomet {
+
+// An append only log of records, written by a background thread. The
+// records appended while the previous write is in progress are written
+// together and synced once (group commit), so Append never blocks on the
+// disk. The log is split into segments named wal.<number> in |dir|, Rotate
+// starts the next one so a snapshot can tell which segments it covers.
+// A record is framed with its length and checksum, a torn record at the
+// end of a segment is dropped when replayed.
+class WriteAheadLog {
+ public:
+  WriteAheadLog(const string& dir, bool sync);
+  // writes everything appended before returning
+  ~WriteAheadLog();
+
+  // starts the writer with the segment |segment|
+  void Open(int64 segment);
+  void Append(const string& record);
+  // the records of a batch are taken under one lock, in order
+  void Append(const vector<string>& records);
+  // the records appended after it go to a new segment, returns its number
+  int64 Rotate();
+  // blocks until everything appended before is written
+  void Flush();
+
+  // the numbers of the segments in |dir|, ascending
+  static vector<int64> ListSegments(const string& dir);
+  static string SegmentPath(const string& dir, int64 segment);
+  // calls |fn| with the records of the segments >= |first| in order,
+  // returns the number of the last segment, or first - 1 if there is none
+  static int64 Replay(const string& dir,
+                      int64 first,
+                      function<void (const string& record)> fn);
+  // removes the segments < |segment|
+  static void RemoveSegments(const string& dir, int64 segment);
+
+ private:
+  struct Op {
+    string data;
+    // > 0 if a new segment starts after |data|
+    int64 segment;
+  };
+
+  void AppendLocked(const string& record);
+  void Loop();
+  void Write(const string& data);
+  void Sync();
+  void OpenSegment(int64 segment);
+
+  const string dir_;
+  const bool sync_;
+  int fd_;
+  int64 segment_;
+  bool stopped_;
+  std::thread thread_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  vector<Op> ops_;
+  // ops appended and done, for Flush
+  int64 appended_;
+  int64 done_;
+
+  DISALLOW_COPY_AND_ASSIGN(WriteAheadLog);
+};
+
+}  // namespace xcomet
+#endif  // SRC_STORAGE_WRITE_AHEAD_LOG_H_
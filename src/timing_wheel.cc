@@ -0,0 +1,154 @@
+#include "src/timing_wheel.h"
+
+#include <string.h>
+#include "deps/base/logging.h"
+
+namespace xcomet {
+
+TimerNode::TimerNode()
+    : prev_(NULL),
+      next_(NULL),
+      slot_(NULL),
+      wheel_(NULL),
+      deadline_(0) {
+}
+
+TimerNode::~TimerNode() {
+  Cancel();
+}
+
+void TimerNode::Cancel() {
+  if (wheel_ != NULL) {
+    wheel_->Cancel(this);
+  }
+}
+
+TimingWheel::TimingWheel(int64 now_ms, int tick_ms)
+    : tick_ms_(tick_ms),
+      current_(0),
+      size_(0),
+      expiring_(NULL) {
+  CHECK(tick_ms_ > 0);
+  current_ = now_ms / tick_ms_;
+  ::memset(slots_, 0, sizeof(slots_));
+}
+
+TimingWheel::~TimingWheel() {
+  for (int i = 0; i < LEVEL_NUMBER; ++i) {
+    for (int j = 0; j < SLOT_NUMBER; ++j) {
+      while (slots_[i][j] != NULL) {
+        Unlink(slots_[i][j]);
+      }
+    }
+  }
+  while (expiring_ != NULL) {
+    Unlink(expiring_);
+  }
+}
+
+void TimingWheel::Schedule(TimerNode* node, int64 deadline_ms) {
+  if (node->wheel_ != NULL) {
+    node->wheel_->Cancel(node);
+  }
+  node->wheel_ = this;
+  node->deadline_ = deadline_ms;
+  ++size_;
+  Place(node, current_ + 1);
+}
+
+void TimingWheel::Cancel(TimerNode* node) {
+  CHECK(node->wheel_ == this);
+  Unlink(node);
+  --size_;
+}
+
+void TimingWheel::Advance(int64 now_ms) {
+  const int64 target = now_ms / tick_ms_;
+  while (current_ < target) {
+    ++current_;
+    for (int level = 1; level < LEVEL_NUMBER; ++level) {
+      if (current_ & ((1LL << (LEVEL_BITS * level)) - 1)) {
+        break;
+      }
+      Cascade(level);
+    }
+    Expire();
+  }
+}
+
+void TimingWheel::Link(TimerNode* node, TimerNode** slot) {
+  node->slot_ = slot;
+  node->prev_ = NULL;
+  node->next_ = *slot;
+  if (*slot != NULL) {
+    (*slot)->prev_ = node;
+  }
+  *slot = node;
+}
+
+void TimingWheel::Unlink(TimerNode* node) {
+  if (node->prev_ != NULL) {
+    node->prev_->next_ = node->next_;
+  } else {
+    *node->slot_ = node->next_;
+  }
+  if (node->next_ != NULL) {
+    node->next_->prev_ = node->prev_;
+  }
+  node->prev_ = NULL;
+  node->next_ = NULL;
+  node->slot_ = NULL;
+  node->wheel_ = NULL;
+}
+
+// |min_tick| is the earliest tick the node may be placed at, a cascade can
+// still hit the tick being processed, a new schedule can't
+void TimingWheel::Place(TimerNode* node, int64 min_tick) {
+  int64 tick = (node->deadline_ + tick_ms_ - 1) / tick_ms_;
+  if (tick < min_tick) {
+    tick = min_tick;
+  }
+  const int64 max_delta = (1LL << (LEVEL_BITS * LEVEL_NUMBER)) - 1;
+  if (tick - current_ > max_delta) {
+    tick = current_ + max_delta;
+  }
+  const int64 delta = tick - current_;
+  int level = 0;
+  while (delta >= (1LL << (LEVEL_BITS * (level + 1)))) {
+    ++level;
+  }
+  int index = (tick >> (LEVEL_BITS * level)) & SLOT_MASK;
+  Link(node, &slots_[level][index]);
+}
+
+void TimingWheel::Cascade(int level) {
+  int index = (current_ >> (LEVEL_BITS * level)) & SLOT_MASK;
+  TimerNode* node = slots_[level][index];
+  slots_[level][index] = NULL;
+  while (node != NULL) {
+    TimerNode* next = node->next_;
+    Place(node, current_);
+    node = next;
+  }
+}
+
+void TimingWheel::Expire() {
+  TimerNode** slot = &slots_[0][current_ & SLOT_MASK];
+  expiring_ = *slot;
+  *slot = NULL;
+  for (TimerNode* node = expiring_; node != NULL; node = node->next_) {
+    node->slot_ = &expiring_;
+  }
+  while (expiring_ != NULL) {
+    TimerNode* node = expiring_;
+    Unlink(node);
+    --size_;
+    // the callback may free the node, or schedule it again
+    function<void ()> cb = node->callback_;
+    if (cb) {
+      cb();
+    }
+  }
+}
+
+}  // namespace xcomet
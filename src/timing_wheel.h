@@ -0,0 +1,94 @@
+#ifndef SRC_TIMING_WHEEL_H_
+#define SRC_TIMING_WHEEL_H_
+
+#include "deps/base/basictypes.h"
+#include "src/include_std.h"
+
+namespace xcomet {
+
+class TimingWheel;
+
+// An intrusive timer entry, embed it in the object which needs a deadline.
+// The entry is unlinked when destroyed, so the owner can be freed at any
+// time, even from its own callback.
+class TimerNode {
+ public:
+  TimerNode();
+  ~TimerNode();
+
+  // keep the callback small, it's copied before being run
+  void SetCallback(function<void ()> cb) {
+    callback_ = cb;
+  }
+  bool IsScheduled() const {
+    return wheel_ != NULL;
+  }
+  // in milliseconds, only meaningful when scheduled
+  int64 Deadline() const {
+    return deadline_;
+  }
+  void Cancel();
+
+ private:
+  TimerNode* prev_;
+  TimerNode* next_;
+  TimerNode** slot_;
+  TimingWheel* wheel_;
+  int64 deadline_;
+  function<void ()> callback_;
+
+  friend class TimingWheel;
+  DISALLOW_COPY_AND_ASSIGN(TimerNode);
+};
+
+// Hierarchical timing wheel with 4 levels of 64 slots. Schedule and Cancel
+// are O(1), an entry is cascaded at most once per level on its way down.
+// Deadlines are absolute milliseconds rounded up to the tick, deadlines
+// beyond the range (64^4 ticks) are parked at the top level and placed
+// again when they come closer. Not thread safe.
+class TimingWheel {
+ public:
+  TimingWheel(int64 now_ms, int tick_ms);
+  ~TimingWheel();
+
+  // reschedules the node if it's already scheduled, a deadline in the past
+  // fires on the next tick
+  void Schedule(TimerNode* node, int64 deadline_ms);
+  void Cancel(TimerNode* node);
+  // runs the callbacks of all the entries due at or before now_ms
+  void Advance(int64 now_ms);
+
+  int64 Now() const {
+    return current_ * tick_ms_;
+  }
+  int TickMs() const {
+    return tick_ms_;
+  }
+  size_t Size() const {
+    return size_;
+  }
+
+ private:
+  static const int LEVEL_BITS = 6;
+  static const int SLOT_NUMBER = 1 << LEVEL_BITS;
+  static const int SLOT_MASK = SLOT_NUMBER - 1;
+  static const int LEVEL_NUMBER = 4;
+
+  void Link(TimerNode* node, TimerNode** slot);
+  void Unlink(TimerNode* node);
+  void Place(TimerNode* node, int64 min_tick);
+  void Cascade(int level);
+  void Expire();
+
+  const int tick_ms_;
+  int64 current_;
+  size_t size_;
+  TimerNode* slots_[LEVEL_NUMBER][SLOT_NUMBER];
+  // entries of the slot being expired, callbacks may cancel them
+  TimerNode* expiring_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimingWheel);
+};
+
+}  // namespace xcomet
+#endif  // SRC_TIMING_WHEEL_H_
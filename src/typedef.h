@@ -1,12 +1,16 @@
 #ifndef SRC_TYPEDEF_H_
 #define SRC_TYPEDEF_H_
 
+#include "deps/base/basictypes.h"
 #include "src/include_std.h"
 
 namespace xcomet {
 
 typedef shared_ptr<std::string> StringPtr;
 typedef const char* Error;
+// the channels of a user by id, to the publish time of the last timeline
+// entry read from each
+typedef map<string, int64> ChannelCursors;
 
 #define NO_ERROR ((const char*)NULL)
 
@@ -0,0 +1,22 @@
+#include "src/uid_table.h"
+
+namespace xcomet {
+
+uint32 UidTable::Intern(const string& uid) {
+  auto result = ids_.insert(make_pair(uid, (uint32)uids_.size()));
+  if (result.second) {
+    uids_.push_back(&result.first->first);
+  }
+  return result.first->second;
+}
+
+bool UidTable::Find(const string& uid, uint32* id) const {
+  auto it = ids_.find(uid);
+  if (it == ids_.end()) {
+    return false;
+  }
+  *id = it->second;
+  return true;
+}
+
+}  // namespace xcomet
@@ -0,0 +1,44 @@
+#ifndef SRC_UID_TABLE_H_
+#define SRC_UID_TABLE_H_
+
+#include "deps/base/basictypes.h"
+#include "deps/base/singleton.h"
+#include "src/include_std.h"
+
+namespace xcomet {
+
+// Maps uids to dense integer ids, so the sets of uids (channel members)
+// can be stored as compact sets of integers. An id is never released,
+// the table grows with the number of distinct uids seen by the process.
+// Not thread safe, only use it from the main loop.
+class UidTable {
+ public:
+  static UidTable& Instance() {
+    return *Singleton<UidTable>::get();
+  }
+
+  // returns the id of |uid|, assigns the next one if it's new
+  uint32 Intern(const string& uid);
+  // doesn't assign an id if |uid| is new
+  bool Find(const string& uid, uint32* id) const;
+  const string& Uid(uint32 id) const {
+    return *uids_[id];
+  }
+  size_t Size() const {
+    return uids_.size();
+  }
+
+ private:
+  UidTable() {}
+  ~UidTable() {}
+
+  unordered_map<string, uint32> ids_;
+  // points to the keys of |ids_|, they don't move when it's rehashed
+  vector<const string*> uids_;
+
+  friend struct DefaultSingletonTraits<UidTable>;
+  DISALLOW_COPY_AND_ASSIGN(UidTable);
+};
+
+}  // namespace xcomet
+#endif  // SRC_UID_TABLE_H_
@@ -8,17 +8,17 @@ User::User(const string& uid,
            int type,
            Session* session,
            SessionServer& serv)
-    : prev_(NULL),
-      next_(NULL),
-      queue_index_(-1),
-      uid_(uid),
+    : uid_(uid),
       type_(type),
+      lane_(0),
+      generation_(0),
       session_(session),
       server_(serv) {
   VLOG(3) << "User construct";
   session_->SetDisconnectCallback(bind(&User::OnSessionDisconnected, this));
   session_->SetMessageCallback(bind(&SessionServer::OnUserMessage,
                                &server_, uid_, this, _1));
+  timer_.SetCallback([this]() {server_.OnUserTimeout(this);});
 }
 
 User::~User() {
@@ -39,6 +39,20 @@ void User::Send(const std::string& pakcet_str) {
   }
 }
 
+void User::Send(const StringPtr& packet) {
+  session_->Send(packet);
+  if (type_ == COMET_TYPE_POLLING) {
+    Close();
+  }
+}
+
+void User::Send(const string& prefix, const StringPtr& rest) {
+  session_->Send(prefix, rest);
+  if (type_ == COMET_TYPE_POLLING) {
+    Close();
+  }
+}
+
 void User::SendHeartbeat() {
   session_->SendHeartbeat();
   if (type_ == COMET_TYPE_POLLING) {
@@ -1,18 +1,16 @@
 #ifndef SRC_USER_H_
 #define SRC_USER_H_
 
-#include "deps/base/dlist.h"
 #include "deps/base/scoped_ptr.h"
 #include "src/include_std.h"
 #include "src/session.h"
 #include "src/message.h"
-
-using base::DLinkedList;
+#include "src/timing_wheel.h"
+#include "src/typedef.h"
 
 namespace xcomet {
 
 class User;
-class UserCircleQueue;
 class SessionServer;
 typedef shared_ptr<User> UserPtr;
 typedef unordered_map<string, UserPtr> UserMap;
@@ -29,69 +27,44 @@ class User {
   ~User();
   void SetType(int type) {type_ = type;}
   int GetType() const {return type_;}
+  // index of the reactor lane which owns the connection
+  void SetLane(int lane) {lane_ = lane;}
+  int GetLane() const {return lane_;}
+  // orders the connections of a user, a bigger one is newer
+  void SetGeneration(int64 generation) {generation_ = generation;}
+  int64 GetGeneration() const {return generation_;}
+  // publish time of the last timeline entry of |cid| sent to the connection
+  void SetChannelTs(const string& cid, int64 ts) {
+    int64& last = channel_ts_[cid];
+    if (ts > last) last = ts;
+  }
+  const ChannelCursors& GetChannelTs() const {return channel_ts_;}
   string GetId() const {return uid_;}
   void Send(const Message& msg);
   void Send(const string& packet_str);
+  void Send(const StringPtr& packet);
+  void Send(const string& prefix, const StringPtr& rest);
   void Close();
   void SendHeartbeat();
   const set<string>& JoinedRooms() const {return joined_rooms_;}
   void JoinRoom(const string& room_id) {joined_rooms_.insert(room_id);}
   void LeaveRoom(const string& room_id) {joined_rooms_.erase(room_id);}
+  // idle timeout or next heartbeat, scheduled on the lane's timing wheel
+  TimerNode* Timer() {return &timer_;}
 
  private:
   void OnSessionDisconnected();
 
-  User* prev_;
-  User* next_;
-  int queue_index_;
+  TimerNode timer_;
   string uid_;
   int type_;
+  int lane_;
+  int64 generation_;
+  ChannelCursors channel_ts_;
 
   scoped_ptr<Session> session_;
   SessionServer& server_;
   set<string> joined_rooms_;
-
-  friend class DLinkedList<User*>;
-  friend class UserCircleQueue;
-};
-
-class UserCircleQueue {
- public:
-  UserCircleQueue(int max_size) : size_(max_size), head_(0) {
-    buffer_.resize(size_);
-  }
-
-  DLinkedList<User*> GetFront() {
-    return buffer_[head_];
-  }
-
-  DLinkedList<User*> PopFront() {
-    DLinkedList<User*> ret = buffer_[head_];
-    buffer_[head_] = DLinkedList<User*>();
-    return ret;
-  }
-
-  void RemoveUser(User* user) {
-    if (user->queue_index_ != -1) {
-      buffer_[user->queue_index_].Remove(user);
-    }
-  }
-
-  void PushUserBack(User* user) {
-    RemoveUser(user);
-    int tail = (head_ - 1 + size_) % size_;
-    buffer_[tail].PushBack(user);
-    user->queue_index_ = tail;
-  }
-
-  void IncHead() {
-    head_ = (head_ + 1) % size_;
-  }
-
- private:
-  const int size_;
-  int head_;
-  vector<DLinkedList<User*> > buffer_;
 };
 
 }  // namespace xcomet
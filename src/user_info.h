@@ -2,6 +2,7 @@
 #define SRC_USER_INFO_H_
 
 #include "src/include_std.h"
+#include "src/typedef.h"
 
 namespace xcomet {
 
@@ -22,11 +23,20 @@ class UserInfo {
   void SetMaxSeq(int seq) {max_seq_ = seq;}
   int GetLastAck() const {return last_ack_;}
   void SetLastAck(int seq) {last_ack_ = seq;}
+  // the last cursor of |cid| written by this node, 0 if none
+  int64 GetChannelCursor(const string& cid) const {
+    ChannelCursors::const_iterator iter = channel_cursors_.find(cid);
+    return iter != channel_cursors_.end() ? iter->second : 0;
+  }
+  void SetChannelCursor(const string& cid, int64 cursor) {
+    channel_cursors_[cid] = cursor;
+  }
 
  private:
   string uid_;
   int max_seq_;
   int last_ack_;
+  ChannelCursors channel_cursors_;
 };
 
 }  // namespace xcomet
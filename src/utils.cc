@@ -1,7 +1,15 @@
 #include "src/utils.h"
 
 #include <fcntl.h>
+#include <unistd.h>
 #include <ctype.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
 
 namespace xcomet {
 
@@ -24,6 +32,32 @@ void SetNonblock(int fd) {
   // TODO check ret != -1
 }
 
+int CreateListenSocket(int port, bool reuse_port) {
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int on = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (reuse_port &&
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  struct sockaddr_in addr;
+  ::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (::bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      ::listen(fd, 128) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  SetNonblock(fd);
+  return fd;
+}
+
 void SerializeJson(const Json::Value& json, string& data) {
   data = Json::FastWriter().write(json);
 }
@@ -11,6 +11,11 @@ using namespace std;
 
 void SetNonblock(int fd);
 
+// return a nonblocking listening socket on 0.0.0.0:port, -1 if failed
+// with reuse_port, several loops can bind the same port and the kernel
+// balances the accepted connections between them
+int CreateListenSocket(int port, bool reuse_port);
+
 void ParseIpPort(const string& address, string& ip, int& port);
 
 void SerializeJson(const Json::Value& json, string& data);
@@ -204,6 +204,26 @@ int WebSocket::makeFrame(WebSocketFrameType frame_type,
   return (size+pos);
 }
 
+int WebSocket::makeFrameHeader(WebSocketFrameType frame_type,
+                               uint64_t msg_len,
+                               unsigned char* buffer) {
+  int pos = 0;
+  buffer[pos++] = (unsigned char)frame_type;
+  if (msg_len <= 125) {
+    buffer[pos++] = msg_len;
+  } else if (msg_len <= 65535) {
+    buffer[pos++] = 126;
+    buffer[pos++] = (msg_len >> 8) & 0xFF;
+    buffer[pos++] = msg_len & 0xFF;
+  } else {
+    buffer[pos++] = 127;
+    for (int i = 7; i >= 0; --i) {
+      buffer[pos++] = (msg_len >> (8 * i)) & 0xFF;
+    }
+  }
+  return pos;
+}
+
 WebSocketFrameType WebSocket::getFrame(unsigned char* in_buffer,
                                        int in_length,
                                        unsigned char* out_buffer,
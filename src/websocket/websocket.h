@@ -52,6 +52,11 @@ class WebSocket {
                 int msg_len,
                 unsigned char* buffer,
                 int buffer_len);
+  // writes the header of a frame of |msg_len| bytes, at most 10 bytes,
+  // the payload is sent after it
+  int makeFrameHeader(WebSocketFrameType frame_type,
+                      uint64_t msg_len,
+                      unsigned char* buffer);
   WebSocketFrameType getFrame(unsigned char* in_buffer,
                               int in_length,
                               unsigned char* out_buffer,
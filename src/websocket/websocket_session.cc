@@ -1,5 +1,7 @@
 #include "src/websocket/websocket_session.h"
 
+#include "src/evhelper.h"
+
 namespace xcomet {
 
 const int16 WS_CR_NONE = 0;
@@ -8,6 +10,7 @@ const int16 WS_CR_PROTO_ERR = 1002;
 const int16 WS_CR_DATA_TOO_BIG = 1009;
 
 const int WS_RECV_BUFFER_SIZE = 4096;
+const int WS_MAX_HEADER_SIZE = 10;
 
 static void GetHeader(struct evkeyvalq* headers, const char* k, string& v) {
   const char* ret = evhttp_find_header(headers, k);
@@ -66,23 +69,36 @@ void WebSocketSession::Send(const Message& msg) {
 }
 
 void WebSocketSession::Send(const string& packet_str) {
-  unsigned char frame[WS_RECV_BUFFER_SIZE] = {0};
-  int len = ws_.makeFrame(TEXT_FRAME,
-                          (unsigned char*)packet_str.c_str(),
-                          packet_str.length(),
-                          frame,
-                          sizeof(frame));
-  VLOG(6) << "WebSocketSession send buffer len: " << len;
   VLOG(6) << "WebSocketSession send buffer: " << packet_str;
-  if (len <= 0) {
-    LOG(WARNING) << "make websocket frame failed";
-    return;
-  }
-  struct evbuffer* evbuf = evhttp_request_get_output_buffer(req_);
-  evbuffer_add(evbuf, frame, len);
+  struct evbuffer* evbuf = StartFrame(packet_str.size());
+  evbuffer_add(evbuf, packet_str.data(), packet_str.size());
+  evhttp_send_ws(req_, evbuf);
+}
+
+void WebSocketSession::Send(const StringPtr& packet) {
+  VLOG(6) << "WebSocketSession send buffer: " << *packet;
+  struct evbuffer* evbuf = StartFrame(packet->size());
+  AddSharedString(evbuf, packet);
   evhttp_send_ws(req_, evbuf);
 }
 
+void WebSocketSession::Send(const string& prefix, const StringPtr& rest) {
+  VLOG(6) << "WebSocketSession send buffer: " << prefix << *rest;
+  struct evbuffer* evbuf = StartFrame(prefix.size() + rest->size());
+  evbuffer_add(evbuf, prefix.data(), prefix.size());
+  AddSharedString(evbuf, rest);
+  evhttp_send_ws(req_, evbuf);
+}
+
+struct evbuffer* WebSocketSession::StartFrame(size_t size) {
+  unsigned char header[WS_MAX_HEADER_SIZE];
+  int len = ws_.makeFrameHeader(TEXT_FRAME, size, header);
+  VLOG(6) << "WebSocketSession send buffer len: " << len + size;
+  struct evbuffer* evbuf = evhttp_request_get_output_buffer(req_);
+  evbuffer_add(evbuf, header, len);
+  return evbuf;
+}
+
 void WebSocketSession::SendHeartbeat() {
 }
 
@@ -15,6 +15,8 @@ class WebSocketSession : public Session {
   virtual ~WebSocketSession();
   virtual void Send(const Message& msg);
   virtual void Send(const string& packet_str);
+  virtual void Send(const StringPtr& packet);
+  virtual void Send(const string& prefix, const StringPtr& rest);
   virtual void SendHeartbeat();
   virtual void Close();
 
@@ -24,6 +26,8 @@ class WebSocketSession : public Session {
 
   void Start();
   void Close(int16 reason);
+  // adds the header of a text frame of |size| bytes to the output buffer
+  struct evbuffer* StartFrame(size_t size);
 
   struct evhttp_request* req_;
   bool closed_;
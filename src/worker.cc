@@ -1,62 +1,174 @@
 #include "src/worker.h"
+#include "deps/base/logging.h"
 #include "deps/base/time.h"
 
-DEFINE_int32(msgqueue_max_size, 200000, "");
-DEFINE_int32(task_queue_warning_size, 100000, "");
+DEFINE_int32(worker_threads, 4, "number of threads in the worker pool");
 
 namespace xcomet {
 
-Worker::Worker(struct event_base* evbase)
-    : base::Thread(true), // joinable
-      evbase_(evbase),
-      event_queue_(NULL) {
+// callbacks are sent back as one batch per wakeup, so the queue only ever
+// holds a single pending item
+const int COMPLETION_QUEUE_SIZE = 16;
+
+Worker::Worker(struct event_base* evbase, int thread_num)
+    : evbase_(evbase),
+      event_queue_(NULL),
+      next_queue_(0),
+      queue_depth_(0),
+      stopped_(false),
+      idle_threads_(0),
+      max_queue_depth_(0),
+      completed_number_(0),
+      total_latency_(0),
+      max_latency_(0) {
   CHECK(evbase_);
+  if (thread_num <= 0) {
+    thread_num = FLAGS_worker_threads;
+  }
+  CHECK(thread_num > 0);
   event_queue_ = msgqueue_new(evbase_,
-                              FLAGS_msgqueue_max_size,
+                              COMPLETION_QUEUE_SIZE,
                               &Callback,
                               this);
   CHECK(event_queue_) << "failed to create event_msgqueue";
-  Start();
+  for (int i = 0; i < thread_num; ++i) {
+    queues_.push_back(shared_ptr<TaskQueue>(new TaskQueue()));
+  }
+  for (int i = 0; i < thread_num; ++i) {
+    threads_.push_back(thread(&Worker::Run, this, i));
+  }
 }
 
 Worker::~Worker() {
-  task_queue_.Push(NULL);
-  LOG(INFO) << "Worker destroy, waiting for task thread exit";
-  this->Join();
-  LOG(INFO) << "worker thread exited";
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    stopped_ = true;
+  }
+  idle_cond_.notify_all();
+  LOG(INFO) << "Worker destroy, waiting for task threads exit";
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i].join();
+  }
+  LOG(INFO) << "worker threads exited";
   msgqueue_destroy(event_queue_);
   LOG(INFO) << "msgqueue destroyed";
+  if (!done_tasks_.empty()) {
+    LOG(WARNING) << done_tasks_.size() << " task callbacks dropped";
+    for (size_t i = 0; i < done_tasks_.size(); ++i) {
+      delete done_tasks_[i];
+    }
+  }
+}
+
+void Worker::Submit(Task* task) {
+  task->submit_time = base::GetTimeInUsec();
+  int depth = ++queue_depth_;
+  int max_depth = max_queue_depth_;
+  while (depth > max_depth &&
+         !max_queue_depth_.compare_exchange_weak(max_depth, depth)) {
+  }
+
+  TaskQueue& q = *queues_[next_queue_++ % queues_.size()];
+  {
+    std::lock_guard<std::mutex> lock(q.mutex);
+    q.tasks.push_back(task);
+  }
+  // a thread going idle bumps idle_threads_ before it checks queue_depth_,
+  // so either it sees the new task or we see it and wake it up
+  if (idle_threads_ > 0) {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    idle_cond_.notify_one();
+  }
+}
+
+// take from the front of our own queue, steal from the back of the others
+bool Worker::TakeTask(int index, Task** task) {
+  const int n = queues_.size();
+  for (int i = 0; i < n; ++i) {
+    TaskQueue& q = *queues_[(index + i) % n];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty()) {
+      continue;
+    }
+    if (i == 0) {
+      *task = q.tasks.front();
+      q.tasks.pop_front();
+    } else {
+      *task = q.tasks.back();
+      q.tasks.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+
+void Worker::Complete(Task* task) {
+  bool need_wakeup = false;
+  {
+    std::lock_guard<std::mutex> lock(done_mutex_);
+    need_wakeup = done_tasks_.empty();
+    done_tasks_.push_back(task);
+  }
+  if (need_wakeup) {
+    int ret = msgqueue_push(event_queue_, this);
+    CHECK(ret == 0) << "msgqueue_push failed";
+  }
 }
 
 void Worker::Callback(void* data, void* self) {
-  Task* task = (Task*)data;
-  task->Callback();
-  delete task;
+  Worker* worker = (Worker*)self;
+  vector<Task*> tasks;
+  {
+    std::lock_guard<std::mutex> lock(worker->done_mutex_);
+    tasks.swap(worker->done_tasks_);
+  }
+  VLOG(6) << "task callbacks batch size: " << tasks.size();
+  int64 now = base::GetTimeInUsec();
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    int64 latency = now - tasks[i]->submit_time;
+    worker->total_latency_ += latency;
+    if (latency > worker->max_latency_) {
+      worker->max_latency_ = latency;
+    }
+    tasks[i]->Callback();
+    delete tasks[i];
+  }
+  worker->completed_number_ += tasks.size();
 }
 
-void Worker::Run() {
+void Worker::Run(int index) {
   while (true) {
-    VLOG(8) << "task queue size:" <<  task_queue_.Size();
-    if (task_queue_.Empty()) {
-      base::MilliSleep(100); 
+    Task* task = NULL;
+    if (TakeTask(index, &task)) {
+      --queue_depth_;
+      VLOG(6) << "before run task";
+      task->Run();
+      VLOG(6) << "after run task";
+      Complete(task);
       continue;
     }
-    Task* task = task_queue_.Front();
-    if (task == NULL) {
+    std::unique_lock<std::mutex> lock(idle_mutex_);
+    ++idle_threads_;
+    idle_cond_.wait(lock, [this]() {
+      return stopped_ || queue_depth_ > 0;
+    });
+    --idle_threads_;
+    if (stopped_ && queue_depth_ == 0) {
       break;
     }
-    VLOG(6) << "before run task";
-    task->Run();
-    VLOG(6) << "after run task";
-    int ret = msgqueue_push(event_queue_, task);
-    if (ret == -1) {
-      LOG(WARNING) << "msgqueue_push failed, will try 100ms later";
-      base::MilliSleep(100); 
-    } else {
-      task_queue_.Pop(task);
-    }
   }
   LOG(INFO) << "Worker thread exit";
 }
 
+void Worker::GetReport(Json::Value& report) const {
+  int64 completed = completed_number_;
+  report["worker_threads"] = (Json::Int64)threads_.size();
+  report["queue_depth"] = (int)queue_depth_;
+  report["max_queue_depth"] = (int)max_queue_depth_;
+  report["completed_number"] = (Json::Int64)completed;
+  report["avg_latency_us"] =
+      (Json::Int64)(completed > 0 ? total_latency_ / completed : 0);
+  report["max_latency_us"] = (Json::Int64)max_latency_;
+}
+
 }  // namespace xcomet
@@ -2,20 +2,28 @@
 #define SRC_WORKER_H_
 
 #include <event.h>
-#include "deps/base/thread.h"
-#include "deps/base/concurrent_queue.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include "deps/base/basictypes.h"
+#include "deps/base/flags.h"
+#include "deps/jsoncpp/include/json/json.h"
 #include "src/include_std.h"
 #include "src/event_msgqueue.h"
 
-DECLARE_int32(task_queue_warning_size);
+DECLARE_int32(worker_threads);
 
 namespace xcomet {
 
 class Task {
  public:
+  Task() : submit_time(0) {}
   virtual ~Task() {}
   virtual void Run() = 0;
   virtual void Callback() = 0;
+
+  // in microseconds, for the submit-to-callback latency
+  int64 submit_time;
 };
 
 template <typename R>
@@ -66,39 +74,66 @@ class TaskImpl<void> : public Task {
 };
 
 
-class Worker : public base::Thread {
+// A pool of threads sharing a work-stealing set of task queues. Tasks run
+// on the pool and their callbacks come back to the event loop of |evbase|,
+// delivered in batches with a single wakeup.
+class Worker {
  public:
-  Worker(struct event_base* evbase);
+  // |thread_num| <= 0 means FLAGS_worker_threads
+  explicit Worker(struct event_base* evbase, int thread_num = 0);
   ~Worker();
 
   void Do(function<void ()> runner, function<void ()> cb) {
-    size_t taskq_size = task_queue_.Size();
-    if(taskq_size >= size_t(FLAGS_task_queue_warning_size)) {
-      LOG(WARNING) << "taskqueue is overloaded, size: " << taskq_size;
-    }
-    task_queue_.Push(new TaskImpl<void>(runner, cb));
+    Submit(new TaskImpl<void>(runner, cb));
   }
 
   template <typename R>
   void Do(function<R ()> runner, function<void (R)> cb) {
-    size_t taskq_size = task_queue_.Size();
-    if(taskq_size >= size_t(FLAGS_task_queue_warning_size)) {
-      LOG(WARNING) << "taskqueue is overloaded, size: " << taskq_size;
-    }
-    task_queue_.Push(new TaskImpl<R>(runner, cb));
+    Submit(new TaskImpl<R>(runner, cb));
   }
 
   void RunInMainLoop(function<void ()> cb) {
     Do(&DoNothing, cb);
   }
 
+  // tasks submitted but not yet picked up by a thread
+  int QueueDepth() const {
+    return queue_depth_;
+  }
+
+  void GetReport(Json::Value& report) const;
+
  private:
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<Task*> tasks;
+  };
+
   static void DoNothing() {}
   static void Callback(void* data, void* self);
-  virtual void Run();
+  void Submit(Task* task);
+  bool TakeTask(int index, Task** task);
+  void Complete(Task* task);
+  void Run(int index);
+
   struct event_base* evbase_;
   struct event_msgqueue* event_queue_;
-  base::ConcurrentQueue<Task*> task_queue_;
+  vector<shared_ptr<TaskQueue> > queues_;
+  vector<thread> threads_;
+  atomic<unsigned> next_queue_;
+  atomic<int> queue_depth_;
+  atomic<bool> stopped_;
+  atomic<int> idle_threads_;
+  std::mutex idle_mutex_;
+  std::condition_variable idle_cond_;
+
+  std::mutex done_mutex_;
+  vector<Task*> done_tasks_;
+
+  atomic<int> max_queue_depth_;
+  atomic<int64> completed_number_;
+  atomic<int64> total_latency_;
+  atomic<int64> max_latency_;
 };
 
 }  // namespace xcomet
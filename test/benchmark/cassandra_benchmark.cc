@@ -0,0 +1,149 @@
+#include <event.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "deps/base/at_exit.h"
+#include "deps/base/flags.h"
+#include "deps/base/logging.h"
+#include "deps/base/time.h"
+#include "src/loop_executor.h"
+#include "src/storage/cassandra_storage.h"
+#include "test/unittest/cassandra_mock.h"
+
+DEFINE_int32(operations, 10000, "calls of each case");
+DEFINE_int32(members, 100, "users of a channel fanout or a subscription");
+DEFINE_int32(message_size, 100, "bytes of each message");
+DECLARE_string(cassandra_ack_layout);
+
+// The requests CassandraStorage sends for its calls, against the stand-in
+// driver of test/unittest/cassandra_mock.cc, so only the client side is
+// timed. A request is a round trip, a parse is a query sent as text which
+// the coordinator parses again.
+
+namespace xcomet {
+
+static struct event_base* evbase = NULL;
+static int64 done = 0;
+
+static void OnDone(Error err) {
+  CHECK(err == NO_ERROR) << err;
+  ++done;
+}
+
+// the callbacks are posted to the loop
+static void Drain(int64 expected) {
+  while (done < expected) {
+    event_base_loop(evbase, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+  }
+}
+
+static void Report(const char* name,
+                   int64 calls,
+                   int64 elapsed_us,
+                   const CassandraMock::Stats& stats) {
+  printf("%-20s calls=%-6" PRId64 " requests/call=%-6.2f "
+         "statements/call=%-6.2f parses=%-4" PRId64 " bytes/call=%-8.1f "
+         "(as text %-8.1f) %.2fus/call\n",
+         name, calls,
+         static_cast<double>(stats.requests) / calls,
+         static_cast<double>(stats.statements) / calls,
+         stats.parses,
+         static_cast<double>(stats.bytes) / calls,
+         static_cast<double>(stats.text_bytes) / calls,
+         static_cast<double>(elapsed_us) / calls);
+}
+
+template<typename Fn>
+static void RunCase(const char* name, int64 calls, Fn fn) {
+  CassandraMock::Reset();
+  done = 0;
+  int64 start = base::GetTimeInUsec();
+  for (int64 i = 0; i < calls; ++i) {
+    fn(i);
+  }
+  Drain(calls);
+  Report(name, calls, base::GetTimeInUsec() - start,
+         CassandraMock::GetStats());
+}
+
+void RunBenchmark() {
+  CassandraMock::Reset();
+  CassandraStorage storage;
+  Storage* s = &storage;
+  printf("prepared at startup: %" PRId64 "\n",
+         CassandraMock::GetStats().prepares);
+  StringPtr msg(new string(FLAGS_message_size, 'x'));
+  const int members = FLAGS_members;
+  const int fanouts = std::max(FLAGS_operations / members, 1);
+
+  RunCase("SaveMessage", FLAGS_operations, [s, &msg](int64 i) {
+    s->SaveMessage(msg, "user" + std::to_string(i % 1000), i, 0, OnDone);
+  });
+  // the offline members of a fanout slice, one user each
+  RunCase("SaveMessages fanout", fanouts, [s, &msg, members](int64 i) {
+    vector<SaveMessageEntry> entries(members);
+    for (int j = 0; j < members; ++j) {
+      entries[j].msg = msg;
+      entries[j].uid = "user" + std::to_string(j);
+      entries[j].seq = i;
+      entries[j].ttl = 0;
+    }
+    s->SaveMessages(entries, OnDone);
+  });
+  // a burst to one user, in one partition
+  RunCase("SaveMessages burst", fanouts, [s, &msg, members](int64 i) {
+    vector<SaveMessageEntry> entries(members);
+    for (int j = 0; j < members; ++j) {
+      entries[j].msg = msg;
+      entries[j].uid = "user" + std::to_string(i);
+      entries[j].seq = j;
+      entries[j].ttl = 0;
+    }
+    s->SaveMessages(entries, OnDone);
+  });
+  RunCase("AddUserToChannel", FLAGS_operations, [s](int64 i) {
+    s->AddUserToChannel("user" + std::to_string(i), "channel", OnDone);
+  });
+  RunCase("AddUsersToChannel", fanouts, [s, members](int64 i) {
+    vector<string> uids(members);
+    for (int j = 0; j < members; ++j) {
+      uids[j] = "user" + std::to_string(i * members + j);
+    }
+    s->AddUsersToChannel(uids, "channel", OnDone);
+  });
+  RunCase("UpdateAck", FLAGS_operations, [s](int64 i) {
+    s->UpdateAck("user" + std::to_string(i % 1000), i, OnDone);
+  });
+  RunCase("GetMessage", FLAGS_operations, [s](int64 i) {
+    s->GetMessage("user" + std::to_string(i % 1000),
+                  [](Error err, MessageDataSet result) {
+      CHECK(err == NO_ERROR) << err;
+      ++done;
+    });
+  });
+
+  // the ack read with the messages
+  FLAGS_cassandra_ack_layout = "static";
+  CassandraStorage static_storage;
+  Storage* ss = &static_storage;
+  RunCase("GetMessage static", FLAGS_operations, [ss](int64 i) {
+    ss->GetMessage("user" + std::to_string(i % 1000),
+                   [](Error err, MessageDataSet result) {
+      CHECK(err == NO_ERROR) << err;
+      ++done;
+    });
+  });
+}
+
+}  // namespace xcomet
+
+int main(int argc, char* argv[]) {
+  base::AtExitManager at_exit;
+  base::ParseCommandLineFlags(&argc, &argv, false);
+  xcomet::evbase = event_base_new();
+  xcomet::LoopExecutor::Init(xcomet::evbase);
+  xcomet::RunBenchmark();
+  xcomet::LoopExecutor::Destroy();
+  event_base_free(xcomet::evbase);
+  return 0;
+}
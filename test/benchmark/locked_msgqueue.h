@@ -0,0 +1,33 @@
+/*
+ * locked_msgqueue.h
+ *
+ * The mutex + socketpair event_msgqueue, kept to benchmark the ring against
+ *
+ * Andrew Danforth <acd@weirdness.net>, October 2006
+ *
+ * Copyright (c) Andrew Danforth, 2006
+ *
+ */
+
+#ifndef TEST_BENCHMARK_LOCKED_MSGQUEUE_H_
+#define TEST_BENCHMARK_LOCKED_MSGQUEUE_H_
+
+#include <event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct locked_msgqueue;
+
+struct locked_msgqueue *locked_msgqueue_new(struct event_base *, unsigned int, void (*)(void *, void *), void *);
+int locked_msgqueue_push(struct locked_msgqueue *, void *);
+unsigned int locked_msgqueue_length(struct locked_msgqueue *);
+void locked_msgqueue_destroy(struct locked_msgqueue*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,107 @@
+#include <event.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#include "deps/base/flags.h"
+#include "deps/base/logging.h"
+#include "deps/base/time.h"
+#include "src/event_msgqueue.h"
+#include "test/benchmark/locked_msgqueue.h"
+
+DEFINE_int32(producers, 4, "number of producer threads");
+DEFINE_int32(messages, 1000000, "messages pushed by each producer");
+DEFINE_int32(queue_size, 65536, "capacity of the queue under test");
+
+namespace xcomet {
+
+struct RingQueue {
+  typedef struct event_msgqueue Type;
+  static const char* Name() { return "lock-free ring + eventfd"; }
+  static Type* New(struct event_base* base,
+                   void (*cb)(void*, void*),
+                   void* arg) {
+    return msgqueue_new(base, FLAGS_queue_size, cb, arg);
+  }
+  static int Push(Type* q, void* data) { return msgqueue_push(q, data); }
+  static void Destroy(Type* q) { msgqueue_destroy(q); }
+};
+
+struct LockedQueue {
+  typedef struct locked_msgqueue Type;
+  static const char* Name() { return "mutex + socketpair"; }
+  static Type* New(struct event_base* base,
+                   void (*cb)(void*, void*),
+                   void* arg) {
+    return locked_msgqueue_new(base, FLAGS_queue_size, cb, arg);
+  }
+  static int Push(Type* q, void* data) { return locked_msgqueue_push(q, data); }
+  static void Destroy(Type* q) { locked_msgqueue_destroy(q); }
+};
+
+struct Consumer {
+  struct event_base* base;
+  int64 expected;
+  int64 received;
+};
+
+static void OnMessage(void* data, void* arg) {
+  Consumer* consumer = static_cast<Consumer*>(arg);
+  if (++consumer->received == consumer->expected) {
+    event_base_loopbreak(consumer->base);
+  }
+}
+
+template <typename Queue>
+void RunBenchmark() {
+  Consumer consumer;
+  consumer.base = event_base_new();
+  consumer.expected = (int64)FLAGS_producers * FLAGS_messages;
+  consumer.received = 0;
+  typename Queue::Type* queue = Queue::New(consumer.base, OnMessage, &consumer);
+  CHECK(queue != NULL);
+
+  int64 full_count = 0;
+  std::vector<std::thread> producers;
+  int64 start = base::GetTimeInMs();
+  for (int i = 0; i < FLAGS_producers; ++i) {
+    producers.push_back(std::thread([queue, &full_count]() {
+      int64 full = 0;
+      for (int j = 0; j < FLAGS_messages; ++j) {
+        while (Queue::Push(queue, queue) != 0) {
+          ++full;
+          std::this_thread::yield();
+        }
+      }
+      __sync_fetch_and_add(&full_count, full);
+    }));
+  }
+  event_base_dispatch(consumer.base);
+  int64 elapsed = base::GetTimeInMs() - start;
+  for (size_t i = 0; i < producers.size(); ++i) {
+    producers[i].join();
+  }
+  CHECK(consumer.received == consumer.expected);
+
+  printf("%-26s producers=%d messages=%" PRId64 " elapsed=%" PRId64 "ms "
+         "throughput=%.0f msg/s full_retries=%" PRId64 "\n",
+         Queue::Name(),
+         FLAGS_producers,
+         consumer.expected,
+         elapsed,
+         elapsed > 0 ? consumer.expected * 1000.0 / elapsed : 0.0,
+         full_count);
+
+  Queue::Destroy(queue);
+  event_base_free(consumer.base);
+}
+
+}  // namespace xcomet
+
+int main(int argc, char* argv[]) {
+  base::ParseCommandLineFlags(&argc, &argv, false);
+  xcomet::RunBenchmark<xcomet::LockedQueue>();
+  xcomet::RunBenchmark<xcomet::RingQueue>();
+  return 0;
+}
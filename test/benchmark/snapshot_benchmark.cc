@@ -0,0 +1,64 @@
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "deps/base/at_exit.h"
+#include "deps/base/file.h"
+#include "deps/base/flags.h"
+#include "deps/base/logging.h"
+#include "deps/base/time.h"
+#include "src/storage/inmemory_storage.h"
+
+DEFINE_int32(users, 1000000, "number of users with offline messages");
+DEFINE_int32(messages, 5, "offline messages of each user");
+DEFINE_int32(message_size, 100, "bytes of each message");
+
+DECLARE_string(inmemory_data_dir);
+DECLARE_bool(inmemory_wal);
+DECLARE_int32(inmemory_snapshot_shards);
+
+namespace xcomet {
+
+void RunBenchmark() {
+  base::File::DeleteRecursively(FLAGS_inmemory_data_dir);
+  StringPtr msg(new string(FLAGS_message_size, 'x'));
+  int64 start = base::GetTimeInMs();
+  {
+    InMemoryStorage storage;
+    Storage* s = &storage;
+    for (int i = 0; i < FLAGS_users; ++i) {
+      string uid = "user" + std::to_string(i);
+      for (int j = 0; j < FLAGS_messages; ++j) {
+        s->SaveMessage(msg, uid, j + 1, 0, [](Error err) {});
+      }
+    }
+    printf("filled users=%d messages=%d elapsed=%" PRId64 "ms\n",
+           FLAGS_users, FLAGS_messages, base::GetTimeInMs() - start);
+    start = base::GetTimeInMs();
+  }
+  int64 dump_elapsed = base::GetTimeInMs() - start;
+
+  start = base::GetTimeInMs();
+  {
+    InMemoryStorage storage;
+    int64 load_elapsed = base::GetTimeInMs() - start;
+    printf("shards=%d snapshot=%" PRId64 "ms load=%" PRId64 "ms "
+           "throughput=%.0f users/s\n",
+           FLAGS_inmemory_snapshot_shards,
+           dump_elapsed,
+           load_elapsed,
+           load_elapsed > 0 ? FLAGS_users * 1000.0 / load_elapsed : 0.0);
+  }
+  base::File::DeleteRecursively(FLAGS_inmemory_data_dir);
+}
+
+}  // namespace xcomet
+
+int main(int argc, char* argv[]) {
+  base::AtExitManager at_exit;
+  FLAGS_inmemory_data_dir = "/tmp/snapshot_benchmark";
+  // only the snapshot is measured
+  FLAGS_inmemory_wal = false;
+  base::ParseCommandLineFlags(&argc, &argv, false);
+  xcomet::RunBenchmark();
+  return 0;
+}
@@ -0,0 +1,433 @@
+#include "test/unittest/cassandra_mock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include "deps/base/logging.h"
+#include "deps/cassandra/cpp-driver/include/cassandra.h"
+
+using xcomet::CassandraMock;
+
+struct CassCluster_ {
+};
+
+struct CassSession_ {
+};
+
+struct CassPrepared_ {
+  string cql;
+};
+
+struct CassStatement_ {
+  string cql;
+  bool prepared;
+  vector<string> values;
+};
+
+struct CassBatch_ {
+  vector<CassStatement_> statements;
+};
+
+struct CassValue_ {
+  string data;
+};
+
+struct CassRow_ {
+  map<string, CassValue_> columns;
+};
+
+struct CassResult_ {
+  vector<CassRow_> rows;
+};
+
+struct CassIterator_ {
+  const CassResult_* result;
+  // of the row returned by the last next, -1 before the first
+  int index;
+};
+
+struct CassFuture_ {
+  CassError code;
+  string error;
+  CassResult_ result;
+  const CassPrepared_* prepared;
+};
+
+namespace {
+
+// a cassandra prepared id is the md5 of the query
+const int64 PREPARED_ID_BYTES = 16;
+
+struct MockState {
+  std::mutex mutex;
+  CassandraMock::Stats stats;
+  vector<std::pair<string, vector<CassandraMock::Row> > > rows;
+  vector<string> failures;
+  vector<string> executed;
+
+  MockState() {
+    memset(&stats, 0, sizeof(stats));
+  }
+};
+
+MockState& State() {
+  static MockState* state = new MockState();
+  return *state;
+}
+
+bool StartsWith(const string& s, const string& prefix) {
+  return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+// called with the lock held, the statements of a request
+CassFuture* Run(const vector<const CassStatement_*>& statements) {
+  MockState& state = State();
+  CassFuture* future = new CassFuture_();
+  future->code = CASS_OK;
+  future->prepared = NULL;
+  ++state.stats.requests;
+  for (size_t i = 0; i < statements.size(); ++i) {
+    const CassStatement_* statement = statements[i];
+    ++state.stats.statements;
+    if (statement->prepared) {
+      state.stats.bytes += PREPARED_ID_BYTES;
+    } else {
+      ++state.stats.parses;
+      state.stats.bytes += statement->cql.size();
+    }
+    state.stats.text_bytes += statement->cql.size();
+    string executed = statement->cql;
+    for (size_t j = 0; j < statement->values.size(); ++j) {
+      state.stats.bytes += statement->values[j].size();
+      state.stats.text_bytes += statement->values[j].size();
+      executed += " " + statement->values[j];
+    }
+    state.executed.push_back(executed);
+    for (size_t j = 0; j < state.failures.size(); ++j) {
+      if (StartsWith(statement->cql, state.failures[j])) {
+        future->code = CASS_ERROR_SERVER_INVALID_QUERY;
+        future->error = "mock failure";
+      }
+    }
+    for (size_t j = 0; j < state.rows.size(); ++j) {
+      if (!StartsWith(statement->cql, state.rows[j].first)) {
+        continue;
+      }
+      const vector<CassandraMock::Row>& rows = state.rows[j].second;
+      for (size_t k = 0; k < rows.size(); ++k) {
+        future->result.rows.push_back(CassRow_());
+        for (auto& column : rows[k]) {
+          future->result.rows.back().columns[column.first].data =
+              column.second;
+        }
+      }
+      break;
+    }
+  }
+  return future;
+}
+
+CassStatement_* NewStatement(const string& cql, bool prepared) {
+  CassStatement_* statement = new CassStatement_();
+  statement->cql = cql;
+  statement->prepared = prepared;
+  return statement;
+}
+
+CassError Bind(CassStatement* statement, size_t index, const string& value) {
+  if (statement->values.size() <= index) {
+    statement->values.resize(index + 1);
+  }
+  statement->values[index] = value;
+  return CASS_OK;
+}
+
+}  // namespace
+
+namespace xcomet {
+
+void CassandraMock::Reset() {
+  MockState& state = State();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  memset(&state.stats, 0, sizeof(state.stats));
+  state.rows.clear();
+  state.failures.clear();
+  state.executed.clear();
+}
+
+CassandraMock::Stats CassandraMock::GetStats() {
+  MockState& state = State();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return state.stats;
+}
+
+void CassandraMock::SetRows(const string& cql, const vector<Row>& rows) {
+  MockState& state = State();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.rows.push_back(make_pair(cql, rows));
+}
+
+void CassandraMock::SetFailure(const string& cql) {
+  MockState& state = State();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.failures.push_back(cql);
+}
+
+vector<string> CassandraMock::Executed() {
+  MockState& state = State();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return state.executed;
+}
+
+}  // namespace xcomet
+
+CassCluster* cass_cluster_new() {
+  return new CassCluster_();
+}
+
+void cass_cluster_free(CassCluster* cluster) {
+  delete cluster;
+}
+
+CassError cass_cluster_set_contact_points(CassCluster* cluster,
+                                          const char* contact_points) {
+  return CASS_OK;
+}
+
+CassError cass_cluster_set_core_connections_per_host(CassCluster* cluster,
+                                                     unsigned num) {
+  return CASS_OK;
+}
+
+CassError cass_cluster_set_max_connections_per_host(CassCluster* cluster,
+                                                    unsigned num) {
+  return CASS_OK;
+}
+
+CassError cass_cluster_set_num_threads_io(CassCluster* cluster,
+                                          unsigned num_threads) {
+  return CASS_OK;
+}
+
+CassError cass_cluster_set_pending_requests_high_water_mark(
+    CassCluster* cluster, unsigned num_requests) {
+  return CASS_OK;
+}
+
+CassError cass_cluster_set_pending_requests_low_water_mark(
+    CassCluster* cluster, unsigned num_requests) {
+  return CASS_OK;
+}
+
+CassError cass_cluster_set_queue_size_io(CassCluster* cluster,
+                                         unsigned queue_size) {
+  return CASS_OK;
+}
+
+CassSession* cass_session_new() {
+  return new CassSession_();
+}
+
+void cass_session_free(CassSession* session) {
+  delete session;
+}
+
+CassFuture* cass_session_connect_keyspace(CassSession* session,
+                                          const CassCluster* cluster,
+                                          const char* keyspace) {
+  CassFuture* future = new CassFuture_();
+  future->code = CASS_OK;
+  future->prepared = NULL;
+  return future;
+}
+
+CassFuture* cass_session_close(CassSession* session) {
+  CassFuture* future = new CassFuture_();
+  future->code = CASS_OK;
+  future->prepared = NULL;
+  return future;
+}
+
+CassFuture* cass_session_prepare(CassSession* session, const char* query) {
+  MockState& state = State();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  ++state.stats.prepares;
+  CassFuture* future = new CassFuture_();
+  future->code = CASS_OK;
+  CassPrepared* prepared = new CassPrepared_();
+  prepared->cql = query;
+  future->prepared = prepared;
+  return future;
+}
+
+CassFuture* cass_session_execute(CassSession* session,
+                                 const CassStatement* statement) {
+  MockState& state = State();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return Run(vector<const CassStatement_*>(1, statement));
+}
+
+CassFuture* cass_session_execute_batch(CassSession* session,
+                                       const CassBatch* batch) {
+  MockState& state = State();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  ++state.stats.batches;
+  vector<const CassStatement_*> statements;
+  for (size_t i = 0; i < batch->statements.size(); ++i) {
+    statements.push_back(&batch->statements[i]);
+  }
+  return Run(statements);
+}
+
+void cass_future_free(CassFuture* future) {
+  delete future;
+}
+
+// the futures are ready when returned
+CassError cass_future_set_callback(CassFuture* future,
+                                   CassFutureCallback callback,
+                                   void* data) {
+  callback(future, data);
+  return CASS_OK;
+}
+
+void cass_future_wait(CassFuture* future) {
+}
+
+CassError cass_future_error_code(CassFuture* future) {
+  return future->code;
+}
+
+void cass_future_error_message(CassFuture* future,
+                               const char** message,
+                               size_t* message_length) {
+  *message = future->error.c_str();
+  *message_length = future->error.size();
+}
+
+const CassResult* cass_future_get_result(CassFuture* future) {
+  return new CassResult_(future->result);
+}
+
+// taken by the caller like the driver does
+const CassPrepared* cass_future_get_prepared(CassFuture* future) {
+  const CassPrepared* prepared = future->prepared;
+  future->prepared = NULL;
+  return prepared;
+}
+
+void cass_result_free(const CassResult* result) {
+  delete result;
+}
+
+CassStatement* cass_statement_new(const char* query, size_t parameter_count) {
+  return NewStatement(query, false);
+}
+
+CassStatement* cass_prepared_bind(const CassPrepared* prepared) {
+  return NewStatement(prepared->cql, true);
+}
+
+void cass_prepared_free(const CassPrepared* prepared) {
+  delete prepared;
+}
+
+void cass_statement_free(CassStatement* statement) {
+  delete statement;
+}
+
+CassError cass_statement_bind_int32(CassStatement* statement,
+                                    size_t index,
+                                    cass_int32_t value) {
+  return Bind(statement, index, std::to_string(value));
+}
+
+CassError cass_statement_bind_int64(CassStatement* statement,
+                                    size_t index,
+                                    cass_int64_t value) {
+  return Bind(statement, index, std::to_string(value));
+}
+
+CassError cass_statement_bind_string(CassStatement* statement,
+                                     size_t index,
+                                     const char* value) {
+  return Bind(statement, index, value);
+}
+
+CassBatch* cass_batch_new(CassBatchType type) {
+  return new CassBatch_();
+}
+
+void cass_batch_free(CassBatch* batch) {
+  delete batch;
+}
+
+// copied, the statement may be freed once added
+CassError cass_batch_add_statement(CassBatch* batch,
+                                   CassStatement* statement) {
+  batch->statements.push_back(*statement);
+  return CASS_OK;
+}
+
+CassIterator* cass_iterator_from_result(const CassResult* result) {
+  CassIterator* iter = new CassIterator_();
+  iter->result = result;
+  iter->index = -1;
+  return iter;
+}
+
+void cass_iterator_free(CassIterator* iterator) {
+  delete iterator;
+}
+
+cass_bool_t cass_iterator_next(CassIterator* iterator) {
+  if (iterator->index + 1 >= static_cast<int>(iterator->result->rows.size())) {
+    return cass_false;
+  }
+  ++iterator->index;
+  return cass_true;
+}
+
+const CassRow* cass_iterator_get_row(CassIterator* iterator) {
+  return &iterator->result->rows[iterator->index];
+}
+
+const CassValue* cass_row_get_column_by_name(const CassRow* row,
+                                             const char* name) {
+  auto iter = row->columns.find(name);
+  return iter == row->columns.end() ? NULL : &iter->second;
+}
+
+CassError cass_value_get_int32(const CassValue* value,
+                               cass_int32_t* output) {
+  if (value == NULL) {
+    return CASS_ERROR_LIB_NULL_VALUE;
+  }
+  *output = static_cast<cass_int32_t>(::strtol(value->data.c_str(), NULL, 10));
+  return CASS_OK;
+}
+
+CassError cass_value_get_int64(const CassValue* value,
+                               cass_int64_t* output) {
+  if (value == NULL) {
+    return CASS_ERROR_LIB_NULL_VALUE;
+  }
+  *output = ::strtoll(value->data.c_str(), NULL, 10);
+  return CASS_OK;
+}
+
+CassError cass_value_get_string(const CassValue* value,
+                                const char** output,
+                                size_t* output_size) {
+  if (value == NULL) {
+    return CASS_ERROR_LIB_NULL_VALUE;
+  }
+  *output = value->data.data();
+  *output_size = value->data.size();
+  return CASS_OK;
+}
+
+// a missing column is a NULL value, a set one is never null
+cass_bool_t cass_value_is_null(const CassValue* value) {
+  return value == NULL ? cass_true : cass_false;
+}
@@ -0,0 +1,43 @@
+#ifndef TEST_UNITTEST_CASSANDRA_MOCK_H_
+#define TEST_UNITTEST_CASSANDRA_MOCK_H_
+
+#include "deps/base/basictypes.h"
+#include "src/include_std.h"
+
+namespace xcomet {
+
+// A stand-in for the driver functions CassandraStorage uses, linked instead
+// of the driver to test it without a cluster. A request completes at once
+// in the calling thread with the rows set for its query, and is counted.
+class CassandraMock {
+ public:
+  struct Stats {
+    // queries prepared by cass_session_prepare
+    int64 prepares;
+    // statements sent as query text, parsed by the coordinator every time
+    int64 parses;
+    // executes and batches, each is a round trip
+    int64 requests;
+    int64 batches;
+    int64 statements;
+    // the query text or the prepared id, and the values
+    int64 bytes;
+    // what |bytes| would be with every statement sent as query text
+    int64 text_bytes;
+  };
+  // column name to value, the numbers in decimal
+  typedef map<string, string> Row;
+
+  // forgets the rows, the failures and the counters
+  static void Reset();
+  static Stats GetStats();
+  // the rows returned to the queries starting with |cql|
+  static void SetRows(const string& cql, const vector<Row>& rows);
+  // the requests with a query starting with |cql| fail
+  static void SetFailure(const string& cql);
+  // the statements run since Reset, each is the query and its values
+  static vector<string> Executed();
+};
+
+}  // namespace xcomet
+#endif  // TEST_UNITTEST_CASSANDRA_MOCK_H_
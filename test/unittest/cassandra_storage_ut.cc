@@ -0,0 +1,304 @@
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+#include "deps/base/flags.h"
+#include "deps/base/logging.h"
+#include "src/include_std.h"
+#include "src/storage/cassandra_storage.h"
+#include "test/unittest/cassandra_mock.h"
+#include "test/unittest/event_loop_setup.h"
+
+DECLARE_int32(cassandra_batch_size);
+DECLARE_string(cassandra_ack_layout);
+
+namespace xcomet {
+
+// the queries of the user, message and channel tables, the others are only
+// prepared with --channel_timeline
+static const int64 BASE_QUERY_NUMBER = 8;
+static const int64 QUERY_NUMBER = 14;
+// the user table isn't read with the static acks, both are while migrating
+static const int64 STATIC_QUERY_NUMBER = 7;
+static const int64 MIGRATING_QUERY_NUMBER = 10;
+
+class CassandraStorageUnittest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    CassandraMock::Reset();
+    FLAGS_channel_timeline = false;
+    event_loop_setup_ = new EventLoopSetup();
+    done_ = 0;
+  }
+
+  virtual void TearDown() {
+    delete event_loop_setup_;
+    FLAGS_channel_timeline = false;
+    FLAGS_cassandra_ack_layout = "user";
+  }
+
+  // the callbacks run in the main loop
+  void WaitDone(int number) {
+    for (int i = 0; i < 1000 && done_ < number; ++i) {
+      ::usleep(1000);
+    }
+    CHECK_EQ(done_, number);
+  }
+
+  // the messages of a GetMessage joined by spaces
+  void GetMessage(Storage* s, const string& uid, string* messages) {
+    s->GetMessage(uid, [this, messages](Error err, MessageDataSet result) {
+      CHECK(err == NO_ERROR) << err;
+      for (size_t i = 0; i < result->size(); ++i) {
+        *messages += (i == 0 ? "" : " ") + *result->at(i);
+      }
+      ++done_;
+    });
+  }
+
+  std::atomic<int> done_;
+
+ private:
+  EventLoopSetup* event_loop_setup_;
+};
+
+TEST_F(CassandraStorageUnittest, PreparedOnce) {
+  CassandraStorage storage;
+  Storage* s = &storage;
+  CHECK_EQ(CassandraMock::GetStats().prepares, BASE_QUERY_NUMBER);
+  auto done = [this](Error err) {
+    CHECK(err == NO_ERROR) << err;
+    ++done_;
+  };
+  for (int i = 1; i <= 3; ++i) {
+    s->SaveMessage(StringPtr(new string("m")), "u1", i, 0, done);
+    s->UpdateAck("u1", i, done);
+    s->AddUserToChannel("u1", "c1", done);
+    s->RemoveUserFromChannel("u1", "c1", done);
+    s->GetMaxSeq("u1", [this](Error err, int seq) {
+      CHECK(err == NO_ERROR) << err;
+      ++done_;
+    });
+    s->GetChannelUsers("c1", [this](Error err, UserResultSet users) {
+      CHECK(err == NO_ERROR) << err;
+      ++done_;
+    });
+    s->GetMessage("u1", [this](Error err, MessageDataSet result) {
+      CHECK(err == NO_ERROR) << err;
+      ++done_;
+    });
+  }
+  WaitDone(21);
+  CassandraMock::Stats stats = CassandraMock::GetStats();
+  // only bound to the handles prepared at startup
+  CHECK_EQ(stats.prepares, BASE_QUERY_NUMBER);
+  CHECK_EQ(stats.parses, 0);
+  CHECK_GT(stats.requests, 0);
+}
+
+TEST_F(CassandraStorageUnittest, ChannelTimeline) {
+  FLAGS_channel_timeline = true;
+  CassandraMock::Row user;
+  user["last_ack"] = "1";
+  CassandraMock::SetRows("SELECT last_ack FROM user",
+                         vector<CassandraMock::Row>(1, user));
+  vector<CassandraMock::Row> messages(2);
+  messages[0]["body"] = "m3";
+  messages[1]["body"] = "m2";
+  CassandraMock::SetRows("SELECT body FROM message", messages);
+  // each channel has its own cursor, c2 was left and only has the cursor
+  // written after it
+  vector<CassandraMock::Row> channels(2);
+  channels[0]["cid"] = "c1";
+  channels[0]["joined"] = "true";
+  channels[0]["cursor"] = "100";
+  channels[1]["cid"] = "c2";
+  channels[1]["cursor"] = "300";
+  CassandraMock::SetRows("SELECT cid, joined, cursor FROM user_channel",
+                         channels);
+  CassandraMock::Row entry;
+  entry["cid"] = "c1";
+  entry["ts"] = "200";
+  entry["body"] = "t1";
+  CassandraMock::SetRows("SELECT cid, ts, body FROM channel_timeline",
+                         vector<CassandraMock::Row>(1, entry));
+
+  CassandraStorage storage;
+  Storage* s = &storage;
+  CHECK_EQ(CassandraMock::GetStats().prepares, QUERY_NUMBER);
+  s->GetOfflineMessage("u1", [this](Error err,
+                                    MessageDataSet result,
+                                    const ChannelCursors& cursors) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 3U);
+    CHECK_EQ(*result->at(0), "m2");
+    CHECK_EQ(*result->at(1), "m3");
+    CHECK_EQ(*result->at(2), "t1");
+    CHECK_EQ(cursors.size(), 1U);
+    CHECK_EQ(cursors.at("c1"), 200);
+    ++done_;
+  });
+  WaitDone(1);
+  vector<string> executed = CassandraMock::Executed();
+  CHECK_EQ(executed.size(), 4U);
+  CHECK_EQ(executed[3], "SELECT cid, ts, body FROM channel_timeline"
+                        " WHERE cid = ? AND ts > ? limit ?; c1 100 100");
+  CHECK_EQ(CassandraMock::GetStats().parses, 0);
+
+  // in the row of the membership
+  CassandraMock::Reset();
+  s->UpdateChannelCursor("u1", "c1", 200, [this](Error err) {
+    CHECK(err == NO_ERROR) << err;
+    ++done_;
+  });
+  WaitDone(2);
+  executed = CassandraMock::Executed();
+  CHECK_EQ(executed.size(), 1U);
+  CHECK_EQ(executed[0], "UPDATE user_channel SET cursor = ?"
+                        " WHERE uid = ? AND cid = ?; 200 u1 c1");
+}
+
+TEST_F(CassandraStorageUnittest, Batch) {
+  CassandraStorage storage;
+  Storage* s = &storage;
+  vector<SaveMessageEntry> entries;
+  for (int i = 1; i <= 5; ++i) {
+    SaveMessageEntry entry;
+    entry.msg = StringPtr(new string("m"));
+    entry.uid = i <= 3 ? "u1" : "u" + std::to_string(i);
+    entry.seq = i;
+    entry.ttl = 0;
+    entries.push_back(entry);
+  }
+  s->SaveMessages(entries, [this](Error err) {
+    CHECK(err == NO_ERROR) << err;
+    ++done_;
+  });
+  WaitDone(1);
+  // one batch for the partition of u1, the other users are single rows
+  CassandraMock::Stats stats = CassandraMock::GetStats();
+  CHECK_EQ(stats.requests, 3);
+  CHECK_EQ(stats.batches, 1);
+  CHECK_EQ(stats.statements, 5);
+
+  // the big partitions are split
+  const int batch_size = FLAGS_cassandra_batch_size;
+  FLAGS_cassandra_batch_size = 2;
+  vector<string> uids;
+  for (int i = 0; i < 5; ++i) {
+    uids.push_back("u" + std::to_string(i));
+  }
+  CassandraMock::Reset();
+  s->AddUsersToChannel(uids, "c1", [this](Error err) {
+    CHECK(err == NO_ERROR) << err;
+    ++done_;
+  });
+  WaitDone(2);
+  CHECK_EQ(CassandraMock::GetStats().requests, 3);
+  FLAGS_cassandra_batch_size = batch_size;
+
+  // one callback with the error, the last ack of a user is written
+  CassandraMock::Reset();
+  CassandraMock::SetFailure("UPDATE user SET last_ack");
+  vector<pair<string, int> > acks;
+  acks.push_back(make_pair("u1", 1));
+  acks.push_back(make_pair("u2", 1));
+  acks.push_back(make_pair("u1", 2));
+  s->UpdateAcks(acks, [this](Error err) {
+    CHECK(err != NO_ERROR);
+    ++done_;
+  });
+  WaitDone(3);
+  vector<string> executed = CassandraMock::Executed();
+  CHECK_EQ(executed.size(), 2U);
+  CHECK_EQ(executed[0], "UPDATE user SET last_ack = ? WHERE uid = ?; 2 u1");
+
+  s->SaveMessages(vector<SaveMessageEntry>(), [this](Error err) {
+    CHECK(err == NO_ERROR) << err;
+    ++done_;
+  });
+  WaitDone(4);
+}
+
+TEST_F(CassandraStorageUnittest, StaticAck) {
+  FLAGS_cassandra_ack_layout = "static";
+  vector<CassandraMock::Row> rows(3);
+  for (int i = 0; i < 3; ++i) {
+    rows[i]["seq"] = std::to_string(5 - i);
+    rows[i]["body"] = "m" + std::to_string(5 - i);
+    rows[i]["last_ack"] = "3";
+  }
+  CassandraMock::SetRows("SELECT seq, body, last_ack FROM message", rows);
+  CassandraStorage storage;
+  Storage* s = &storage;
+  CHECK_EQ(CassandraMock::GetStats().prepares, STATIC_QUERY_NUMBER);
+  string messages;
+  GetMessage(s, "u1", &messages);
+  WaitDone(1);
+  // read with the ack, the acked ones are dropped
+  CHECK_EQ(messages, "m4 m5");
+  CHECK_EQ(CassandraMock::GetStats().requests, 1);
+
+  // the static columns alone if there are no messages
+  CassandraMock::Reset();
+  CassandraMock::Row ack;
+  ack["last_ack"] = "5";
+  CassandraMock::SetRows("SELECT seq, body, last_ack FROM message",
+                         vector<CassandraMock::Row>(1, ack));
+  messages.clear();
+  GetMessage(s, "u1", &messages);
+  WaitDone(2);
+  CHECK_EQ(messages, "");
+
+  CassandraMock::Reset();
+  s->UpdateAck("u1", 7, [this](Error err) {
+    CHECK(err == NO_ERROR) << err;
+    ++done_;
+  });
+  WaitDone(3);
+  vector<string> executed = CassandraMock::Executed();
+  CHECK_EQ(executed.size(), 1U);
+  CHECK_EQ(executed[0], "UPDATE message SET last_ack = ? WHERE uid = ?; 7 u1");
+}
+
+TEST_F(CassandraStorageUnittest, MigratingAck) {
+  FLAGS_cassandra_ack_layout = "migrating";
+  vector<CassandraMock::Row> rows(2);
+  rows[0]["seq"] = "2";
+  rows[0]["body"] = "m2";
+  rows[1]["seq"] = "1";
+  rows[1]["body"] = "m1";
+  CassandraMock::SetRows("SELECT seq, body, last_ack FROM message", rows);
+  CassandraMock::Row user;
+  user["last_ack"] = "1";
+  CassandraMock::SetRows("SELECT last_ack FROM user",
+                         vector<CassandraMock::Row>(1, user));
+  CassandraStorage storage;
+  Storage* s = &storage;
+  CHECK_EQ(CassandraMock::GetStats().prepares, MIGRATING_QUERY_NUMBER);
+  string messages;
+  GetMessage(s, "u1", &messages);
+  WaitDone(1);
+  // not copied yet, read from the user table and copied
+  CHECK_EQ(messages, "m2");
+  vector<string> executed = CassandraMock::Executed();
+  CHECK_EQ(executed.size(), 3U);
+  CHECK_EQ(executed[1], "SELECT last_ack FROM user where uid = ?; u1");
+  CHECK_EQ(executed[2], "UPDATE message SET last_ack = ? WHERE uid = ?; 1 u1");
+  Json::Value report;
+  storage.GetReport(report);
+  CHECK_EQ(report["ack_fallback_number"].asInt64(), 1);
+
+  // written to both
+  CassandraMock::Reset();
+  s->UpdateAck("u1", 2, [this](Error err) {
+    CHECK(err == NO_ERROR) << err;
+    ++done_;
+  });
+  WaitDone(2);
+  executed = CassandraMock::Executed();
+  CHECK_EQ(executed.size(), 2U);
+  CHECK_EQ(CassandraMock::GetStats().requests, 2);
+}
+
+}  // namespace xcomet
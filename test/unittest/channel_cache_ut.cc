@@ -0,0 +1,83 @@
+#include "gtest/gtest.h"
+
+#include "deps/base/logging.h"
+#include "src/channel_cache.h"
+
+namespace xcomet {
+
+static ChannelInfo MakeChannel(const string& cid, int members) {
+  ChannelInfo channel(cid);
+  for (int i = 0; i < members; ++i) {
+    channel.AddUser(cid + "_" + std::to_string(i), i % 2);
+  }
+  return channel;
+}
+
+TEST(ChannelCacheUnittest, LRU) {
+  ChannelCache cache(2, 0);
+  CHECK(cache.Get("c1") == NULL);
+  cache.Put("c1", MakeChannel("c1", 1));
+  cache.Put("c2", MakeChannel("c2", 2));
+  // c1 becomes the most recently used one, c2 is evicted
+  CHECK(cache.Get("c1") != NULL);
+  cache.Put("c3", MakeChannel("c3", 3));
+  CHECK_EQ(cache.Size(), 2U);
+  CHECK(cache.Peek("c2") == NULL);
+  CHECK_EQ(cache.Get("c1")->GetUserCount(), 1);
+  CHECK_EQ(cache.Get("c3")->GetUserCount(), 3);
+
+  // the cached one is kept
+  ChannelInfo* c3 = cache.Put("c3", MakeChannel("c3", 5));
+  CHECK_EQ(c3->GetUserCount(), 3);
+
+  Json::Value report;
+  cache.GetReport(report);
+  CHECK_EQ(report["size"].asInt(), 2);
+  CHECK_EQ(report["hit_number"].asInt(), 3);
+  CHECK_EQ(report["miss_number"].asInt(), 1);
+  CHECK_EQ(report["evict_number"].asInt(), 1);
+
+  cache.Erase("c1");
+  CHECK_EQ(cache.Size(), 1U);
+  CHECK(cache.Peek("c1") == NULL);
+}
+
+TEST(ChannelCacheUnittest, Pin) {
+  ChannelCache cache(2, 0);
+  cache.Pin("hot");
+  cache.Put("hot", MakeChannel("hot", 1));
+  for (int i = 0; i < 10; ++i) {
+    string cid = "c" + std::to_string(i);
+    cache.Put(cid, MakeChannel(cid, 1));
+  }
+  CHECK_EQ(cache.Size(), 2U);
+  CHECK(cache.Peek("hot") != NULL);
+  CHECK(cache.Peek("c9") != NULL);
+
+  cache.Unpin("hot");
+  cache.Put("c10", MakeChannel("c10", 1));
+  CHECK(cache.Peek("hot") == NULL);
+}
+
+TEST(ChannelCacheUnittest, Memory) {
+  const size_t small = MakeChannel("c0", 10).MemoryBytes();
+  ChannelCache cache(100, small * 3);
+  for (int i = 0; i < 5; ++i) {
+    string cid = "c" + std::to_string(i);
+    cache.Put(cid, MakeChannel(cid, 10));
+  }
+  CHECK_EQ(cache.Size(), 3U);
+  CHECK(cache.MemoryBytes() <= small * 3);
+
+  // a channel growing over the limit pushes out the others
+  ChannelInfo* c4 = cache.Get("c4");
+  for (int i = 0; i < 10000; ++i) {
+    c4->AddUser("big_" + std::to_string(i), 0);
+  }
+  cache.Resize("c4");
+  CHECK_EQ(cache.Size(), 1U);
+  CHECK(cache.Peek("c4") != NULL);
+  CHECK_EQ(cache.MemoryBytes(), cache.Peek("c4")->MemoryBytes());
+}
+
+}  // namespace xcomet
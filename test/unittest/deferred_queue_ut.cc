@@ -0,0 +1,154 @@
+#include "gtest/gtest.h"
+
+#include <event.h>
+#include <unistd.h>
+#include "deps/base/logging.h"
+#include "src/deferred_queue.h"
+
+namespace xcomet {
+
+// runs the callbacks of one loop pass
+static void RunPass(struct event_base* evbase) {
+  event_base_loop(evbase, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+}
+
+TEST(DeferredQueueUnittest, RunInNextPass) {
+  struct event_base* evbase = event_base_new();
+  {
+    DeferredQueue queue(evbase, 1000000);
+    vector<int> order;
+    for (int i = 0; i < 3; ++i) {
+      queue.Push([&order, &queue, i]() {
+        order.push_back(i);
+        // pushed while draining, must wait for the next pass
+        queue.Push([&order, i]() { order.push_back(i + 10); });
+      });
+    }
+    CHECK_EQ(queue.Size(), 3U);
+    CHECK(order.empty());
+
+    RunPass(evbase);
+    CHECK_EQ(order.size(), 3U);
+    CHECK_EQ(queue.Size(), 3U);
+
+    RunPass(evbase);
+    CHECK_EQ(order.size(), 6U);
+    CHECK_EQ(order[3], 10);
+    CHECK_EQ(order[5], 12);
+    CHECK_EQ(queue.Size(), 0U);
+
+    Json::Value report;
+    queue.GetReport(report);
+    CHECK_EQ(report["run_number"].asInt(), 6);
+    CHECK_EQ(report["over_budget_number"].asInt(), 0);
+  }
+  event_base_free(evbase);
+}
+
+TEST(DeferredQueueUnittest, TimeBudget) {
+  struct event_base* evbase = event_base_new();
+  {
+    DeferredQueue queue(evbase, 1000);
+    int count = 0;
+    for (int i = 0; i < 100; ++i) {
+      queue.Push([&count]() {
+        ++count;
+        usleep(100);
+      });
+    }
+    RunPass(evbase);
+    CHECK(count > 0 && count < 100);
+    while (queue.Size() > 0) {
+      RunPass(evbase);
+    }
+    CHECK_EQ(count, 100);
+
+    Json::Value report;
+    queue.GetReport(report);
+    CHECK(report["over_budget_number"].asInt() > 0);
+  }
+  event_base_free(evbase);
+}
+
+// one slow closure ends the pass, the next one sees its wait
+TEST(DeferredQueueUnittest, SlowClosure) {
+  struct event_base* evbase = event_base_new();
+  {
+    DeferredQueue queue(evbase, 5000);
+    int count = 0;
+    queue.Push([&count]() {
+      ++count;
+      usleep(10000);
+    });
+    for (int i = 0; i < 3; ++i) {
+      queue.Push([&count]() { ++count; });
+    }
+    RunPass(evbase);
+    CHECK_EQ(count, 1);
+    CHECK_EQ(queue.Size(), 3U);
+
+    RunPass(evbase);
+    CHECK_EQ(count, 4);
+
+    Json::Value report;
+    queue.GetReport(report);
+    CHECK_EQ(report["over_budget_number"].asInt(), 1);
+    CHECK(report["max_latency_us"].asInt() >= 10000);
+  }
+  event_base_free(evbase);
+}
+
+struct PipeReader {
+  int fd;
+  // closures run when the pipe was read, -1 before
+  int read_at;
+  const int* count;
+};
+
+static void OnPipeReadable(evutil_socket_t fd, short events, void* ctx) {
+  PipeReader* reader = static_cast<PipeReader*>(ctx);
+  char c;
+  CHECK_EQ(read(fd, &c, 1), 1);
+  reader->read_at = *reader->count;
+}
+
+// an fd which becomes ready during a drain is served before the next one
+TEST(DeferredQueueUnittest, IoBetweenPasses) {
+  struct event_base* evbase = event_base_new();
+  int fds[2];
+  CHECK_EQ(pipe(fds), 0);
+  {
+    DeferredQueue queue(evbase, 1000);
+    int count = 0;
+    PipeReader reader = {fds[0], -1, &count};
+    struct event* ev = event_new(evbase, fds[0], EV_READ | EV_PERSIST,
+                                 OnPipeReadable, &reader);
+    event_add(ev, NULL);
+    for (int i = 0; i < 100; ++i) {
+      queue.Push([&count, &fds, i]() {
+        ++count;
+        if (i == 5) {
+          CHECK_EQ(write(fds[1], "x", 1), 1);
+        }
+        usleep(100);
+      });
+    }
+    RunPass(evbase);
+    const int first_pass = count;
+    CHECK(first_pass > 5 && first_pass < 100);
+    CHECK_EQ(reader.read_at, -1);
+    RunPass(evbase);
+    CHECK_EQ(reader.read_at, first_pass);
+    CHECK(count > first_pass);
+    while (queue.Size() > 0) {
+      RunPass(evbase);
+    }
+    CHECK_EQ(count, 100);
+    event_free(ev);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  event_base_free(evbase);
+}
+
+}  // namespace xcomet
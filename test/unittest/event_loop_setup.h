@@ -13,7 +13,13 @@ class EventLoopSetup {
     LoopExecutor::Init(evbase_);
     CHECK(evbase_) << "create event_base failed";
     LOG(INFO) << "event base created";
+    running_ = false;
+    // a loopbreak before the dispatch starts would be lost
+    event_base_once(evbase_, -1, EV_TIMEOUT, OnStarted, this, NULL);
     main_thread_ = std::thread(&EventLoopSetup::MainLoop, this);
+    while (!running_) {
+      std::this_thread::yield();
+    }
     LOG(INFO) << "start event loop";
   }
 
@@ -55,10 +61,15 @@ class EventLoopSetup {
   static void OnTimer(evutil_socket_t sig, short events, void* user_data) {
     LOG(INFO) << "OnTimer";
   }
+
+  static void OnStarted(evutil_socket_t sig, short events, void* user_data) {
+    static_cast<EventLoopSetup*>(user_data)->running_ = true;
+  }
  private:
   struct event_base* evbase_;
   std::thread main_thread_;
   std::thread::id main_thread_id_;
+  std::atomic<bool> running_;
 };
 }  // namespace xcomet
 
@@ -0,0 +1,33 @@
+#include "gtest/gtest.h"
+
+#include "deps/base/logging.h"
+#include "src/evhelper.h"
+
+namespace xcomet {
+
+TEST(EvhelperUnittest, AddSharedString) {
+  struct evbuffer* buf = evbuffer_new();
+  StringPtr data(new string("shared message body"));
+  evbuffer_add(buf, "head:", 5);
+  AddSharedString(buf, data);
+  CHECK_EQ(evbuffer_get_length(buf), 5 + data->size());
+  // the buffer points to the string instead of a copy
+  CHECK_EQ(data.use_count(), 2);
+  struct evbuffer_iovec vec[2];
+  CHECK_EQ(evbuffer_peek(buf, -1, NULL, vec, 2), 2);
+  CHECK(vec[1].iov_base == data->data());
+
+  // moving it to another buffer keeps the reference
+  struct evbuffer* output = evbuffer_new();
+  evbuffer_add_buffer(output, buf);
+  CHECK_EQ(data.use_count(), 2);
+  evbuffer_drain(output, evbuffer_get_length(output));
+  CHECK_EQ(data.use_count(), 1);
+
+  AddSharedString(buf, StringPtr(new string()));
+  CHECK_EQ(evbuffer_get_length(buf), 0U);
+  evbuffer_free(output);
+  evbuffer_free(buf);
+}
+
+}  // namespace xcomet
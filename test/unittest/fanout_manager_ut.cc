@@ -0,0 +1,145 @@
+#include "gtest/gtest.h"
+
+#include <event.h>
+#include <unistd.h>
+#include "deps/base/logging.h"
+#include "src/deferred_queue.h"
+#include "src/fanout_manager.h"
+#include "src/uid_table.h"
+
+namespace xcomet {
+
+static vector<uint32> MakeUids(const string& prefix, int n) {
+  vector<uint32> uids;
+  for (int i = 0; i < n; ++i) {
+    uids.push_back(UidTable::Instance().Intern(prefix + std::to_string(i)));
+  }
+  return uids;
+}
+
+// runs the callbacks of one loop pass
+static void RunPass(struct event_base* evbase) {
+  event_base_loop(evbase, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+}
+
+TEST(FanoutManagerUnittest, SmallChannel) {
+  struct event_base* evbase = event_base_new();
+  {
+    DeferredQueue queue(evbase, 1000000);
+    FanoutManager fanout(&queue, 1000000);
+    vector<uint32> uids = MakeUids("small_", 10);
+    vector<string> delivered;
+    fanout.Start("small", &uids, [&delivered](const string& uid) {
+      delivered.push_back(uid);
+    });
+    CHECK(uids.empty());
+    CHECK_EQ(delivered.size(), 10U);
+    CHECK_EQ(delivered[3], "small_3");
+    CHECK_EQ(fanout.ActiveJobs(), 0U);
+    CHECK_EQ(queue.Size(), 0U);
+  }
+  event_base_free(evbase);
+}
+
+TEST(FanoutManagerUnittest, Slices) {
+  struct event_base* evbase = event_base_new();
+  {
+    DeferredQueue queue(evbase, 1000000);
+    FanoutManager fanout(&queue, 1000);
+    const int N = 1000;
+    vector<uint32> uids = MakeUids("big_", N);
+    vector<string> delivered;
+    fanout.Start("big", &uids, [&delivered](const string& uid) {
+      delivered.push_back(uid);
+      usleep(10);
+    });
+    CHECK(delivered.size() > 0 && delivered.size() < N);
+    CHECK_EQ(fanout.ActiveJobs(), 1U);
+
+    // a second message of the channel waits for the first one
+    vector<uint32> uids2 = MakeUids("big_", 2);
+    fanout.Start("big", &uids2, [&delivered](const string& uid) {
+      delivered.push_back("second " + uid);
+    });
+    CHECK_EQ(fanout.ActiveJobs(), 2U);
+
+    Json::Value report;
+    fanout.GetReport(report);
+    CHECK_EQ(report["jobs"].size(), 2U);
+    CHECK_EQ(report["jobs"][0u]["total"].asInt(), N);
+    CHECK_EQ(report["jobs"][0u]["delivered"].asInt(), (int)delivered.size());
+
+    int passes = 0;
+    while (fanout.ActiveJobs() > 0) {
+      size_t before = delivered.size();
+      RunPass(evbase);
+      CHECK(delivered.size() > before || fanout.ActiveJobs() > 0);
+      ++passes;
+    }
+    CHECK(passes > 1);
+    CHECK_EQ(delivered.size(), N + 2U);
+    CHECK_EQ(delivered[N - 1], "big_999");
+    CHECK_EQ(delivered[N], "second big_0");
+
+    fanout.GetReport(report);
+    CHECK_EQ(report["finished_number"].asInt(), 2);
+    CHECK_EQ(report["delivered_number"].asInt(), N + 2);
+    CHECK(report["slice_number"].asInt() > 2);
+    CHECK(report["max_latency_us"].asInt() > 0);
+    CHECK_EQ(report["jobs"].size(), 0U);
+  }
+  event_base_free(evbase);
+}
+
+struct PipeReader {
+  // members delivered when the pipe was read, -1 before
+  int read_at;
+  const vector<string>* delivered;
+};
+
+static void OnPipeReadable(evutil_socket_t fd, short events, void* ctx) {
+  PipeReader* reader = static_cast<PipeReader*>(ctx);
+  char c;
+  CHECK_EQ(read(fd, &c, 1), 1);
+  reader->read_at = reader->delivered->size();
+}
+
+// an fd which becomes ready during a slice is served before the next one
+TEST(FanoutManagerUnittest, IoBetweenSlices) {
+  struct event_base* evbase = event_base_new();
+  int fds[2];
+  CHECK_EQ(pipe(fds), 0);
+  {
+    DeferredQueue queue(evbase, 1000000);
+    FanoutManager fanout(&queue, 1000);
+    vector<string> delivered;
+    PipeReader reader = {-1, &delivered};
+    struct event* ev = event_new(evbase, fds[0], EV_READ | EV_PERSIST,
+                                 OnPipeReadable, &reader);
+    event_add(ev, NULL);
+    const int N = 1000;
+    vector<uint32> uids = MakeUids("io_", N);
+    fanout.Start("io", &uids, [&delivered, &fds](const string& uid) {
+      if (delivered.size() == 5) {
+        CHECK_EQ(write(fds[1], "x", 1), 1);
+      }
+      delivered.push_back(uid);
+      usleep(10);
+    });
+    const int first_slice = delivered.size();
+    CHECK(first_slice > 5 && first_slice < N);
+    RunPass(evbase);
+    CHECK_EQ(reader.read_at, first_slice);
+    CHECK(delivered.size() > first_slice);
+    while (fanout.ActiveJobs() > 0) {
+      RunPass(evbase);
+    }
+    CHECK_EQ(delivered.size(), N);
+    event_free(ev);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  event_base_free(evbase);
+}
+
+}  // namespace xcomet
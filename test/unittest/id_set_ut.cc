@@ -0,0 +1,132 @@
+#include "gtest/gtest.h"
+
+#include <stdlib.h>
+#include "deps/base/logging.h"
+#include "src/channel_info.h"
+#include "src/id_set.h"
+#include "src/uid_table.h"
+
+namespace xcomet {
+
+static vector<uint32> ToVector(const IdSet& ids) {
+  vector<uint32> result;
+  ids.ForEach([&result](uint32 id) {
+    result.push_back(id);
+  });
+  return result;
+}
+
+TEST(IdSetUnittest, Normal) {
+  IdSet ids;
+  CHECK(ids.Empty());
+  CHECK(ids.Insert(5));
+  CHECK(ids.Insert(1));
+  CHECK(ids.Insert(70000));
+  CHECK(!ids.Insert(5));
+  CHECK(ids.Size() == 3);
+  CHECK(ids.Contains(1));
+  CHECK(ids.Contains(70000));
+  CHECK(!ids.Contains(2));
+  CHECK(!ids.Contains(70001));
+
+  vector<uint32> expected = {1, 5, 70000};
+  CHECK(ToVector(ids) == expected);
+
+  CHECK(ids.Erase(5));
+  CHECK(!ids.Erase(5));
+  CHECK(!ids.Erase(123456));
+  CHECK(ids.Erase(70000));
+  CHECK(ids.Size() == 1);
+  expected = {1};
+  CHECK(ToVector(ids) == expected);
+}
+
+TEST(IdSetUnittest, Bitmap) {
+  IdSet ids;
+  const uint32 N = 20000;
+  for (uint32 i = 0; i < N; ++i) {
+    CHECK(ids.Insert(i * 3));
+  }
+  CHECK(ids.Size() == N);
+  // dense chunks are bitmaps, far below 2 bytes per id
+  CHECK(ids.MemoryBytes() < N) << ids.MemoryBytes();
+  vector<uint32> result = ToVector(ids);
+  CHECK(result.size() == N);
+  for (uint32 i = 0; i < N; ++i) {
+    CHECK(result[i] == i * 3);
+    CHECK(ids.Contains(i * 3));
+    CHECK(!ids.Contains(i * 3 + 1));
+  }
+  // back to arrays
+  for (uint32 i = 0; i < N; ++i) {
+    if (i % 10 != 0) {
+      CHECK(ids.Erase(i * 3));
+    }
+  }
+  CHECK(ids.Size() == N / 10);
+  result = ToVector(ids);
+  for (uint32 i = 0; i < result.size(); ++i) {
+    CHECK(result[i] == i * 30);
+  }
+}
+
+TEST(IdSetUnittest, Random) {
+  IdSet ids;
+  set<uint32> expected;
+  ::srand(1);
+  for (int i = 0; i < 200000; ++i) {
+    uint32 id = ::rand() % 300000;
+    if (::rand() % 3 == 0) {
+      CHECK(ids.Erase(id) == (expected.erase(id) == 1));
+    } else {
+      CHECK(ids.Insert(id) == expected.insert(id).second);
+    }
+  }
+  CHECK(ids.Size() == expected.size());
+  vector<uint32> result = ToVector(ids);
+  CHECK(std::equal(result.begin(), result.end(), expected.begin()));
+}
+
+TEST(UidTableUnittest, Normal) {
+  UidTable& table = UidTable::Instance();
+  uint32 id1 = table.Intern("uid_table_user1");
+  uint32 id2 = table.Intern("uid_table_user2");
+  CHECK(id1 != id2);
+  CHECK(table.Intern("uid_table_user1") == id1);
+  CHECK(table.Uid(id2) == "uid_table_user2");
+  uint32 id = 0;
+  CHECK(table.Find("uid_table_user2", &id));
+  CHECK(id == id2);
+  CHECK(!table.Find("uid_table_user3", &id));
+
+}
+
+TEST(ChannelInfoUnittest, Shards) {
+  ChannelInfo channel("channel1");
+  channel.AddUser("channel_user1", 0);
+  channel.AddUser("channel_user2", 1);
+  channel.AddUser("channel_user3", 0);
+  channel.AddUser("channel_user1", 0);
+  channel.RemoveUser("channel_user4", 0);
+  channel.RemoveUser("channel_user2", 0);
+  CHECK(channel.GetUserCount() == 3);
+  CHECK(channel.GetShardUserIds(2) == NULL);
+  CHECK(channel.GetShardUserIds(1)->Size() == 1);
+
+  set<string> users;
+  channel.ForEachUser(0, [&users](const string& uid) {
+    users.insert(uid);
+  });
+  CHECK(users.size() == 2);
+  CHECK(users.count("channel_user1") == 1);
+  CHECK(users.count("channel_user3") == 1);
+  channel.ForEachUser(2, [](const string& uid) {
+    CHECK(false) << uid;
+  });
+
+  channel.RemoveUser("channel_user1", 0);
+  channel.RemoveUser("channel_user2", 1);
+  CHECK(channel.GetUserCount() == 1);
+}
+
+}  // namespace xcomet
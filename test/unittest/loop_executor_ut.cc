@@ -1,7 +1,10 @@
 #include "gtest/gtest.h"
 
+#include "deps/base/flags.h"
 #include "test/unittest/event_loop_setup.h"
 
+DECLARE_int32(loop_queue_ring_size);
+
 namespace xcomet {
 class LoopExecutorUnittest : public testing::Test {
  public:
@@ -40,4 +43,84 @@ TEST_F(LoopExecutorUnittest, Normal) {
   ::sleep(1);
 }
 
+TEST(LoopQueueUnittest, OverflowAndReject) {
+  struct event_base* evbase = event_base_new();
+  vector<int> order;
+  {
+    LoopQueue queue(evbase, 4);
+    for (int i = 0; i < 8; ++i) {
+      CHECK(queue.Post([&order, i]() { order.push_back(i); }));
+    }
+    CHECK(!queue.Post([&order]() { order.push_back(-1); }));
+    CHECK_EQ(queue.OverflowNumber(), 4);
+    CHECK_EQ(queue.RejectNumber(), 1);
+
+    event_base_loop(evbase, EVLOOP_NONBLOCK);
+    CHECK_EQ(order.size(), 8U);
+    for (int i = 0; i < 8; ++i) {
+      CHECK_EQ(order[i], i);
+    }
+
+    // closures too big for the inline storage still work
+    char big[LoopTask::INLINE_SIZE * 2] = "big";
+    CHECK(queue.Post([&order, big]() { order.push_back(big[0]); }));
+    event_base_loop(evbase, EVLOOP_NONBLOCK);
+    CHECK_EQ(order.back(), 'b');
+  }
+  event_base_free(evbase);
+}
+
+TEST(LoopQueueUnittest, NoLimit) {
+  const int ring_size = FLAGS_loop_queue_ring_size;
+  FLAGS_loop_queue_ring_size = 4;
+  struct event_base* evbase = event_base_new();
+  vector<int> order;
+  {
+    LoopQueue queue(evbase, LoopQueue::NO_LIMIT);
+    for (int i = 0; i < 3000; ++i) {
+      CHECK(queue.Post([&order, i]() { order.push_back(i); }));
+    }
+    CHECK_EQ(queue.OverflowNumber(), 2996);
+    CHECK_EQ(queue.RejectNumber(), 0);
+    event_base_loop(evbase, EVLOOP_NONBLOCK);
+    CHECK_EQ(order.size(), 3000U);
+    for (int i = 0; i < 3000; ++i) {
+      CHECK_EQ(order[i], i);
+    }
+  }
+  event_base_free(evbase);
+  FLAGS_loop_queue_ring_size = ring_size;
+}
+
+// the nodes are taken from the free list by all the producers while the
+// loop gives them back
+TEST(LoopQueueUnittest, Producers) {
+  const int PRODUCERS = 4;
+  const int POSTS = 200000;
+  struct event_base* evbase = event_base_new();
+  int64 sum = 0;
+  {
+    LoopQueue queue(evbase, LoopQueue::NO_LIMIT);
+    std::atomic<int> finished(0);
+    vector<std::thread> producers;
+    for (int p = 0; p < PRODUCERS; ++p) {
+      producers.push_back(std::thread([&queue, &sum, &finished]() {
+        for (int i = 1; i <= POSTS; ++i) {
+          CHECK(queue.Post([&sum, i]() { sum += i; }));
+        }
+        ++finished;
+      }));
+    }
+    const int64 expected = (int64)PRODUCERS * POSTS * (POSTS + 1) / 2;
+    while (finished < PRODUCERS || sum < expected) {
+      event_base_loop(evbase, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+    }
+    for (int p = 0; p < PRODUCERS; ++p) {
+      producers[p].join();
+    }
+    CHECK_EQ(sum, expected);
+  }
+  event_base_free(evbase);
+}
+
 }  // namespace xcomet
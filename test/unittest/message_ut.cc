@@ -1,6 +1,10 @@
 #include "gtest/gtest.h"
 
+#include <event.h>
+#include <inttypes.h>
+#include <stdio.h>
 #include "deps/base/logging.h"
+#include "deps/base/time.h"
 #include "src/message.h"
 
 namespace xcomet {
@@ -196,4 +200,447 @@ TEST(MessageUnittest, RealMessage) {
   CHECK(msg2.Body() == MSG_BODY);
 }
 
+TEST(MessageUnittest, ParseEscapes) {
+  const char* json = "{\"y\":3,\"b\":\"a\\\"b\\\\c\\nd\\re\"}";
+  Message msg;
+  CHECK(Message::Parse(json, strlen(json), &msg));
+  CHECK(msg.Body() == "a\"b\\c\nd\re");
+  CHECK(Message::Unserialize(Message::Serialize(msg)) == msg);
+}
+
+TEST(MessageUnittest, ParseInvalid) {
+  const char* invalid[] = {
+    "",
+    "{}",
+    "{\"y\":3",
+    "{\"y\":3,",
+    "{\"b\":\"unterminated}",
+    "{\"b\":\"bad escape\\",
+    "{\"s\":1x}",
+    "[\"y\",3]",
+  };
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+    Message msg;
+    CHECK(!Message::Parse(invalid[i], strlen(invalid[i]), &msg)) << invalid[i];
+  }
+  Message msg;
+  const char* negative = "{\"y\":3,\"l\":-1}";
+  CHECK(Message::Parse(negative, strlen(negative), &msg));
+  CHECK(msg.TTL() == -1);
+}
+
+TEST(MessageUnittest, ParseEvbuffer) {
+  Message msg1;
+  msg1.SetType(Message::T_MESSAGE);
+  msg1.SetTo("user1");
+  msg1.SetSeq(7);
+  msg1.SetBody("message body in an evbuffer");
+  StringPtr data = Message::Serialize(msg1);
+
+  struct evbuffer* buf = evbuffer_new();
+  evbuffer_add(buf, data->data(), data->size());
+  Message msg2;
+  CHECK(Message::Parse(buf, data->size(), &msg2));
+  CHECK(msg1 == msg2);
+  CHECK(evbuffer_get_length(buf) == data->size());
+  evbuffer_free(buf);
+
+  // split over two chunks
+  buf = evbuffer_new();
+  size_t half = data->size() / 2;
+  evbuffer_add_reference(buf, data->data(), half, NULL, NULL);
+  evbuffer_add_reference(buf, data->data() + half, data->size() - half,
+                         NULL, NULL);
+  Message msg3;
+  CHECK(Message::Parse(buf, data->size(), &msg3));
+  CHECK(msg1 == msg3);
+  evbuffer_free(buf);
+}
+
+TEST(MessageUnittest, Clone) {
+  Message msg;
+  msg.SetType(Message::T_CHANNEL_MESSAGE);
+  msg.SetFrom("user1");
+  msg.SetChannel("channel1");
+  msg.SetBody(string(4096, 'x'));
+  msg.SetSeq(1);
+
+  Message copy = msg.Clone();
+  CHECK(copy == msg);
+  CHECK(copy.Body().data() == msg.Body().data());
+  copy.SetTo("user2");
+  copy.SetSeq(2);
+  CHECK(msg.To().empty());
+  CHECK(msg.Seq() == 1);
+  CHECK(copy.Body().data() == msg.Body().data());
+
+  copy.SetBody("y");
+  CHECK(copy.Body() == string(4096, 'x') + "y");
+  CHECK(msg.Body() == string(4096, 'x'));
+  CHECK(copy.Channel() == "channel1");
+  CHECK(copy.From() == "user1");
+
+  msg.SetFrom("user3");
+  CHECK(copy.From() == "user1");
+  CHECK(*Message::Serialize(msg) ==
+        "{\"s\":1,\"y\":4,\"f\":\"user3\",\"c\":\"channel1\",\"b\":\"" +
+        string(4096, 'x') + "\"}\n");
+
+  Message empty;
+  CHECK(empty.Body().empty());
+  CHECK(empty.Clone() == empty);
+}
+
+TEST(MessageUnittest, PoolAllocator) {
+  PoolAllocator<MessageContent> alloc;
+  size_t free_blocks = PoolAllocator<MessageContent>::FreeBlocks();
+  MessageContent* p = alloc.allocate(1);
+  alloc.deallocate(p, 1);
+  CHECK(PoolAllocator<MessageContent>::FreeBlocks() == free_blocks + 1);
+  CHECK(alloc.allocate(1) == p);
+  CHECK(PoolAllocator<MessageContent>::FreeBlocks() == free_blocks);
+  alloc.deallocate(p, 1);
+}
+
+TEST(MessageUnittest, SerializeParts) {
+  Message msg;
+  msg.SetType(Message::T_CHANNEL_MESSAGE);
+  msg.SetChannel("channel1");
+  msg.SetBody("a \"quoted\" body\n");
+  string prefix;
+  StringPtr rest = Message::SerializeParts(msg, &prefix);
+  CHECK(prefix == "{") << prefix;
+  CHECK(prefix + *rest == *Message::Serialize(msg));
+
+  Message copy = msg.Clone();
+  copy.SetTo("user1");
+  copy.SetSeq(7);
+  string copy_prefix;
+  CHECK(Message::SerializeParts(copy, &copy_prefix).get() == rest.get());
+  CHECK(copy_prefix == "{\"t\":\"user1\",\"s\":7,") << copy_prefix;
+  StringPtr data = Message::Serialize(copy);
+  CHECK(*data == copy_prefix + *rest);
+  Message parsed;
+  CHECK(Message::Parse(data->data(), data->size(), &parsed));
+  CHECK(parsed == copy);
+
+  // changing a shared field of the clone leaves the original alone
+  copy.SetType(Message::T_MESSAGE);
+  CHECK(Message::SerializeParts(copy, &copy_prefix).get() != rest.get());
+  CHECK(Message::SerializeParts(msg, &prefix).get() == rest.get());
+
+  Message only_to;
+  only_to.SetTo("user2");
+  rest = Message::SerializeParts(only_to, &prefix);
+  CHECK(prefix == "{\"t\":\"user2\"") << prefix;
+  CHECK(*rest == "}\n");
+  CHECK(*Message::Serialize(only_to) == "{\"t\":\"user2\"}\n");
+}
+
+// the character by character parser which Parse replaced, kept to compare
+// the throughput
+static Message LegacyUnserialize(const string& data) {
+  enum ParseStatus {
+    PS_NOT_START,
+    PS_OBJ_START,
+    PS_FIELD_START,
+    PS_FIELD_FOUND,
+    PS_FIELD_END,
+    PS_VALUE_START,
+    PS_VALUE_INT,
+    PS_VALUE_STRING,
+    PS_VALUE_STRING_ESCAPE,
+    PS_VALUE_STRING_END,
+    PS_OBJ_END,
+  };
+  Message msg;
+  ParseStatus status = PS_NOT_START;
+  ostringstream stream;
+  char f = '\0';
+  for (int i = 0; i < data.size(); ++i) {
+    char c = data[i];
+    if (c == ' ') {
+      if (status == PS_VALUE_STRING) {
+        stream << c;
+      }
+      continue;
+    }
+    switch (status) {
+      case PS_NOT_START:
+        if (c != '{') return msg;
+        status = PS_OBJ_START;
+        break;
+      case PS_OBJ_START:
+        if (c != '"') return msg;
+        status = PS_FIELD_START;
+        break;
+      case PS_FIELD_START:
+        if (!::isalpha(c)) return msg;
+        f = c;
+        status = PS_FIELD_FOUND;
+        break;
+      case PS_FIELD_FOUND:
+        if (c != '"') return msg;
+        status = PS_FIELD_END;
+        break;
+      case PS_FIELD_END:
+        if (c != ':') return msg;
+        status = PS_VALUE_START;
+        stream.str("");
+        break;
+      case PS_VALUE_START:
+        if (c == '"') {
+          status = PS_VALUE_STRING;
+        } else if (::isdigit(c)) {
+          status = PS_VALUE_INT;
+          stream << c;
+        }
+        break;
+      case PS_VALUE_STRING:
+        if (c == '\\') {
+          status = PS_VALUE_STRING_ESCAPE;
+        } else if (c == '"') {
+          status = PS_VALUE_STRING_END;
+        } else {
+          stream << c;
+        }
+        break;
+      case PS_VALUE_STRING_ESCAPE:
+        if (c == 'n') {
+          stream << '\n';
+        } else if (c == 'r') {
+          stream << '\r';
+        } else if (::isprint(c)) {
+          stream << c;
+        } else {
+          return msg;
+        }
+        status = PS_VALUE_STRING;
+        break;
+      case PS_VALUE_STRING_END:
+      case PS_VALUE_INT:
+        if (c == ',' || c == '}') {
+          string v = stream.str();
+          if (f == K_TYPE) {
+            msg.SetType(Message::MType(std::stoi(v)));
+          } else if (f == K_SEQ) {
+            msg.SetSeq(std::stoi(v));
+          } else {
+            Message::SetField(f, msg, v);
+          }
+          status = (c == ',' ? PS_OBJ_START : PS_OBJ_END);
+        } else if (status == PS_VALUE_INT) {
+          stream << c;
+        } else {
+          return msg;
+        }
+        break;
+      default:
+        return msg;
+    }
+  }
+  return msg;
+}
+
+TEST(MessageUnittest, ParseBenchmark) {
+  Message msg;
+  msg.SetType(Message::T_MESSAGE);
+  msg.SetTo("ff693d67a96fe86d4cf4fda8e4acf006");
+  msg.SetFrom("push_service");
+  msg.SetSeq(12345);
+  msg.SetBody("{\"type\":1040,\"td\":\"55266c351267419c34f168aa\","
+              "\"content\":\"a typical notification payload with some text "
+              "in it, long enough to make the scanning matter\","
+              "\"url\":\"http://www.example.com/some/path?x=1\"}");
+  const string data = *Message::Serialize(msg);
+  CHECK(LegacyUnserialize(data) == msg);
+
+  const int N = 100000;
+  int64 start = base::GetTimeInUsec();
+  for (int i = 0; i < N; ++i) {
+    Message m = LegacyUnserialize(data);
+    CHECK(m.Seq() == 12345);
+  }
+  int64 legacy_usec = base::GetTimeInUsec() - start;
+
+  start = base::GetTimeInUsec();
+  for (int i = 0; i < N; ++i) {
+    Message m;
+    CHECK(Message::Parse(data.data(), data.size(), &m));
+    CHECK(m.Seq() == 12345);
+  }
+  int64 parse_usec = base::GetTimeInUsec() - start;
+
+  printf("message of %d bytes, %d times\n"
+         "  legacy parser: %.1f MB/s\n"
+         "  Parse:         %.1f MB/s\n",
+         (int)data.size(), N,
+         data.size() * (double)N / (legacy_usec > 0 ? legacy_usec : 1),
+         data.size() * (double)N / (parse_usec > 0 ? parse_usec : 1));
+}
+
+TEST(MessageUnittest, SerializeCache) {
+  Message msg;
+  msg.SetType(Message::T_MESSAGE);
+  msg.SetTo("user1");
+  msg.SetBody("hello");
+  StringPtr data = Message::Serialize(msg);
+  CHECK(Message::Serialize(msg).get() == data.get());
+  Message copy = msg;
+  CHECK(Message::Serialize(copy).get() == data.get());
+
+  msg.SetSeq(3);
+  StringPtr data2 = Message::Serialize(msg);
+  CHECK(data2.get() != data.get());
+  CHECK(*data2 == "{\"t\":\"user1\",\"s\":3,\"y\":3,\"b\":\"hello\"}\n");
+  CHECK(*data == "{\"t\":\"user1\",\"y\":3,\"b\":\"hello\"}\n");
+
+  msg.SetTTL(100);
+  CHECK(Message::Serialize(msg)->find("\"l\":100") != string::npos);
+  CHECK(msg.TTL() == 100);
+  CHECK(*Message::Serialize(msg) == *data2);
+
+  Message parsed;
+  CHECK(Message::Parse(data->data(), data->size(), &parsed));
+  Message::Serialize(parsed);
+  CHECK(Message::Parse(data2->data(), data2->size(), &parsed));
+  CHECK(*Message::Serialize(parsed) == *data2);
+}
+
+TEST(MessageUnittest, SerializeEscapes) {
+  Message msg;
+  msg.SetSeq(-2);
+  msg.SetTTL(-9223372036854775807LL);
+  msg.SetFrom("a\"b");
+  string body = "0123456789abcdef\"\\\r\n";
+  for (int i = 0; i < 5; ++i) {
+    body += body;
+  }
+  msg.SetBody(body);
+  StringPtr data = Message::Serialize(msg);
+  CHECK(data->find("{\"s\":-2,\"l\":-9223372036854775807,\"f\":\"a\\\"b\"")
+        == 0);
+  CHECK(data->find("0123456789abcdef\\\"\\\\\\r\\n0123") != string::npos);
+  Message parsed;
+  CHECK(Message::Parse(data->data(), data->size(), &parsed));
+  CHECK(parsed.Body() == body);
+  CHECK(parsed.From() == "a\"b");
+  CHECK(parsed.Seq() == -2);
+}
+
+static string LegacySerialize(const Message& msg) {
+  ostringstream stream;
+  stream << "{";
+  if (msg.HasType()) {
+    stream << '"' << K_TYPE << "\":" << msg.Type();
+  }
+  if (msg.HasSeq()) {
+    stream << ",\"" << K_SEQ << "\":" << msg.Seq();
+  }
+  if (msg.HasTo()) {
+    stream << ",\"" << K_TO << "\":\"" << msg.To() << '"';
+  }
+  if (!msg.From().empty()) {
+    stream << ",\"" << K_FROM << "\":\"" << msg.From() << '"';
+  }
+  if (!msg.Body().empty()) {
+    stream << ",\"" << K_BODY << "\":\"";
+    const string& body = msg.Body();
+    for (int i = 0; i < body.size(); ++i) {
+      char c = body[i];
+      if (c == '"') {
+        stream << "\\\"";
+      } else if (c == '\\') {
+        stream << "\\\\";
+      } else if (c == '\r') {
+        stream << "\\r";
+      } else if (c == '\n') {
+        stream << "\\n";
+      } else {
+        stream << c;
+      }
+    }
+    stream << '"';
+  }
+  stream << "}\n";
+  return stream.str();
+}
+
+TEST(MessageUnittest, SerializeBenchmark) {
+  Message msg;
+  msg.SetType(Message::T_MESSAGE);
+  msg.SetTo("ff693d67a96fe86d4cf4fda8e4acf006");
+  msg.SetFrom("push_service");
+  msg.SetSeq(12345);
+  msg.SetBody("{\"type\":1040,\"td\":\"55266c351267419c34f168aa\","
+              "\"content\":\"a typical notification payload with some text "
+              "in it, long enough to make the scanning matter\","
+              "\"url\":\"http://www.example.com/some/path?x=1\"}");
+  const string data = LegacySerialize(msg);
+  CHECK(Message::Serialize(msg)->size() == data.size());
+  CHECK(Message::UnserializeString(*Message::Serialize(msg)) == msg);
+
+  const int N = 100000;
+  int64 start = base::GetTimeInUsec();
+  for (int i = 0; i < N; ++i) {
+    CHECK(LegacySerialize(msg).size() == data.size());
+  }
+  int64 legacy_usec = base::GetTimeInUsec() - start;
+
+  start = base::GetTimeInUsec();
+  for (int i = 0; i < N; ++i) {
+    msg.SetSeq(12345);
+    CHECK(Message::Serialize(msg)->size() == data.size());
+  }
+  int64 serialize_usec = base::GetTimeInUsec() - start;
+
+  printf("message of %d bytes, %d times\n"
+         "  legacy serializer: %.1f MB/s\n"
+         "  Serialize:         %.1f MB/s\n",
+         (int)data.size(), N,
+         data.size() * (double)N / (legacy_usec > 0 ? legacy_usec : 1),
+         data.size() * (double)N / (serialize_usec > 0 ? serialize_usec : 1));
+}
+
+TEST(MessageUnittest, FanoutBenchmark) {
+  Message msg;
+  msg.SetType(Message::T_CHANNEL_MESSAGE);
+  msg.SetFrom("push_service");
+  msg.SetChannel("broadcast_channel");
+  string body;
+  while (body.size() < 2048) {
+    body += "{\"content\":\"a long channel payload\",\"n\":1}\n";
+  }
+  msg.SetBody(body);
+
+  const int N = 50000;
+  size_t bytes = 0;
+  int64 start = base::GetTimeInUsec();
+  for (int i = 0; i < N; ++i) {
+    Message copy = msg.Clone();
+    copy.SetTo("user");
+    copy.SetSeq(i);
+    bytes += Message::Serialize(copy)->size();
+  }
+  int64 full_usec = base::GetTimeInUsec() - start;
+
+  string prefix;
+  Message::SerializeParts(msg, &prefix);
+  start = base::GetTimeInUsec();
+  for (int i = 0; i < N; ++i) {
+    Message copy = msg.Clone();
+    copy.SetTo("user");
+    copy.SetSeq(i);
+    StringPtr rest = Message::SerializeParts(copy, &prefix);
+    bytes -= prefix.size() + rest->size();
+  }
+  int64 parts_usec = base::GetTimeInUsec() - start;
+  CHECK(bytes == 0);
+
+  printf("fan-out of a %d bytes body to %d members\n"
+         "  full serialize: %" PRId64 " us\n"
+         "  shared part:    %" PRId64 " us\n",
+         (int)body.size(), N, full_usec, parts_usec);
+}
+
 }  // namespace xcomet
@@ -0,0 +1,92 @@
+#include "gtest/gtest.h"
+
+#include "deps/base/logging.h"
+#include "src/peer/peer_message.h"
+
+namespace xcomet {
+
+TEST(PeerMessageUnittest, Normal) {
+  PeerMessage msg;
+  msg.type = PMT_NOTIFY_TO_USER;
+  msg.user = "system";
+  msg.msg_type = 3;
+  msg.to = "user1";
+  msg.ttl = 86400;
+  msg.seq = 12345;
+  msg.channel_ts = 1500000000123456LL;
+  msg.content = "{\"y\":3,\"t\":\"user1\",\"b\":\"a\\nb\"}\n";
+  string frame;
+  EncodePeerFrame(msg, &frame);
+  CHECK(frame[0] == PEER_FRAME_VERSION);
+
+  PeerMessage decoded;
+  CHECK(DecodePeerFrame(frame.data(), frame.size(), &decoded));
+  CHECK(decoded.type == msg.type);
+  CHECK(decoded.user == msg.user);
+  CHECK(decoded.msg_type == msg.msg_type);
+  CHECK(decoded.to == msg.to);
+  CHECK(decoded.ttl == msg.ttl);
+  CHECK(decoded.seq == msg.seq);
+  CHECK(decoded.channel_ts == msg.channel_ts);
+  CHECK(decoded.content == msg.content);
+}
+
+TEST(PeerMessageUnittest, Unset) {
+  PeerMessage msg;
+  msg.type = PMT_REDIRECT_TO_SERVER;
+  string frame;
+  EncodePeerFrame(msg, &frame);
+  // version, type, user, msg_type, to, ttl, seq, channel_ts
+  CHECK(frame.size() == 8) << frame.size();
+
+  PeerMessage decoded;
+  decoded.content = "stale";
+  CHECK(DecodePeerFrame(frame.data(), frame.size(), &decoded));
+  CHECK(decoded.msg_type == -1);
+  CHECK(decoded.ttl == -1);
+  CHECK(decoded.seq == -1);
+  CHECK(decoded.channel_ts == 0);
+  CHECK(decoded.user.empty());
+  CHECK(decoded.to.empty());
+  CHECK(decoded.content.empty());
+}
+
+TEST(PeerMessageUnittest, Invalid) {
+  PeerMessage msg;
+  msg.type = PMT_NOTIFY_TO_USER;
+  msg.user = "system";
+  msg.to = "user1";
+  msg.ttl = 1LL << 40;
+  msg.channel_ts = 1LL << 50;
+  string frame;
+  EncodePeerFrame(msg, &frame);
+
+  PeerMessage decoded;
+  CHECK(!DecodePeerFrame(frame.data(), 0, &decoded));
+  // the content is empty, every cut is inside the header
+  for (size_t i = 1; i < frame.size(); ++i) {
+    CHECK(!DecodePeerFrame(frame.data(), i, &decoded)) << i;
+  }
+  string legacy = "2";
+  CHECK(!DecodePeerFrame(legacy.data(), legacy.size(), &decoded));
+}
+
+TEST(PeerMessageUnittest, Address) {
+  // no address is a prefix of another, zmq subscriptions match by prefix
+  vector<string> addresses;
+  for (int i = 0; i < 300; ++i) {
+    string address;
+    EncodePeerAddress(i, &address);
+    addresses.push_back(address);
+  }
+  for (int i = 0; i < addresses.size(); ++i) {
+    for (int j = 0; j < addresses.size(); ++j) {
+      if (i != j) {
+        CHECK(addresses[j].compare(0, addresses[i].size(), addresses[i]) != 0)
+            << i << " " << j;
+      }
+    }
+  }
+}
+
+}  // namespace xcomet
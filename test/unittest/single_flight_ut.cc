@@ -0,0 +1,76 @@
+#include "gtest/gtest.h"
+
+#include "deps/base/logging.h"
+#include "src/single_flight.h"
+
+namespace xcomet {
+
+typedef SingleFlight<int> IntFlight;
+
+TEST(SingleFlightUnittest, Coalesce) {
+  IntFlight flight;
+  vector<IntFlight::Callback> pending;
+  int loads = 0;
+  IntFlight::Loader loader = [&pending, &loads](IntFlight::Callback done) {
+    ++loads;
+    pending.push_back(done);
+  };
+  vector<string> results;
+  for (int i = 0; i < 3; ++i) {
+    flight.Load("k1", loader, [&results, i](Error error, int value) {
+      CHECK(error == NO_ERROR);
+      results.push_back("k1 " + std::to_string(i) + " " +
+                        std::to_string(value));
+    });
+  }
+  flight.Load("k2", loader, [&results](Error error, int value) {
+    results.push_back("k2 " + std::to_string(value));
+  });
+  CHECK_EQ(loads, 2);
+  CHECK_EQ(flight.InFlight(), 2U);
+  CHECK(results.empty());
+
+  pending[0](NO_ERROR, 7);
+  CHECK_EQ(results.size(), 3U);
+  CHECK_EQ(results[0], "k1 0 7");
+  CHECK_EQ(results[2], "k1 2 7");
+  CHECK_EQ(flight.InFlight(), 1U);
+
+  pending[1](NO_ERROR, 8);
+  CHECK_EQ(results[3], "k2 8");
+
+  // a new flight once the previous one is done
+  flight.Load("k1", loader, [](Error error, int value) {});
+  CHECK_EQ(loads, 3);
+
+  Json::Value report;
+  flight.GetReport(report);
+  CHECK_EQ(report["load_number"].asInt(), 3);
+  CHECK_EQ(report["coalesced_number"].asInt(), 2);
+  CHECK_EQ(report["in_flight"].asInt(), 1);
+}
+
+TEST(SingleFlightUnittest, Sync) {
+  IntFlight flight;
+  int loads = 0;
+  IntFlight::Loader loader = [&loads](IntFlight::Callback done) {
+    ++loads;
+    done("failed", -1);
+  };
+  int calls = 0;
+  // a load from the callback starts a new flight
+  flight.Load("k", loader, [&](Error error, int value) {
+    CHECK(error != NO_ERROR);
+    ++calls;
+    if (calls == 1) {
+      flight.Load("k", loader, [&calls](Error error, int value) {
+        ++calls;
+      });
+    }
+  });
+  CHECK_EQ(loads, 2);
+  CHECK_EQ(calls, 2);
+  CHECK_EQ(flight.InFlight(), 0U);
+}
+
+}  // namespace xcomet
@@ -1,14 +1,23 @@
 #include "gtest/gtest.h"
 
+#include <event.h>
+#include <unistd.h>
+
 #include "deps/base/logging.h"
 #include "deps/base/file.h"
 #include "deps/base/flags.h"
+#include "deps/base/time.h"
+#include "src/deferred_queue.h"
+#include "src/fanout_manager.h"
 #include "src/include_std.h"
 #include "src/storage/inmemory_storage.h"
 #include "src/storage/cassandra_storage.h"
+#include "src/uid_table.h"
 #include "test/unittest/event_loop_setup.h"
 
 DECLARE_string(inmemory_data_dir);
+DECLARE_int32(inmemory_snapshot_interval_sec);
+DECLARE_int32(inmemory_snapshot_slice_usec);
 
 namespace xcomet {
 class StorageUnittest : public testing::Test {
@@ -78,7 +87,7 @@ static void NormalTest(Storage* s) {
     CHECK(result.get() != NULL);
     VLOG(3) << "size = " << result->size();
     CHECK(result->size() == 1);
-    CHECK_EQ(result->at(0), *msg1);
+    CHECK_EQ(*result->at(0), *msg1);
     ++counter;
   });
   ::sleep(1);
@@ -105,10 +114,10 @@ static void NormalTest(Storage* s) {
     VLOG(3) << "size = " << result->size();
     CHECK(result->size() == 10);
     for (int i = 0; i < result->size(); ++i) {
-      VLOG(4) << "result " << i << ": " << result->at(i);
+      VLOG(4) << "result " << i << ": " << *result->at(i);
     }
-    CHECK(result->at(0) == *msg1);
-    Message msg = Message::UnserializeString(result->at(9));
+    CHECK(*result->at(0) == *msg1);
+    Message msg = Message::UnserializeString(*result->at(9));
     CHECK(msg.Seq() == 10);
     msg.SetSeq(1);
     CHECK(msg == Message::Unserialize(msg1));
@@ -146,9 +155,9 @@ static void NormalTest(Storage* s) {
     VLOG(3) << "size = " << result->size();
     CHECK(result->size() == 30);
     for (int i = 0; i < result->size(); ++i) {
-      VLOG(4) << "result " << i << ": " << result->at(i);
+      VLOG(4) << "result " << i << ": " << *result->at(i);
     }
-    Message msg = Message::UnserializeString(result->at(29));
+    Message msg = Message::UnserializeString(*result->at(29));
     CHECK(msg.Seq() == 150);
     msg.SetSeq(1);
     CHECK(msg == Message::Unserialize(msg1));
@@ -174,6 +183,519 @@ TEST_F(StorageUnittest, InMemoryNormal) {
   NormalTest(&storage);
 }
 
+TEST_F(StorageUnittest, InMemoryTTL) {
+  TimingWheel wheel(base::GetTimeInMs(), 100);
+  InMemoryStorage storage(&wheel);
+  // the periodic snapshot is on the wheel too
+  const size_t timers = wheel.Size();
+  Storage* s = &storage;
+  s->SaveMessage(CreateMessage(1), "u1", 1, 1, [](Error err) {
+    CHECK(err == NO_ERROR) << err;
+  });
+  s->SaveMessage(CreateMessage(2), "u1", 2, 0, [](Error err) {
+    CHECK(err == NO_ERROR) << err;
+  });
+  CHECK_EQ(wheel.Size(), timers + 1);
+  ::sleep(2);
+  wheel.Advance(base::GetTimeInMs());
+  CHECK_EQ(wheel.Size(), timers);
+  s->GetMessage("u1", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL && result->size() == 1);
+  });
+}
+
+TEST_F(StorageUnittest, InMemoryChannelTimeline) {
+  FLAGS_channel_timeline = true;
+  InMemoryStorage storage;
+  Storage* s = &storage;
+  auto ok = [](Error err) {
+    CHECK(err == NO_ERROR) << err;
+  };
+  s->AddUserToChannel("u1", "c1", ok);
+  s->AddUserToChannel("u2", "c1", ok);
+  s->AddUserToChannel("u2", "c2", ok);
+  // written once, read by every member
+  s->SaveChannelMessage(StringPtr(new string("c1-10")), "c1", 10, 0, ok);
+  s->SaveChannelMessage(StringPtr(new string("c1-30")), "c1", 30, 0, ok);
+  s->SaveChannelMessage(StringPtr(new string("c1-20")), "c1", 20, 0, ok);
+  s->SaveChannelMessage(StringPtr(new string("c2-25")), "c2", 25, 0, ok);
+  s->SaveMessage(CreateMessage(1), "u2", 1, 0, ok);
+
+  s->GetMessage("u1", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 3U);
+    CHECK_EQ(*result->at(0), "c1-10");
+    CHECK_EQ(*result->at(1), "c1-20");
+    CHECK_EQ(*result->at(2), "c1-30");
+  });
+  // the own messages first, then the channels merged by the publish time
+  s->GetMessage("u2", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 5U);
+    CHECK_EQ(*result->at(0), *CreateMessage(1));
+    CHECK_EQ(*result->at(3), "c2-25");
+    CHECK_EQ(*result->at(4), "c1-30");
+  });
+
+  // each cursor can move up to the last entry returned of its channel
+  s->GetOfflineMessage("u2", [](Error err,
+                                MessageDataSet result,
+                                const ChannelCursors& cursors) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK_EQ(cursors.size(), 2U);
+    CHECK_EQ(cursors.at("c1"), 30);
+    CHECK_EQ(cursors.at("c2"), 25);
+  });
+  // a later entry read from a channel doesn't skip the others
+  s->UpdateChannelCursor("u2", "c2", 25, ok);
+  s->GetMessage("u2", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 4U);
+    CHECK_EQ(*result->at(1), "c1-10");
+    CHECK_EQ(*result->at(3), "c1-30");
+  });
+
+  s->UpdateChannelCursor("u1", "c1", 20, ok);
+  s->GetMessage("u1", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 1U);
+    CHECK_EQ(*result->at(0), "c1-30");
+  });
+  s->UpdateChannelCursor("u1", "c1", 30, ok);
+  s->GetOfflineMessage("u1", [](Error err,
+                                MessageDataSet result,
+                                const ChannelCursors& cursors) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() == NULL || result->empty());
+    CHECK(cursors.empty());
+  });
+  s->RemoveUserFromChannel("u2", "c1", ok);
+  s->GetMessage("u2", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 1U);
+  });
+  // the cursor goes with the membership
+  s->UpdateChannelCursor("u2", "c1", 20, ok);
+  s->AddUserToChannel("u2", "c1", ok);
+  s->GetMessage("u2", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 4U);
+    CHECK_EQ(*result->at(1), "c1-10");
+  });
+
+  // the oldest entries are dropped beyond the limit
+  FLAGS_max_channel_timeline_num = 2;
+  s->SaveChannelMessage(StringPtr(new string("c1-40")), "c1", 40, 0, ok);
+  s->UpdateChannelCursor("u1", "c1", 0, ok);
+  s->GetMessage("u1", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 2U);
+    CHECK_EQ(*result->at(0), "c1-30");
+    CHECK_EQ(*result->at(1), "c1-40");
+  });
+  FLAGS_max_channel_timeline_num = 100;
+  FLAGS_channel_timeline = false;
+}
+
+// copies the log and the snapshots of a running storage, as if it crashed
+static void CopyLog(const string& from, const string& to) {
+  vector<string> files;
+  CHECK(base::File::GetFilesInDir(from, &files));
+  base::File::RecursivelyCreateDir(to, 0777);
+  for (size_t i = 0; i < files.size(); ++i) {
+    string data;
+    CHECK(base::File::ReadFileToString(files[i], &data));
+    CHECK(base::File::WriteStringToFile(data,
+          base::File::JoinPath(to, base::File::BaseName(files[i]))));
+  }
+  vector<string> dirs;
+  base::File::GetDirsInDir(from, &dirs);
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    CopyLog(dirs[i], base::File::JoinPath(to, base::File::BaseName(dirs[i])));
+  }
+}
+
+// The fan-outs of the channels run apart, a member leaving while the one of
+// a big channel is in flight, after the one of a small channel published
+// later is done, still gets the entry of the big one at the next login
+TEST_F(StorageUnittest, InMemoryCursorPerChannel) {
+  auto ok = [](Error err) {
+    CHECK(err == NO_ERROR) << err;
+  };
+  FLAGS_channel_timeline = true;
+  struct event_base* evbase = event_base_new();
+  {
+    InMemoryStorage storage;
+    Storage* s = &storage;
+    DeferredQueue queue(evbase, 1000000);
+    FanoutManager fanout(&queue, 1000);
+    UidTable& table = UidTable::Instance();
+    // the member is reached last in the big channel
+    const int N = 1000;
+    vector<uint32> big;
+    for (int i = 0; i < N; ++i) {
+      const string uid = i + 1 < N ? "cursor_" + std::to_string(i) : "m";
+      s->AddUserToChannel(uid, "big", ok);
+      big.push_back(table.Intern(uid));
+    }
+    s->AddUserToChannel("m", "small", ok);
+    vector<uint32> small(1, table.Intern("m"));
+    s->SaveChannelMessage(StringPtr(new string("big-10")), "big", 10, 0, ok);
+    s->SaveChannelMessage(StringPtr(new string("small-20")), "small", 20, 0,
+                          ok);
+
+    // what the connection of the member was sent, by channel
+    bool online = true;
+    ChannelCursors sent;
+    auto deliver = [&online, &sent](const string& cid, int64 ts) {
+      return [&online, &sent, cid, ts](const string& uid) {
+        if (uid == "m" && online) {
+          sent[cid] = ts;
+        }
+        usleep(10);
+      };
+    };
+    fanout.Start("big", &big, deliver("big", 10));
+    CHECK_EQ(fanout.ActiveJobs(), 1U);
+    fanout.Start("small", &small, deliver("small", 20));
+    CHECK_EQ(fanout.ActiveJobs(), 1U);
+    CHECK_EQ(sent.size(), 1U);
+
+    // disconnects, the cursors of the channels sent move
+    online = false;
+    for (auto& channel : sent) {
+      s->UpdateChannelCursor("m", channel.first, channel.second, ok);
+    }
+    while (fanout.ActiveJobs() > 0) {
+      event_base_loop(evbase, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+    }
+    CHECK_EQ(sent.size(), 1U);
+
+    s->GetOfflineMessage("m", [](Error err,
+                                 MessageDataSet result,
+                                 const ChannelCursors& cursors) {
+      CHECK(err == NO_ERROR) << err;
+      CHECK(result.get() != NULL);
+      CHECK_EQ(result->size(), 1U);
+      CHECK_EQ(*result->at(0), "big-10");
+      CHECK_EQ(cursors.size(), 1U);
+      CHECK_EQ(cursors.at("big"), 10);
+    });
+  }
+  event_base_free(evbase);
+  FLAGS_channel_timeline = false;
+}
+
+TEST_F(StorageUnittest, InMemoryRecovery) {
+  auto ok = [](Error err) {
+    CHECK(err == NO_ERROR) << err;
+  };
+  const string crashed = FLAGS_inmemory_data_dir + ".crashed";
+  base::File::DeleteRecursively(crashed);
+  {
+    InMemoryStorage storage;
+    Storage* s = &storage;
+    s->SaveMessage(CreateMessage(1), "u1", 1, 0, ok);
+    s->SaveMessage(CreateMessage(2), "u1", 2, 0, ok);
+    s->UpdateAck("u1", 1, ok);
+    s->AddUserToChannel("u1", "c1", ok);
+    s->AddUserToChannel("u2", "c1", ok);
+    s->RemoveUserFromChannel("u2", "c1", ok);
+    storage.FlushLog();
+    CopyLog(FLAGS_inmemory_data_dir, crashed);
+  }
+  base::File::DeleteRecursively(FLAGS_inmemory_data_dir);
+  CHECK(::rename(crashed.c_str(), FLAGS_inmemory_data_dir.c_str()) == 0);
+  // a record torn by the crash is dropped
+  base::File::AppendStringToFile("\x20torn",
+      WriteAheadLog::SegmentPath(FLAGS_inmemory_data_dir, 1));
+
+  {
+    InMemoryStorage storage;
+    Storage* s = &storage;
+    s->GetMessage("u1", [](Error err, MessageDataSet result) {
+      CHECK(err == NO_ERROR) << err;
+      CHECK(result.get() != NULL);
+      CHECK_EQ(result->size(), 1U);
+      CHECK_EQ(*result->at(0), *CreateMessage(2));
+    });
+    s->GetChannelUsers("c1", [](Error err, UserResultSet users) {
+      CHECK(err == NO_ERROR) << err;
+      CHECK(users.get() != NULL);
+      CHECK_EQ(users->size(), 1U);
+      CHECK_EQ(users->at(0), "u1");
+    });
+    s->SaveMessage(CreateMessage(3), "u1", 3, 0, ok);
+  }
+  // the snapshot taken at exit covers the log, only the empty segment
+  // started by it is left
+  CHECK_EQ(WriteAheadLog::ListSegments(FLAGS_inmemory_data_dir).size(), 1U);
+
+  InMemoryStorage storage;
+  Storage* s = &storage;
+  s->SaveMessage(CreateMessage(4), "u1", 4, 0, ok);
+  s->GetMessage("u1", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 3U);
+    CHECK_EQ(*result->at(2), *CreateMessage(4));
+  });
+}
+
+TEST_F(StorageUnittest, InMemorySnapshotInSlices) {
+  auto ok = [](Error err) {
+    CHECK(err == NO_ERROR) << err;
+  };
+  FLAGS_channel_timeline = true;
+  FLAGS_inmemory_snapshot_interval_sec = 1;
+  // a bucket per tick
+  FLAGS_inmemory_snapshot_slice_usec = 0;
+  const int users = 100;
+  const string crashed = FLAGS_inmemory_data_dir + ".crashed";
+  base::File::DeleteRecursively(crashed);
+  {
+    int64 now = 0;
+    TimingWheel wheel(now, 1);
+    InMemoryStorage storage(&wheel);
+    Storage* s = &storage;
+    for (int i = 0; i < users; ++i) {
+      const string uid = "u" + std::to_string(i);
+      s->SaveMessage(CreateMessage(1), uid, 1, 0, ok);
+      s->AddUserToChannel(uid, "c1", ok);
+    }
+    s->SaveChannelMessage(StringPtr(new string("c1-10")), "c1", 10, 0, ok);
+    s->SaveChannelMessage(StringPtr(new string("c3-15")), "c3", 15, 0, ok);
+    s->AddUserToChannel("u1", "c3", ok);
+    s->UpdateChannelCursor("u1", "c1", 10, ok);
+    wheel.Advance(now += 1000);
+    Json::Value report;
+    storage.GetReport(report);
+    CHECK(report["snapshot_running"].asBool());
+
+    // some of them are updated before their buckets are scanned
+    for (int i = 0; i < users; ++i) {
+      const string uid = "u" + std::to_string(i);
+      s->SaveMessage(CreateMessage(2), uid, 2, 0, ok);
+      s->UpdateAck(uid, 1, ok);
+      s->AddUserToChannel(uid, "c2", ok);
+      wheel.Advance(++now);
+    }
+    s->RemoveUserFromChannel("u0", "c1", ok);
+    s->AddUserToChannel("u100", "c1", ok);
+    s->SaveChannelMessage(StringPtr(new string("c1-20")), "c1", 20, 0, ok);
+    s->UpdateChannelCursor("u2", "c1", 20, ok);
+    while (report["snapshot_running"].asBool()) {
+      wheel.Advance(++now);
+      usleep(1000);
+      report.clear();
+      storage.GetReport(report);
+    }
+    CHECK_LT(now, 2000);
+    storage.FlushLog();
+    CopyLog(FLAGS_inmemory_data_dir, crashed);
+  }
+  base::File::DeleteRecursively(FLAGS_inmemory_data_dir);
+  CHECK(::rename(crashed.c_str(), FLAGS_inmemory_data_dir.c_str()) == 0);
+
+  // the snapshot plus the log after it, every update is applied once
+  InMemoryStorage storage;
+  Storage* s = &storage;
+  for (int i = 3; i < users; ++i) {
+    const string uid = "u" + std::to_string(i);
+    s->GetMaxSeq(uid, [](Error err, int seq) {
+      CHECK(err == NO_ERROR) << err;
+      CHECK_EQ(seq, 2);
+    });
+    s->GetMessage(uid, [](Error err, MessageDataSet result) {
+      CHECK(err == NO_ERROR) << err;
+      CHECK(result.get() != NULL);
+      CHECK_EQ(result->size(), 3U);
+      CHECK_EQ(*result->at(0), *CreateMessage(2));
+      CHECK_EQ(*result->at(1), "c1-10");
+      CHECK_EQ(*result->at(2), "c1-20");
+    });
+  }
+  // the cursors of the snapshot and of the log, apart for each channel
+  s->GetMessage("u1", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 3U);
+    CHECK_EQ(*result->at(1), "c3-15");
+    CHECK_EQ(*result->at(2), "c1-20");
+  });
+  s->GetMessage("u2", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 1U);
+  });
+  s->GetChannelUsers("c1", [users](Error err, UserResultSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), static_cast<size_t>(users));
+  });
+  s->GetChannelUsers("c2", [users](Error err, UserResultSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), static_cast<size_t>(users));
+  });
+  FLAGS_channel_timeline = false;
+  FLAGS_inmemory_snapshot_interval_sec = 600;
+  FLAGS_inmemory_snapshot_slice_usec = 2000;
+}
+
+TEST_F(StorageUnittest, InMemoryJsonDump) {
+  // the dumps written before the binary snapshots are still loaded
+  string dir = base::File::JoinPath(FLAGS_inmemory_data_dir, "20160101000000");
+  base::File::RecursivelyCreateDir(dir, 0777);
+  CHECK(base::File::WriteStringToFile(
+        "{\"name\":\"u1\",\"imud\":{\"head\":0,\"head_seq\":0,"
+        "\"tail\":2,\"tail_seq\":2,\"ack\":1,\"msgs\":["
+        "{\"i\":1,\"t\":0,\"b\":\"m2\"}]}}\n",
+        base::File::JoinPath(dir, "user")));
+  CHECK(base::File::WriteStringToFile(
+        "{\"name\":\"c1\",\"users\":[\"u1\",\"u2\"]}\n",
+        base::File::JoinPath(dir, "channel")));
+  InMemoryStorage storage;
+  Storage* s = &storage;
+  s->GetMessage("u1", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 1U);
+    CHECK_EQ(*result->at(0), "m2");
+  });
+  s->GetChannelUsers("c1", [](Error err, UserResultSet users) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(users.get() != NULL);
+    CHECK_EQ(users->size(), 2U);
+  });
+}
+
+TEST_F(StorageUnittest, InMemoryLazyUsers) {
+  auto ok = [](Error err) {
+    CHECK(err == NO_ERROR) << err;
+  };
+  InMemoryStorage storage;
+  Storage* s = &storage;
+  // reading never creates a user
+  s->GetMessage("nobody", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() == NULL);
+  });
+  s->GetMaxSeq("nobody", [](Error err, int seq) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK_EQ(seq, 0);
+  });
+  s->UpdateAck("nobody", 0, ok);
+  Json::Value report;
+  storage.GetReport(report);
+  CHECK_EQ(report["user_number"].asInt(), 0);
+  CHECK_EQ(report["message_bytes"].asInt(), 0);
+
+  // the ring grows with the messages, up to the limit
+  const int number = FLAGS_max_offline_msg_num + 10;
+  for (int i = 1; i <= number; ++i) {
+    s->SaveMessage(CreateMessage(i), "u1", i, 0, ok);
+  }
+  report.clear();
+  storage.GetReport(report);
+  CHECK_EQ(report["user_number"].asInt(), 1);
+  CHECK_EQ(report["message_number"].asInt(), FLAGS_max_offline_msg_num);
+  CHECK_GT(report["message_bytes"].asInt(), 0);
+  s->GetMessage("u1", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(),
+             static_cast<size_t>(FLAGS_max_offline_msg_num));
+    CHECK_EQ(*result->back(),
+             *CreateMessage(FLAGS_max_offline_msg_num + 10));
+  });
+
+  // the ring is released once everything is acked
+  s->UpdateAck("u1", number, ok);
+  report.clear();
+  storage.GetReport(report);
+  CHECK_EQ(report["message_number"].asInt(), 0);
+  CHECK_EQ(report["message_bytes"].asInt(), 0);
+  s->SaveMessage(CreateMessage(number + 1), "u1", number + 1, 0, ok);
+  s->GetMaxSeq("u1", [number](Error err, int seq) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK_EQ(seq, number + 1);
+  });
+  s->GetMessage("u1", [](Error err, MessageDataSet result) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(result.get() != NULL);
+    CHECK_EQ(result->size(), 1U);
+  });
+}
+
+TEST_F(StorageUnittest, InMemoryBatch) {
+  const string crashed = FLAGS_inmemory_data_dir + ".crashed";
+  base::File::DeleteRecursively(crashed);
+  {
+    InMemoryStorage storage;
+    Storage* s = &storage;
+    vector<SaveMessageEntry> entries;
+    for (int i = 1; i <= 3; ++i) {
+      for (int j = 1; j <= 2; ++j) {
+        SaveMessageEntry entry;
+        entry.msg = CreateMessage(i);
+        entry.uid = "u" + std::to_string(j);
+        entry.seq = i;
+        entry.ttl = 0;
+        entries.push_back(entry);
+      }
+    }
+    int calls = 0;
+    auto count = [&calls](Error err) {
+      CHECK(err == NO_ERROR) << err;
+      ++calls;
+    };
+    s->SaveMessages(entries, count);
+    // the last ack of a user wins
+    vector<pair<string, int> > acks;
+    acks.push_back(make_pair("u1", 1));
+    acks.push_back(make_pair("u2", 2));
+    acks.push_back(make_pair("u1", 2));
+    s->UpdateAcks(acks, count);
+    vector<string> uids;
+    uids.push_back("u1");
+    uids.push_back("u2");
+    s->AddUsersToChannel(uids, "c1", count);
+    s->AddUsersToChannel(vector<string>(), "c2", count);
+    CHECK_EQ(calls, 4);
+    storage.FlushLog();
+    // copied like a crash, so the batches are replayed from the log
+    CopyLog(FLAGS_inmemory_data_dir, crashed);
+  }
+  base::File::DeleteRecursively(FLAGS_inmemory_data_dir);
+  CHECK(::rename(crashed.c_str(), FLAGS_inmemory_data_dir.c_str()) == 0);
+
+  InMemoryStorage storage;
+  Storage* s = &storage;
+  for (int j = 1; j <= 2; ++j) {
+    s->GetMessage("u" + std::to_string(j), [](Error err,
+                                              MessageDataSet result) {
+      CHECK(err == NO_ERROR) << err;
+      CHECK(result.get() != NULL);
+      CHECK_EQ(result->size(), 1U);
+      CHECK_EQ(*result->at(0), *CreateMessage(3));
+    });
+  }
+  s->GetChannelUsers("c1", [](Error err, UserResultSet users) {
+    CHECK(err == NO_ERROR) << err;
+    CHECK(users.get() != NULL);
+    CHECK_EQ(users->size(), 2U);
+  });
+}
+
 TEST_F(StorageUnittest, CassandraNormal) {
   CassandraStorage storage;
   NormalTest(&storage);
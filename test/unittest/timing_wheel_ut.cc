@@ -0,0 +1,78 @@
+#include "gtest/gtest.h"
+
+#include "deps/base/logging.h"
+#include "src/timing_wheel.h"
+
+namespace xcomet {
+
+TEST(TimingWheelUnittest, Deadlines) {
+  const int64 start = 1000000;
+  TimingWheel wheel(start, 10);
+  // cover every level, the far ones need cascading on the way down
+  const int64 delays[] = {5, 10, 640, 650, 40960, 41000, 2621440, 3000000};
+  const int n = sizeof(delays) / sizeof(delays[0]);
+  vector<int64> fired(n, -1);
+  TimerNode nodes[n];
+  for (int i = 0; i < n; ++i) {
+    nodes[i].SetCallback([&wheel, &fired, i]() { fired[i] = wheel.Now(); });
+    wheel.Schedule(&nodes[i], start + delays[i]);
+  }
+  CHECK_EQ(wheel.Size(), (size_t)n);
+
+  for (int64 now = start; now <= start + 3000000; now += 10) {
+    wheel.Advance(now);
+  }
+  CHECK_EQ(wheel.Size(), 0U);
+  for (int i = 0; i < n; ++i) {
+    CHECK(!nodes[i].IsScheduled());
+    // rounded up to the 10ms tick
+    CHECK_EQ(fired[i], start + (delays[i] + 9) / 10 * 10);
+  }
+}
+
+TEST(TimingWheelUnittest, CancelAndReschedule) {
+  TimingWheel wheel(0, 1);
+  int count = 0;
+  TimerNode a;
+  TimerNode b;
+  a.SetCallback([&count]() { count += 1; });
+  b.SetCallback([&count]() { count += 10; });
+  wheel.Schedule(&a, 100);
+  wheel.Schedule(&b, 100);
+  a.Cancel();
+  wheel.Schedule(&b, 200);
+  wheel.Advance(150);
+  CHECK_EQ(count, 0);
+  wheel.Advance(200);
+  CHECK_EQ(count, 10);
+
+  // a deadline in the past fires on the next tick
+  wheel.Schedule(&a, 0);
+  wheel.Advance(200);
+  CHECK_EQ(count, 10);
+  wheel.Advance(201);
+  CHECK_EQ(count, 11);
+}
+
+TEST(TimingWheelUnittest, CallbackFreesOtherNode) {
+  TimingWheel wheel(0, 1);
+  TimerNode* first = new TimerNode();
+  TimerNode* second = new TimerNode();
+  int count = 0;
+  first->SetCallback([&second, &count]() {
+    ++count;
+    delete second;
+    second = NULL;
+  });
+  second->SetCallback([&count]() { ++count; });
+  wheel.Schedule(first, 10);
+  wheel.Schedule(second, 10);
+  wheel.Advance(10);
+  // whichever ran first, nothing is left scheduled
+  CHECK(count == 1 || count == 2);
+  CHECK_EQ(wheel.Size(), 0U);
+  delete first;
+  delete second;
+}
+
+}  // namespace xcomet
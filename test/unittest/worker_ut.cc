@@ -60,4 +60,31 @@ TEST_F(WorkerUnittest, SimpleTest) {
       bind(&WorkerUnittest::Callback1, this, _1));
 }
 
+TEST_F(WorkerUnittest, ManyTasks) {
+  const int N = 10000;
+  atomic<int> run_count(0);
+  int callback_count = 0;
+  for (int i = 0; i < N; ++i) {
+    worker_->Do<int>(
+        [&run_count]() { return ++run_count; },
+        [this, &callback_count](int) {
+          CHECK_EQ(MainThreadId(), std::this_thread::get_id());
+          ++callback_count;
+        });
+  }
+  Json::Value report;
+  for (int i = 0; i < 50; ++i) {
+    report.clear();
+    worker_->GetReport(report);
+    if (report["completed_number"].asInt() == N) {
+      break;
+    }
+    usleep(100 * 1000);
+  }
+  CHECK_EQ(report["completed_number"].asInt(), N);
+  CHECK_EQ(report["queue_depth"].asInt(), 0);
+  CHECK_EQ(run_count, N);
+  CHECK_EQ(callback_count, N);
+}
+
 }  // namespace xcomet